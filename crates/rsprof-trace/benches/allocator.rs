@@ -0,0 +1,223 @@
+//! Allocator overhead: `ProfilingAllocator` against the system allocator,
+//! which is what it compiles to without the `heap` feature.
+//!
+//! Build with frame pointers, as profiled apps are, or every stack walk
+//! stops early and all allocations land on one callsite:
+//!
+//! ```bash
+//! RUSTFLAGS="-C force-frame-pointers=yes" cargo bench -p rsprof-trace --features heap
+//! ```
+//!
+//! The allocators are called directly rather than installed as the global
+//! allocator, so Criterion's own allocations are not profiled. The first
+//! allocation creates this process's `/rsprof-trace-<pid>` shared memory
+//! object.
+
+use criterion::{BenchmarkId, Criterion, Throughput, criterion_group, criterion_main};
+use rsprof_trace::ProfilingAllocator;
+use std::alloc::{GlobalAlloc, Layout, System};
+use std::collections::VecDeque;
+use std::hint::black_box;
+use std::sync::{Arc, Barrier};
+use std::time::{Duration, Instant};
+
+/// Heap profiling only; CPU timers would add signal noise to the timings
+static PROFILING: ProfilingAllocator<0> = ProfilingAllocator::new();
+
+/// Sizes from the example app: small strings and records up to pool buffers
+const SIZES: [usize; 4] = [32, 256, 4096, 64 * 1024];
+
+/// Live buffers kept by the churn pattern, as a buffer pool would
+const POOL_DEPTH: usize = 64;
+
+/// Callsites visited round-robin by the spread benchmark (2^levels)
+const SPREAD_LEVELS: u32 = 10;
+
+/// Allocate and free one block
+fn alloc_free<A: GlobalAlloc>(allocator: &A, layout: Layout) {
+    unsafe {
+        let ptr = allocator.alloc(layout);
+        black_box(ptr);
+        allocator.dealloc(ptr, layout);
+    }
+}
+
+/// Grow a block from 64 bytes to 4KB by doubling, like a `Vec` being filled
+fn grow<A: GlobalAlloc>(allocator: &A) {
+    unsafe {
+        let mut layout = Layout::from_size_align_unchecked(64, 8);
+        let mut ptr = allocator.alloc(layout);
+        while layout.size() < 4096 {
+            let size = layout.size() * 2;
+            ptr = allocator.realloc(ptr, layout, size);
+            layout = Layout::from_size_align_unchecked(size, 8);
+        }
+        black_box(ptr);
+        allocator.dealloc(ptr, layout);
+    }
+}
+
+/// Allocate a buffer and release the oldest, keeping the pool at a
+/// steady depth (the `BufferPool` pattern at a finer grain)
+fn churn<A: GlobalAlloc>(allocator: &A, pool: &mut VecDeque<*mut u8>, layout: Layout) {
+    unsafe {
+        pool.push_back(allocator.alloc(layout));
+        if pool.len() > POOL_DEPTH
+            && let Some(ptr) = pool.pop_front()
+        {
+            allocator.dealloc(ptr, layout);
+        }
+    }
+}
+
+/// Run `op` `iters` times on each of `threads` threads at once; returns the
+/// wall time, so per-iteration time is per-op latency under contention
+fn run_threads(threads: usize, iters: u64, op: impl Fn() + Send + Copy + 'static) -> Duration {
+    let barrier = Arc::new(Barrier::new(threads + 1));
+    let handles: Vec<_> = (0..threads)
+        .map(|_| {
+            let barrier = Arc::clone(&barrier);
+            std::thread::spawn(move || {
+                // Warm up: thread-local state and the thread's counter shard
+                op();
+                barrier.wait();
+                for _ in 0..iters {
+                    op();
+                }
+            })
+        })
+        .collect();
+
+    barrier.wait();
+    let start = Instant::now();
+    for handle in handles {
+        handle.join().unwrap();
+    }
+    start.elapsed()
+}
+
+fn thread_counts() -> Vec<usize> {
+    let max = std::thread::available_parallelism().map_or(4, |n| n.get());
+    let mut counts: Vec<usize> = [1, 2, 4, 8, 16].into_iter().filter(|&n| n <= max).collect();
+    if counts.last() != Some(&max) {
+        counts.push(max);
+    }
+    counts
+}
+
+fn bench_alloc_free(c: &mut Criterion) {
+    let mut group = c.benchmark_group("alloc_free");
+    for size in SIZES {
+        let layout = Layout::from_size_align(size, 8).unwrap();
+        group.bench_with_input(BenchmarkId::new("system", size), &layout, |b, &layout| {
+            b.iter(|| alloc_free(&System, layout))
+        });
+        group.bench_with_input(
+            BenchmarkId::new("profiling", size),
+            &layout,
+            |b, &layout| b.iter(|| alloc_free(&PROFILING, layout)),
+        );
+    }
+    group.finish();
+}
+
+fn bench_realloc(c: &mut Criterion) {
+    let mut group = c.benchmark_group("realloc_grow");
+    group.bench_function("system", |b| b.iter(|| grow(&System)));
+    group.bench_function("profiling", |b| b.iter(|| grow(&PROFILING)));
+    group.finish();
+}
+
+fn bench_churn(c: &mut Criterion) {
+    let layout = Layout::from_size_align(4096, 8).unwrap();
+    let mut group = c.benchmark_group("pool_churn");
+    group.bench_function("system", |b| {
+        let mut pool = VecDeque::new();
+        b.iter(|| churn(&System, &mut pool, layout));
+        for ptr in pool {
+            unsafe { System.dealloc(ptr, layout) };
+        }
+    });
+    group.bench_function("profiling", |b| {
+        let mut pool = VecDeque::new();
+        b.iter(|| churn(&PROFILING, &mut pool, layout));
+        for ptr in pool {
+            unsafe { PROFILING.dealloc(ptr, layout) };
+        }
+    });
+    group.finish();
+}
+
+fn bench_threads(c: &mut Criterion) {
+    let layout = Layout::from_size_align(256, 8).unwrap();
+    let mut group = c.benchmark_group("alloc_free_threads");
+    for threads in thread_counts() {
+        group.throughput(Throughput::Elements(threads as u64));
+        group.bench_with_input(BenchmarkId::new("system", threads), &threads, |b, &n| {
+            b.iter_custom(|iters| run_threads(n, iters, move || alloc_free(&System, layout)))
+        });
+        group.bench_with_input(BenchmarkId::new("profiling", threads), &threads, |b, &n| {
+            b.iter_custom(|iters| run_threads(n, iters, move || alloc_free(&PROFILING, layout)))
+        });
+    }
+    group.finish();
+}
+
+/// One of two call paths per level, so `path` picks one of 2^`levels`
+/// distinct stacks before `f` runs
+#[inline(never)]
+fn descend(path: u32, levels: u32, f: &dyn Fn()) {
+    if levels == 0 {
+        f();
+    } else if path & 1 == 0 {
+        left(path >> 1, levels - 1, f);
+    } else {
+        right(path >> 1, levels - 1, f);
+    }
+}
+
+// The black_box arguments differ so the two are not merged into one function
+#[inline(never)]
+fn left(path: u32, levels: u32, f: &dyn Fn()) {
+    descend(path, levels, f);
+    black_box(0u8);
+}
+
+#[inline(never)]
+fn right(path: u32, levels: u32, f: &dyn Fn()) {
+    descend(path, levels, f);
+    black_box(1u8);
+}
+
+/// Callsite table lookups: one hot callsite, whose slot stays in cache, against
+/// a thousand visited in turn, which miss on every lookup
+///
+/// The table lives for the life of the process, so a truly first-seen
+/// callsite can only be measured once; the spread case is the steady-state
+/// cost of a program with many allocation sites.
+fn bench_callsites(c: &mut Criterion) {
+    let layout = Layout::from_size_align(64, 8).unwrap();
+    let op = move || alloc_free(&PROFILING, layout);
+    let spread = 1u32 << SPREAD_LEVELS;
+
+    let mut group = c.benchmark_group("callsite_lookup");
+    group.bench_function("warm", |b| b.iter(|| descend(0, SPREAD_LEVELS, &op)));
+    group.bench_function(BenchmarkId::new("spread", spread), |b| {
+        let mut path = 0u32;
+        b.iter(|| {
+            path = (path + 1) % spread;
+            descend(path, SPREAD_LEVELS, &op);
+        })
+    });
+    group.finish();
+}
+
+criterion_group!(
+    benches,
+    bench_alloc_free,
+    bench_realloc,
+    bench_churn,
+    bench_threads,
+    bench_callsites
+);
+criterion_main!(benches);
@@ -0,0 +1,92 @@
+//! Churn benchmark: free latency over a long run of alloc/free traffic.
+//!
+//! Keeps a fixed live set and repeatedly frees a random block and allocates
+//! a replacement, reporting the mean `dealloc` cost per epoch for the alloc
+//! table mode and the in-band header mode. Both should stay flat: in-band
+//! frees never touch the table, and table deletes at the end of a probe
+//! chain clear its tombstones instead of leaving them to pile up.
+//!
+//! ```bash
+//! RUSTFLAGS="-C force-frame-pointers=yes" \
+//!     cargo run --release -p rsprof-trace --features heap --example churn -- [epochs] [ops-per-epoch]
+//! ```
+
+use rsprof_trace::ProfilingAllocator;
+use std::alloc::{GlobalAlloc, Layout};
+use std::time::{Duration, Instant};
+
+/// Blocks kept alive throughout the run
+const LIVE_BLOCKS: usize = 50_000;
+
+struct Rng(u64);
+
+impl Rng {
+    fn next(&mut self) -> u64 {
+        self.0 ^= self.0 << 13;
+        self.0 ^= self.0 >> 7;
+        self.0 ^= self.0 << 17;
+        self.0
+    }
+}
+
+fn random_layout(rng: &mut Rng) -> Layout {
+    Layout::from_size_align(16 + (rng.next() % 240) as usize, 8).unwrap()
+}
+
+/// Run the churn loop, printing mean free latency per epoch
+fn churn<A: GlobalAlloc>(name: &str, alloc: &A, epochs: usize, ops: usize) {
+    let mut rng = Rng(0x2545_F491_4F6C_DD1D);
+    let mut live: Vec<(*mut u8, Layout)> = (0..LIVE_BLOCKS)
+        .map(|_| {
+            let layout = random_layout(&mut rng);
+            (unsafe { alloc.alloc(layout) }, layout)
+        })
+        .collect();
+
+    println!("{name}:");
+    for epoch in 0..epochs {
+        let mut free_time = Duration::ZERO;
+        for _ in 0..ops {
+            let slot = (rng.next() % LIVE_BLOCKS as u64) as usize;
+            let (ptr, layout) = live[slot];
+
+            let start = Instant::now();
+            unsafe { alloc.dealloc(ptr, layout) };
+            free_time += start.elapsed();
+
+            let layout = random_layout(&mut rng);
+            live[slot] = (unsafe { alloc.alloc(layout) }, layout);
+        }
+        println!(
+            "  epoch {:>3}: {:>7.1} ns/free",
+            epoch,
+            free_time.as_nanos() as f64 / ops as f64
+        );
+    }
+
+    for (ptr, layout) in live {
+        unsafe { alloc.dealloc(ptr, layout) };
+    }
+}
+
+fn main() {
+    let mut args = std::env::args().skip(1);
+    let epochs = args.next().and_then(|a| a.parse().ok()).unwrap_or(10);
+    let ops = args
+        .next()
+        .and_then(|a| a.parse().ok())
+        .unwrap_or(1_000_000);
+
+    churn(
+        "alloc table",
+        &ProfilingAllocator::<0, 0, false>::new(),
+        epochs,
+        ops,
+    );
+    churn(
+        "in-band header",
+        &ProfilingAllocator::<0, 0, true>::new(),
+        epochs,
+        ops,
+    );
+}
@@ -1,7 +1,7 @@
 //! Self-instrumentation library for rsprof.
 //!
 //! This crate provides CPU and heap profiling through self-instrumentation:
-//! - **CPU profiling**: Timer-based sampling using SIGPROF
+//! - **CPU profiling**: Per-thread CPU-time timers delivering SIGPROF
 //! - **Heap profiling**: Custom allocator that tracks allocations
 //!
 //! # Usage
@@ -22,11 +22,24 @@
 //! rsprof_trace::profiler!(cpu = 199);  // CPU at 199Hz + heap profiling
 //! ```
 //!
+//! For lower overhead, sample heap allocations instead of recording all of them:
+//! ```rust,ignore
+//! rsprof_trace::profiler!(cpu = 99, heap_sample_bytes = 512 * 1024);
+//! ```
+//!
+//! For long-running processes with heavy churn, keep each block's callsite in
+//! a small in-band header so frees never search the alloc table:
+//! ```rust,ignore
+//! rsprof_trace::profiler!(cpu = 99, inband_header = true);
+//! ```
+//!
 //! Build with frame pointers for accurate stack traces:
 //! ```bash
 //! RUSTFLAGS="-C force-frame-pointers=yes" cargo build --release --features profiling
 //! ```
 //!
+//! Or run `rsprof --unwind dwarf`, which sends the process CFI unwind tables.
+//!
 //! When the `profiling` feature is disabled, the macro expands to a no-op
 //! allocator passthrough with zero overhead.
 
@@ -40,7 +53,7 @@ mod profiling;
 
 // Re-export CPU profiling functions
 #[cfg(feature = "cpu")]
-pub use profiling::{start_cpu_profiling, stop_cpu_profiling};
+pub use profiling::{register_thread, start_cpu_profiling, stop_cpu_profiling};
 
 // Stubs when CPU feature is disabled
 #[cfg(not(feature = "cpu"))]
@@ -51,25 +64,47 @@ pub fn start_cpu_profiling(_freq_hz: u32) {}
 #[inline]
 pub fn stop_cpu_profiling() {}
 
+#[cfg(not(feature = "cpu"))]
+#[inline]
+pub fn register_thread() {}
+
 /// A profiling allocator that wraps the system allocator.
 ///
 /// The const generic `CPU_FREQ` specifies the CPU sampling frequency in Hz.
 /// Set to 0 to disable CPU profiling.
 ///
+/// `HEAP_SAMPLE_BYTES` enables sampled heap profiling: on average one
+/// allocation is captured per that many bytes allocated, and rsprof scales
+/// the results back up. Set to 0 (the default) to record every allocation.
+///
+/// `INBAND_HEADER` stores each block's callsite and allocation time in a small
+/// header in front of it (16 bytes, or the alignment if larger), so frees are
+/// attributed without the global alloc table. This keeps free cost flat under
+/// long-running churn and never drops allocations, at the cost of the extra
+/// bytes per block.
+///
 /// When the `heap` feature is enabled, this allocator captures
 /// allocation and deallocation events along with stack traces.
 /// CPU profiling (if enabled) starts automatically on the first allocation.
 ///
 /// When profiling features are disabled, it's a zero-cost passthrough.
-pub struct ProfilingAllocator<const CPU_FREQ: u32 = 99>;
+pub struct ProfilingAllocator<
+    const CPU_FREQ: u32 = 99,
+    const HEAP_SAMPLE_BYTES: usize = 0,
+    const INBAND_HEADER: bool = false,
+>;
 
-impl<const CPU_FREQ: u32> ProfilingAllocator<CPU_FREQ> {
+impl<const CPU_FREQ: u32, const HEAP_SAMPLE_BYTES: usize, const INBAND_HEADER: bool>
+    ProfilingAllocator<CPU_FREQ, HEAP_SAMPLE_BYTES, INBAND_HEADER>
+{
     pub const fn new() -> Self {
         Self
     }
 }
 
-impl<const CPU_FREQ: u32> Default for ProfilingAllocator<CPU_FREQ> {
+impl<const CPU_FREQ: u32, const HEAP_SAMPLE_BYTES: usize, const INBAND_HEADER: bool> Default
+    for ProfilingAllocator<CPU_FREQ, HEAP_SAMPLE_BYTES, INBAND_HEADER>
+{
     fn default() -> Self {
         Self::new()
     }
@@ -83,7 +118,9 @@ mod disabled {
     use super::ProfilingAllocator;
     use core::alloc::{GlobalAlloc, Layout};
 
-    unsafe impl<const CPU_FREQ: u32> GlobalAlloc for ProfilingAllocator<CPU_FREQ> {
+    unsafe impl<const CPU_FREQ: u32, const HEAP_SAMPLE_BYTES: usize, const INBAND_HEADER: bool>
+        GlobalAlloc for ProfilingAllocator<CPU_FREQ, HEAP_SAMPLE_BYTES, INBAND_HEADER>
+    {
         #[inline]
         unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
             unsafe { libc::malloc(layout.size()) as *mut u8 }
@@ -109,20 +146,35 @@ mod disabled {
 #[cfg(feature = "heap")]
 mod enabled {
     use super::ProfilingAllocator;
+    use super::profiling::{
+        InbandHeader, record_alloc, record_alloc_inband, record_dealloc, record_dealloc_inband,
+        record_taken_dealloc, restore_alloc, set_heap_sample_bytes, take_alloc,
+    };
     #[cfg(feature = "cpu")]
-    use super::profiling::start_cpu_profiling;
-    use super::profiling::{record_alloc, record_dealloc};
+    use super::profiling::{register_thread, start_cpu_profiling};
     use core::alloc::{GlobalAlloc, Layout};
     use core::sync::atomic::{AtomicBool, Ordering};
 
-    static CPU_INITIALIZED: AtomicBool = AtomicBool::new(false);
+    static CONFIGURED: AtomicBool = AtomicBool::new(false);
 
+    /// Setup on the first allocation (heap sampling rate, then CPU timers),
+    /// and on each thread's first allocation (its own CPU timer)
     #[inline]
-    fn maybe_init_cpu<const FREQ: u32>() {
+    fn maybe_init<const FREQ: u32, const SAMPLE_BYTES: usize>() {
+        // Plain load first so the common path never writes the shared line
+        if !CONFIGURED.load(Ordering::Relaxed) && !CONFIGURED.swap(true, Ordering::SeqCst) {
+            set_heap_sample_bytes(SAMPLE_BYTES);
+            #[cfg(feature = "cpu")]
+            {
+                if FREQ > 0 {
+                    start_cpu_profiling(FREQ);
+                }
+            }
+        }
         #[cfg(feature = "cpu")]
         {
-            if FREQ > 0 && !CPU_INITIALIZED.swap(true, Ordering::SeqCst) {
-                start_cpu_profiling(FREQ);
+            if FREQ > 0 {
+                register_thread();
             }
         }
     }
@@ -148,12 +200,64 @@ mod enabled {
         }
     }
 
-    unsafe impl<const CPU_FREQ: u32> GlobalAlloc for ProfilingAllocator<CPU_FREQ> {
+    /// Bytes the in-band header needs: the callsite tag and allocation time
+    const HEADER_MIN: usize = 16;
+
+    /// Size of the in-band header in front of a block: keeps the block aligned
+    #[inline(always)]
+    const fn header_size(align: usize) -> usize {
+        if align > HEADER_MIN {
+            align
+        } else {
+            HEADER_MIN
+        }
+    }
+
+    /// Read the header stored just before a block
+    #[inline(always)]
+    unsafe fn read_header(ptr: *mut u8) -> InbandHeader {
+        let words = ptr as *mut u64;
+        unsafe {
+            InbandHeader {
+                tag: words.sub(1).read(),
+                born: words.sub(2).read(),
+            }
+        }
+    }
+
+    /// Store the header just before a block
+    #[inline(always)]
+    unsafe fn write_header(ptr: *mut u8, header: InbandHeader) {
+        let words = ptr as *mut u64;
+        unsafe {
+            words.sub(1).write(header.tag);
+            words.sub(2).write(header.born);
+        }
+    }
+
+    unsafe impl<const CPU_FREQ: u32, const HEAP_SAMPLE_BYTES: usize, const INBAND_HEADER: bool>
+        GlobalAlloc for ProfilingAllocator<CPU_FREQ, HEAP_SAMPLE_BYTES, INBAND_HEADER>
+    {
         // IMPORTANT: These must NOT be inlined!
         // If inlined into libstd (which has no frame pointers), stack capture breaks.
+        // The record_* calls must also be made directly from these methods so
+        // every path has the same number of allocator frames to skip.
         #[inline(never)]
         unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
-            maybe_init_cpu::<CPU_FREQ>();
+            maybe_init::<CPU_FREQ, HEAP_SAMPLE_BYTES>();
+            if INBAND_HEADER {
+                let header = header_size(layout.align());
+                let Some(total) = layout.size().checked_add(header) else {
+                    return core::ptr::null_mut();
+                };
+                let base = unsafe { aligned_malloc(total, layout.align()) };
+                if base.is_null() {
+                    return base;
+                }
+                let ptr = unsafe { base.add(header) };
+                unsafe { write_header(ptr, record_alloc_inband(layout.size())) };
+                return ptr;
+            }
             let ptr = unsafe { aligned_malloc(layout.size(), layout.align()) };
             if !ptr.is_null() {
                 record_alloc(ptr, layout.size());
@@ -163,12 +267,49 @@ mod enabled {
 
         #[inline(never)]
         unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+            if INBAND_HEADER {
+                record_dealloc_inband(unsafe { read_header(ptr) }, layout.size());
+                let base = unsafe { ptr.sub(header_size(layout.align())) };
+                unsafe { libc::free(base as *mut libc::c_void) };
+                return;
+            }
             record_dealloc(ptr, layout.size());
             unsafe { libc::free(ptr as *mut libc::c_void) }
         }
 
         #[inline(never)]
         unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
+            if INBAND_HEADER {
+                let header = header_size(layout.align());
+                let Some(total) = new_size.checked_add(header) else {
+                    return core::ptr::null_mut();
+                };
+                let old_header = unsafe { read_header(ptr) };
+                let old_base = unsafe { ptr.sub(header) };
+                let new_base = if layout.align() > MIN_ALIGN {
+                    // realloc doesn't preserve alignment: alloc+copy+free
+                    let new_base = unsafe { aligned_malloc(total, layout.align()) };
+                    if !new_base.is_null() {
+                        let copy_size = header + new_size.min(layout.size());
+                        unsafe {
+                            core::ptr::copy_nonoverlapping(old_base, new_base, copy_size);
+                            libc::free(old_base as *mut libc::c_void);
+                        }
+                    }
+                    new_base
+                } else {
+                    unsafe { libc::realloc(old_base as *mut libc::c_void, total) as *mut u8 }
+                };
+                if new_base.is_null() {
+                    // The old block is untouched and still owned by the caller
+                    return new_base;
+                }
+                record_dealloc_inband(old_header, layout.size());
+                let new_ptr = unsafe { new_base.add(header) };
+                unsafe { write_header(new_ptr, record_alloc_inband(new_size)) };
+                return new_ptr;
+            }
+
             // realloc doesn't preserve alignment, so we need to alloc+copy+free
             // for over-aligned types
             if layout.align() > MIN_ALIGN {
@@ -186,10 +327,15 @@ mod enabled {
                 }
                 new_ptr
             } else {
-                record_dealloc(ptr, layout.size());
+                // The record is taken before realloc can free the block, and
+                // put back if it fails: the caller still owns the old block
+                let taken = take_alloc(ptr);
                 let new_ptr =
                     unsafe { libc::realloc(ptr as *mut libc::c_void, new_size) as *mut u8 };
-                if !new_ptr.is_null() {
+                if new_ptr.is_null() {
+                    restore_alloc(ptr, taken);
+                } else {
+                    record_taken_dealloc(taken);
                     record_alloc(new_ptr, new_size);
                 }
                 new_ptr
@@ -198,7 +344,28 @@ mod enabled {
 
         #[inline(never)]
         unsafe fn alloc_zeroed(&self, layout: Layout) -> *mut u8 {
-            maybe_init_cpu::<CPU_FREQ>();
+            maybe_init::<CPU_FREQ, HEAP_SAMPLE_BYTES>();
+            if INBAND_HEADER {
+                let header = header_size(layout.align());
+                let Some(total) = layout.size().checked_add(header) else {
+                    return core::ptr::null_mut();
+                };
+                let base = if layout.align() <= MIN_ALIGN {
+                    unsafe { libc::calloc(1, total) as *mut u8 }
+                } else {
+                    let base = unsafe { aligned_malloc(total, layout.align()) };
+                    if !base.is_null() {
+                        unsafe { core::ptr::write_bytes(base, 0, total) };
+                    }
+                    base
+                };
+                if base.is_null() {
+                    return base;
+                }
+                let ptr = unsafe { base.add(header) };
+                unsafe { write_header(ptr, record_alloc_inband(layout.size())) };
+                return ptr;
+            }
             if layout.align() <= MIN_ALIGN {
                 let ptr = unsafe { libc::calloc(1, layout.size()) as *mut u8 };
                 if !ptr.is_null() {
@@ -232,6 +399,12 @@ mod enabled {
 ///
 /// // Custom CPU frequency
 /// rsprof_trace::profiler!(cpu = 199);
+///
+/// // Sampled heap profiling: ~one allocation captured per 512 KiB allocated
+/// rsprof_trace::profiler!(cpu = 99, heap_sample_bytes = 512 * 1024);
+///
+/// // Attribute frees through a per-block header instead of the alloc table
+/// rsprof_trace::profiler!(cpu = 99, inband_header = true);
 /// ```
 ///
 /// # Build
@@ -247,9 +420,22 @@ macro_rules! profiler {
         $crate::profiler!(cpu = 99);
     };
     (cpu = $freq:expr) => {
+        $crate::profiler!(cpu = $freq, heap_sample_bytes = 0);
+    };
+    (cpu = $freq:expr, heap_sample_bytes = $bytes:expr) => {
+        $crate::profiler!(
+            cpu = $freq,
+            heap_sample_bytes = $bytes,
+            inband_header = false
+        );
+    };
+    (cpu = $freq:expr, inband_header = $inband:expr) => {
+        $crate::profiler!(cpu = $freq, heap_sample_bytes = 0, inband_header = $inband);
+    };
+    (cpu = $freq:expr, heap_sample_bytes = $bytes:expr, inband_header = $inband:expr) => {
         #[global_allocator]
-        static __RSPROF_ALLOC: $crate::ProfilingAllocator<$freq> =
-            $crate::ProfilingAllocator::<$freq>::new();
+        static __RSPROF_ALLOC: $crate::ProfilingAllocator<{ $freq }, { $bytes }, { $inband }> =
+            $crate::ProfilingAllocator::<{ $freq }, { $bytes }, { $inband }>::new();
     };
 }
 
@@ -259,4 +445,7 @@ macro_rules! profiler {
 macro_rules! profiler {
     () => {};
     (cpu = $freq:expr) => {};
+    (cpu = $freq:expr, heap_sample_bytes = $bytes:expr) => {};
+    (cpu = $freq:expr, inband_header = $inband:expr) => {};
+    (cpu = $freq:expr, heap_sample_bytes = $bytes:expr, inband_header = $inband:expr) => {};
 }
@@ -1,33 +1,115 @@
 //! Profiling implementation - aggregated callsite stats for CPU and heap.
 
-use core::sync::atomic::{AtomicBool, AtomicU32, AtomicU64, Ordering};
+#[cfg(feature = "heap")]
+use core::sync::atomic::AtomicI64;
+use core::sync::atomic::{AtomicBool, AtomicPtr, AtomicU8, AtomicU32, AtomicU64, Ordering};
 
 /// Maximum stack depth to capture
 const MAX_STACK_DEPTH: usize = 64;
 
-/// Number of callsite stats slots
-const CALLSITE_CAPACITY: usize = 8192;
+/// Default callsite capacity of the first table segment
+const DEFAULT_CALLSITE_CAPACITY: usize = 8192;
+
+/// Default alloc table capacity of the first table segment
+const DEFAULT_ALLOC_TABLE_CAPACITY: usize = 256 * 1024;
+
+/// Default stack node capacity of the first table segment
+const DEFAULT_STACK_NODE_CAPACITY: usize = 64 * 1024;
+
+/// Number of table segments; segment `i` holds `capacity << i` slots
+///
+/// All segments are mapped up front but only touched pages are backed, so an
+/// unused segment costs address space only. A table grows by activating the
+/// next segment; existing entries never move.
+const TABLE_SEGMENTS: u32 = 4;
 
-/// Number of allocation tracking slots
-const ALLOC_TABLE_CAPACITY: usize = 256 * 1024;
+/// Probe limit within a segment before the next segment is used
+const CALLSITE_PROBE_LIMIT: usize = 256;
+const ALLOC_PROBE_LIMIT: usize = 1024;
+const STACK_PROBE_LIMIT: usize = 256;
 
-/// Tombstone marker for deleted entries (allows continued probing)
+/// Tombstone marker for deleted entries inside a probe chain (allows
+/// continued probing)
 const TOMBSTONE: u64 = u64::MAX;
 
-/// Shared memory path
-const SHM_PATH: &[u8] = b"/rsprof-trace\0";
+/// Shared memory name prefix; each process's object is `/rsprof-trace-<pid>`
+const SHM_PREFIX: &[u8] = b"/rsprof-trace-";
+
+/// Unwind table name prefix; `rsprof --unwind dwarf` creates
+/// `/rsprof-unwind-<pid>` after attaching
+const UNWIND_SHM_PREFIX: &[u8] = b"/rsprof-unwind-";
+
+/// Magic number of a complete unwind table
+const UNWIND_MAGIC: u64 = 0x5253_5052_4F46_5557; // "RSPROFUW"
+
+/// Unwind table version
+const UNWIND_VERSION: u32 = 1;
+
+/// Stack walks between looks for an unwind table, until one is mapped
+const UNWIND_PROBE_INTERVAL: u32 = 256;
+
+/// Largest frame the CFI walk accepts, as a sanity bound on a bad rule
+const MAX_FRAME_BYTES: u64 = 8 << 20;
+
+/// Most counter shards; a segment has one per CPU the process may run on,
+/// up to this, and a thread updates the shard of its CPU (`CPU_SHARDS`)
+const MAX_COUNTER_SHARDS: usize = 32;
+
+/// CPUs a shard is kept for (`CPU_SETSIZE`)
+const MAX_CPUS: usize = 1024;
+
+/// Most histogram shards; fewer than the counters, since each histogram
+/// entry spans six cache lines and its updates spread over buckets
+const MAX_HISTOGRAM_SHARDS: usize = 8;
+
+/// Buckets per size and lifetime histogram
+const HISTOGRAM_BUCKETS: usize = 24;
+
+/// Lifetimes are measured in ticks of CLOCK_MONOTONIC nanoseconds >> this
+/// (about 1us)
+#[cfg(feature = "heap")]
+const LIFETIME_SHIFT: u32 = 10;
 
 /// Magic number for validation
-const MAGIC: u64 = 0x5253_5052_4F46_5333; // "RSPROFS3" (stats v3)
+const MAGIC: u64 = 0x5253_5052_4F46_5341; // "RSPROFSA" (stats v12)
 
 /// Version number
-const VERSION: u32 = 3;
+const VERSION: u32 = 12;
+
+/// Set in `CallsiteStats::stack` once the stack reference is written
+const STACK_PUBLISHED: u64 = 1 << 63;
 
-/// Aggregated stats per callsite
+/// Identity of a callsite: full-stack hash, interned stack and thread
 #[repr(C)]
 pub struct CallsiteStats {
-    /// Callsite hash (0 = unused slot)
+    /// Hash of the full captured stack and thread (0 = unused slot)
     pub hash: AtomicU64,
+    /// `STACK_PUBLISHED | depth << 32 | stack id`, 0 until published;
+    /// the id is the innermost node in the stack store (0 = empty stack)
+    pub stack: AtomicU64,
+    /// Thread the CPU samples were taken on (0 for heap callsites)
+    pub tid: AtomicU32,
+    pub _reserved: u32,
+}
+
+/// One frame in the stack store: a node in a trie rooted at the outermost
+/// frame, so stacks that share callers share nodes
+#[repr(C)]
+pub struct StackNode {
+    /// Return address of this frame
+    pub addr: AtomicU64,
+    /// Id of the caller's node (0 = outermost frame)
+    pub parent: AtomicU32,
+    /// 0 = empty, 1 = being written, 2 = ready
+    pub state: AtomicU32,
+}
+
+/// One shard of a callsite's counters
+///
+/// Cache-line sized so cores updating different shards never share a line;
+/// the reader sums all shards.
+#[repr(C, align(64))]
+pub struct CallsiteCounters {
     /// Total allocation count
     pub alloc_count: AtomicU64,
     /// Total allocated bytes
@@ -38,12 +120,17 @@ pub struct CallsiteStats {
     pub free_bytes: AtomicU64,
     /// CPU sample count
     pub cpu_samples: AtomicU64,
-    /// Stack depth
-    pub stack_depth: AtomicU32,
-    /// Reserved for alignment
-    pub _reserved: u32,
-    /// Stack trace (stored once per callsite)
-    pub stack: [AtomicU64; MAX_STACK_DEPTH],
+}
+
+/// One shard of a callsite's allocation histograms, log2-bucketed; the last
+/// bucket of each is open-ended
+#[repr(C, align(64))]
+pub struct CallsiteHistogram {
+    /// Allocations by size: bucket `b` holds `[2^b, 2^(b+1))` bytes
+    pub size: [AtomicU64; HISTOGRAM_BUCKETS],
+    /// Frees by lifetime: bucket 0 is under one tick, bucket `b` is
+    /// `[2^(b-1), 2^b)` ticks
+    pub lifetime: [AtomicU64; HISTOGRAM_BUCKETS],
 }
 
 /// Allocation tracking entry for dealloc attribution
@@ -53,29 +140,182 @@ pub struct AllocEntry {
     pub ptr: AtomicU64,
     /// Allocation size
     pub size: AtomicU64,
-    /// Callsite hash
-    pub callsite_hash: AtomicU64,
+    /// Callsite slot
+    pub callsite: AtomicU64,
+    /// Allocation time in lifetime ticks
+    pub born: AtomicU64,
 }
 
 /// Shared memory header
+///
+/// Layout after the header, each region sized for all segments:
+/// dirty bitmap | callsites | alloc table | stack nodes | counter shards
+/// (64-byte aligned) | histogram shards
 #[repr(C)]
 pub struct StatsHeader {
     /// Magic number for validation
     pub magic: u64,
     /// Version number
     pub version: u32,
-    /// Callsite table capacity
+    /// Callsite capacity of the first segment
     pub callsite_capacity: u32,
-    /// Alloc table capacity
+    /// Alloc table capacity of the first segment
     pub alloc_table_capacity: u32,
     /// Process ID
     pub pid: u32,
+    /// Number of counter shards
+    pub counter_shards: u32,
+    /// Number of segments per table
+    pub table_segments: u32,
+    /// Mean bytes between sampled allocations (0 = every allocation recorded)
+    pub heap_sample_bytes: u64,
+    /// Callsite segments in use (1..=table_segments)
+    pub callsite_segments: AtomicU32,
+    /// Alloc table segments in use (1..=table_segments)
+    pub alloc_segments: AtomicU32,
+    /// Events dropped because every callsite segment was full
+    pub callsite_overflow: AtomicU64,
+    /// Allocations not tracked because every alloc segment was full;
+    /// their frees go unattributed, so live bytes are overstated
+    pub alloc_dropped: AtomicU64,
+    /// Stack node capacity of the first segment
+    pub stack_node_capacity: u32,
+    /// Stack node segments in use (1..=table_segments)
+    pub stack_segments: AtomicU32,
+    /// Events dropped because the stack store was full
+    pub stack_overflow: AtomicU64,
+    /// Number of histogram shards
+    pub histogram_shards: u32,
+    /// Buckets per histogram
+    pub histogram_buckets: u32,
+    /// Inode of the creator's pid namespace, so rsprof only judges
+    /// segments whose pid means the same process to it
+    pub pid_ns: u64,
+    /// Creator's start time in clock ticks since boot, as in
+    /// /proc/[pid]/stat; tells a reused pid from the creator
+    pub start_time: u64,
+}
+
+/// Table geometry, fixed at init
+struct TableLayout {
+    /// First-segment callsite capacity (power of two)
+    callsite_capacity: usize,
+    /// First-segment alloc table capacity (power of two)
+    alloc_capacity: usize,
+    /// First-segment stack node capacity (power of two)
+    stack_node_capacity: usize,
+    /// Counter and histogram shards
+    counter_shards: usize,
+    histogram_shards: usize,
+    /// Callsite slots across all segments
+    callsite_slots: usize,
+    dirty_offset: usize,
+    callsites_offset: usize,
+    alloc_table_offset: usize,
+    stack_nodes_offset: usize,
+    counters_offset: usize,
+    histograms_offset: usize,
+    total_size: usize,
+}
+
+impl TableLayout {
+    const fn new(
+        callsite_capacity: usize,
+        alloc_capacity: usize,
+        stack_node_capacity: usize,
+        counter_shards: usize,
+    ) -> Self {
+        let histogram_shards = if counter_shards < MAX_HISTOGRAM_SHARDS {
+            counter_shards
+        } else {
+            MAX_HISTOGRAM_SHARDS
+        };
+        let callsite_slots = segment_start(callsite_capacity, TABLE_SEGMENTS);
+        let alloc_slots = segment_start(alloc_capacity, TABLE_SEGMENTS);
+        let stack_node_slots = segment_start(stack_node_capacity, TABLE_SEGMENTS);
+        let dirty_offset = core::mem::size_of::<StatsHeader>();
+        let callsites_offset = dirty_offset + callsite_slots / 64 * 8;
+        let alloc_table_offset =
+            callsites_offset + callsite_slots * core::mem::size_of::<CallsiteStats>();
+        let stack_nodes_offset =
+            alloc_table_offset + alloc_slots * core::mem::size_of::<AllocEntry>();
+        let counters_offset = (stack_nodes_offset
+            + stack_node_slots * core::mem::size_of::<StackNode>())
+        .next_multiple_of(64);
+        let histograms_offset = counters_offset
+            + counter_shards * callsite_slots * core::mem::size_of::<CallsiteCounters>();
+        let total_size = histograms_offset
+            + histogram_shards * callsite_slots * core::mem::size_of::<CallsiteHistogram>();
+        TableLayout {
+            callsite_capacity,
+            alloc_capacity,
+            stack_node_capacity,
+            counter_shards,
+            histogram_shards,
+            callsite_slots,
+            dirty_offset,
+            callsites_offset,
+            alloc_table_offset,
+            stack_nodes_offset,
+            counters_offset,
+            histograms_offset,
+            total_size,
+        }
+    }
+}
+
+/// First slot of segment `seg` in a table whose first segment has `capacity` slots
+#[inline]
+const fn segment_start(capacity: usize, seg: u32) -> usize {
+    capacity * ((1 << seg) - 1)
 }
 
 /// Global state
 static INITIALIZED: AtomicBool = AtomicBool::new(false);
-static IN_SIGNAL_HANDLER: AtomicBool = AtomicBool::new(false);
 static mut SHM_BASE: *mut u8 = core::ptr::null_mut();
+/// Written once in init, before SHM_BASE is published
+static mut LAYOUT: TableLayout = TableLayout::new(
+    DEFAULT_CALLSITE_CAPACITY,
+    DEFAULT_ALLOC_TABLE_CAPACITY,
+    DEFAULT_STACK_NODE_CAPACITY,
+    1,
+);
+
+/// Mean sampling interval in bytes, set by the allocator before first use
+static HEAP_SAMPLE_BYTES: AtomicU64 = AtomicU64::new(0);
+
+/// Segments created by this process image; bumped in a fork child, whose
+/// new segment makes in-band tags from the parent's meaningless
+static GENERATION: AtomicU32 = AtomicU32::new(0);
+
+/// Whether the fork handler has been registered
+static ATFORK_REGISTERED: AtomicBool = AtomicBool::new(false);
+
+/// Set in a fork child until `init` moves it off the parent's segment
+static FORK_PENDING: AtomicBool = AtomicBool::new(false);
+
+/// The parent's mapping in a fork child, unmapped by `init`
+static PARENT_MAPPING: AtomicPtr<u8> = AtomicPtr::new(core::ptr::null_mut());
+
+/// Per-shard allocation sampler state
+#[cfg(feature = "heap")]
+#[repr(C, align(64))]
+struct HeapSampler {
+    /// Bytes left before the next sampled allocation
+    bytes_left: AtomicI64,
+    /// xorshift64 state (0 = unseeded)
+    rng: AtomicU64,
+}
+
+#[cfg(feature = "heap")]
+#[allow(clippy::declare_interior_mutable_const)]
+const HEAP_SAMPLER_INIT: HeapSampler = HeapSampler {
+    bytes_left: AtomicI64::new(0),
+    rng: AtomicU64::new(0),
+};
+
+#[cfg(feature = "heap")]
+static HEAP_SAMPLERS: [HeapSampler; MAX_COUNTER_SHARDS] = [HEAP_SAMPLER_INIT; MAX_COUNTER_SHARDS];
 
 /// Get pointer to the header
 #[inline]
@@ -86,17 +326,70 @@ fn get_header() -> *mut StatsHeader {
 /// Get pointer to callsite stats array
 #[inline]
 fn get_callsites() -> *mut CallsiteStats {
-    unsafe { SHM_BASE.add(core::mem::size_of::<StatsHeader>()) as *mut CallsiteStats }
+    unsafe { SHM_BASE.add(LAYOUT.callsites_offset) as *mut CallsiteStats }
 }
 
 /// Get pointer to alloc table array
 #[inline]
 fn get_alloc_table() -> *mut AllocEntry {
-    let callsites_size = CALLSITE_CAPACITY * core::mem::size_of::<CallsiteStats>();
+    unsafe { SHM_BASE.add(LAYOUT.alloc_table_offset) as *mut AllocEntry }
+}
+
+/// Get pointer to stack node array; node id `n` lives at index `n - 1`
+#[inline]
+fn get_stack_nodes() -> *mut StackNode {
+    unsafe { SHM_BASE.add(LAYOUT.stack_nodes_offset) as *mut StackNode }
+}
+
+#[allow(clippy::declare_interior_mutable_const)]
+const CPU_SHARD_INIT: AtomicU8 = AtomicU8::new(0);
+
+/// Counter shard of each CPU: its rank among the CPUs the process may run
+/// on, so a strided mask like `taskset -c 0,8,16,24` still spreads over all
+/// shards. Set by `counter_shards`.
+static CPU_SHARDS: [AtomicU8; MAX_CPUS] = [CPU_SHARD_INIT; MAX_CPUS];
+
+/// Shard index for the CPU this thread is running on
+#[inline]
+fn local_shard() -> usize {
+    let cpu = unsafe { libc::sched_getcpu() };
+    CPU_SHARDS
+        .get(cpu as usize)
+        .map_or(0, |shard| shard.load(Ordering::Relaxed) as usize)
+}
+
+/// Get this CPU's counter shard for a callsite slot
+#[inline]
+fn local_counters(idx: usize) -> *mut CallsiteCounters {
     unsafe {
-        SHM_BASE
-            .add(core::mem::size_of::<StatsHeader>())
-            .add(callsites_size) as *mut AllocEntry
+        (SHM_BASE.add(LAYOUT.counters_offset) as *mut CallsiteCounters)
+            .add(local_shard() * LAYOUT.callsite_slots + idx)
+    }
+}
+
+/// Get this CPU's histogram shard for a callsite slot
+#[cfg(feature = "heap")]
+#[inline]
+fn local_histogram(idx: usize) -> *mut CallsiteHistogram {
+    unsafe {
+        (SHM_BASE.add(LAYOUT.histograms_offset) as *mut CallsiteHistogram)
+            .add(local_shard() % LAYOUT.histogram_shards * LAYOUT.callsite_slots + idx)
+    }
+}
+
+/// Flag a callsite as changed for the reader
+///
+/// Must follow the counter updates. Counter RMWs, this load and the reader's
+/// swap and counter loads are all SeqCst: if we still see the bit set, the
+/// reader's clear comes later and its reads see our update. On x86 this costs
+/// nothing over Relaxed.
+#[inline]
+fn mark_dirty(idx: usize) {
+    let word = unsafe { &*(SHM_BASE.add(LAYOUT.dirty_offset) as *const AtomicU64).add(idx / 64) };
+    let bit = 1u64 << (idx % 64);
+    // Load first: a hot callsite only pays for the RMW once per reader pass
+    if word.load(Ordering::SeqCst) & bit == 0 {
+        word.fetch_or(bit, Ordering::SeqCst);
     }
 }
 
@@ -106,16 +399,11 @@ fn shm_ready() -> bool {
     unsafe { !SHM_BASE.is_null() }
 }
 
-/// Compute callsite hash from stack for heap events.
-/// Skip first 4 frames (allocator internals), hash next 8 frames.
+/// Hash the full captured stack (FNV-1a over whole frames)
 #[inline]
-fn stack_key_heap(stack: &[u64], depth: u32) -> u64 {
-    let mut key = 0u64;
-    let skip = 4.min(depth as usize);
-    let take = 8.min((depth as usize).saturating_sub(skip));
-
-    for i in 0..take {
-        let addr = stack[skip + i];
+fn stack_key(stack: &[u64], depth: u32) -> u64 {
+    let mut key = 0xcbf2_9ce4_8422_2325u64;
+    for &addr in &stack[..(depth as usize).min(MAX_STACK_DEPTH)] {
         key ^= addr;
         key = key.wrapping_mul(0x100000001b3);
     }
@@ -127,168 +415,483 @@ fn stack_key_heap(stack: &[u64], depth: u32) -> u64 {
     key
 }
 
-/// Compute callsite hash from stack for CPU samples.
-/// No skip needed - CPU stacks start with the interrupted PC.
+/// Fold the sampled thread into a stack key, so each thread gets its own
+/// CPU callsite
+#[cfg(feature = "cpu")]
 #[inline]
-fn stack_key_cpu(stack: &[u64], depth: u32) -> u64 {
-    let mut key = 0u64;
-    let take = 6.min(depth as usize);
+fn thread_key(key: u64, tid: u32) -> u64 {
+    match key ^ (tid as u64).wrapping_mul(0x9E37_79B9_7F4A_7C15) {
+        0 => 1,
+        key => key,
+    }
+}
 
-    for i in 0..take {
-        let addr = stack[i];
-        key ^= addr;
-        key = key.wrapping_mul(0x100000001b3);
+/// Move a table from `seg` to `seg + 1` segments in use, if any remain
+///
+/// Returns false when the table is already at its last segment.
+#[inline]
+fn grow_table(active: &AtomicU32, seg: u32) -> bool {
+    if seg + 1 >= TABLE_SEGMENTS {
+        return false;
     }
+    // Losing the race is fine: someone else grew it
+    let _ = active.compare_exchange(seg + 1, seg + 2, Ordering::AcqRel, Ordering::Relaxed);
+    true
+}
 
-    // Ensure non-zero (0 means empty slot)
-    if key == 0 {
-        key = 1;
+/// Check whether a published callsite holds this exact stack and thread
+///
+/// The depth and innermost frame are compared as well as the full-stack hash,
+/// so a hash collision between different stacks is caught rather than merged.
+#[inline]
+fn callsite_matches(
+    entry: &CallsiteStats,
+    stack: &[u64; MAX_STACK_DEPTH],
+    depth: u32,
+    tid: u32,
+) -> bool {
+    let stack_ref = entry.stack.load(Ordering::Acquire);
+    if stack_ref & STACK_PUBLISHED == 0
+        || ((stack_ref >> 32) as u32 & 0x7fff_ffff) != depth
+        || entry.tid.load(Ordering::Relaxed) != tid
+    {
+        return false;
+    }
+    let id = stack_ref as u32;
+    if id == 0 {
+        return depth == 0;
+    }
+    unsafe {
+        (*get_stack_nodes().add(id as usize - 1))
+            .addr
+            .load(Ordering::Relaxed)
+            == stack[0]
+    }
+}
+
+/// Intern one frame under `parent`, returning its node id
+///
+/// Lock-free and never waits, so it is safe in the signal handler: a node
+/// another thread is still writing is skipped, at worst duplicating a frame.
+#[inline]
+fn intern_frame(parent: u32, addr: u64) -> Option<u32> {
+    let nodes = get_stack_nodes();
+    let header = unsafe { &*get_header() };
+    let capacity = unsafe { LAYOUT.stack_node_capacity };
+    let hash = (addr ^ ((parent as u64) << 40) ^ parent as u64).wrapping_mul(0x9E37_79B9_7F4A_7C15);
+
+    let mut seg = 0;
+    loop {
+        let newest = seg + 1 == header.stack_segments.load(Ordering::Acquire);
+        let start = segment_start(capacity, seg);
+        let mask = (capacity << seg) - 1;
+        let mut idx = (hash >> 32) as usize & mask;
+
+        for _ in 0..STACK_PROBE_LIMIT {
+            let slot = start + idx;
+            let node = unsafe { &*nodes.add(slot) };
+            match node.state.load(Ordering::Acquire) {
+                2 if node.parent.load(Ordering::Relaxed) == parent
+                    && node.addr.load(Ordering::Relaxed) == addr =>
+                {
+                    return Some(slot as u32 + 1);
+                }
+                0 if !newest => break,
+                0 => {
+                    if node
+                        .state
+                        .compare_exchange(0, 1, Ordering::AcqRel, Ordering::Relaxed)
+                        .is_ok()
+                    {
+                        node.addr.store(addr, Ordering::Relaxed);
+                        node.parent.store(parent, Ordering::Relaxed);
+                        node.state.store(2, Ordering::Release);
+                        return Some(slot as u32 + 1);
+                    }
+                }
+                _ => {}
+            }
+            idx = (idx + 1) & mask;
+        }
+
+        if newest && !grow_table(&header.stack_segments, seg) {
+            header.stack_overflow.fetch_add(1, Ordering::Relaxed);
+            return None;
+        }
+        seg += 1;
     }
-    key
 }
 
-/// Find or create a callsite entry. Returns pointer to the CallsiteStats.
+/// Intern a stack (innermost frame first), returning the innermost node id
+#[inline]
+fn intern_stack(stack: &[u64; MAX_STACK_DEPTH], depth: u32) -> Option<u32> {
+    let mut id = 0;
+    for &addr in stack[..(depth as usize).min(MAX_STACK_DEPTH)].iter().rev() {
+        id = intern_frame(id, addr)?;
+    }
+    Some(id)
+}
+
+/// Find or create a callsite entry for a stack on thread `tid` (0 for heap
+/// callsites). Returns its slot index, or None if every segment is full.
+///
+/// New callsites only go into the newest segment; callsites are never
+/// removed, so an empty slot in an older segment means "not in this segment"
+/// and the search moves on. The stack is interned only when a new callsite
+/// is created.
 #[inline]
 fn find_or_create_callsite(
     hash: u64,
     stack: &[u64; MAX_STACK_DEPTH],
     depth: u32,
-) -> *mut CallsiteStats {
+    tid: u32,
+) -> Option<usize> {
     let callsites = get_callsites();
-    let mut idx = (hash as usize) % CALLSITE_CAPACITY;
-
-    for _ in 0..CALLSITE_CAPACITY {
-        let entry = unsafe { callsites.add(idx) };
-        let stored_hash = unsafe { (*entry).hash.load(Ordering::Acquire) };
-
-        if stored_hash == hash {
-            // Found existing entry
-            return entry;
-        }
+    let header = unsafe { &*get_header() };
+    let capacity = unsafe { LAYOUT.callsite_capacity };
+
+    let depth = depth.min(MAX_STACK_DEPTH as u32);
+    let mut stack_id = None;
+    let mut seg = 0;
+    loop {
+        let active = header.callsite_segments.load(Ordering::Acquire);
+        let newest = seg + 1 == active;
+        let start = segment_start(capacity, seg);
+        let mask = (capacity << seg) - 1;
+        let mut idx = hash as usize & mask;
+
+        for _ in 0..CALLSITE_PROBE_LIMIT.min(mask + 1) {
+            let slot = start + idx;
+            let entry = unsafe { &*callsites.add(slot) };
+            let stored_hash = entry.hash.load(Ordering::Acquire);
+
+            // An unpublished entry with our hash is skipped; at worst the
+            // same stack gets a second slot
+            if stored_hash == hash && callsite_matches(entry, stack, depth, tid) {
+                return Some(slot);
+            }
 
-        if stored_hash == 0 {
-            // Empty slot - try to claim it
-            if unsafe {
-                (*entry)
+            if stored_hash == 0 {
+                if !newest {
+                    break;
+                }
+                let id = match stack_id {
+                    Some(id) => id,
+                    None => *stack_id.insert(intern_stack(stack, depth)?),
+                };
+                // Empty slot - try to claim it, then publish the stack
+                if entry
                     .hash
-                    .compare_exchange(0, hash, Ordering::AcqRel, Ordering::Relaxed)
+                    .compare_exchange(0, hash, Ordering::AcqRel, Ordering::Acquire)
                     .is_ok()
-            } {
-                // Successfully claimed - store the stack
-                unsafe {
-                    (*entry).stack_depth.store(depth, Ordering::Relaxed);
-                    for i in 0..(depth as usize).min(MAX_STACK_DEPTH) {
-                        (*entry).stack[i].store(stack[i], Ordering::Relaxed);
-                    }
+                {
+                    entry.tid.store(tid, Ordering::Relaxed);
+                    entry.stack.store(
+                        STACK_PUBLISHED | (depth as u64) << 32 | id as u64,
+                        Ordering::Release,
+                    );
+                    return Some(slot);
                 }
-                return entry;
             }
 
-            // Another thread claimed it, re-check
-            let new_hash = unsafe { (*entry).hash.load(Ordering::Acquire) };
-            if new_hash == hash {
-                return entry;
-            }
+            // Linear probe
+            idx = (idx + 1) & mask;
         }
 
-        // Linear probe
-        idx = (idx + 1) % CALLSITE_CAPACITY;
+        if newest && !grow_table(&header.callsite_segments, seg) {
+            header.callsite_overflow.fetch_add(1, Ordering::Relaxed);
+            return None;
+        }
+        seg += 1;
     }
-
-    // Table full - return first slot as fallback (will aggregate there)
-    callsites
 }
 
-/// Find a callsite by hash only (for dealloc attribution)
+/// Alloc table home slot for a pointer (skip low bits, which are often 0)
 #[inline]
-fn find_callsite(hash: u64) -> *mut CallsiteStats {
-    let callsites = get_callsites();
-    let mut idx = (hash as usize) % CALLSITE_CAPACITY;
+fn alloc_slot_hash(ptr: u64) -> usize {
+    (ptr >> 4) as usize
+}
 
-    for _ in 0..CALLSITE_CAPACITY {
-        let entry = unsafe { callsites.add(idx) };
-        let stored_hash = unsafe { (*entry).hash.load(Ordering::Acquire) };
+/// Track an allocation in the newest alloc table segment
+#[inline]
+fn track_alloc(ptr: u64, size: u64, callsite: usize, born: u64) {
+    let alloc_table = get_alloc_table();
+    let header = unsafe { &*get_header() };
+    let capacity = unsafe { LAYOUT.alloc_capacity };
+
+    loop {
+        let seg = header.alloc_segments.load(Ordering::Acquire) - 1;
+        let start = segment_start(capacity, seg);
+        let mask = (capacity << seg) - 1;
+        let mut idx = alloc_slot_hash(ptr) & mask;
+
+        for _ in 0..ALLOC_PROBE_LIMIT {
+            let entry = unsafe { &*alloc_table.add(start + idx) };
+            let mut stored_ptr = entry.ptr.load(Ordering::Acquire);
+
+            // Can claim empty slot (0) or tombstone (deleted). A lost CAS
+            // retries the slot, which a delete may have just emptied, rather
+            // than probing past it
+            while stored_ptr == 0 || stored_ptr == TOMBSTONE {
+                match entry.ptr.compare_exchange(
+                    stored_ptr,
+                    ptr,
+                    Ordering::AcqRel,
+                    Ordering::Acquire,
+                ) {
+                    Ok(_) => {
+                        entry.size.store(size, Ordering::Relaxed);
+                        entry.born.store(born, Ordering::Relaxed);
+                        entry.callsite.store(callsite as u64, Ordering::Release);
+                        return;
+                    }
+                    Err(current) => stored_ptr = current,
+                }
+            }
+            // Occupied - continue probing
 
-        if stored_hash == hash {
-            return entry;
+            idx = (idx + 1) & mask;
         }
 
-        if stored_hash == 0 {
-            // Not found
-            return core::ptr::null_mut();
+        // Too much probing in the newest segment: move on to the next one
+        if !grow_table(&header.alloc_segments, seg) {
+            header.alloc_dropped.fetch_add(1, Ordering::Relaxed);
+            return;
         }
-
-        idx = (idx + 1) % CALLSITE_CAPACITY;
     }
-
-    core::ptr::null_mut()
 }
 
-/// Track an allocation in the alloc table
+/// Untrack an allocation, returning (size, callsite slot, allocation time)
+/// if found
+///
+/// Searches the newest segment first, where recent allocations live.
 #[inline]
-fn track_alloc(ptr: u64, size: u64, callsite_hash: u64) {
+fn untrack_alloc(ptr: u64) -> Option<(u64, usize, u64)> {
     let alloc_table = get_alloc_table();
-    // Use pointer bits for better distribution (skip low bits which are often 0)
-    let mut idx = ((ptr >> 4) as usize) % ALLOC_TABLE_CAPACITY;
-
-    for _ in 0..1024 {
-        // Limited probing to avoid long searches
-        let entry = unsafe { alloc_table.add(idx) };
-        let stored_ptr = unsafe { (*entry).ptr.load(Ordering::Acquire) };
-
-        // Can claim empty slot (0) or tombstone (deleted)
-        if stored_ptr == 0 || stored_ptr == TOMBSTONE {
-            if unsafe {
-                (*entry)
-                    .ptr
-                    .compare_exchange(stored_ptr, ptr, Ordering::AcqRel, Ordering::Relaxed)
-                    .is_ok()
-            } {
-                unsafe {
-                    (*entry).size.store(size, Ordering::Relaxed);
-                    (*entry)
-                        .callsite_hash
-                        .store(callsite_hash, Ordering::Release);
-                }
-                return;
+    let header = unsafe { &*get_header() };
+    let capacity = unsafe { LAYOUT.alloc_capacity };
+
+    for seg in (0..header.alloc_segments.load(Ordering::Acquire)).rev() {
+        let start = segment_start(capacity, seg);
+        let mask = (capacity << seg) - 1;
+        let mut idx = alloc_slot_hash(ptr) & mask;
+
+        for _ in 0..ALLOC_PROBE_LIMIT {
+            let entry = unsafe { &*alloc_table.add(start + idx) };
+            let stored_ptr = entry.ptr.load(Ordering::Acquire);
+
+            if stored_ptr == ptr {
+                let callsite = entry.callsite.load(Ordering::Acquire) as usize;
+                let size = entry.size.load(Ordering::Relaxed);
+                let born = entry.born.load(Ordering::Relaxed);
+                remove_alloc_entry(alloc_table, start, mask, idx);
+                return Some((size, callsite, born));
+            }
+
+            if stored_ptr == 0 {
+                // Empty slot: not in this segment
+                break;
             }
-            // CAS failed, another thread took this slot - continue probing
-        }
 
-        idx = (idx + 1) % ALLOC_TABLE_CAPACITY;
+            // Tombstone or other pointer - continue probing
+            idx = (idx + 1) & mask;
+        }
     }
 
-    // Table full or too much probing - drop this allocation's tracking
+    // Not tracked (sampled out, dropped, or allocated before profiling started)
+    None
 }
 
-/// Untrack an allocation, returning (size, callsite_hash) if found
+/// Delete the alloc table entry at `idx` of the segment at `start`
+///
+/// Inside a probe chain it becomes a tombstone. At the end of a chain it
+/// is emptied instead, along with the tombstones before it, so churn never
+/// leaves chains longer than the live entries need. An insert that races
+/// past a slot as it is emptied can rarely land beyond the new end of its
+/// chain; that block's free then goes unattributed, as for a dropped
+/// allocation.
 #[inline]
-fn untrack_alloc(ptr: u64) -> Option<(u64, u64)> {
-    let alloc_table = get_alloc_table();
-    let mut idx = ((ptr >> 4) as usize) % ALLOC_TABLE_CAPACITY;
+fn remove_alloc_entry(alloc_table: *mut AllocEntry, start: usize, mask: usize, idx: usize) {
+    let slot = |i: usize| unsafe { &(*alloc_table.add(start + (i & mask))).ptr };
+
+    if slot(idx + 1).load(Ordering::Acquire) != 0 {
+        slot(idx).store(TOMBSTONE, Ordering::Release);
+        return;
+    }
+    let mut idx = idx;
+    slot(idx).store(0, Ordering::SeqCst);
+    for _ in 0..ALLOC_PROBE_LIMIT {
+        // An insert claimed the next slot meanwhile: keep the chain linked
+        if slot(idx + 1).load(Ordering::SeqCst) != 0 {
+            let _ = slot(idx).compare_exchange(0, TOMBSTONE, Ordering::SeqCst, Ordering::Relaxed);
+            return;
+        }
+        idx = idx.wrapping_sub(1);
+        if slot(idx)
+            .compare_exchange(TOMBSTONE, 0, Ordering::SeqCst, Ordering::Relaxed)
+            .is_err()
+        {
+            return;
+        }
+    }
+}
+
+/// Read a power-of-two capacity from the environment, falling back to `default`
+///
+/// Runs inside the allocator, so it parses by hand instead of allocating.
+fn env_capacity(name: &[u8], default: usize, min: usize, max: usize) -> usize {
+    let value = unsafe { libc::getenv(name.as_ptr() as *const libc::c_char) };
+    if value.is_null() {
+        return default;
+    }
+    let mut n = 0usize;
+    let mut p = value as *const u8;
+    unsafe {
+        while (*p).is_ascii_digit() {
+            n = n.saturating_mul(10).saturating_add((*p - b'0') as usize);
+            p = p.add(1);
+        }
+        if *p != 0 || n == 0 {
+            return default;
+        }
+    }
+    n.clamp(min, max).next_power_of_two().min(max)
+}
 
-    for _ in 0..1024 {
-        let entry = unsafe { alloc_table.add(idx) };
-        let stored_ptr = unsafe { (*entry).ptr.load(Ordering::Acquire) };
+/// Counter shards for this process: as many as the CPUs it may run on, up
+/// to `MAX_COUNTER_SHARDS`
+///
+/// Every slot gets every shard, so a fixed maximum would map (and the
+/// reader sum) shards no CPU ever updates; a small machine gets a small
+/// segment. Also fills in `CPU_SHARDS`: the allowed CPUs take the shards in
+/// turn, and any other CPU (after the mask is widened) its index modulo the
+/// count.
+fn counter_shards() -> usize {
+    let mut set: libc::cpu_set_t = unsafe { core::mem::zeroed() };
+    let allowed =
+        unsafe { libc::sched_getaffinity(0, core::mem::size_of::<libc::cpu_set_t>(), &mut set) }
+            == 0;
+    let shards = if allowed {
+        (unsafe { libc::CPU_COUNT(&set) } as usize).clamp(1, MAX_COUNTER_SHARDS)
+    } else {
+        MAX_COUNTER_SHARDS
+    };
+
+    let mut rank = 0;
+    for (cpu, shard) in CPU_SHARDS.iter().enumerate() {
+        let value = if allowed && unsafe { libc::CPU_ISSET(cpu, &set) } {
+            rank += 1;
+            (rank - 1) % shards
+        } else {
+            cpu % shards
+        };
+        shard.store(value as u8, Ordering::Relaxed);
+    }
+    shards
+}
 
-        if stored_ptr == ptr {
-            let size = unsafe { (*entry).size.load(Ordering::Relaxed) };
-            let callsite_hash = unsafe { (*entry).callsite_hash.load(Ordering::Acquire) };
-            // Mark as tombstone (not 0!) to allow continued probing
-            unsafe { (*entry).ptr.store(TOMBSTONE, Ordering::Release) };
-            return Some((size, callsite_hash));
+/// The shared memory name `prefix` + `pid`, NUL-terminated in `buf`
+///
+/// Runs inside the allocator, so it formats by hand instead of allocating.
+fn shm_name(prefix: &[u8], pid: u32, buf: &mut [u8; 32]) -> *const libc::c_char {
+    buf[..prefix.len()].copy_from_slice(prefix);
+    let mut digits = [0u8; 10];
+    let mut len = 0;
+    let mut n = pid;
+    loop {
+        digits[len] = b'0' + (n % 10) as u8;
+        len += 1;
+        n /= 10;
+        if n == 0 {
+            break;
         }
+    }
+    let mut pos = prefix.len();
+    for &digit in digits[..len].iter().rev() {
+        buf[pos] = digit;
+        pos += 1;
+    }
+    buf[pos] = 0;
+    buf.as_ptr() as *const libc::c_char
+}
 
-        if stored_ptr == 0 {
-            // Empty slot means not found (allocation wasn't tracked or before profiling started)
-            return None;
+/// This process's pid namespace inode and start time, for the header
+///
+/// Runs inside the allocator, so it reads /proc by hand instead of allocating.
+fn process_identity() -> (u64, u64) {
+    unsafe {
+        let mut st: libc::stat = core::mem::zeroed();
+        let pid_ns = if libc::stat(c"/proc/self/ns/pid".as_ptr(), &mut st) == 0 {
+            st.st_ino as u64
+        } else {
+            0
+        };
+
+        let mut buf = [0u8; 512];
+        let fd = libc::open(
+            c"/proc/self/stat".as_ptr(),
+            libc::O_RDONLY | libc::O_CLOEXEC,
+        );
+        if fd < 0 {
+            return (pid_ns, 0);
         }
+        let len = libc::read(fd, buf.as_mut_ptr() as *mut libc::c_void, buf.len());
+        libc::close(fd);
+        let stat = &buf[..len.max(0) as usize];
+        // starttime is the 22nd field, the 20th after the name; the name in
+        // parentheses may contain spaces, so count from the last ')'
+        let Some(name_end) = stat.iter().rposition(|&b| b == b')') else {
+            return (pid_ns, 0);
+        };
+        let start_time = stat[name_end + 1..]
+            .split(|&b| b == b' ')
+            .filter(|field| !field.is_empty())
+            .nth(19)
+            .map_or(0, |field| {
+                field
+                    .iter()
+                    .take_while(|b| b.is_ascii_digit())
+                    .fold(0u64, |n, &b| n * 10 + (b - b'0') as u64)
+            });
+        (pid_ns, start_time)
+    }
+}
 
-        // Tombstone - continue probing
-        idx = (idx + 1) % ALLOC_TABLE_CAPACITY;
+/// pthread_atfork child handler: stop counting into the parent's segment
+///
+/// The child inherits the parent's `MAP_SHARED` mapping, so without this
+/// both would count into one segment. A child of a multithreaded parent
+/// may only make async-signal-safe calls here, so this only drops the
+/// mapping from use; `init` runs on the child's next allocation (or
+/// `register_thread` call) and gives it a segment of its own. The child
+/// starts with empty tables under its own pid; frees of blocks inherited
+/// from the parent are not attributed.
+extern "C" fn after_fork_child() {
+    unsafe {
+        if SHM_BASE.is_null() {
+            return;
+        }
+        PARENT_MAPPING.store(SHM_BASE, Ordering::Relaxed);
+        SHM_BASE = core::ptr::null_mut();
     }
+    GENERATION.fetch_add(1, Ordering::Relaxed);
+    FORK_PENDING.store(true, Ordering::Relaxed);
+    INITIALIZED.store(false, Ordering::SeqCst);
+}
 
-    None
+/// Finish moving a fork child off its parent's segment, before `init`
+/// creates its own
+///
+/// Returns whether this is a fork child's first `init`.
+fn finish_fork() -> bool {
+    if !FORK_PENDING.swap(false, Ordering::AcqRel) {
+        return false;
+    }
+    let base = PARENT_MAPPING.swap(core::ptr::null_mut(), Ordering::Relaxed);
+    if !base.is_null() {
+        unsafe { libc::munmap(base as *mut libc::c_void, LAYOUT.total_size) };
+    }
+    true
 }
 
 /// Initialize the profiler - sets up shared memory
@@ -297,22 +900,56 @@ pub fn init() {
         return;
     }
 
-    unsafe {
-        // Calculate shared memory size
-        let header_size = core::mem::size_of::<StatsHeader>();
-        let callsites_size = CALLSITE_CAPACITY * core::mem::size_of::<CallsiteStats>();
-        let alloc_table_size = ALLOC_TABLE_CAPACITY * core::mem::size_of::<AllocEntry>();
-        let total_size = header_size + callsites_size + alloc_table_size;
+    // Timers are not inherited across fork; re-arm this thread's
+    #[cfg(feature = "cpu")]
+    if finish_fork() {
+        cpu_profiling::after_fork();
+    }
+    #[cfg(not(feature = "cpu"))]
+    finish_fork();
 
-        // Remove any existing shared memory to ensure fresh start
-        libc::shm_unlink(SHM_PATH.as_ptr() as *const libc::c_char);
+    unsafe {
+        // Size the tables: RSPROF_CALLSITES / RSPROF_ALLOCS /
+        // RSPROF_STACK_NODES set the first segment's capacity
+        LAYOUT = TableLayout::new(
+            env_capacity(
+                b"RSPROF_CALLSITES\0",
+                DEFAULT_CALLSITE_CAPACITY,
+                1024,
+                1 << 18,
+            ),
+            env_capacity(
+                b"RSPROF_ALLOCS\0",
+                DEFAULT_ALLOC_TABLE_CAPACITY,
+                4096,
+                1 << 26,
+            ),
+            env_capacity(
+                b"RSPROF_STACK_NODES\0",
+                DEFAULT_STACK_NODE_CAPACITY,
+                4096,
+                1 << 24,
+            ),
+            counter_shards(),
+        );
+        let total_size = LAYOUT.total_size;
+
+        // Remove a segment and unwind table left by an earlier process with
+        // this pid; the table would describe its mappings, not ours. Other
+        // processes' segments are left to rsprof, which reads their final
+        // stats first
+        let mut unwind_name = [0u8; 32];
+        libc::shm_unlink(shm_name(
+            UNWIND_SHM_PREFIX,
+            libc::getpid() as u32,
+            &mut unwind_name,
+        ));
+        let mut name = [0u8; 32];
+        let name = shm_name(SHM_PREFIX, libc::getpid() as u32, &mut name);
+        libc::shm_unlink(name);
 
         // Create new shared memory
-        let fd = libc::shm_open(
-            SHM_PATH.as_ptr() as *const libc::c_char,
-            libc::O_CREAT | libc::O_RDWR | libc::O_EXCL,
-            0o666,
-        );
+        let fd = libc::shm_open(name, libc::O_CREAT | libc::O_RDWR | libc::O_EXCL, 0o666);
         if fd < 0 {
             INITIALIZED.store(false, Ordering::SeqCst);
             return;
@@ -343,25 +980,57 @@ pub fn init() {
 
         SHM_BASE = ptr as *mut u8;
 
-        // Explicitly zero the entire region to be safe
-        core::ptr::write_bytes(SHM_BASE, 0, total_size);
+        // The object was just created (O_EXCL), so ftruncate zero-filled it.
+        // Don't write_bytes it: that would fault in every counter shard page,
+        // most of which are never touched.
 
         // Initialize header
         let header = get_header();
         (*header).magic = MAGIC;
         (*header).version = VERSION;
-        (*header).callsite_capacity = CALLSITE_CAPACITY as u32;
-        (*header).alloc_table_capacity = ALLOC_TABLE_CAPACITY as u32;
+        (*header).callsite_capacity = LAYOUT.callsite_capacity as u32;
+        (*header).alloc_table_capacity = LAYOUT.alloc_capacity as u32;
         (*header).pid = libc::getpid() as u32;
+        (*header).counter_shards = LAYOUT.counter_shards as u32;
+        (*header).heap_sample_bytes = HEAP_SAMPLE_BYTES.load(Ordering::Relaxed);
+        (*header).table_segments = TABLE_SEGMENTS;
+        (*header).callsite_segments.store(1, Ordering::Relaxed);
+        (*header).alloc_segments.store(1, Ordering::Relaxed);
+        (*header).stack_node_capacity = LAYOUT.stack_node_capacity as u32;
+        (*header).stack_segments.store(1, Ordering::Relaxed);
+        (*header).histogram_shards = LAYOUT.histogram_shards as u32;
+        (*header).histogram_buckets = HISTOGRAM_BUCKETS as u32;
+        let (pid_ns, start_time) = process_identity();
+        (*header).pid_ns = pid_ns;
+        (*header).start_time = start_time;
 
-        // Zero-initialize tables (mmap may already be zeroed, but be explicit)
         // Callsites and alloc table use 0 as "empty" marker
+
+        if !ATFORK_REGISTERED.swap(true, Ordering::SeqCst) {
+            libc::pthread_atfork(None, None, Some(after_fork_child));
+        }
     }
 }
 
-/// Capture stack trace using frame pointers
+/// Capture stack trace, with the unwind table if rsprof sent one and
+/// frame pointers otherwise
 #[inline(never)]
 fn capture_stack(stack: &mut [u64; MAX_STACK_DEPTH]) -> u32 {
+    if let Some(rows) = unwind_table() {
+        let (ip, sp, bp): (u64, u64, u64);
+        unsafe {
+            core::arch::asm!(
+                "lea {ip}, [rip]",
+                "mov {sp}, rsp",
+                "mov {bp}, rbp",
+                ip = out(reg) ip,
+                sp = out(reg) sp,
+                bp = out(reg) bp,
+                options(nomem, nostack, preserves_flags)
+            );
+        }
+        return unsafe { capture_stack_from_cfi(stack, rows, ip, sp, bp) };
+    }
     capture_stack_from_fp(stack, core::ptr::null())
 }
 
@@ -418,70 +1087,446 @@ fn capture_stack_from_fp(stack: &mut [u64; MAX_STACK_DEPTH], start_fp: *const us
     depth
 }
 
+/// Unwind table header, followed by the rows (must match rsprof)
+#[repr(C)]
+pub struct UnwindHeader {
+    /// `UNWIND_MAGIC` once the table is complete
+    pub magic: AtomicU64,
+    pub version: u32,
+    pub _reserved: u32,
+    /// Number of rows
+    pub rows: u64,
+}
+
+/// How to recover the caller's frame, from `start` up to the next row's
+/// (must match rsprof)
+#[repr(C)]
+#[derive(Clone, Copy)]
+pub struct UnwindRow {
+    /// First runtime address the row applies to
+    pub start: u64,
+    pub cfa_offset: i32,
+    /// Register the CFA is based on (`CFA_*`)
+    pub cfa: u8,
+    /// Where the caller's RBP is saved, in words from the CFA (0 = unchanged)
+    pub rbp_slot: i8,
+    /// Where the return address is, in words from the CFA
+    pub ra_slot: i8,
+    pub _reserved: u8,
+}
+
+/// The CFA is RSP plus the offset
+const CFA_RSP: u8 = 1;
+/// The CFA is RBP plus the offset
+const CFA_RBP: u8 = 2;
+
+/// The mapped unwind table (null until rsprof sends one)
+static UNWIND_TABLE: AtomicPtr<UnwindHeader> = AtomicPtr::new(core::ptr::null_mut());
+
+/// Stack walks since the last look for an unwind table
+static UNWIND_PROBES: AtomicU32 = AtomicU32::new(0);
+
+/// Held by the thread mapping the unwind table
+static UNWIND_MAPPING: AtomicBool = AtomicBool::new(false);
+
+/// The rows of the unwind table rsprof sent, if any
+///
+/// Until one is mapped, every `UNWIND_PROBE_INTERVAL`th call looks for it.
+/// Only syscalls are made, so this is safe in the allocator and the
+/// signal handler.
+fn unwind_table() -> Option<&'static [UnwindRow]> {
+    let mut header = UNWIND_TABLE.load(Ordering::Acquire);
+    if header.is_null() {
+        if !UNWIND_PROBES
+            .fetch_add(1, Ordering::Relaxed)
+            .is_multiple_of(UNWIND_PROBE_INTERVAL)
+        {
+            return None;
+        }
+        header = map_unwind_table();
+        if header.is_null() {
+            return None;
+        }
+    }
+    unsafe {
+        let rows = header.add(1) as *const UnwindRow;
+        Some(core::slice::from_raw_parts(rows, (*header).rows as usize))
+    }
+}
+
+/// Map `/rsprof-unwind-<pid>` if rsprof has finished writing it
+fn map_unwind_table() -> *mut UnwindHeader {
+    if UNWIND_MAPPING.swap(true, Ordering::Acquire) {
+        return core::ptr::null_mut();
+    }
+    let mut header: *mut UnwindHeader = core::ptr::null_mut();
+    unsafe {
+        let mut name = [0u8; 32];
+        let fd = libc::shm_open(
+            shm_name(UNWIND_SHM_PREFIX, libc::getpid() as u32, &mut name),
+            libc::O_RDONLY,
+            0,
+        );
+        let mut stat: libc::stat = core::mem::zeroed();
+        if fd >= 0 && libc::fstat(fd, &mut stat) == 0 {
+            let size = stat.st_size as usize;
+            let ptr = if size >= core::mem::size_of::<UnwindHeader>() {
+                libc::mmap(
+                    core::ptr::null_mut(),
+                    size,
+                    libc::PROT_READ,
+                    libc::MAP_SHARED,
+                    fd,
+                    0,
+                )
+            } else {
+                libc::MAP_FAILED
+            };
+            if ptr != libc::MAP_FAILED {
+                let table = ptr as *mut UnwindHeader;
+                let complete = (*table).magic.load(Ordering::Acquire) == UNWIND_MAGIC
+                    && (*table).version == UNWIND_VERSION
+                    && ((*table).rows as usize)
+                        .checked_mul(core::mem::size_of::<UnwindRow>())
+                        .and_then(|len| len.checked_add(core::mem::size_of::<UnwindHeader>()))
+                        .is_some_and(|len| len <= size);
+                if complete {
+                    header = table;
+                    UNWIND_TABLE.store(header, Ordering::Release);
+                } else {
+                    libc::munmap(ptr, size);
+                }
+            }
+        }
+        if fd >= 0 {
+            libc::close(fd);
+        }
+    }
+    UNWIND_MAPPING.store(false, Ordering::Release);
+    header
+}
+
+/// Capture a stack trace with the unwind table, from the innermost frame's
+/// registers; the first entry is `ip`
+///
+/// Stops at an address no row covers: unlike frame pointers, a saved
+/// register is only loaded where a row says it was stored, between the
+/// current stack pointer and the caller's frame.
+unsafe fn capture_stack_from_cfi(
+    stack: &mut [u64; MAX_STACK_DEPTH],
+    rows: &[UnwindRow],
+    mut ip: u64,
+    mut sp: u64,
+    mut bp: u64,
+) -> u32 {
+    let mut depth = 0usize;
+    while depth < MAX_STACK_DEPTH {
+        stack[depth] = ip;
+        depth += 1;
+
+        // Past the leaf, `ip` is a return address; the call before it
+        // holds the rules
+        let pc = if depth == 1 { ip } else { ip - 1 };
+        let idx = rows.partition_point(|row| row.start <= pc);
+        let Some(row) = idx.checked_sub(1).map(|idx| rows[idx]) else {
+            break;
+        };
+        let base = match row.cfa {
+            CFA_RSP => sp,
+            CFA_RBP => bp,
+            _ => break,
+        };
+        let cfa = base.wrapping_add_signed(row.cfa_offset as i64);
+        // Each caller's frame is above the last
+        if cfa <= sp || cfa - sp > MAX_FRAME_BYTES || cfa & 0x7 != 0 || cfa > 0x7fff_ffff_ffff {
+            break;
+        }
+        let load = |slot: i8| -> Option<u64> {
+            let addr = cfa.wrapping_add_signed(slot as i64 * 8);
+            (addr >= sp && addr < cfa).then(|| unsafe { *(addr as *const u64) })
+        };
+        let Some(ra) = load(row.ra_slot) else {
+            break;
+        };
+        if row.rbp_slot != 0 {
+            let Some(saved) = load(row.rbp_slot) else {
+                break;
+            };
+            bp = saved;
+        }
+        if ra == 0 {
+            break;
+        }
+        ip = ra;
+        sp = cfa;
+    }
+    depth as u32
+}
+
 // =============================================================================
 // Heap profiling (conditional on "heap" feature)
 // =============================================================================
 
-/// Record an allocation event
+/// Set the mean sampling interval in bytes (0 = record every allocation)
+///
+/// Must be called before the first allocation is recorded; the value is
+/// published in the shared memory header so rsprof can scale its estimates.
 #[cfg(feature = "heap")]
-#[inline(never)]
-pub fn record_alloc(ptr: *mut u8, size: usize) {
-    // Don't record allocations from within signal handler
-    if IN_SIGNAL_HANDLER.load(Ordering::Relaxed) {
-        return;
+pub fn set_heap_sample_bytes(bytes: usize) {
+    HEAP_SAMPLE_BYTES.store(bytes as u64, Ordering::Relaxed);
+}
+
+/// Approximate log2 for x > 0 (max error ~0.005, enough for drawing intervals)
+#[cfg(feature = "heap")]
+#[inline]
+fn fast_log2(x: f64) -> f64 {
+    let bits = x.to_bits();
+    let exp = ((bits >> 52) & 0x7ff) as i64 - 1023;
+    let m = f64::from_bits((bits & ((1u64 << 52) - 1)) | (1023u64 << 52));
+    exp as f64 + (-0.344_848_43 * m + 2.024_665_78) * m - 1.674_877_59
+}
+
+/// Draw the next sampling interval from an exponential distribution
+///
+/// Exponential gaps make the byte-level sampling a Poisson process, so an
+/// allocation of `s` bytes is sampled with probability `1 - exp(-s / mean)`.
+#[cfg(feature = "heap")]
+#[inline]
+fn next_sample_interval(sampler: &HeapSampler, mean: u64) -> i64 {
+    let mut x = sampler.rng.load(Ordering::Relaxed);
+    if x == 0 {
+        x = (sampler as *const HeapSampler as u64) ^ 0x9E37_79B9_7F4A_7C15;
     }
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    sampler.rng.store(x, Ordering::Relaxed);
+
+    // Uniform in (0, 1]
+    let u = ((x >> 11) + 1) as f64 / (1u64 << 53) as f64;
+    let interval = -fast_log2(u) * core::f64::consts::LN_2 * mean as f64;
+    (interval as i64).clamp(1, i64::MAX / 2)
+}
+
+/// Decide whether an allocation of `size` bytes is sampled
+///
+/// Each CPU shard counts down a randomized number of bytes; the allocation
+/// that crosses zero is sampled and the countdown is redrawn.
+#[cfg(feature = "heap")]
+#[inline]
+fn should_sample(size: usize, mean: u64) -> bool {
+    let sampler = &HEAP_SAMPLERS[local_shard()];
+    let size = size as i64;
+    if sampler.bytes_left.fetch_sub(size, Ordering::Relaxed) > size {
+        return false;
+    }
+    sampler
+        .bytes_left
+        .store(next_sample_interval(sampler, mean), Ordering::Relaxed);
+    true
+}
+
+/// Callsite tag for an in-band header whose allocation was not recorded
+#[cfg(feature = "heap")]
+pub const UNTRACKED: u64 = u64::MAX;
+
+/// Contents of an in-band header
+#[cfg(feature = "heap")]
+#[derive(Clone, Copy)]
+pub struct InbandHeader {
+    /// Callsite slot and, in the high half, the segment generation it
+    /// belongs to; `UNTRACKED` if the allocation was not recorded
+    pub tag: u64,
+    /// Allocation time in lifetime ticks
+    pub born: u64,
+}
+
+/// Monotonic time in lifetime ticks (a vDSO call, no syscall)
+#[cfg(feature = "heap")]
+#[inline]
+fn now_ticks() -> u64 {
+    let mut ts = libc::timespec {
+        tv_sec: 0,
+        tv_nsec: 0,
+    };
+    unsafe { libc::clock_gettime(libc::CLOCK_MONOTONIC, &mut ts) };
+    (ts.tv_sec as u64 * 1_000_000_000 + ts.tv_nsec as u64) >> LIFETIME_SHIFT
+}
+
+/// Size histogram bucket: `[2^b, 2^(b+1))` bytes, with 0 in bucket 0
+#[cfg(feature = "heap")]
+#[inline]
+fn size_bucket(size: u64) -> usize {
+    (size.checked_ilog2().unwrap_or(0) as usize).min(HISTOGRAM_BUCKETS - 1)
+}
 
+/// Lifetime histogram bucket: 0 under one tick, else `[2^(b-1), 2^b)` ticks
+#[cfg(feature = "heap")]
+#[inline]
+fn lifetime_bucket(ticks: u64) -> usize {
+    ((64 - ticks.leading_zeros()) as usize).min(HISTOGRAM_BUCKETS - 1)
+}
+
+/// Count an allocation against its callsite; returns the callsite slot
+///
+/// Always inlined so the stack walk sees the same frames from every caller.
+#[cfg(feature = "heap")]
+#[inline(always)]
+fn count_alloc(size: usize) -> Option<usize> {
     // Ensure initialized
     if !INITIALIZED.load(Ordering::Relaxed) {
         init();
     }
 
     if !shm_ready() {
-        return;
+        return None;
+    }
+
+    // In sampled mode skip the stack walk for unsampled allocations; their
+    // frees miss the alloc table and are ignored the same way
+    let sample_bytes = HEAP_SAMPLE_BYTES.load(Ordering::Relaxed);
+    if sample_bytes != 0 && !should_sample(size, sample_bytes) {
+        return None;
     }
 
     // Capture stack and compute hash
     let mut stack = [0u64; MAX_STACK_DEPTH];
     let depth = capture_stack(&mut stack);
-    let hash = stack_key_heap(&stack, depth);
+    let hash = stack_key(&stack, depth);
 
     // Find or create callsite, update stats
-    let callsite = find_or_create_callsite(hash, &stack, depth);
+    let idx = find_or_create_callsite(hash, &stack, depth, 0)?;
+    let counters = local_counters(idx);
+    let histogram = local_histogram(idx);
     unsafe {
-        (*callsite).alloc_count.fetch_add(1, Ordering::Relaxed);
-        (*callsite)
+        (*counters).alloc_count.fetch_add(1, Ordering::SeqCst);
+        (*counters)
             .alloc_bytes
-            .fetch_add(size as u64, Ordering::Relaxed);
+            .fetch_add(size as u64, Ordering::SeqCst);
+        (*histogram).size[size_bucket(size as u64)].fetch_add(1, Ordering::SeqCst);
     }
+    mark_dirty(idx);
 
-    // Track allocation for later dealloc attribution
-    track_alloc(ptr as u64, size as u64, hash);
+    Some(idx)
 }
 
-/// Record a deallocation event
+/// Count a free of a block allocated at `born` against a callsite slot
+#[cfg(feature = "heap")]
+#[inline]
+fn count_free(idx: usize, size: u64, born: u64) {
+    let counters = local_counters(idx);
+    let histogram = local_histogram(idx);
+    let lifetime = now_ticks().saturating_sub(born);
+    unsafe {
+        (*counters).free_count.fetch_add(1, Ordering::SeqCst);
+        (*counters).free_bytes.fetch_add(size, Ordering::SeqCst);
+        (*histogram).lifetime[lifetime_bucket(lifetime)].fetch_add(1, Ordering::SeqCst);
+    }
+    mark_dirty(idx);
+}
+
+/// Record an allocation event
 #[cfg(feature = "heap")]
 #[inline(never)]
-pub fn record_dealloc(ptr: *mut u8, _size: usize) {
-    // Don't record deallocations from within signal handler
-    if IN_SIGNAL_HANDLER.load(Ordering::Relaxed) {
+pub fn record_alloc(ptr: *mut u8, size: usize) {
+    if let Some(idx) = count_alloc(size) {
+        // Track allocation for later dealloc attribution
+        track_alloc(ptr as u64, size as u64, idx, now_ticks());
+    }
+}
+
+/// Record an allocation whose callsite is kept in an in-band header
+///
+/// Returns the header to store in front of the block.
+#[cfg(feature = "heap")]
+#[inline(never)]
+pub fn record_alloc_inband(size: usize) -> InbandHeader {
+    match count_alloc(size) {
+        Some(idx) => InbandHeader {
+            tag: (GENERATION.load(Ordering::Relaxed) as u64) << 32 | idx as u64,
+            born: now_ticks(),
+        },
+        None => InbandHeader {
+            tag: UNTRACKED,
+            born: 0,
+        },
+    }
+}
+
+/// Record a deallocation using its in-band header: no table lookup
+#[cfg(feature = "heap")]
+#[inline]
+pub fn record_dealloc_inband(header: InbandHeader, size: usize) {
+    let tag = header.tag;
+    // Blocks a fork child inherited point into the parent's segment
+    if tag == UNTRACKED || (tag >> 32) as u32 != GENERATION.load(Ordering::Relaxed) || !shm_ready()
+    {
         return;
     }
+    count_free(tag as u32 as usize, size as u64, header.born);
+}
 
+/// Record a deallocation event
+#[cfg(feature = "heap")]
+#[inline(never)]
+pub fn record_dealloc(ptr: *mut u8, _size: usize) {
     // Can't dealloc if never initialized
     if !INITIALIZED.load(Ordering::Relaxed) || !shm_ready() {
         return;
     }
 
     // Look up the allocation to get size and callsite
-    if let Some((size, callsite_hash)) = untrack_alloc(ptr as u64) {
-        // Find the callsite and update free stats
-        let callsite = find_callsite(callsite_hash);
-        if !callsite.is_null() {
-            unsafe {
-                (*callsite).free_count.fetch_add(1, Ordering::Relaxed);
-                (*callsite).free_bytes.fetch_add(size, Ordering::Relaxed);
-            }
-        }
+    if let Some((size, idx, born)) = untrack_alloc(ptr as u64) {
+        count_free(idx, size, born);
+    }
+}
+
+/// An allocation's alloc table record, taken out ahead of a realloc
+#[cfg(feature = "heap")]
+pub struct TakenAlloc {
+    size: u64,
+    callsite: usize,
+    born: u64,
+}
+
+/// Take `ptr`'s record out of the alloc table before a realloc
+///
+/// Taken before the block can be freed, so another thread reusing its
+/// address can never be confused with it. Counts nothing: a failed realloc
+/// puts the record back with `restore_alloc`, a successful one counts the
+/// free with `record_taken_dealloc`.
+#[cfg(feature = "heap")]
+#[inline(never)]
+pub fn take_alloc(ptr: *mut u8) -> Option<TakenAlloc> {
+    if !INITIALIZED.load(Ordering::Relaxed) || !shm_ready() {
+        return None;
+    }
+    untrack_alloc(ptr as u64).map(|(size, callsite, born)| TakenAlloc {
+        size,
+        callsite,
+        born,
+    })
+}
+
+/// Put back the record of a block a realloc failed to move
+#[cfg(feature = "heap")]
+#[inline(never)]
+pub fn restore_alloc(ptr: *mut u8, taken: Option<TakenAlloc>) {
+    if let Some(taken) = taken
+        && shm_ready()
+    {
+        track_alloc(ptr as u64, taken.size, taken.callsite, taken.born);
+    }
+}
+
+/// Count the free of a block whose record was taken for a realloc
+#[cfg(feature = "heap")]
+#[inline(never)]
+pub fn record_taken_dealloc(taken: Option<TakenAlloc>) {
+    if let Some(taken) = taken
+        && shm_ready()
+    {
+        count_free(taken.callsite, taken.size, taken.born);
     }
 }
 
@@ -501,51 +1546,74 @@ pub fn record_dealloc(_ptr: *mut u8, _size: usize) {}
 #[cfg(feature = "cpu")]
 mod cpu_profiling {
     use super::*;
+    use core::sync::atomic::AtomicUsize;
 
     /// Default sampling frequency in Hz
     const DEFAULT_FREQ_HZ: u32 = 99;
 
+    /// Reentrancy guards for the signal handler, indexed by `tid % SAMPLING_GUARDS`;
+    /// each holds the tid currently sampling (0 = free). Two threads sharing a
+    /// guard at the same instant drop one sample.
+    const SAMPLING_GUARDS: usize = 256;
+
+    #[allow(clippy::declare_interior_mutable_const)]
+    const SAMPLING_GUARD_INIT: AtomicU32 = AtomicU32::new(0);
+
+    static SAMPLING_THREADS: [AtomicU32; SAMPLING_GUARDS] = [SAMPLING_GUARD_INIT; SAMPLING_GUARDS];
+
     /// Signal handler for CPU sampling
     extern "C" fn cpu_sample_handler(
         _sig: libc::c_int,
         _info: *mut libc::siginfo_t,
         ucontext: *mut libc::c_void,
     ) {
-        // Prevent reentrant calls
-        if IN_SIGNAL_HANDLER.swap(true, Ordering::SeqCst) {
+        // Prevent reentrant calls on this thread; other threads sample
+        // concurrently. The handler never allocates, so the allocator
+        // needs no guard of its own.
+        let tid = current_tid();
+        let guard = &SAMPLING_THREADS[tid as usize % SAMPLING_GUARDS];
+        if guard
+            .compare_exchange(0, tid, Ordering::Acquire, Ordering::Relaxed)
+            .is_err()
+        {
             return;
         }
 
         if !shm_ready() {
-            IN_SIGNAL_HANDLER.store(false, Ordering::SeqCst);
+            guard.store(0, Ordering::Release);
             return;
         }
 
         // Extract the interrupted registers from the ucontext
-        let (rip, start_fp) = if !ucontext.is_null() {
+        let (rip, rsp, start_fp) = if !ucontext.is_null() {
             unsafe {
                 let uc = ucontext as *const libc::ucontext_t;
                 const REG_RIP: usize = 16;
+                const REG_RSP: usize = 15;
                 const REG_RBP: usize = 10;
                 let rip = (*uc).uc_mcontext.gregs[REG_RIP] as u64;
+                let rsp = (*uc).uc_mcontext.gregs[REG_RSP] as u64;
                 let rbp = (*uc).uc_mcontext.gregs[REG_RBP] as usize;
-                (rip, rbp as *const usize)
+                (rip, rsp, rbp as *const usize)
             }
         } else {
-            (0, core::ptr::null())
+            (0, 0, core::ptr::null())
         };
 
         // Build stack with RIP as first frame
         let mut stack = [0u64; MAX_STACK_DEPTH];
         let mut depth = 0u32;
 
-        if rip != 0 {
+        let rows = unwind_table().filter(|_| rip != 0);
+        if let Some(rows) = rows {
+            depth = unsafe { capture_stack_from_cfi(&mut stack, rows, rip, rsp, start_fp as u64) };
+        } else if rip != 0 {
             stack[0] = rip;
             depth = 1;
         }
 
         // Walk the rest of the stack
-        if !start_fp.is_null() {
+        if rows.is_none() && !start_fp.is_null() {
             let mut fp = start_fp;
 
             while !fp.is_null() && (depth as usize) < MAX_STACK_DEPTH {
@@ -573,15 +1641,273 @@ mod cpu_profiling {
             }
         }
 
-        // Compute callsite hash and update stats
-        let hash = stack_key_cpu(&stack, depth);
-        let callsite = find_or_create_callsite(hash, &stack, depth);
-        unsafe { (*callsite).cpu_samples.fetch_add(1, Ordering::Relaxed) };
+        // Compute callsite hash (per thread) and update stats
+        let hash = thread_key(stack_key(&stack, depth), tid);
+        if let Some(idx) = find_or_create_callsite(hash, &stack, depth, tid) {
+            unsafe {
+                (*local_counters(idx))
+                    .cpu_samples
+                    .fetch_add(1, Ordering::SeqCst)
+            };
+            mark_dirty(idx);
+        }
+
+        guard.store(0, Ordering::Release);
+    }
+
+    /// Most threads with a live CPU timer at once
+    const MAX_TIMED_THREADS: usize = 4096;
+
+    /// A thread with a CPU-time timer (tid 0 = free slot)
+    struct TimedThread {
+        tid: AtomicU32,
+        /// Its `timer_t` plus one (0 = none); glibc hands out kernel timer
+        /// ids as they are, and the first one is 0
+        timer: AtomicUsize,
+    }
+
+    /// Delete a timer as stored in `TimedThread::timer`
+    fn delete_timer(stored: usize) {
+        if stored != 0 {
+            unsafe { libc::timer_delete((stored - 1) as libc::timer_t) };
+        }
+    }
+
+    #[allow(clippy::declare_interior_mutable_const)]
+    const TIMED_THREAD_INIT: TimedThread = TimedThread {
+        tid: AtomicU32::new(0),
+        timer: AtomicUsize::new(0),
+    };
+
+    static TIMED_THREADS: [TimedThread; MAX_TIMED_THREADS] = [TIMED_THREAD_INIT; MAX_TIMED_THREADS];
+
+    /// Longest probe from a tid's home slot to the slot it was given
+    static PROBE_LEN: AtomicUsize = AtomicUsize::new(0);
+
+    /// Sampling interval in nanoseconds (0 = CPU profiling stopped)
+    static INTERVAL_NS: AtomicU64 = AtomicU64::new(0);
+
+    /// pthread key whose value marks a registered thread (`u32::MAX` = none)
+    static THREAD_KEY: AtomicU32 = AtomicU32::new(u32::MAX);
+
+    fn current_tid() -> u32 {
+        unsafe { libc::syscall(libc::SYS_gettid) as u32 }
+    }
+
+    /// CPU-time clock of another thread (`MAKE_THREAD_CPUCLOCK(tid, CPUCLOCK_SCHED)`)
+    fn thread_cpu_clock(tid: u32) -> libc::clockid_t {
+        ((!(tid as libc::clockid_t)) << 3) | 6
+    }
+
+    /// Create and arm a timer on `tid`'s CPU-time clock that sends SIGPROF
+    /// to that thread. Returns the slot index.
+    fn arm_thread_timer(tid: u32) -> Option<usize> {
+        let interval_ns = INTERVAL_NS.load(Ordering::Acquire);
+        if interval_ns == 0 {
+            return None;
+        }
+
+        let slot = match find_slot(tid) {
+            Some(slot) => slot,
+            None => claim_slot(tid)?,
+        };
+        let t = &TIMED_THREADS[slot];
+
+        // Re-registering a tid replaces its timer: the old one may belong to
+        // an exited thread whose tid was reused
+        delete_timer(t.timer.swap(0, Ordering::AcqRel));
+
+        unsafe {
+            let mut sev: libc::sigevent = core::mem::zeroed();
+            sev.sigev_notify = libc::SIGEV_THREAD_ID;
+            sev.sigev_signo = libc::SIGPROF;
+            sev.sigev_notify_thread_id = tid as libc::c_int;
+
+            let mut timer: libc::timer_t = core::ptr::null_mut();
+            if libc::timer_create(thread_cpu_clock(tid), &mut sev, &mut timer) < 0 {
+                if t.timer.load(Ordering::Acquire) == 0 {
+                    let _ = t
+                        .tid
+                        .compare_exchange(tid, 0, Ordering::AcqRel, Ordering::Relaxed);
+                }
+                return None;
+            }
+
+            // The thread registering itself and `start_cpu_profiling` can
+            // arm the same slot at once; only the first timer stays, and it
+            // is installed before it starts so the other never fires
+            if t.timer
+                .compare_exchange(0, timer as usize + 1, Ordering::AcqRel, Ordering::Acquire)
+                .is_err()
+            {
+                libc::timer_delete(timer);
+                return Some(slot);
+            }
+
+            let interval = libc::timespec {
+                tv_sec: (interval_ns / 1_000_000_000) as libc::time_t,
+                tv_nsec: (interval_ns % 1_000_000_000) as libc::c_long,
+            };
+            let spec = libc::itimerspec {
+                it_interval: interval,
+                it_value: interval,
+            };
+            libc::timer_settime(timer, 0, &spec, core::ptr::null_mut());
+        }
+        Some(slot)
+    }
+
+    /// Registry slots a tid is placed at, starting from its home slot
+    fn probe(tid: u32, len: usize) -> impl Iterator<Item = usize> {
+        let home = tid as usize % MAX_TIMED_THREADS;
+        (0..len).map(move |i| (home + i) % MAX_TIMED_THREADS)
+    }
+
+    /// The slot holding `tid`, if it has one
+    ///
+    /// Only the slots within the longest probe used so far are looked at;
+    /// with tids handed out mostly in sequence that is one or two. Loads
+    /// are SeqCst so that of two claims racing for one tid, at least one
+    /// sees the other (see `settle_claim`).
+    fn find_slot(tid: u32) -> Option<usize> {
+        let len = PROBE_LEN.load(Ordering::SeqCst);
+        probe(tid, len).find(|&slot| TIMED_THREADS[slot].tid.load(Ordering::SeqCst) == tid)
+    }
+
+    /// Claim the first free slot from `tid`'s home slot, reclaiming slots of
+    /// exited threads when the registry is full
+    fn claim_slot(tid: u32) -> Option<usize> {
+        for sweep in 0..2 {
+            for (i, slot) in probe(tid, MAX_TIMED_THREADS).enumerate() {
+                if TIMED_THREADS[slot]
+                    .tid
+                    .compare_exchange(0, tid, Ordering::SeqCst, Ordering::Relaxed)
+                    .is_ok()
+                {
+                    PROBE_LEN.fetch_max(i + 1, Ordering::SeqCst);
+                    return Some(settle_claim(tid, slot));
+                }
+            }
+            if sweep == 0 {
+                reap_exited_threads();
+            }
+        }
+        None
+    }
+
+    /// Keep one slot per tid after claiming `claimed`
+    ///
+    /// Two registrations of a tid can both miss in `find_slot` and claim
+    /// different slots. Each looks again once its claim is visible; both
+    /// settle on the first slot in probe order, and the other is given back
+    /// before it has a timer.
+    fn settle_claim(tid: u32, claimed: usize) -> usize {
+        match find_slot(tid) {
+            Some(first) if first != claimed => {
+                TIMED_THREADS[claimed].tid.store(0, Ordering::Release);
+                first
+            }
+            _ => claimed,
+        }
+    }
+
+    /// Free registry slots whose thread no longer exists
+    fn reap_exited_threads() {
+        let pid = unsafe { libc::getpid() };
+        for t in &TIMED_THREADS {
+            let tid = t.tid.load(Ordering::Acquire);
+            if tid == 0 {
+                continue;
+            }
+            let alive = unsafe { libc::syscall(libc::SYS_tgkill, pid, tid, 0) } == 0
+                || unsafe { *libc::__errno_location() } != libc::ESRCH;
+            if !alive {
+                release_slot(t);
+            }
+        }
+    }
+
+    fn release_slot(t: &TimedThread) {
+        delete_timer(t.timer.swap(0, Ordering::AcqRel));
+        t.tid.store(0, Ordering::Release);
+    }
 
-        IN_SIGNAL_HANDLER.store(false, Ordering::SeqCst);
+    /// pthread key destructor: runs on thread exit for registered threads
+    unsafe extern "C" fn thread_exit(value: *mut libc::c_void) {
+        // The slot may have been reused after a stop/start
+        if let Some(t) = TIMED_THREADS.get(value as usize - 1)
+            && t.tid.load(Ordering::Acquire) == current_tid()
+        {
+            release_slot(t);
+        }
     }
 
-    /// Start CPU profiling with timer-based sampling
+    /// Give the calling thread its own CPU-time timer, once
+    ///
+    /// Heap builds call this on every allocation; after the first call on a
+    /// thread this is one `pthread_getspecific`. CPU-only builds have no
+    /// allocator hook, so threads started after `start_cpu_profiling`
+    /// must call it themselves to be sampled.
+    #[inline]
+    pub fn register_thread() {
+        if INTERVAL_NS.load(Ordering::Relaxed) == 0 {
+            return;
+        }
+        // A fork child re-arms from `init`, outside the atfork handler
+        if FORK_PENDING.load(Ordering::Relaxed) {
+            init();
+        }
+        let key = THREAD_KEY.load(Ordering::Acquire);
+        if key == u32::MAX || !unsafe { libc::pthread_getspecific(key) }.is_null() {
+            return;
+        }
+        register_thread_slow(key);
+    }
+
+    #[cold]
+    #[inline(never)]
+    fn register_thread_slow(key: u32) {
+        if let Some(slot) = arm_thread_timer(current_tid()) {
+            unsafe { libc::pthread_setspecific(key, (slot + 1) as *const libc::c_void) };
+        }
+    }
+
+    /// Arm timers for the threads that already exist
+    ///
+    /// Their slots are not tied to the thread's exit; they are replaced when
+    /// the thread registers itself, or reaped once the thread is gone.
+    fn register_existing_threads() {
+        let own_tid = current_tid();
+        unsafe {
+            let dir = libc::opendir(c"/proc/self/task".as_ptr());
+            if dir.is_null() {
+                return;
+            }
+            loop {
+                let entry = libc::readdir(dir);
+                if entry.is_null() {
+                    break;
+                }
+                let name = core::ffi::CStr::from_ptr((*entry).d_name.as_ptr());
+                if let Some(tid) = core::str::from_utf8(name.to_bytes())
+                    .ok()
+                    .and_then(|s| s.parse::<u32>().ok())
+                    && tid != own_tid
+                {
+                    arm_thread_timer(tid);
+                }
+            }
+            libc::closedir(dir);
+        }
+    }
+
+    /// Start CPU profiling with per-thread CPU-time timers
+    ///
+    /// Every thread gets a timer on its own CPU clock that signals that
+    /// thread, so samples are spread across threads by the CPU they actually
+    /// use. Threads running now are registered immediately; threads started
+    /// later register on their first allocation, or, without the `heap`
+    /// feature, by calling `register_thread`.
     pub fn start_cpu_profiling(freq_hz: u32) {
         // Ensure initialized
         if !INITIALIZED.load(Ordering::Relaxed) {
@@ -599,59 +1925,68 @@ mod cpu_profiling {
                 return;
             }
 
-            // Set up interval timer
-            let freq = if freq_hz == 0 {
-                DEFAULT_FREQ_HZ
-            } else {
-                freq_hz
-            };
-            let interval_usec = 1_000_000 / freq as i64;
-
-            let timer = libc::itimerval {
-                it_interval: libc::timeval {
-                    tv_sec: 0,
-                    tv_usec: interval_usec,
-                },
-                it_value: libc::timeval {
-                    tv_sec: 0,
-                    tv_usec: interval_usec,
-                },
-            };
+            if THREAD_KEY.load(Ordering::Acquire) == u32::MAX {
+                let mut key: libc::pthread_key_t = 0;
+                if libc::pthread_key_create(&mut key, Some(thread_exit)) != 0 {
+                    return;
+                }
+                THREAD_KEY.store(key, Ordering::Release);
+            }
+        }
+
+        let freq = if freq_hz == 0 {
+            DEFAULT_FREQ_HZ
+        } else {
+            freq_hz
+        };
+        INTERVAL_NS.store(1_000_000_000 / freq as u64, Ordering::Release);
+
+        register_thread();
+        register_existing_threads();
+    }
 
-            libc::setitimer(libc::ITIMER_PROF, &timer, core::ptr::null_mut());
+    /// Re-arm CPU timers in a fork child, from its first `init`
+    ///
+    /// Timers are not inherited across fork, but the registry and the
+    /// forking thread's key value are, so both are reset first.
+    pub(super) fn after_fork() {
+        for t in &TIMED_THREADS {
+            t.tid.store(0, Ordering::Relaxed);
+            t.timer.store(0, Ordering::Relaxed);
+        }
+        PROBE_LEN.store(0, Ordering::Relaxed);
+        let key = THREAD_KEY.load(Ordering::Acquire);
+        if key != u32::MAX {
+            unsafe { libc::pthread_setspecific(key, core::ptr::null()) };
+        }
+        if INTERVAL_NS.load(Ordering::Acquire) != 0 {
+            register_thread_slow(key);
         }
     }
 
     /// Stop CPU profiling
     pub fn stop_cpu_profiling() {
+        INTERVAL_NS.store(0, Ordering::Release);
+        for t in &TIMED_THREADS {
+            if t.tid.load(Ordering::Acquire) != 0 {
+                release_slot(t);
+            }
+        }
+
         unsafe {
-            // Disable timer
-            let timer = libc::itimerval {
-                it_interval: libc::timeval {
-                    tv_sec: 0,
-                    tv_usec: 0,
-                },
-                it_value: libc::timeval {
-                    tv_sec: 0,
-                    tv_usec: 0,
-                },
-            };
-            libc::setitimer(libc::ITIMER_PROF, &timer, core::ptr::null_mut());
+            let key = THREAD_KEY.load(Ordering::Acquire);
+            if key != u32::MAX {
+                libc::pthread_setspecific(key, core::ptr::null());
+            }
 
-            // Reset signal handler
+            // Ignore rather than reset: a SIGPROF still pending, or sent by a
+            // timer not yet deleted, would otherwise kill the process
             let mut sa: libc::sigaction = core::mem::zeroed();
-            sa.sa_sigaction = libc::SIG_DFL;
+            sa.sa_sigaction = libc::SIG_IGN;
             libc::sigaction(libc::SIGPROF, &sa, core::ptr::null_mut());
         }
     }
 }
 
 #[cfg(feature = "cpu")]
-pub use cpu_profiling::{start_cpu_profiling, stop_cpu_profiling};
-
-// Stubs when cpu feature is disabled
-#[cfg(not(feature = "cpu"))]
-pub fn start_cpu_profiling(_freq_hz: u32) {}
-
-#[cfg(not(feature = "cpu"))]
-pub fn stop_cpu_profiling() {}
+pub use cpu_profiling::{register_thread, start_cpu_profiling, stop_cpu_profiling};
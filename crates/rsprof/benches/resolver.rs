@@ -0,0 +1,65 @@
+//! `SymbolResolver` load and lookup cost, on this benchmark binary's own
+//! debug info (rsprof, rusqlite's bundled SQLite and their dependencies).
+//!
+//! ```bash
+//! cargo bench -p rsprof --bench resolver
+//! ```
+
+use criterion::{Criterion, Throughput, criterion_group, criterion_main};
+use rsprof::process::ProcessInfo;
+use rsprof::symbols::SymbolResolver;
+use std::hint::black_box;
+
+/// Addresses resolved per iteration
+const ADDRESSES: u64 = 4096;
+
+/// Addresses spread evenly over the code between a handful of functions
+/// from different crates, so lookups hit many compilation units
+fn sample_addresses() -> Vec<u64> {
+    let anchors = [
+        rsprof::symbols::shorten_function_name as usize as u64,
+        rsprof::cpu::CpuSampler::new as usize as u64,
+        rsprof::storage::query_total_samples as usize as u64,
+        rsprof::commands::top::run as usize as u64,
+        rusqlite::Connection::open_in_memory as usize as u64,
+        std::process::id as usize as u64,
+    ];
+    let low = *anchors.iter().min().unwrap();
+    let high = *anchors.iter().max().unwrap();
+    let stride = ((high - low) / ADDRESSES).max(1);
+    (0..ADDRESSES).map(|i| low + i * stride).collect()
+}
+
+fn bench_resolver(c: &mut Criterion) {
+    let info = ProcessInfo::new(std::process::id()).expect("inspect own process");
+
+    let mut group = c.benchmark_group("resolver");
+    group.sample_size(10);
+    group.bench_function("open", |b| {
+        b.iter(|| SymbolResolver::new(&info).expect("load symbols"))
+    });
+    group.finish();
+
+    let addresses = sample_addresses();
+    let mut resolver = SymbolResolver::new(&info).expect("load symbols");
+    let mut group = c.benchmark_group("resolve");
+    group.throughput(Throughput::Elements(ADDRESSES));
+    group.bench_function("uncached", |b| {
+        b.iter(|| {
+            for &addr in &addresses {
+                black_box(resolver.resolve(addr));
+            }
+        })
+    });
+    group.bench_function("cached", |b| {
+        b.iter(|| {
+            for &addr in &addresses {
+                black_box(resolver.resolve_cached(addr));
+            }
+        })
+    });
+    group.finish();
+}
+
+criterion_group!(benches, bench_resolver);
+criterion_main!(benches);
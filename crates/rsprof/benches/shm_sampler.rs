@@ -0,0 +1,83 @@
+//! `ShmHeapSampler` snapshot reads with 1K and 8K occupied callsite slots.
+//!
+//! This binary allocates through rsprof-trace's `ProfilingAllocator` and
+//! reads its own shared memory, standing in for a profiled target. Build
+//! with frame pointers so distinct call paths get distinct callsites:
+//!
+//! ```bash
+//! RUSTFLAGS="-C force-frame-pointers=yes" cargo bench -p rsprof --bench shm_sampler
+//! ```
+
+use criterion::{BatchSize, BenchmarkId, Criterion, Throughput, criterion_group, criterion_main};
+use rsprof::heap::ShmHeapSampler;
+use rsprof_trace::ProfilingAllocator;
+use std::hint::black_box;
+use std::path::Path;
+
+#[global_allocator]
+static ALLOC: ProfilingAllocator<0> = ProfilingAllocator::new();
+
+/// One of two call paths per level, so `path` picks one of 2^`levels`
+/// distinct stacks before allocating
+#[inline(never)]
+fn descend(path: u32, levels: u32) {
+    if levels == 0 {
+        black_box(Vec::<u8>::with_capacity(64));
+    } else if path & 1 == 0 {
+        left(path >> 1, levels - 1);
+    } else {
+        right(path >> 1, levels - 1);
+    }
+}
+
+// The black_box arguments differ so the two are not merged into one function
+#[inline(never)]
+fn left(path: u32, levels: u32) {
+    descend(path, levels);
+    black_box(0u8);
+}
+
+#[inline(never)]
+fn right(path: u32, levels: u32) {
+    descend(path, levels);
+    black_box(1u8);
+}
+
+/// Allocate once at each of 2^`levels` callsites, marking them all dirty
+fn touch_callsites(levels: u32) {
+    for path in 0..1u32 << levels {
+        descend(path, levels);
+    }
+}
+
+fn bench_read_heap_stats(c: &mut Criterion) {
+    // Creates the shared memory before the sampler opens it
+    touch_callsites(0);
+    let mut sampler = ShmHeapSampler::new(std::process::id(), Path::new(""))
+        .expect("open rsprof-trace shared memory");
+
+    let mut group = c.benchmark_group("read_heap_stats");
+    for levels in [10, 13] {
+        let slots = 1u64 << levels;
+        touch_callsites(levels);
+        group.throughput(Throughput::Elements(slots));
+
+        // Every slot changed since the last read: the checkpoint after a burst
+        group.bench_with_input(BenchmarkId::new("dirty", slots), &levels, |b, &levels| {
+            b.iter_batched(
+                || touch_callsites(levels),
+                |()| sampler.read_heap_stats().count(),
+                BatchSize::PerIteration,
+            )
+        });
+
+        // Nothing changed: the cost of an idle target
+        group.bench_with_input(BenchmarkId::new("idle", slots), &levels, |b, _| {
+            b.iter(|| sampler.read_heap_stats().count())
+        });
+    }
+    group.finish();
+}
+
+criterion_group!(benches, bench_read_heap_stats);
+criterion_main!(benches);
@@ -0,0 +1,94 @@
+//! `Storage::flush_checkpoint` with 1K and 10K active locations, timed
+//! until the writer thread has the checkpoints on disk.
+//!
+//! ```bash
+//! cargo bench -p rsprof --bench storage
+//! ```
+
+use criterion::{BenchmarkId, Criterion, Throughput, criterion_group, criterion_main};
+use rsprof::process::ProcessInfo;
+use rsprof::storage::Storage;
+use rsprof::symbols::Location;
+use std::path::{Path, PathBuf};
+use std::time::{Duration, Instant};
+
+/// A fresh database path under the temp dir
+fn db_path(locations: usize) -> PathBuf {
+    std::env::temp_dir().join(format!(
+        "rsprof-bench-{}-{}.db",
+        std::process::id(),
+        locations
+    ))
+}
+
+fn remove_db(path: &Path) {
+    for suffix in ["", "-wal", "-shm"] {
+        let mut name = path.as_os_str().to_owned();
+        name.push(suffix);
+        let _ = std::fs::remove_file(name);
+    }
+}
+
+/// Location ids for `count` callsites spread over source files as a real
+/// program's would be; the locations are written by the first checkpoint
+fn add_locations(storage: &mut Storage, count: usize) -> Vec<i64> {
+    let ids = (0..count)
+        .filter_map(|i| {
+            storage.callsite_location_id(i as u64, &[i as u64 + 1], || {
+                Some(Location {
+                    file: format!("/src/app/src/module_{}.rs", i / 50),
+                    line: (i % 50) as u32 * 7 + 1,
+                    column: 0,
+                    function: format!("app::module_{}::function_{}", i / 50, i % 50),
+                })
+            })
+        })
+        .collect();
+    storage.flush_checkpoint().expect("write locations");
+    ids
+}
+
+/// Record one checkpoint's samples and flush it `iters` times, then wait
+/// for the writer; returns the total time
+fn run_checkpoints(info: &ProcessInfo, locations: usize, iters: u64) -> Duration {
+    let path = db_path(locations);
+    remove_db(&path);
+    let mut storage = Storage::new(&path, info, 99).expect("create profile");
+    let ids = add_locations(&mut storage, locations);
+
+    let start = Instant::now();
+    for i in 0..iters {
+        for (j, &id) in ids.iter().enumerate() {
+            // Uneven counts, and not every location in every checkpoint
+            let count = (i as usize + j) % 4;
+            if count > 0 {
+                storage.record_cpu_samples_at(id, count as u64, 0, 0);
+            }
+        }
+        storage.flush_checkpoint().expect("flush checkpoint");
+    }
+    storage.finish().expect("finish profile");
+    let elapsed = start.elapsed();
+
+    remove_db(&path);
+    elapsed
+}
+
+fn bench_flush_checkpoint(c: &mut Criterion) {
+    let info = ProcessInfo::new(std::process::id()).expect("inspect own process");
+
+    let mut group = c.benchmark_group("flush_checkpoint");
+    group.sample_size(20);
+    for locations in [1_000, 10_000] {
+        group.throughput(Throughput::Elements(locations as u64));
+        group.bench_with_input(
+            BenchmarkId::from_parameter(locations),
+            &locations,
+            |b, &locations| b.iter_custom(|iters| run_checkpoints(&info, locations, iters)),
+        );
+    }
+    group.finish();
+}
+
+criterion_group!(benches, bench_flush_checkpoint);
+criterion_main!(benches);
@@ -34,6 +34,15 @@ pub struct Cli {
     #[arg(long, default_value = "99")]
     pub cpu_freq: u64,
 
+    /// perf ring buffer size per thread, in pages (power of two)
+    #[arg(long, default_value_t = crate::cpu::DEFAULT_RING_PAGES)]
+    pub perf_pages: usize,
+
+    /// How stacks are unwound; `dwarf` works on binaries built without
+    /// frame pointers
+    #[arg(long, value_enum, default_value = "fp")]
+    pub unwind: Unwind,
+
     /// Disable TUI, record only
     #[arg(long, short = 'q')]
     pub quiet: bool,
@@ -42,14 +51,56 @@ pub struct Cli {
     #[arg(long)]
     pub include_internal: bool,
 
+    /// Sample on the cycles hardware counter and record instructions, cache
+    /// and branch misses per location (needs a CPU with a PMU)
+    #[arg(long)]
+    pub pmu: bool,
+
+    /// Also record where threads block (off-CPU time, from context
+    /// switches; needs perf_event_paranoid <= 1)
+    #[arg(long)]
+    pub off_cpu: bool,
+
+    /// Drop per-checkpoint samples older than this (totals and zoomed-out
+    /// charts are kept for the whole recording)
+    #[arg(long, value_parser = parse_duration)]
+    pub retention: Option<Duration>,
+
     /// Append to the most recent profile for this process instead of creating a new one
     #[arg(long, short = 'a')]
     pub append: bool,
+
+    /// Record on triggers: keep --pre-trigger and --post-trigger around
+    /// each trigger at full resolution and the rest at --baseline-interval;
+    /// `signal` (SIGUSR2), `cpu:PERCENT` (target CPU use, 100 = one core)
+    /// or `socket:PATH` (send "trigger [reason]"); repeatable, implies --quiet
+    #[arg(long, value_name = "TRIGGER", value_parser = parse_trigger)]
+    pub trigger: Vec<crate::trigger::TriggerSpec>,
+
+    /// Recording kept from before a trigger
+    #[arg(long, default_value = "10s", value_parser = parse_duration)]
+    pub pre_trigger: Duration,
+
+    /// Recording kept from after a trigger
+    #[arg(long, default_value = "10s", value_parser = parse_duration)]
+    pub post_trigger: Duration,
+
+    /// Checkpoint interval outside the trigger windows
+    #[arg(long, default_value = "60s", value_parser = parse_duration)]
+    pub baseline_interval: Duration,
+
+    /// Send checkpoints to an `rsprof collect` server (HOST:PORT or
+    /// unix:PATH) instead of writing a local profile; implies --quiet
+    #[arg(long, value_name = "ADDR", conflicts_with_all = ["output", "append"])]
+    pub stream: Option<String>,
 }
 
 #[derive(Subcommand, Debug)]
 pub enum Command {
-    /// View top CPU or heap consumers from a recorded profile
+    /// View top CPU, heap or per-thread consumers from a recorded profile
+    ///
+    /// With --pid, cpu and heap cover that one process of a multi-process
+    /// recording.
     Top {
         /// What to display
         #[arg(value_enum)]
@@ -87,6 +138,58 @@ pub enum Command {
         filter: Option<String>,
     },
 
+    /// Compare two recorded profiles and rank what got worse
+    ///
+    /// Exits with status 7 if any location regressed by more than the threshold.
+    Diff {
+        /// Baseline profile database
+        baseline: PathBuf,
+
+        /// Profile database to compare against the baseline
+        candidate: PathBuf,
+
+        /// Number of entries to display per metric
+        #[arg(long, short = 'n', default_value = "20")]
+        top: usize,
+
+        /// Minimum change to display and to count as a regression, in
+        /// percentage points of the baseline's total
+        #[arg(long, short = 't', default_value = "2")]
+        threshold: f64,
+
+        /// Output as JSON
+        #[arg(long)]
+        json: bool,
+
+        /// Output as CSV
+        #[arg(long)]
+        csv: bool,
+    },
+
+    /// Export recorded call stacks for flamegraph and pprof tooling
+    ///
+    /// Writes to stdout; rows are streamed, so large profiles export in
+    /// constant memory.
+    Export {
+        /// Profile database file
+        file: PathBuf,
+
+        /// Output format
+        #[arg(long, value_enum, default_value = "collapsed")]
+        format: ExportFormat,
+    },
+
+    /// Convert a finished profile into a compacted archive
+    ///
+    /// The archive (FILE with an .rsc extension, or --output) is read-only
+    /// and memory-mapped, so `top` and `view` open it in time proportional
+    /// to the number of locations rather than samples. Threads, processes
+    /// and stacks stay in the database.
+    Compact {
+        /// Profile database file
+        file: PathBuf,
+    },
+
     /// Execute raw SQL query on a profile database
     Query {
         /// Profile database file
@@ -109,6 +212,20 @@ pub enum Command {
         dir: Option<PathBuf>,
     },
 
+    /// Receive streams from `rsprof --stream` agents into local profiles
+    ///
+    /// Each agent's recording goes to DIR/<host>/rsprof.<name>.<time>-<pid>.db;
+    /// an agent that reconnects continues its file. Runs until Ctrl-C.
+    Collect {
+        /// Address to listen on (HOST:PORT or unix:PATH)
+        #[arg(long, short = 'l', value_name = "ADDR")]
+        listen: String,
+
+        /// Directory for the received profiles
+        #[arg(long, default_value = ".")]
+        dir: PathBuf,
+    },
+
     /// Generate shell completions
     Completions {
         /// Shell to generate completions for
@@ -120,6 +237,33 @@ pub enum Command {
 pub enum TopMetric {
     Cpu,
     Heap,
+    /// CPU per thread, with each thread's hottest function
+    Threads,
+    /// Time blocked off-CPU (recorded with --off-cpu)
+    Offcpu,
+    /// CPU and live heap per process (several when recorded with --process)
+    Processes,
+    /// Heap sites allocating fast, freeing soon and in one size band:
+    /// candidates for an arena or object pool
+    Churn,
+}
+
+#[derive(clap::ValueEnum, Clone, Copy, Debug, PartialEq, Eq)]
+pub enum Unwind {
+    /// Walk frame pointers (needs `-C force-frame-pointers=yes`)
+    Fp,
+    /// Use the binaries' .eh_frame CFI: perf copies 8 KiB of stack per
+    /// sample (raise --perf-pages if samples are lost), and rsprof-trace
+    /// targets are sent an unwind table
+    Dwarf,
+}
+
+#[derive(clap::ValueEnum, Clone, Debug)]
+pub enum ExportFormat {
+    /// Folded stacks (`root;...;leaf count`) for flamegraph.pl or inferno
+    Collapsed,
+    /// Uncompressed pprof protobuf, for `go tool pprof`
+    Pprof,
 }
 
 fn parse_duration(s: &str) -> Result<Duration, String> {
@@ -139,6 +283,10 @@ fn parse_duration(s: &str) -> Result<Duration, String> {
     ))
 }
 
+fn parse_trigger(s: &str) -> Result<crate::trigger::TriggerSpec, String> {
+    crate::trigger::TriggerSpec::parse(s).map_err(|e| e.to_string())
+}
+
 impl Cli {
     pub fn validate(&self) -> Result<(), String> {
         // For recording mode (no subcommand), require either --pid or --process
@@ -154,6 +302,27 @@ impl Cli {
             ));
         }
 
+        // The kernel only accepts power-of-two data areas
+        if !self.perf_pages.is_power_of_two() || self.perf_pages > 4096 {
+            return Err(format!(
+                "perf ring size must be a power of two between 1 and 4096 pages, got {}",
+                self.perf_pages
+            ));
+        }
+
+        // The unwinder reads x86-64 registers and CFI
+        if self.unwind == Unwind::Dwarf && !cfg!(target_arch = "x86_64") {
+            return Err("--unwind dwarf is only supported on x86-64".to_string());
+        }
+
+        // Merging outside the windows needs something to merge
+        if !self.trigger.is_empty() && self.baseline_interval < self.interval {
+            return Err(format!(
+                "--baseline-interval ({:?}) must not be shorter than the checkpoint interval ({:?})",
+                self.baseline_interval, self.interval
+            ));
+        }
+
         Ok(())
     }
 }
@@ -0,0 +1,46 @@
+use crate::error::Result;
+use crate::storage::{Sessions, StreamAddr, collect_stream};
+use std::path::Path;
+use std::sync::Arc;
+
+/// Accept agent streams on `listen` and write each into a profile under
+/// `dir`, one thread per agent, until interrupted
+pub fn run(listen: &str, dir: &Path) -> Result<()> {
+    let addr = StreamAddr::parse(listen)?;
+    std::fs::create_dir_all(dir)?;
+    let listener = addr.bind()?;
+    eprintln!("Collecting on {} into {}", addr, dir.display());
+    let sessions = Arc::new(Sessions::default());
+
+    loop {
+        let (mut socket, peer) = match listener.accept() {
+            Ok(accepted) => accepted,
+            Err(e) => {
+                eprintln!("Accept failed: {}", e);
+                continue;
+            }
+        };
+        let dir = dir.to_path_buf();
+        let sessions = Arc::clone(&sessions);
+        std::thread::Builder::new()
+            .name("rsprof-collect".to_string())
+            .spawn(move || {
+                let result = collect_stream(&mut socket, &dir, &sessions, |hello, path| {
+                    eprintln!(
+                        "{}: {} (PID {}) on {} -> {}",
+                        peer,
+                        hello.process_name,
+                        hello.pid,
+                        hello.host,
+                        path.display()
+                    );
+                });
+                match result {
+                    Ok(checkpoints) => {
+                        eprintln!("{}: disconnected after {} checkpoints", peer, checkpoints)
+                    }
+                    Err(e) => eprintln!("{}: stream ended: {}", peer, e),
+                }
+            })?;
+    }
+}
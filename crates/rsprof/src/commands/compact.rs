@@ -0,0 +1,26 @@
+use crate::error::{Error, Result};
+use crate::storage::{archive_path, compact};
+use std::path::Path;
+
+/// Convert a finished profile into a compacted archive for fast `top` and
+/// `view`; the database is left as it is
+pub fn run(file: &Path, output: Option<&Path>) -> Result<()> {
+    let output = output.map_or_else(|| archive_path(file), Path::to_path_buf);
+    if output == file {
+        return Err(Error::InvalidArgument(
+            "the archive would overwrite its database; pass --output".to_string(),
+        ));
+    }
+
+    let summary = compact(file, &output)?;
+    let db_bytes = std::fs::metadata(file).map_or(0, |m| m.len());
+    eprintln!(
+        "Compacted {} locations over {} checkpoints: {:.1} MB -> {:.1} MB",
+        summary.locations,
+        summary.checkpoints,
+        db_bytes as f64 / (1024.0 * 1024.0),
+        summary.bytes as f64 / (1024.0 * 1024.0)
+    );
+    println!("{}", output.display());
+    Ok(())
+}
@@ -0,0 +1,346 @@
+use super::top::{format_bytes, format_function, format_location};
+use crate::error::{Error, Result};
+use crate::storage::{query_top_cpu, query_top_heap_live, query_total_samples, upgrade_schema};
+use rusqlite::Connection;
+use std::collections::HashMap;
+use std::path::Path;
+
+/// `LIMIT` that keeps every row
+const ALL_ROWS: usize = i64::MAX as usize;
+
+/// Locations are matched by source position; ids are per database
+type Key = (String, u32, String);
+
+/// A recording's per-location values, normalized so profiles of different
+/// lengths and sample counts compare
+struct Profile {
+    duration_ms: i64,
+    total_samples: i64,
+    /// Share of all CPU samples, in percent
+    cpu: HashMap<Key, f64>,
+    /// Bytes allocated per second of recording
+    alloc_rate: HashMap<Key, f64>,
+    /// Bytes still live at the last checkpoint
+    live_bytes: HashMap<Key, f64>,
+}
+
+impl Profile {
+    fn load(file: &Path) -> Result<Self> {
+        // Connection::open would create an empty database instead
+        if !file.exists() {
+            return Err(Error::InvalidArgument(format!(
+                "profile not found: {}",
+                file.display()
+            )));
+        }
+        let conn = Connection::open(file)?;
+        upgrade_schema(&conn)?;
+
+        let duration_ms: i64 = conn.query_row(
+            "SELECT COALESCE(MAX(timestamp_ms), 0) FROM checkpoints",
+            [],
+            |row| row.get(0),
+        )?;
+        let total_samples = query_total_samples(&conn)?;
+
+        let mut cpu: HashMap<Key, f64> = HashMap::new();
+        for entry in query_top_cpu(&conn, ALL_ROWS, 0.0)? {
+            *cpu.entry((entry.file, entry.line, entry.function))
+                .or_default() += entry.total_percent;
+        }
+
+        let secs = duration_ms.max(1) as f64 / 1000.0;
+        let mut alloc_rate: HashMap<Key, f64> = HashMap::new();
+        let mut live_bytes: HashMap<Key, f64> = HashMap::new();
+        for entry in query_top_heap_live(&conn, ALL_ROWS)? {
+            let key = (entry.file, entry.line, entry.function);
+            *alloc_rate.entry(key.clone()).or_default() += entry.total_alloc_bytes as f64 / secs;
+            *live_bytes.entry(key).or_default() += entry.live_bytes.max(0) as f64;
+        }
+
+        Ok(Profile {
+            duration_ms,
+            total_samples,
+            cpu,
+            alloc_rate,
+            live_bytes,
+        })
+    }
+}
+
+/// How a metric's values are displayed
+#[derive(Clone, Copy)]
+enum Unit {
+    Percent,
+    BytesPerSec,
+    Bytes,
+}
+
+impl Unit {
+    fn format(self, value: f64) -> String {
+        match self {
+            Unit::Percent => format!("{:.1}%", value),
+            Unit::BytesPerSec => format!("{}/s", format_bytes(value as i64)),
+            Unit::Bytes => format_bytes(value as i64),
+        }
+    }
+}
+
+/// One location's value in both profiles
+struct Change {
+    file: String,
+    line: u32,
+    function: String,
+    base: f64,
+    new: f64,
+    /// New minus base, in percentage points of the baseline total
+    delta: f64,
+}
+
+/// Every location of one metric whose change exceeds the threshold
+struct Section {
+    /// JSON key and CSV metric column
+    name: &'static str,
+    title: &'static str,
+    unit: Unit,
+    changes: Vec<Change>,
+    regressions: usize,
+}
+
+impl Section {
+    /// Join both sides on location and keep changes past `threshold`, worst first
+    fn compare(
+        name: &'static str,
+        title: &'static str,
+        unit: Unit,
+        base: &HashMap<Key, f64>,
+        new: &HashMap<Key, f64>,
+        threshold: f64,
+    ) -> Self {
+        // Heap metrics are absolute, so scale them to a share of the baseline
+        // total; CPU values are shares already. A baseline without the metric
+        // falls back to the candidate's total.
+        let scale = match unit {
+            Unit::Percent => 1.0,
+            Unit::BytesPerSec | Unit::Bytes => {
+                let mut total = base.values().sum::<f64>();
+                if total == 0.0 {
+                    total = new.values().sum::<f64>();
+                }
+                if total > 0.0 { 100.0 / total } else { 0.0 }
+            }
+        };
+
+        let mut changes: Vec<Change> = base
+            .keys()
+            .chain(new.keys().filter(|key| !base.contains_key(*key)))
+            .map(|key| {
+                let base = base.get(key).copied().unwrap_or(0.0);
+                let new = new.get(key).copied().unwrap_or(0.0);
+                Change {
+                    file: key.0.clone(),
+                    line: key.1,
+                    function: key.2.clone(),
+                    base,
+                    new,
+                    delta: (new - base) * scale,
+                }
+            })
+            .filter(|change| change.delta.abs() > threshold)
+            .collect();
+        changes.sort_by(|a, b| b.delta.total_cmp(&a.delta));
+
+        let regressions = changes.iter().filter(|c| c.delta > 0.0).count();
+        Section {
+            name,
+            title,
+            unit,
+            changes,
+            regressions,
+        }
+    }
+}
+
+/// Compare two profiles; errors with `Error::Regression` if any location got
+/// worse by more than `threshold` percentage points
+pub fn run(
+    baseline: &Path,
+    candidate: &Path,
+    limit: usize,
+    threshold: f64,
+    json: bool,
+    csv: bool,
+) -> Result<()> {
+    let base = Profile::load(baseline)?;
+    let new = Profile::load(candidate)?;
+
+    let mut sections = Vec::new();
+    if base.total_samples > 0 || new.total_samples > 0 {
+        sections.push(Section::compare(
+            "cpu",
+            "CPU share",
+            Unit::Percent,
+            &base.cpu,
+            &new.cpu,
+            threshold,
+        ));
+    }
+    if !base.alloc_rate.is_empty() || !new.alloc_rate.is_empty() {
+        sections.push(Section::compare(
+            "alloc_rate",
+            "Allocation rate",
+            Unit::BytesPerSec,
+            &base.alloc_rate,
+            &new.alloc_rate,
+            threshold,
+        ));
+        sections.push(Section::compare(
+            "live_bytes",
+            "Live bytes",
+            Unit::Bytes,
+            &base.live_bytes,
+            &new.live_bytes,
+            threshold,
+        ));
+    }
+
+    if sections.is_empty() {
+        eprintln!("Neither profile has CPU or heap data to compare");
+        return Ok(());
+    }
+
+    if json {
+        print_json(
+            baseline, &base, candidate, &new, threshold, &sections, limit,
+        );
+    } else if csv {
+        print_csv(&sections, limit);
+    } else {
+        print_table(
+            baseline, &base, candidate, &new, threshold, &sections, limit,
+        );
+    }
+
+    let regressions: usize = sections.iter().map(|s| s.regressions).sum();
+    if regressions > 0 {
+        return Err(Error::Regression(format!(
+            "{} location(s) worse by more than {:.1} points",
+            regressions, threshold
+        )));
+    }
+    Ok(())
+}
+
+fn print_table(
+    baseline: &Path,
+    base: &Profile,
+    candidate: &Path,
+    new: &Profile,
+    threshold: f64,
+    sections: &[Section],
+    limit: usize,
+) {
+    for (label, file, profile) in [("Baseline", baseline, base), ("Candidate", candidate, new)] {
+        let secs = profile.duration_ms / 1000;
+        println!(
+            "# {}: {} | Duration: {}m{:02}s | Samples: {}",
+            label,
+            file.display(),
+            secs / 60,
+            secs % 60,
+            profile.total_samples
+        );
+    }
+    println!("# Threshold: {:.1} points of the baseline total", threshold);
+
+    for section in sections {
+        println!();
+        println!("{} ({} regressed)", section.title, section.regressions);
+        println!(
+            "{:>10}  {:>10}  {:>7}  {:<30}  FUNCTION",
+            "BASE", "NEW", "CHANGE", "LOCATION"
+        );
+        println!("{}", "-".repeat(88));
+
+        for change in section.changes.iter().take(limit) {
+            println!(
+                "{:>10}  {:>10}  {:>+7.1}  {:<30}  {}",
+                section.unit.format(change.base),
+                section.unit.format(change.new),
+                change.delta,
+                format_location(&change.file, change.line),
+                format_function(&change.function)
+            );
+        }
+    }
+}
+
+fn print_json(
+    baseline: &Path,
+    base: &Profile,
+    candidate: &Path,
+    new: &Profile,
+    threshold: f64,
+    sections: &[Section],
+    limit: usize,
+) {
+    println!("{{");
+    for (label, file, profile) in [("baseline", baseline, base), ("candidate", candidate, new)] {
+        println!(
+            "  \"{}\": {{ \"file\": \"{}\", \"duration_ms\": {}, \"total_samples\": {} }},",
+            label,
+            escape_json(&file.display().to_string()),
+            profile.duration_ms,
+            profile.total_samples
+        );
+    }
+    println!("  \"threshold\": {},", threshold);
+    println!(
+        "  \"regressions\": {},",
+        sections.iter().map(|s| s.regressions).sum::<usize>()
+    );
+
+    for (i, section) in sections.iter().enumerate() {
+        println!("  \"{}\": [", section.name);
+        let changes: Vec<&Change> = section.changes.iter().take(limit).collect();
+        for (j, change) in changes.iter().enumerate() {
+            let comma = if j < changes.len() - 1 { "," } else { "" };
+            println!(
+                "    {{ \"base\": {:.1}, \"new\": {:.1}, \"change\": {:.2}, \"file\": \"{}\", \"line\": {}, \"function\": \"{}\" }}{}",
+                change.base,
+                change.new,
+                change.delta,
+                escape_json(&change.file),
+                change.line,
+                escape_json(&change.function),
+                comma
+            );
+        }
+        let comma = if i < sections.len() - 1 { "," } else { "" };
+        println!("  ]{}", comma);
+    }
+
+    println!("}}");
+}
+
+fn print_csv(sections: &[Section], limit: usize) {
+    println!("metric,base,new,change,file,line,function");
+    for section in sections {
+        for change in section.changes.iter().take(limit) {
+            println!(
+                "{},{:.1},{:.1},{:.2},{},{},\"{}\"",
+                section.name,
+                change.base,
+                change.new,
+                change.delta,
+                change.file,
+                change.line,
+                change.function
+            );
+        }
+    }
+}
+
+fn escape_json(s: &str) -> String {
+    s.replace('\\', "\\\\").replace('"', "\\\"")
+}
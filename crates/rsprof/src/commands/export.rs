@@ -0,0 +1,244 @@
+use crate::cli::ExportFormat;
+use crate::error::{Error, Result};
+use crate::storage::varint::put_u64;
+use crate::storage::{for_each_stack, query_locations, upgrade_schema};
+use crate::symbols::Location;
+use rusqlite::Connection;
+use std::collections::HashMap;
+use std::io::{BufWriter, IsTerminal, Write};
+use std::path::Path;
+
+/// Export a profile's call stacks to stdout
+///
+/// Stacks are streamed from the database one row at a time; only the
+/// locations table is held in memory.
+pub fn run(file: &Path, format: ExportFormat) -> Result<()> {
+    // Connection::open would create an empty database instead
+    if !file.exists() {
+        return Err(Error::InvalidArgument(format!(
+            "profile not found: {}",
+            file.display()
+        )));
+    }
+    let stdout = std::io::stdout();
+    if matches!(format, ExportFormat::Pprof) && stdout.is_terminal() {
+        return Err(Error::InvalidArgument(
+            "pprof output is binary; redirect it to a file".to_string(),
+        ));
+    }
+
+    let conn = Connection::open(file)?;
+    upgrade_schema(&conn)?;
+    let locations = query_locations(&conn)?;
+
+    let mut out = BufWriter::new(stdout.lock());
+    let stacks = match format {
+        ExportFormat::Collapsed => write_collapsed(&conn, &locations, &mut out)?,
+        ExportFormat::Pprof => write_pprof(&conn, &locations, &mut out)?,
+    };
+    out.flush()?;
+
+    if stacks == 0 {
+        eprintln!("No call stacks found (recorded by an older rsprof?)");
+    }
+    Ok(())
+}
+
+/// Write one `root;...;leaf count` line per stack (Brendan Gregg's folded
+/// format, as read by flamegraph.pl and inferno); returns the stack count
+fn write_collapsed(
+    conn: &Connection,
+    locations: &HashMap<i64, Location>,
+    out: &mut impl Write,
+) -> Result<u64> {
+    let names: HashMap<i64, String> = locations
+        .iter()
+        .map(|(&id, location)| (id, frame_name(location).replace(';', ",")))
+        .collect();
+
+    let mut stacks = 0;
+    for_each_stack(conn, |samples, frames| {
+        stacks += 1;
+        for (i, frame) in frames.iter().rev().enumerate() {
+            if i > 0 {
+                out.write_all(b";")?;
+            }
+            let name = names.get(frame).map_or("[unknown]", String::as_str);
+            out.write_all(name.as_bytes())?;
+        }
+        writeln!(out, " {}", samples)?;
+        Ok(())
+    })?;
+    Ok(stacks)
+}
+
+/// Write a pprof profile (uncompressed profile.proto); returns the stack count
+///
+/// Protobuf fields may come in any order, so samples are written as they are
+/// read and the location, function and string tables follow at the end.
+fn write_pprof(
+    conn: &Connection,
+    locations: &HashMap<i64, Location>,
+    out: &mut impl Write,
+) -> Result<u64> {
+    let freq: u64 = conn
+        .query_row(
+            "SELECT value FROM meta WHERE key = 'cpu_freq_hz'",
+            [],
+            |row| row.get::<_, String>(0),
+        )
+        .ok()
+        .and_then(|v| v.parse().ok())
+        .filter(|&freq| freq > 0)
+        .unwrap_or(99);
+    let period_ns = 1_000_000_000 / freq;
+    let duration_ms: i64 = conn.query_row(
+        "SELECT COALESCE(MAX(timestamp_ms), 0) FROM checkpoints",
+        [],
+        |row| row.get(0),
+    )?;
+
+    let mut stacks = 0;
+    let mut sample = Vec::new();
+    let mut packed = Vec::new();
+    let mut message = Vec::new();
+    for_each_stack(conn, |samples, frames| {
+        stacks += 1;
+        sample.clear();
+        packed.clear();
+        for &frame in frames {
+            put_u64(&mut packed, frame as u64);
+        }
+        put_bytes(&mut sample, 1, &packed);
+        packed.clear();
+        put_u64(&mut packed, samples);
+        put_u64(&mut packed, samples * period_ns);
+        put_bytes(&mut sample, 2, &packed);
+
+        message.clear();
+        put_bytes(&mut message, 2, &sample);
+        out.write_all(&message)?;
+        Ok(())
+    })?;
+
+    let mut strings = StringTable::default();
+    let mut tail = Vec::new();
+    let samples = strings.intern("samples");
+    let count = strings.intern("count");
+    let cpu = strings.intern("cpu");
+    let nanoseconds = strings.intern("nanoseconds");
+    for (kind, unit) in [(samples, count), (cpu, nanoseconds)] {
+        put_bytes(&mut tail, 1, &value_type(kind, unit));
+    }
+
+    let mut functions: HashMap<(&str, &str), u64> = HashMap::new();
+    let mut ids: Vec<&i64> = locations.keys().collect();
+    ids.sort();
+    for &id in ids {
+        let location = &locations[&id];
+        let next_id = functions.len() as u64 + 1;
+        let function_id = *functions
+            .entry((&location.function, &location.file))
+            .or_insert_with(|| {
+                let mut function = Vec::new();
+                put_uint(&mut function, 1, next_id);
+                put_uint(&mut function, 2, strings.intern(&frame_name(location)));
+                put_uint(&mut function, 3, strings.intern(&location.function));
+                put_uint(&mut function, 4, strings.intern(&location.file));
+                put_bytes(&mut tail, 5, &function);
+                next_id
+            });
+
+        let mut line = Vec::new();
+        put_uint(&mut line, 1, function_id);
+        put_uint(&mut line, 2, location.line as u64);
+        let mut entry = Vec::new();
+        put_uint(&mut entry, 1, id as u64);
+        put_bytes(&mut entry, 4, &line);
+        put_bytes(&mut tail, 4, &entry);
+    }
+
+    put_uint(&mut tail, 10, duration_ms as u64 * 1_000_000);
+    put_bytes(&mut tail, 11, &value_type(cpu, nanoseconds));
+    put_uint(&mut tail, 12, period_ns);
+    for string in &strings.strings {
+        put_bytes(&mut tail, 6, string.as_bytes());
+    }
+    out.write_all(&tail)?;
+
+    Ok(stacks)
+}
+
+/// A frame's display name: the function without its hash suffix, or the
+/// source position when the function is unknown
+fn frame_name(location: &Location) -> String {
+    let function = location.function.as_str();
+    if function.is_empty() || function == "[unknown]" {
+        return if location.file.is_empty() {
+            "[unknown]".to_string()
+        } else if location.line > 0 {
+            format!("{}:{}", location.file, location.line)
+        } else {
+            location.file.clone()
+        };
+    }
+
+    // Remove the hash suffix (e.g., "::h1234567890abcdef")
+    if let Some(idx) = function.rfind("::h") {
+        let suffix = &function[idx + 3..];
+        if suffix.len() == 16 && suffix.chars().all(|c| c.is_ascii_hexdigit()) {
+            return function[..idx].to_string();
+        }
+    }
+    function.to_string()
+}
+
+/// pprof string table; index 0 is always the empty string
+struct StringTable {
+    strings: Vec<String>,
+    index: HashMap<String, u64>,
+}
+
+impl Default for StringTable {
+    fn default() -> Self {
+        StringTable {
+            strings: vec![String::new()],
+            index: HashMap::from([(String::new(), 0)]),
+        }
+    }
+}
+
+impl StringTable {
+    fn intern(&mut self, s: &str) -> u64 {
+        if let Some(&i) = self.index.get(s) {
+            return i;
+        }
+        let i = self.strings.len() as u64;
+        self.strings.push(s.to_string());
+        self.index.insert(s.to_string(), i);
+        i
+    }
+}
+
+/// Encoded `ValueType { type, unit }`
+fn value_type(kind: u64, unit: u64) -> Vec<u8> {
+    let mut buf = Vec::new();
+    put_uint(&mut buf, 1, kind);
+    put_uint(&mut buf, 2, unit);
+    buf
+}
+
+/// Varint field; zero is the default and is left out
+fn put_uint(buf: &mut Vec<u8>, field: u32, value: u64) {
+    if value != 0 {
+        put_u64(buf, (field as u64) << 3);
+        put_u64(buf, value);
+    }
+}
+
+/// Length-delimited field (string, message or packed repeated)
+fn put_bytes(buf: &mut Vec<u8>, field: u32, bytes: &[u8]) {
+    put_u64(buf, (field as u64) << 3 | 2);
+    put_u64(buf, bytes.len() as u64);
+    buf.extend_from_slice(bytes);
+}
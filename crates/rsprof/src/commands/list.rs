@@ -1,4 +1,5 @@
 use crate::error::Result;
+use crate::storage::query_total_samples;
 use rusqlite::Connection;
 use std::path::{Path, PathBuf};
 
@@ -78,12 +79,16 @@ fn get_profile_info(path: &Path) -> Result<ProfileInfo> {
         )
         .unwrap_or(0);
 
-    let samples: i64 = conn
-        .query_row(
-            "SELECT COALESCE(SUM(count), 0) FROM cpu_samples",
-            [],
-            |row| row.get(0),
-        )
+    // Profiles from before schema v6 have no running totals; listing
+    // doesn't upgrade them, so fall back to summing their samples
+    let samples: i64 = query_total_samples(&conn)
+        .or_else(|_| {
+            conn.query_row(
+                "SELECT COALESCE(SUM(count), 0) FROM cpu_samples",
+                [],
+                |row| row.get(0),
+            )
+        })
         .unwrap_or(0);
 
     Ok(ProfileInfo {
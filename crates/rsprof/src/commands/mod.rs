@@ -1,3 +1,7 @@
+pub mod collect;
+pub mod compact;
+pub mod diff;
+pub mod export;
 pub mod list;
 pub mod query;
 pub mod top;
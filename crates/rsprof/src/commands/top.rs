@@ -1,7 +1,17 @@
 use crate::cli::TopMetric;
-use crate::error::Result;
-use crate::storage::{HeapEntry, query_top_cpu, query_top_heap_live};
+use crate::cpu::PmuCounters;
+use crate::error::{Error, Result};
+use crate::heap::histogram::{SHORT_LIVED_NS, lifetime_bounds_ns, size_bounds};
+use crate::storage::{
+    Archive, ChurnEntry, HeapEntry, OffCpuEntry, ProcessEntry, ThreadEntry, is_archive,
+    query_checkpoint_range, query_pmu_between, query_pmu_totals, query_pruned_before,
+    query_top_churn, query_top_cpu, query_top_cpu_between, query_top_cpu_for_pid,
+    query_top_heap_between, query_top_heap_for_pid, query_top_heap_live, query_top_offcpu,
+    query_top_offcpu_between, query_top_processes, query_top_threads, query_total_samples,
+    upgrade_schema,
+};
 use rusqlite::Connection;
+use std::collections::HashMap;
 use std::path::Path;
 use std::time::Duration;
 
@@ -11,14 +21,58 @@ pub fn run(
     metric: TopMetric,
     limit: usize,
     threshold: f64,
-    _since: Option<Duration>,
-    _until: Option<Duration>,
+    since: Option<Duration>,
+    until: Option<Duration>,
     json: bool,
     csv: bool,
     _filter: Option<String>,
+    pid: Option<u32>,
 ) -> Result<()> {
+    if pid.is_some() && !matches!(metric, TopMetric::Cpu | TopMetric::Heap) {
+        return Err(Error::InvalidArgument(
+            "--pid only applies to the cpu and heap views".to_string(),
+        ));
+    }
+
+    if matches!(metric, TopMetric::Churn) && (since.is_some() || until.is_some()) {
+        return Err(Error::InvalidArgument(
+            "allocation histograms are kept as of the last checkpoint only; drop --since/--until"
+                .to_string(),
+        ));
+    }
+
+    if is_archive(file) {
+        return run_archive(file, metric, limit, threshold, since, until, json, csv, pid);
+    }
+
     let conn = Connection::open(file)?;
 
+    // Older profiles get their running-total tables built once, here
+    upgrade_schema(&conn)?;
+
+    // Checkpoints inside --since/--until; None means the whole recording
+    let range = if since.is_some() || until.is_some() {
+        let since_ms = since.map(|d| d.as_millis() as i64);
+        let until_ms = until.map(|d| d.as_millis() as i64);
+        match query_checkpoint_range(&conn, since_ms, until_ms)? {
+            Some(range) => Some(range),
+            None => {
+                eprintln!("No checkpoints in the requested time range");
+                return Ok(());
+            }
+        }
+    } else {
+        None
+    };
+    if let Some((first, _)) = range
+        && let Some(retained_from_ms) = query_pruned_before(&conn, first)?
+    {
+        return Err(Error::InvalidArgument(format!(
+            "samples from before {:.1}s were pruned by --retention; start the range after it",
+            retained_from_ms as f64 / 1000.0
+        )));
+    }
+
     // Get metadata
     let duration_ms: Option<i64> = conn
         .query_row("SELECT MAX(timestamp_ms) FROM checkpoints", [], |row| {
@@ -26,54 +80,228 @@ pub fn run(
         })
         .ok();
 
-    let total_samples: i64 = conn
-        .query_row(
-            "SELECT COALESCE(SUM(count), 0) FROM cpu_samples",
-            [],
-            |row| row.get(0),
-        )
-        .unwrap_or(0);
+    let total_samples = query_total_samples(&conn).unwrap_or(0);
 
     match metric {
         TopMetric::Cpu => {
-            let entries = query_top_cpu(&conn, limit, threshold)?;
+            let entries = match (pid, range) {
+                (Some(pid), _) => query_top_cpu_for_pid(&conn, pid, range, limit, threshold)?,
+                (None, Some((first, last))) => {
+                    query_top_cpu_between(&conn, first, last, limit, threshold)?
+                }
+                (None, None) => query_top_cpu(&conn, limit, threshold)?,
+            };
+            // Hardware counters, if recorded with --pmu (not kept per process)
+            let pmu = match (pid, range) {
+                (Some(_), _) => HashMap::new(),
+                (None, Some((first, last))) => query_pmu_between(&conn, first, last)?,
+                (None, None) => query_pmu_totals(&conn)?,
+            };
+            show_cpu(file, duration_ms, total_samples, &entries, &pmu, json, csv);
+        }
+        TopMetric::Heap => {
+            let entries = match (pid, range) {
+                (Some(_), Some(_)) => {
+                    return Err(Error::InvalidArgument(
+                        "per-process heap stats are kept as of the last checkpoint only; drop --since/--until".to_string(),
+                    ));
+                }
+                (Some(pid), None) => query_top_heap_for_pid(&conn, pid, limit)?,
+                (None, Some((first, last))) => query_top_heap_between(&conn, first, last, limit)?,
+                (None, None) => query_top_heap_live(&conn, limit)?,
+            };
+            show_heap(file, duration_ms, &entries, json, csv);
+        }
+        TopMetric::Threads => {
+            // Profiles recorded before per-thread samples have no such table
+            let entries = query_top_threads(&conn, limit, threshold).unwrap_or_default();
+
+            if entries.is_empty() {
+                eprintln!("No per-thread CPU data found (recorded by an older rsprof?)");
+                return Ok(());
+            }
 
             if json {
-                print_cpu_json(file, duration_ms, total_samples, &entries);
+                print_threads_json(file, duration_ms, total_samples, &entries);
             } else if csv {
-                print_cpu_csv(&entries);
+                print_threads_csv(&entries);
             } else {
-                print_cpu_table(file, duration_ms, total_samples, &entries);
+                print_threads_table(file, duration_ms, total_samples, &entries);
             }
         }
-        TopMetric::Heap => {
-            let entries = query_top_heap_live(&conn, limit)?;
+        TopMetric::Offcpu => {
+            let entries = match range {
+                Some((first, last)) => {
+                    query_top_offcpu_between(&conn, first, last, limit, threshold)?
+                }
+                None => query_top_offcpu(&conn, limit, threshold)?,
+            };
+            show_offcpu(file, duration_ms, &entries, json, csv);
+        }
+        TopMetric::Processes => {
+            // Profiles recorded before the processes table have none
+            let entries = query_top_processes(&conn, limit).unwrap_or_default();
 
             if entries.is_empty() {
-                eprintln!("No heap data found. Heap profiling requires:");
-                eprintln!("  - The 'heap' feature enabled at build time");
-                eprintln!("  - Running as root or with CAP_BPF capability");
+                eprintln!("No per-process data found (recorded by an older rsprof?)");
                 return Ok(());
             }
 
             if json {
-                print_heap_json(file, duration_ms, &entries);
+                print_processes_json(file, duration_ms, total_samples, &entries);
             } else if csv {
-                print_heap_csv(&entries);
+                print_processes_csv(&entries);
             } else {
-                print_heap_table(file, duration_ms, &entries);
+                print_processes_table(file, duration_ms, total_samples, &entries);
+            }
+        }
+        TopMetric::Churn => {
+            let entries = query_top_churn(&conn, limit)?;
+            show_churn(file, duration_ms, &entries, json, csv);
+        }
+    }
+
+    Ok(())
+}
+
+/// `run` on a compacted archive, which keeps no per-thread or per-process
+/// samples
+#[allow(clippy::too_many_arguments)]
+fn run_archive(
+    file: &Path,
+    metric: TopMetric,
+    limit: usize,
+    threshold: f64,
+    since: Option<Duration>,
+    until: Option<Duration>,
+    json: bool,
+    csv: bool,
+    pid: Option<u32>,
+) -> Result<()> {
+    if pid.is_some() || matches!(metric, TopMetric::Threads | TopMetric::Processes) {
+        return Err(Error::InvalidArgument(
+            "compacted archives keep no per-thread or per-process data; run this on the database"
+                .to_string(),
+        ));
+    }
+
+    let archive = Archive::open(file)?;
+    let range = if since.is_some() || until.is_some() {
+        let since_ms = since.map(|d| d.as_millis() as i64);
+        let until_ms = until.map(|d| d.as_millis() as i64);
+        match archive.checkpoint_range(since_ms, until_ms) {
+            Some(range) => Some(range),
+            None => {
+                eprintln!("No checkpoints in the requested time range");
+                return Ok(());
             }
         }
+    } else {
+        None
+    };
+    let duration_ms = archive.duration_ms();
+    let total_samples = archive.total_samples() as i64;
+
+    match metric {
+        TopMetric::Cpu => {
+            let entries = archive.top_cpu(range, limit, threshold);
+            let pmu = archive.pmu(range);
+            show_cpu(file, duration_ms, total_samples, &entries, &pmu, json, csv);
+        }
+        TopMetric::Heap => {
+            let entries = archive.top_heap(range, limit);
+            show_heap(file, duration_ms, &entries, json, csv);
+        }
+        TopMetric::Offcpu => {
+            let entries = archive.top_offcpu(range, limit, threshold);
+            show_offcpu(file, duration_ms, &entries, json, csv);
+        }
+        TopMetric::Churn => {
+            let entries = archive.top_churn(limit);
+            show_churn(file, duration_ms, &entries, json, csv);
+        }
+        TopMetric::Threads | TopMetric::Processes => unreachable!("rejected above"),
     }
 
     Ok(())
 }
 
+fn show_cpu(
+    file: &Path,
+    duration_ms: Option<i64>,
+    total_samples: i64,
+    entries: &[crate::storage::CpuEntry],
+    pmu: &HashMap<i64, PmuCounters>,
+    json: bool,
+    csv: bool,
+) {
+    if json {
+        print_cpu_json(file, duration_ms, total_samples, entries, pmu);
+    } else if csv {
+        print_cpu_csv(entries, pmu);
+    } else {
+        print_cpu_table(file, duration_ms, total_samples, entries, pmu);
+    }
+}
+
+fn show_heap(file: &Path, duration_ms: Option<i64>, entries: &[HeapEntry], json: bool, csv: bool) {
+    if entries.is_empty() {
+        eprintln!("No heap data found. Heap profiling requires:");
+        eprintln!("  - The 'heap' feature enabled at build time");
+        eprintln!("  - Running as root or with CAP_BPF capability");
+    } else if json {
+        print_heap_json(file, duration_ms, entries);
+    } else if csv {
+        print_heap_csv(entries);
+    } else {
+        print_heap_table(file, duration_ms, entries);
+    }
+}
+
+fn show_offcpu(
+    file: &Path,
+    duration_ms: Option<i64>,
+    entries: &[OffCpuEntry],
+    json: bool,
+    csv: bool,
+) {
+    if entries.is_empty() {
+        eprintln!("No off-CPU data found (record with --off-cpu)");
+    } else if json {
+        print_offcpu_json(file, duration_ms, entries);
+    } else if csv {
+        print_offcpu_csv(entries);
+    } else {
+        print_offcpu_table(file, duration_ms, entries);
+    }
+}
+
+fn show_churn(
+    file: &Path,
+    duration_ms: Option<i64>,
+    entries: &[ChurnEntry],
+    json: bool,
+    csv: bool,
+) {
+    if entries.is_empty() {
+        eprintln!("No churning heap sites found. Allocation histograms require:");
+        eprintln!("  - The target built with rsprof-trace's 'heap' feature");
+        eprintln!("  - A profile recorded by this rsprof version");
+    } else if json {
+        print_churn_json(file, duration_ms, entries);
+    } else if csv {
+        print_churn_csv(entries);
+    } else {
+        print_churn_table(file, duration_ms, entries);
+    }
+}
+
 fn print_cpu_table(
     file: &Path,
     duration_ms: Option<i64>,
     total_samples: i64,
     entries: &[crate::storage::CpuEntry],
+    pmu: &HashMap<i64, PmuCounters>,
 ) {
     // Header comment
     println!("# {}", file.display());
@@ -89,16 +317,37 @@ fn print_cpu_table(
     println!();
 
     // Simple aligned output - LLM-friendly
-    println!("{:>6}  {:<30}  FUNCTION", "CPU%", "LOCATION");
-    println!("{}", "-".repeat(80));
+    if pmu.is_empty() {
+        println!("{:>6}  {:<30}  FUNCTION", "CPU%", "LOCATION");
+        println!("{}", "-".repeat(80));
+    } else {
+        println!(
+            "{:>6}  {:>5}  {:>8}  {:>7}  {:<30}  FUNCTION",
+            "CPU%", "IPC", "LLC-MPKI", "BR-MPKI", "LOCATION"
+        );
+        println!("{}", "-".repeat(108));
+    }
 
     for entry in entries {
         let location = format_location(&entry.file, entry.line);
         let function = format_function(&entry.function);
-        println!(
-            "{:>5.1}%  {:<30}  {}",
-            entry.total_percent, location, function
-        );
+        if pmu.is_empty() {
+            println!(
+                "{:>5.1}%  {:<30}  {}",
+                entry.total_percent, location, function
+            );
+        } else {
+            let counters = pmu.get(&entry.location_id).copied().unwrap_or_default();
+            println!(
+                "{:>5.1}%  {:>5}  {:>8}  {:>7}  {:<30}  {}",
+                entry.total_percent,
+                format_ratio(counters.ipc(), 2),
+                format_ratio(counters.llc_mpki(), 1),
+                format_ratio(counters.branch_mpki(), 1),
+                location,
+                function
+            );
+        }
     }
 }
 
@@ -107,6 +356,7 @@ fn print_cpu_json(
     duration_ms: Option<i64>,
     total_samples: i64,
     entries: &[crate::storage::CpuEntry],
+    pmu: &HashMap<i64, PmuCounters>,
 ) {
     println!("{{");
     println!("  \"file\": \"{}\",", file.display());
@@ -118,12 +368,20 @@ fn print_cpu_json(
 
     for (i, entry) in entries.iter().enumerate() {
         let comma = if i < entries.len() - 1 { "," } else { "" };
+        let counters = match pmu.get(&entry.location_id) {
+            Some(c) => format!(
+                ", \"cycles\": {}, \"instructions\": {}, \"llc_misses\": {}, \"branch_misses\": {}",
+                c.cycles, c.instructions, c.llc_misses, c.branch_misses
+            ),
+            None => String::new(),
+        };
         println!(
-            "    {{ \"cpu_pct\": {:.1}, \"file\": \"{}\", \"line\": {}, \"function\": \"{}\" }}{}",
+            "    {{ \"cpu_pct\": {:.1}, \"file\": \"{}\", \"line\": {}, \"function\": \"{}\"{} }}{}",
             entry.total_percent,
             entry.file.replace('\\', "\\\\").replace('"', "\\\""),
             entry.line,
             entry.function.replace('\\', "\\\\").replace('"', "\\\""),
+            counters,
             comma
         );
     }
@@ -132,18 +390,398 @@ fn print_cpu_json(
     println!("}}");
 }
 
-fn print_cpu_csv(entries: &[crate::storage::CpuEntry]) {
-    println!("cpu_pct,file,line,function");
+fn print_cpu_csv(entries: &[crate::storage::CpuEntry], pmu: &HashMap<i64, PmuCounters>) {
+    if pmu.is_empty() {
+        println!("cpu_pct,file,line,function");
+    } else {
+        println!("cpu_pct,file,line,function,cycles,instructions,llc_misses,branch_misses");
+    }
+    for entry in entries {
+        if pmu.is_empty() {
+            println!(
+                "{:.1},{},{},\"{}\"",
+                entry.total_percent, entry.file, entry.line, entry.function
+            );
+        } else {
+            let c = pmu.get(&entry.location_id).copied().unwrap_or_default();
+            println!(
+                "{:.1},{},{},\"{}\",{},{},{},{}",
+                entry.total_percent,
+                entry.file,
+                entry.line,
+                entry.function,
+                c.cycles,
+                c.instructions,
+                c.llc_misses,
+                c.branch_misses
+            );
+        }
+    }
+}
+
+fn print_threads_table(
+    file: &Path,
+    duration_ms: Option<i64>,
+    total_samples: i64,
+    entries: &[ThreadEntry],
+) {
+    // Header comment
+    println!("# {}", file.display());
+    if let Some(ms) = duration_ms {
+        let secs = ms / 1000;
+        let mins = secs / 60;
+        let remaining_secs = secs % 60;
+        println!(
+            "# Duration: {}m{:02}s | Samples: {}",
+            mins, remaining_secs, total_samples
+        );
+    }
+    println!();
+
+    println!(
+        "{:>6}  {:<24}  {:<30}  TOP FUNCTION",
+        "CPU%", "THREAD", "LOCATION"
+    );
+    println!("{}", "-".repeat(100));
+
     for entry in entries {
+        let thread = format_thread(entry);
+        let location = format_location(&entry.file, entry.line);
+        let function = format_function(&entry.function);
         println!(
-            "{:.1},{},{},\"{}\"",
-            entry.total_percent, entry.file, entry.line, entry.function
+            "{:>5.1}%  {:<24}  {:<30}  {}",
+            entry.total_percent, thread, location, function
         );
     }
 }
 
+fn print_threads_json(
+    file: &Path,
+    duration_ms: Option<i64>,
+    total_samples: i64,
+    entries: &[ThreadEntry],
+) {
+    println!("{{");
+    println!("  \"file\": \"{}\",", file.display());
+    if let Some(ms) = duration_ms {
+        println!("  \"duration_ms\": {},", ms);
+    }
+    println!("  \"total_samples\": {},", total_samples);
+    println!("  \"entries\": [");
+
+    for (i, entry) in entries.iter().enumerate() {
+        let comma = if i < entries.len() - 1 { "," } else { "" };
+        println!(
+            "    {{ \"cpu_pct\": {:.1}, \"tid\": {}, \"name\": \"{}\", \"samples\": {}, \"file\": \"{}\", \"line\": {}, \"function\": \"{}\" }}{}",
+            entry.total_percent,
+            entry.tid,
+            entry.name.replace('\\', "\\\\").replace('"', "\\\""),
+            entry.total_samples,
+            entry.file.replace('\\', "\\\\").replace('"', "\\\""),
+            entry.line,
+            entry.function.replace('\\', "\\\\").replace('"', "\\\""),
+            comma
+        );
+    }
+
+    println!("  ]");
+    println!("}}");
+}
+
+fn print_threads_csv(entries: &[ThreadEntry]) {
+    println!("cpu_pct,tid,name,samples,file,line,function");
+    for entry in entries {
+        println!(
+            "{:.1},{},\"{}\",{},{},{},\"{}\"",
+            entry.total_percent,
+            entry.tid,
+            entry.name,
+            entry.total_samples,
+            entry.file,
+            entry.line,
+            entry.function
+        );
+    }
+}
+
+fn print_offcpu_table(file: &Path, duration_ms: Option<i64>, entries: &[OffCpuEntry]) {
+    // Header comment
+    println!("# {}", file.display());
+    if let Some(ms) = duration_ms {
+        let secs = ms / 1000;
+        let mins = secs / 60;
+        let remaining_secs = secs % 60;
+        println!("# Duration: {}m{:02}s", mins, remaining_secs);
+    }
+    println!();
+
+    println!(
+        "{:>10}  {:>6}  {:<30}  FUNCTION",
+        "BLOCKED", "%", "LOCATION"
+    );
+    println!("{}", "-".repeat(80));
+
+    for entry in entries {
+        let location = format_location(&entry.file, entry.line);
+        let function = format_function(&entry.function);
+        println!(
+            "{:>10}  {:>5.1}%  {:<30}  {}",
+            format_nanos(entry.blocked_ns),
+            entry.percent,
+            location,
+            function
+        );
+    }
+}
+
+fn print_offcpu_json(file: &Path, duration_ms: Option<i64>, entries: &[OffCpuEntry]) {
+    println!("{{");
+    println!("  \"file\": \"{}\",", file.display());
+    if let Some(ms) = duration_ms {
+        println!("  \"duration_ms\": {},", ms);
+    }
+    println!("  \"entries\": [");
+
+    for (i, entry) in entries.iter().enumerate() {
+        let comma = if i < entries.len() - 1 { "," } else { "" };
+        println!(
+            "    {{ \"blocked_ns\": {}, \"pct\": {:.1}, \"file\": \"{}\", \"line\": {}, \"function\": \"{}\" }}{}",
+            entry.blocked_ns,
+            entry.percent,
+            entry.file.replace('\\', "\\\\").replace('"', "\\\""),
+            entry.line,
+            entry.function.replace('\\', "\\\\").replace('"', "\\\""),
+            comma
+        );
+    }
+
+    println!("  ]");
+    println!("}}");
+}
+
+fn print_processes_table(
+    file: &Path,
+    duration_ms: Option<i64>,
+    total_samples: i64,
+    entries: &[ProcessEntry],
+) {
+    // Header comment
+    println!("# {}", file.display());
+    if let Some(ms) = duration_ms {
+        let secs = ms / 1000;
+        let mins = secs / 60;
+        let remaining_secs = secs % 60;
+        println!(
+            "# Duration: {}m{:02}s | Samples: {}",
+            mins, remaining_secs, total_samples
+        );
+    }
+    println!();
+
+    println!(
+        "{:>6}  {:>8}  {:<24}  {:>10}  {:>10}",
+        "CPU%", "PID", "PROCESS", "LIVE", "ALLOCATED"
+    );
+    println!("{}", "-".repeat(66));
+
+    for entry in entries {
+        println!(
+            "{:>5.1}%  {:>8}  {:<24}  {:>10}  {:>10}",
+            entry.cpu_percent,
+            entry.pid,
+            entry.name,
+            format_bytes(entry.live_bytes),
+            format_bytes(entry.total_alloc_bytes)
+        );
+    }
+}
+
+fn print_processes_json(
+    file: &Path,
+    duration_ms: Option<i64>,
+    total_samples: i64,
+    entries: &[ProcessEntry],
+) {
+    println!("{{");
+    println!("  \"file\": \"{}\",", file.display());
+    if let Some(ms) = duration_ms {
+        println!("  \"duration_ms\": {},", ms);
+    }
+    println!("  \"total_samples\": {},", total_samples);
+    println!("  \"entries\": [");
+
+    for (i, entry) in entries.iter().enumerate() {
+        let comma = if i < entries.len() - 1 { "," } else { "" };
+        println!(
+            "    {{ \"cpu_pct\": {:.1}, \"pid\": {}, \"name\": \"{}\", \"samples\": {}, \"live_bytes\": {}, \"alloc_bytes\": {} }}{}",
+            entry.cpu_percent,
+            entry.pid,
+            entry.name.replace('\\', "\\\\").replace('"', "\\\""),
+            entry.cpu_samples,
+            entry.live_bytes,
+            entry.total_alloc_bytes,
+            comma
+        );
+    }
+
+    println!("  ]");
+    println!("}}");
+}
+
+fn print_processes_csv(entries: &[ProcessEntry]) {
+    println!("cpu_pct,pid,name,samples,live_bytes,alloc_bytes");
+    for entry in entries {
+        println!(
+            "{:.1},{},\"{}\",{},{},{}",
+            entry.cpu_percent,
+            entry.pid,
+            entry.name,
+            entry.cpu_samples,
+            entry.live_bytes,
+            entry.total_alloc_bytes
+        );
+    }
+}
+
+fn print_churn_table(file: &Path, duration_ms: Option<i64>, entries: &[ChurnEntry]) {
+    // Header comment
+    println!("# {}", file.display());
+    if let Some(ms) = duration_ms {
+        let secs = ms / 1000;
+        println!(
+            "# Duration: {}m{:02}s | Short-lived: under {}",
+            secs / 60,
+            secs % 60,
+            format_nanos(SHORT_LIVED_NS)
+        );
+    }
+    println!();
+
+    // CHURN is short-lived allocations per second in the size band
+    println!(
+        "{:>8}  {:>8}  {:>6}  {:>8}  {:>15}  {:<30}  FUNCTION",
+        "CHURN/s", "ALLOCS/s", "SHORT", "MEDIAN", "SIZE BAND", "LOCATION"
+    );
+    println!("{}", "-".repeat(100));
+
+    for entry in entries {
+        let churn = &entry.churn;
+        let (low, high) = churn.size_band;
+        println!(
+            "{:>8}  {:>8}  {:>5.1}%  {:>8}  {:>15}  {:<30}  {}",
+            format_rate(churn.score),
+            format_rate(churn.alloc_rate),
+            churn.short_lived_share * 100.0,
+            format_nanos(churn.median_lifetime_ns),
+            format!(
+                "{}-{} {:.0}%",
+                format_bytes(low as i64),
+                format_bytes(high as i64),
+                churn.size_band_share * 100.0
+            ),
+            format_location(&entry.file, entry.line),
+            format_function(&entry.function)
+        );
+    }
+}
+
+fn print_churn_json(file: &Path, duration_ms: Option<i64>, entries: &[ChurnEntry]) {
+    println!("{{");
+    println!("  \"file\": \"{}\",", file.display());
+    if let Some(ms) = duration_ms {
+        println!("  \"duration_ms\": {},", ms);
+    }
+    println!("  \"short_lived_ns\": {},", SHORT_LIVED_NS);
+    // Bucket lower bounds, shared by every entry's histograms
+    let size_buckets: Vec<String> = (0..entries[0].histogram.size.len())
+        .map(|b| size_bounds(b).0.to_string())
+        .collect();
+    let lifetime_buckets: Vec<String> = (0..entries[0].histogram.lifetime.len())
+        .map(|b| lifetime_bounds_ns(b).0.to_string())
+        .collect();
+    println!("  \"size_bucket_bytes\": [{}],", size_buckets.join(", "));
+    println!(
+        "  \"lifetime_bucket_ns\": [{}],",
+        lifetime_buckets.join(", ")
+    );
+    println!("  \"entries\": [");
+
+    let join = |counts: &[u64]| {
+        counts
+            .iter()
+            .map(|c| c.to_string())
+            .collect::<Vec<_>>()
+            .join(", ")
+    };
+    for (i, entry) in entries.iter().enumerate() {
+        let comma = if i < entries.len() - 1 { "," } else { "" };
+        let churn = &entry.churn;
+        println!(
+            "    {{ \"churn_per_sec\": {:.1}, \"allocs_per_sec\": {:.1}, \"short_lived_pct\": {:.1}, \"median_lifetime_ns\": {}, \"size_band\": [{}, {}], \"size_band_pct\": {:.1}, \"alloc_count\": {}, \"size_histogram\": [{}], \"lifetime_histogram\": [{}], \"file\": \"{}\", \"line\": {}, \"function\": \"{}\" }}{}",
+            churn.score,
+            churn.alloc_rate,
+            churn.short_lived_share * 100.0,
+            churn.median_lifetime_ns,
+            churn.size_band.0,
+            churn.size_band.1,
+            churn.size_band_share * 100.0,
+            entry.alloc_count,
+            join(&entry.histogram.size),
+            join(&entry.histogram.lifetime),
+            entry.file.replace('\\', "\\\\").replace('"', "\\\""),
+            entry.line,
+            entry.function.replace('\\', "\\\\").replace('"', "\\\""),
+            comma
+        );
+    }
+
+    println!("  ]");
+    println!("}}");
+}
+
+fn print_churn_csv(entries: &[ChurnEntry]) {
+    println!(
+        "churn_per_sec,allocs_per_sec,short_lived_pct,median_lifetime_ns,size_band_min,size_band_max,size_band_pct,file,line,function"
+    );
+    for entry in entries {
+        let churn = &entry.churn;
+        println!(
+            "{:.1},{:.1},{:.1},{},{},{},{:.1},{},{},\"{}\"",
+            churn.score,
+            churn.alloc_rate,
+            churn.short_lived_share * 100.0,
+            churn.median_lifetime_ns,
+            churn.size_band.0,
+            churn.size_band.1,
+            churn.size_band_share * 100.0,
+            entry.file,
+            entry.line,
+            entry.function
+        );
+    }
+}
+
+fn print_offcpu_csv(entries: &[OffCpuEntry]) {
+    println!("blocked_ns,pct,file,line,function");
+    for entry in entries {
+        println!(
+            "{},{:.1},{},{},\"{}\"",
+            entry.blocked_ns, entry.percent, entry.file, entry.line, entry.function
+        );
+    }
+}
+
+/// Format a thread as `name (tid)`, or just the tid if it has no name
+fn format_thread(entry: &ThreadEntry) -> String {
+    if entry.name.is_empty() {
+        entry.tid.to_string()
+    } else {
+        format!("{} ({})", entry.name, entry.tid)
+    }
+}
+
 /// Format a file path for display - keep the most relevant parts
-fn format_location(file: &str, line: u32) -> String {
+pub(super) fn format_location(file: &str, line: u32) -> String {
     let simplified = simplify_path(file);
     if line > 0 {
         format!("{}:{}", simplified, line)
@@ -278,7 +916,7 @@ fn print_heap_csv(entries: &[HeapEntry]) {
 }
 
 /// Format bytes as human-readable with decimals (heaptrack style)
-fn format_bytes(bytes: i64) -> String {
+pub(super) fn format_bytes(bytes: i64) -> String {
     let abs = bytes.unsigned_abs() as f64;
     let sign = if bytes < 0 { "-" } else { "" };
     if abs >= 1024.0 * 1024.0 * 1024.0 {
@@ -292,6 +930,33 @@ fn format_bytes(bytes: i64) -> String {
     }
 }
 
+/// Format a derived counter ratio, or `-` when it is undefined
+fn format_ratio(value: Option<f64>, decimals: usize) -> String {
+    value.map_or_else(|| "-".to_string(), |v| format!("{:.*}", decimals, v))
+}
+
+/// Format a duration in nanoseconds with a unit, e.g. `1.25s` or `340ms`
+fn format_nanos(ns: u64) -> String {
+    if ns >= 1_000_000_000 {
+        format!("{:.2}s", ns as f64 / 1e9)
+    } else if ns >= 1_000_000 {
+        format!("{:.1}ms", ns as f64 / 1e6)
+    } else {
+        format!("{:.1}us", ns as f64 / 1e3)
+    }
+}
+
+/// Format a per-second rate compactly, e.g. `12.5K`
+fn format_rate(per_sec: f64) -> String {
+    if per_sec >= 1e6 {
+        format!("{:.1}M", per_sec / 1e6)
+    } else if per_sec >= 1e3 {
+        format!("{:.1}K", per_sec / 1e3)
+    } else {
+        format!("{:.1}", per_sec)
+    }
+}
+
 /// Format a number with commas for readability
 fn format_count(n: u64) -> String {
     let s = n.to_string();
@@ -306,7 +971,7 @@ fn format_count(n: u64) -> String {
 }
 
 /// Format a function name - remove hash suffix and simplify
-fn format_function(func: &str) -> String {
+pub(super) fn format_function(func: &str) -> String {
     let mut result = func.to_string();
 
     // Remove the hash suffix (e.g., "::h1234567890abcdef")
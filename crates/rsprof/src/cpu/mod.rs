@@ -1,4 +1,5 @@
 mod perf;
 mod sampler;
 
-pub use sampler::CpuSampler;
+pub use perf::PmuCounters;
+pub use sampler::{CpuSampler, DEFAULT_RING_PAGES};
@@ -1,16 +1,57 @@
 use crate::error::{Error, Result};
+use crate::symbols::UserRegs;
 use libc::{self, SYS_perf_event_open, c_int, c_ulong, pid_t, syscall};
 use std::fs;
 use std::os::unix::io::{AsRawFd, FromRawFd, OwnedFd};
 use std::ptr;
 
 // perf_event constants (from linux/perf_event.h)
+pub const PERF_TYPE_HARDWARE: u32 = 0;
 pub const PERF_TYPE_SOFTWARE: u32 = 1;
+pub const PERF_COUNT_HW_CPU_CYCLES: u64 = 0;
+pub const PERF_COUNT_HW_INSTRUCTIONS: u64 = 1;
+pub const PERF_COUNT_HW_CACHE_MISSES: u64 = 3;
+pub const PERF_COUNT_HW_BRANCH_MISSES: u64 = 5;
 pub const PERF_COUNT_SW_CPU_CLOCK: u64 = 0;
+pub const PERF_COUNT_SW_CONTEXT_SWITCHES: u64 = 3;
 
 pub const PERF_SAMPLE_IP: u64 = 1 << 0;
 pub const PERF_SAMPLE_TID: u64 = 1 << 1;
 pub const PERF_SAMPLE_TIME: u64 = 1 << 2;
+pub const PERF_SAMPLE_READ: u64 = 1 << 4;
+pub const PERF_SAMPLE_CALLCHAIN: u64 = 1 << 5;
+pub const PERF_SAMPLE_REGS_USER: u64 = 1 << 12;
+pub const PERF_SAMPLE_STACK_USER: u64 = 1 << 13;
+
+// x86-64 register numbers for sample_regs_user (asm/perf_regs.h); the
+// kernel writes the selected registers in this order
+const PERF_REG_X86_BP: u64 = 6;
+const PERF_REG_X86_SP: u64 = 7;
+const PERF_REG_X86_IP: u64 = 8;
+const USER_REGS_MASK: u64 = 1 << PERF_REG_X86_BP | 1 << PERF_REG_X86_SP | 1 << PERF_REG_X86_IP;
+
+/// Bytes of user stack copied with each sample in `StackMode::UserStack`
+pub const USER_STACK_BYTES: u32 = 8192;
+
+pub const PERF_FORMAT_GROUP: u64 = 1 << 3;
+
+/// Apply an enable/disable ioctl to the whole group, not just the leader
+const PERF_IOC_FLAG_GROUP: c_ulong = 1;
+
+/// Counting members of a hardware group, after the cycles leader; sample
+/// reads return values in this order
+const HARDWARE_GROUP_MEMBERS: [u64; 3] = [
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_BRANCH_MISSES,
+];
+
+/// Callchain entries at or above this value are context markers
+/// (PERF_CONTEXT_USER etc.), not addresses
+pub const PERF_CONTEXT_MAX: u64 = -4095i64 as u64;
+
+/// Maximum callchain depth requested from the kernel
+pub const MAX_STACK_DEPTH: usize = 64;
 
 /// perf_event_attr structure
 #[repr(C)]
@@ -50,6 +91,9 @@ impl PerfEventAttr {
     const EXCLUDE_HV_BIT: u64 = 1 << 6;
     const FREQ_BIT: u64 = 1 << 10;
     const WATERMARK_BIT: u64 = 1 << 14;
+    const SAMPLE_ID_ALL_BIT: u64 = 1 << 18;
+    const EXCLUDE_CALLCHAIN_KERNEL_BIT: u64 = 1 << 21;
+    const CONTEXT_SWITCH_BIT: u64 = 1 << 26;
 
     pub fn new() -> Self {
         PerfEventAttr {
@@ -90,6 +134,30 @@ impl PerfEventAttr {
         }
     }
 
+    pub fn set_exclude_callchain_kernel(&mut self, val: bool) {
+        if val {
+            self.flags |= Self::EXCLUDE_CALLCHAIN_KERNEL_BIT;
+        } else {
+            self.flags &= !Self::EXCLUDE_CALLCHAIN_KERNEL_BIT;
+        }
+    }
+
+    pub fn set_sample_id_all(&mut self, val: bool) {
+        if val {
+            self.flags |= Self::SAMPLE_ID_ALL_BIT;
+        } else {
+            self.flags &= !Self::SAMPLE_ID_ALL_BIT;
+        }
+    }
+
+    pub fn set_context_switch(&mut self, val: bool) {
+        if val {
+            self.flags |= Self::CONTEXT_SWITCH_BIT;
+        } else {
+            self.flags &= !Self::CONTEXT_SWITCH_BIT;
+        }
+    }
+
     pub fn set_watermark(&mut self, val: bool) {
         if val {
             self.flags |= Self::WATERMARK_BIT;
@@ -141,69 +209,214 @@ pub struct PerfEventHeader {
 
 // Record types
 pub const PERF_RECORD_SAMPLE: u32 = 9;
-#[allow(dead_code)]
 pub const PERF_RECORD_LOST: u32 = 2;
+pub const PERF_RECORD_SWITCH: u32 = 14;
+
+/// Set in a PERF_RECORD_SWITCH header's misc when the thread was switched out
+pub const PERF_RECORD_MISC_SWITCH_OUT: u16 = 1 << 13;
+
+/// What a perf event samples
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum EventKind {
+    /// On-CPU time, sampled at a frequency in Hz
+    CpuClock { freq: u64 },
+    /// Every context switch, with the thread's user stack as it blocks, plus
+    /// switch records to time how long it stayed off the CPU
+    ContextSwitches,
+    /// CPU cycles sampled at a frequency in Hz, each sample reading a group
+    /// of instruction, cache-miss and branch-miss counters
+    Hardware { freq: u64 },
+}
+
+/// How a sample's stack is taken
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum StackMode {
+    /// The kernel walks frame pointers into a callchain
+    Callchain,
+    /// The kernel copies the user registers and the top of the user stack,
+    /// for rsprof to unwind with CFI
+    UserStack,
+}
+
+/// Hardware counter values: running totals in a sample, or deltas once
+/// attributed to a stack or location
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct PmuCounters {
+    pub cycles: u64,
+    pub instructions: u64,
+    /// Last-level cache misses
+    pub llc_misses: u64,
+    pub branch_misses: u64,
+}
+
+impl PmuCounters {
+    /// Counts since `earlier`, saturating if a counter went backwards
+    pub fn since(&self, earlier: &PmuCounters) -> PmuCounters {
+        PmuCounters {
+            cycles: self.cycles.saturating_sub(earlier.cycles),
+            instructions: self.instructions.saturating_sub(earlier.instructions),
+            llc_misses: self.llc_misses.saturating_sub(earlier.llc_misses),
+            branch_misses: self.branch_misses.saturating_sub(earlier.branch_misses),
+        }
+    }
+
+    pub fn add(&mut self, other: &PmuCounters) {
+        self.cycles += other.cycles;
+        self.instructions += other.instructions;
+        self.llc_misses += other.llc_misses;
+        self.branch_misses += other.branch_misses;
+    }
+
+    pub fn is_zero(&self) -> bool {
+        *self == PmuCounters::default()
+    }
+
+    /// Instructions per cycle
+    pub fn ipc(&self) -> Option<f64> {
+        (self.cycles > 0).then(|| self.instructions as f64 / self.cycles as f64)
+    }
+
+    /// Last-level cache misses per thousand instructions
+    pub fn llc_mpki(&self) -> Option<f64> {
+        (self.instructions > 0).then(|| self.llc_misses as f64 * 1000.0 / self.instructions as f64)
+    }
+
+    /// Branch misses per thousand instructions
+    pub fn branch_mpki(&self) -> Option<f64> {
+        (self.instructions > 0)
+            .then(|| self.branch_misses as f64 * 1000.0 / self.instructions as f64)
+    }
+}
+
+/// A decoded sample record; `stack` borrows the event's scratch buffer
+pub struct PerfSample<'a> {
+    pub tid: u32,
+    pub time: u64,
+    /// Group counter totals for the thread, for hardware events
+    pub counters: Option<PmuCounters>,
+    /// User-space callchain, leaf first; just the sampled IP when the
+    /// stack was copied instead
+    pub stack: &'a [u64],
+    /// Registers and stack copy, in `StackMode::UserStack`
+    pub user: Option<UserStack<'a>>,
+}
+
+/// The user registers and stack copied at a sample
+pub struct UserStack<'a> {
+    pub regs: UserRegs,
+    /// The stack from `regs.sp` up
+    pub bytes: &'a [u8],
+}
+
+/// A decoded ring buffer record
+pub enum PerfRecord<'a> {
+    Sample(PerfSample<'a>),
+    /// The thread was scheduled back onto a CPU at `time`
+    SwitchIn {
+        tid: u32,
+        time: u64,
+    },
+}
 
 /// Wrapper for a perf_event file descriptor
 pub struct PerfEvent {
     fd: OwnedFd,
+    /// Counting group members, for hardware events
+    _members: Vec<OwnedFd>,
+    kind: EventKind,
+    stack_mode: StackMode,
     mmap: *mut u8,
     mmap_size: usize,
     data_size: usize,
+    /// Reused for each decoded callchain
+    stack: Vec<u64>,
+    /// Reused for each copied user stack
+    user_stack: Vec<u8>,
+    /// Samples the kernel dropped because the ring was full
+    lost: u64,
 }
 
 // SAFETY: The mmap pointer is only used from a single thread
 unsafe impl Send for PerfEvent {}
 
 impl PerfEvent {
-    /// Open a perf_event for CPU sampling
-    pub fn open(pid: pid_t, freq: u64) -> Result<Self> {
-        // Check perf_event_paranoid
-        check_perf_paranoid()?;
+    /// Open a perf_event sampling a single thread
+    ///
+    /// `data_pages` is the ring buffer size and must be a power of two.
+    pub fn open(
+        tid: pid_t,
+        kind: EventKind,
+        stack_mode: StackMode,
+        data_pages: usize,
+    ) -> Result<Self> {
+        let page_size = unsafe { libc::sysconf(libc::_SC_PAGESIZE) } as usize;
+        let mmap_size = (1 + data_pages) * page_size; // 1 metadata page + data pages
+        let data_size = data_pages * page_size;
 
         let mut attr = PerfEventAttr::new();
         attr.type_ = PERF_TYPE_SOFTWARE;
-        attr.config = PERF_COUNT_SW_CPU_CLOCK;
         attr.sample_type = PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_TIME;
-        attr.sample_period_or_freq = freq;
-        attr.set_freq(true);
+        match stack_mode {
+            StackMode::Callchain => {
+                attr.sample_type |= PERF_SAMPLE_CALLCHAIN;
+                attr.sample_max_stack = MAX_STACK_DEPTH as u16;
+            }
+            StackMode::UserStack => {
+                attr.sample_type |= PERF_SAMPLE_REGS_USER | PERF_SAMPLE_STACK_USER;
+                attr.sample_regs_user = USER_REGS_MASK;
+                attr.sample_stack_user = USER_STACK_BYTES;
+            }
+        }
+        match kind {
+            EventKind::CpuClock { freq } => {
+                attr.config = PERF_COUNT_SW_CPU_CLOCK;
+                attr.sample_period_or_freq = freq;
+                attr.set_freq(true);
+                attr.set_exclude_kernel(true);
+            }
+            EventKind::ContextSwitches => {
+                // Switches happen in the kernel, so it can't be excluded;
+                // the callchain is still user-only
+                attr.config = PERF_COUNT_SW_CONTEXT_SWITCHES;
+                attr.sample_period_or_freq = 1;
+                attr.set_context_switch(true);
+                attr.set_sample_id_all(true);
+            }
+            EventKind::Hardware { freq } => {
+                attr.type_ = PERF_TYPE_HARDWARE;
+                attr.config = PERF_COUNT_HW_CPU_CYCLES;
+                attr.sample_period_or_freq = freq;
+                attr.sample_type |= PERF_SAMPLE_READ;
+                attr.read_format = PERF_FORMAT_GROUP;
+                attr.set_freq(true);
+                attr.set_exclude_kernel(true);
+            }
+        }
         attr.set_disabled(true);
-        attr.set_exclude_kernel(true);
         attr.set_exclude_hv(true);
+        attr.set_exclude_callchain_kernel(true);
+        // Wake the sampler's epoll set once the ring is a quarter full
         attr.set_watermark(true);
-        attr.wakeup_events_or_watermark = 4096; // Wake when 4KB ready
-
-        let fd = unsafe {
-            syscall(
-                SYS_perf_event_open,
-                &attr as *const PerfEventAttr,
-                pid,
-                -1 as c_int, // any CPU
-                -1 as c_int, // no group
-                0 as c_ulong,
-            )
-        };
-
-        if fd < 0 {
-            let err = std::io::Error::last_os_error();
-            return Err(match err.raw_os_error() {
-                Some(libc::EACCES) | Some(libc::EPERM) => Error::PermissionDenied(format!(
-                    "Cannot attach to PID {}. Try: sudo sysctl kernel.perf_event_paranoid=1",
-                    pid
-                )),
-                Some(libc::ESRCH) => Error::ProcessNotFound(format!("PID {}", pid)),
-                _ => Error::PerfEvent(format!("perf_event_open failed: {}", err)),
-            });
+        attr.wakeup_events_or_watermark = (data_size / 4) as u32;
+
+        let fd = open_event(&attr, tid, -1)?;
+
+        // Counting members read with each cycles sample; they start and stop
+        // with the leader
+        let mut members = Vec::new();
+        if let EventKind::Hardware { .. } = kind {
+            for config in HARDWARE_GROUP_MEMBERS {
+                let mut member = PerfEventAttr::new();
+                member.type_ = PERF_TYPE_HARDWARE;
+                member.config = config;
+                member.read_format = PERF_FORMAT_GROUP;
+                member.set_exclude_kernel(true);
+                member.set_exclude_hv(true);
+                members.push(open_event(&member, tid, fd.as_raw_fd())?);
+            }
         }
 
-        let fd = unsafe { OwnedFd::from_raw_fd(fd as c_int) };
-
         // Memory map the ring buffer
-        let page_size = unsafe { libc::sysconf(libc::_SC_PAGESIZE) } as usize;
-        let data_pages = 64; // 64 pages = 256KB
-        let mmap_size = (1 + data_pages) * page_size; // 1 metadata page + data pages
-        let data_size = data_pages * page_size;
-
         let mmap = unsafe {
             libc::mmap(
                 ptr::null_mut(),
@@ -223,7 +436,7 @@ impl PerfEvent {
         }
 
         // Enable the event
-        let ret = unsafe { libc::ioctl(fd.as_raw_fd(), 0x2400, 0) }; // PERF_EVENT_IOC_ENABLE
+        let ret = unsafe { libc::ioctl(fd.as_raw_fd(), 0x2400, PERF_IOC_FLAG_GROUP) }; // PERF_EVENT_IOC_ENABLE
         if ret < 0 {
             unsafe { libc::munmap(mmap, mmap_size) };
             return Err(Error::PerfEvent(format!(
@@ -234,52 +447,162 @@ impl PerfEvent {
 
         Ok(PerfEvent {
             fd,
+            _members: members,
+            kind,
+            stack_mode,
             mmap: mmap as *mut u8,
             mmap_size,
             data_size,
+            stack: Vec::with_capacity(MAX_STACK_DEPTH),
+            user_stack: Vec::with_capacity(USER_STACK_BYTES as usize),
+            lost: 0,
         })
     }
 
-    /// Read samples from the ring buffer
-    pub fn read_samples(&mut self) -> Vec<u64> {
-        let mut samples = Vec::new();
+    /// What this event samples
+    pub fn kind(&self) -> EventKind {
+        self.kind
+    }
 
-        let header = unsafe { &*(self.mmap as *const PerfEventMmapPage) };
-        let data_ptr = unsafe { self.mmap.add(header.data_offset as usize) };
+    /// Total samples the kernel reported as lost for this event
+    pub fn lost(&self) -> u64 {
+        self.lost
+    }
 
-        // Read barrier
-        std::sync::atomic::fence(std::sync::atomic::Ordering::Acquire);
+    /// Decode all pending records from the ring buffer, calling `f` for each
+    ///
+    /// Records are decoded in place; nothing is allocated per sample.
+    pub fn read_records<F: FnMut(PerfRecord<'_>)>(&mut self, mut f: F) {
+        let page = self.mmap as *mut PerfEventMmapPage;
+        let data_ptr = unsafe { self.mmap.add((*page).data_offset as usize) };
 
-        let mut tail = header.data_tail;
-        let head = header.data_head;
+        // The kernel updates data_head concurrently; read it once, then
+        // fence so record contents are not read before it
+        let head = unsafe { ptr::read_volatile(ptr::addr_of!((*page).data_head)) };
+        std::sync::atomic::fence(std::sync::atomic::Ordering::Acquire);
+        let mut tail = unsafe { (*page).data_tail };
 
         while tail < head {
             let offset = (tail % self.data_size as u64) as usize;
             let event_header = unsafe { &*(data_ptr.add(offset) as *const PerfEventHeader) };
 
+            // Every field is 8-byte aligned, so reading word by word modulo
+            // the ring size handles records that wrap
+            let word = |i: usize| -> u64 {
+                let pos =
+                    (offset + std::mem::size_of::<PerfEventHeader>() + i * 8) % self.data_size;
+                unsafe { *(data_ptr.add(pos) as *const u64) }
+            };
+
             if event_header.type_ == PERF_RECORD_SAMPLE {
-                // Sample record: header followed by IP (and optionally TID, TIME)
-                // We configured PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_TIME
-                // Layout: ip, pid, tid, time
-                let ip_offset = offset + std::mem::size_of::<PerfEventHeader>();
-                let ip_ptr = data_ptr.wrapping_add(ip_offset % self.data_size);
-                let ip = unsafe { *(ip_ptr as *const u64) };
-                samples.push(ip);
+                // We configured IP | TID | TIME | [READ] and CALLCHAIN or
+                // REGS_USER | STACK_USER, so the layout is: ip, pid/tid, time,
+                // [nr, values[nr]], then nr, ips[nr] or abi, [bp, sp, ip],
+                // size, [data[size], dyn_size]
+                let ip = word(0);
+                let tid = (word(1) >> 32) as u32;
+                let time = word(2);
+                let mut next = 3;
+
+                let mut counters = None;
+                if let EventKind::Hardware { .. } = self.kind {
+                    let values = word(next) as usize;
+                    if values == 1 + HARDWARE_GROUP_MEMBERS.len() {
+                        counters = Some(PmuCounters {
+                            cycles: word(next + 1),
+                            instructions: word(next + 2),
+                            llc_misses: word(next + 3),
+                            branch_misses: word(next + 4),
+                        });
+                    }
+                    next += 1 + values;
+                }
+
+                self.stack.clear();
+                let mut regs = None;
+                match self.stack_mode {
+                    StackMode::Callchain => {
+                        let nr = (word(next) as usize).min(MAX_STACK_DEPTH + 8);
+                        for i in 0..nr {
+                            let addr = word(next + 1 + i);
+                            if addr < PERF_CONTEXT_MAX {
+                                self.stack.push(addr);
+                            }
+                        }
+                    }
+                    StackMode::UserStack => {
+                        // ABI 0: no user context (e.g. a kernel thread)
+                        if word(next) != 0 {
+                            regs = Some(UserRegs {
+                                bp: word(next + 1),
+                                sp: word(next + 2),
+                                ip: word(next + 3),
+                            });
+                            next += 3;
+                        }
+                        next += 1;
+                        let size = word(next) as usize;
+                        self.user_stack.clear();
+                        if size > 0 && regs.is_some() {
+                            let dyn_size = word(next + 1 + size / 8) as usize;
+                            let start =
+                                (offset + std::mem::size_of::<PerfEventHeader>() + (next + 1) * 8)
+                                    % self.data_size;
+                            // Copy in up to two pieces, since the data may wrap
+                            let len = dyn_size.min(size);
+                            let first = len.min(self.data_size - start);
+                            unsafe {
+                                let ring = std::slice::from_raw_parts(data_ptr, self.data_size);
+                                self.user_stack
+                                    .extend_from_slice(&ring[start..start + first]);
+                                self.user_stack.extend_from_slice(&ring[..len - first]);
+                            }
+                        }
+                    }
+                }
+                if self.stack.is_empty() {
+                    self.stack.push(ip);
+                }
+
+                f(PerfRecord::Sample(PerfSample {
+                    tid,
+                    time,
+                    counters,
+                    stack: &self.stack,
+                    user: regs.map(|regs| UserStack {
+                        regs,
+                        bytes: &self.user_stack,
+                    }),
+                }));
+            } else if event_header.type_ == PERF_RECORD_SWITCH
+                && event_header.misc & PERF_RECORD_MISC_SWITCH_OUT == 0
+            {
+                // No body; the sample_id trailer is pid/tid, time
+                f(PerfRecord::SwitchIn {
+                    tid: (word(0) >> 32) as u32,
+                    time: word(1),
+                });
+            } else if event_header.type_ == PERF_RECORD_LOST {
+                // Layout: id, lost
+                self.lost += word(1);
             }
 
             tail += event_header.size as u64;
         }
 
         // Update tail pointer
-        // Write barrier
+        // Write barrier: finish reading records before handing the space back
         std::sync::atomic::fence(std::sync::atomic::Ordering::Release);
 
         unsafe {
-            let header_mut = &mut *(self.mmap as *mut PerfEventMmapPage);
-            header_mut.data_tail = tail;
+            ptr::write_volatile(ptr::addr_of_mut!((*page).data_tail), tail);
         }
+    }
+}
 
-        samples
+impl AsRawFd for PerfEvent {
+    fn as_raw_fd(&self) -> c_int {
+        self.fd.as_raw_fd()
     }
 }
 
@@ -287,15 +610,47 @@ impl Drop for PerfEvent {
     fn drop(&mut self) {
         unsafe {
             // Disable the event
-            libc::ioctl(self.fd.as_raw_fd(), 0x2401, 0); // PERF_EVENT_IOC_DISABLE
+            libc::ioctl(self.fd.as_raw_fd(), 0x2401, PERF_IOC_FLAG_GROUP); // PERF_EVENT_IOC_DISABLE
             // Unmap
             libc::munmap(self.mmap as *mut libc::c_void, self.mmap_size);
         }
     }
 }
 
+/// perf_event_open for one thread on any CPU; `group_fd` is -1 for a leader
+fn open_event(attr: &PerfEventAttr, tid: pid_t, group_fd: c_int) -> Result<OwnedFd> {
+    let fd = unsafe {
+        syscall(
+            SYS_perf_event_open,
+            attr as *const PerfEventAttr,
+            tid,
+            -1 as c_int, // any CPU
+            group_fd,
+            0 as c_ulong,
+        )
+    };
+
+    if fd < 0 {
+        let err = std::io::Error::last_os_error();
+        return Err(match err.raw_os_error() {
+            Some(libc::EACCES) | Some(libc::EPERM) => Error::PermissionDenied(format!(
+                "Cannot attach to TID {}. Try: sudo sysctl kernel.perf_event_paranoid=1",
+                tid
+            )),
+            Some(libc::ESRCH) => Error::ProcessNotFound(format!("TID {}", tid)),
+            // No PMU (common in VMs) or the event is not supported
+            Some(libc::ENOENT) | Some(libc::EOPNOTSUPP) if attr.type_ == PERF_TYPE_HARDWARE => {
+                Error::PerfEvent(format!("hardware counters unavailable: {}", err))
+            }
+            _ => Error::PerfEvent(format!("perf_event_open failed: {}", err)),
+        });
+    }
+
+    Ok(unsafe { OwnedFd::from_raw_fd(fd as c_int) })
+}
+
 /// Check /proc/sys/kernel/perf_event_paranoid
-fn check_perf_paranoid() -> Result<()> {
+pub fn check_perf_paranoid() -> Result<()> {
     let path = "/proc/sys/kernel/perf_event_paranoid";
     match fs::read_to_string(path) {
         Ok(content) => {
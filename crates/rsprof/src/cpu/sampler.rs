@@ -1,33 +1,410 @@
-use super::perf::PerfEvent;
-use crate::error::Result;
+use super::perf::{self, EventKind, PerfEvent, PerfRecord, PmuCounters, StackMode};
+use crate::cli::Unwind;
+use crate::error::{Error, Result};
+use crate::process::{self, ProcessInfo};
+use crate::symbols::Unwinder;
+use std::collections::{HashMap, HashSet};
+use std::os::unix::io::{AsRawFd, FromRawFd, OwnedFd};
+use std::time::{Duration, Instant};
+
+/// How often /proc/[pid]/task is rescanned for threads spawned after attach
+const THREAD_RESCAN_INTERVAL: Duration = Duration::from_millis(500);
+
+/// Maximum number of ready fds handled per epoll_wait call
+const MAX_READY_EVENTS: usize = 256;
+
+/// Unique stacks kept between reads; idle ones are pruned past this
+const MAX_TRACKED_STACKS: usize = 1 << 16;
+
+/// Default perf ring buffer size per thread, in pages
+pub const DEFAULT_RING_PAGES: usize = 64;
 
 /// CPU sampler that reads perf_event samples
+///
+/// Samples on-CPU time, or in off-CPU mode, the time threads spend blocked
+/// (switched out until they next run). In hardware mode the on-CPU samples
+/// also carry cycle, instruction and miss counts. With `Unwind::Dwarf` the
+/// kernel copies each sample's stack and it is unwound here with CFI.
 pub struct CpuSampler {
-    /// Per-thread perf events
-    events: Vec<PerfEvent>,
+    pid: u32,
+    kind: EventKind,
+    ring_pages: usize,
+    /// Unwinds copied stacks; None when the kernel walks frame pointers
+    unwinder: Option<Unwinder>,
+    /// Per-thread perf events, keyed by TID
+    events: HashMap<u32, PerfEvent>,
+    /// Epoll set holding every event fd, so a read only touches threads with data
+    epoll: OwnedFd,
+    /// Scratch buffer for epoll_wait results
+    ready: Vec<libc::epoll_event>,
+    last_rescan: Instant,
+    /// Per-stack counts decoded from the rings
+    counts: StackCounts,
+    /// Lost samples from events that have since been closed
+    retired_lost: u64,
+    /// Lost samples already handed out by `take_lost_samples`
+    reported_lost: u64,
 }
 
 impl CpuSampler {
     /// Create a new CPU sampler for all threads of a process
-    pub fn new(pid: u32, freq: u64) -> Result<Self> {
-        // For now, just sample the main thread
-        // TODO: Sample all threads by enumerating /proc/[pid]/task/
-        let event = PerfEvent::open(pid as i32, freq)?;
+    ///
+    /// `ring_pages` is the per-thread ring buffer size and must be a power of two.
+    pub fn new(pid: u32, freq: u64, ring_pages: usize, unwind: Unwind) -> Result<Self> {
+        Self::open(pid, EventKind::CpuClock { freq }, ring_pages, unwind)
+    }
 
-        Ok(CpuSampler {
-            events: vec![event],
-        })
+    /// Create an off-CPU sampler: `take_samples` reports nanoseconds blocked
+    /// per stack instead of sample counts
+    ///
+    /// Context switches are kernel events, so this needs
+    /// perf_event_paranoid <= 1 (or CAP_PERFMON).
+    pub fn off_cpu(pid: u32, ring_pages: usize, unwind: Unwind) -> Result<Self> {
+        Self::open(pid, EventKind::ContextSwitches, ring_pages, unwind)
     }
 
-    /// Read all available samples from all threads
-    pub fn read_samples(&mut self) -> Result<Vec<u64>> {
-        let mut all_samples = Vec::new();
+    /// Create a CPU sampler on the cycles PMU event, reading instruction and
+    /// miss counters with each sample (see `take_counters`)
+    ///
+    /// Fails where the CPU exposes no hardware counters, e.g. in most VMs.
+    pub fn hardware(pid: u32, freq: u64, ring_pages: usize, unwind: Unwind) -> Result<Self> {
+        Self::open(pid, EventKind::Hardware { freq }, ring_pages, unwind)
+    }
+
+    fn open(pid: u32, kind: EventKind, ring_pages: usize, unwind: Unwind) -> Result<Self> {
+        if !ring_pages.is_power_of_two() {
+            return Err(Error::InvalidArgument(format!(
+                "perf ring size must be a power of two, got {} pages",
+                ring_pages
+            )));
+        }
+
+        perf::check_perf_paranoid()?;
+
+        let epfd = unsafe { libc::epoll_create1(libc::EPOLL_CLOEXEC) };
+        if epfd < 0 {
+            return Err(Error::PerfEvent(format!(
+                "epoll_create1 failed: {}",
+                std::io::Error::last_os_error()
+            )));
+        }
+
+        let unwinder = match unwind {
+            Unwind::Fp => None,
+            Unwind::Dwarf => Some(Unwinder::new(&ProcessInfo::new(pid)?)),
+        };
+
+        let mut sampler = CpuSampler {
+            pid,
+            kind,
+            ring_pages,
+            unwinder,
+            events: HashMap::new(),
+            epoll: unsafe { OwnedFd::from_raw_fd(epfd) },
+            ready: vec![libc::epoll_event { events: 0, u64: 0 }; MAX_READY_EVENTS],
+            last_rescan: Instant::now(),
+            counts: StackCounts::default(),
+            retired_lost: 0,
+            reported_lost: 0,
+        };
+
+        for tid in process::thread_ids(pid)? {
+            match sampler.add_thread(tid) {
+                Ok(()) => {}
+                // Thread exited between listing and opening
+                Err(Error::ProcessNotFound(_)) => {}
+                Err(e) => return Err(e),
+            }
+        }
+
+        if sampler.events.is_empty() {
+            return Err(Error::ProcessNotFound(format!("PID {}", pid)));
+        }
+
+        Ok(sampler)
+    }
+
+    /// The sampled process
+    pub fn pid(&self) -> u32 {
+        self.pid
+    }
+
+    /// Number of threads currently being sampled
+    pub fn thread_count(&self) -> usize {
+        self.events.len()
+    }
+
+    /// Wait up to `timeout` for any ring to cross its watermark, then drain
+    /// the rings that did. Pass `Duration::ZERO` to never block.
+    pub fn poll(&mut self, timeout: Duration) -> Result<()> {
+        if self.last_rescan.elapsed() >= THREAD_RESCAN_INTERVAL {
+            self.rescan_threads();
+        }
+
+        let n = unsafe {
+            libc::epoll_wait(
+                self.epoll.as_raw_fd(),
+                self.ready.as_mut_ptr(),
+                self.ready.len() as libc::c_int,
+                timeout.as_millis().min(libc::c_int::MAX as u128) as libc::c_int,
+            )
+        };
+        if n < 0 {
+            let err = std::io::Error::last_os_error();
+            if err.raw_os_error() == Some(libc::EINTR) {
+                return Ok(());
+            }
+            return Err(Error::PerfEvent(format!("epoll_wait failed: {}", err)));
+        }
+
+        for i in 0..n as usize {
+            let ready = self.ready[i];
+            let tid = ready.u64 as u32;
+
+            if let Some(event) = self.events.get_mut(&tid) {
+                self.counts.drain(event, self.unwinder.as_mut());
+            }
+
+            // The kernel reports HUP once the thread has exited; its buffer
+            // was drained above so the event can go
+            if ready.events & libc::EPOLLHUP as u32 != 0 {
+                self.remove_thread(tid);
+            }
+        }
+
+        Ok(())
+    }
 
-        for event in &mut self.events {
-            let samples = event.read_samples();
-            all_samples.extend(samples);
+    /// Drain every ring, including those still below the watermark
+    ///
+    /// Call before a checkpoint so it sees all samples taken so far.
+    pub fn drain_all(&mut self) {
+        for event in self.events.values_mut() {
+            self.counts.drain(event, self.unwinder.as_mut());
         }
+    }
+
+    /// Take the samples collected since the last call as (count, tid, stack hash, stack)
+    ///
+    /// Same attribution input as `ShmHeapSampler::read_cpu_stats`, so callers
+    /// can run the same user-frame logic over both. For an off-CPU sampler the
+    /// count is nanoseconds blocked, charged when the thread runs again.
+    pub fn take_samples(&mut self) -> impl Iterator<Item = (u64, u32, u64, &[u64])> {
+        if self.counts.stacks.len() > MAX_TRACKED_STACKS {
+            // A switched-out thread's stack is charged at SwitchIn, so its
+            // entry stays even while empty
+            let blocked = &self.counts.blocked;
+            self.counts.stacks.retain(|&(tid, hash), entry| {
+                entry.count > 0
+                    || !entry.counters.is_zero()
+                    || blocked
+                        .get(&tid)
+                        .is_some_and(|&(_, blocked_hash)| blocked_hash == hash)
+            });
+        }
+
+        self.counts
+            .stacks
+            .iter_mut()
+            .filter_map(|(&(tid, hash), entry)| {
+                if entry.count == 0 {
+                    return None;
+                }
+                Some((
+                    std::mem::take(&mut entry.count),
+                    tid,
+                    hash,
+                    entry.stack.as_slice(),
+                ))
+            })
+    }
+
+    /// Take the hardware counts collected since the last call as
+    /// (counters, stack hash, stack); empty unless this is a hardware sampler
+    ///
+    /// Each sample is charged the counts since the thread's previous sample.
+    pub fn take_counters(&mut self) -> impl Iterator<Item = (PmuCounters, u64, &[u64])> {
+        self.counts
+            .stacks
+            .iter_mut()
+            .filter_map(|(&(_, hash), entry)| {
+                if entry.counters.is_zero() {
+                    return None;
+                }
+                Some((
+                    std::mem::take(&mut entry.counters),
+                    hash,
+                    entry.stack.as_slice(),
+                ))
+            })
+    }
+
+    /// Samples the kernel dropped since the last call (ring buffer overflow)
+    pub fn take_lost_samples(&mut self) -> u64 {
+        let total = self.retired_lost + self.events.values().map(PerfEvent::lost).sum::<u64>();
+        let delta = total - self.reported_lost;
+        self.reported_lost = total;
+        delta
+    }
+
+    /// Open an event for a thread and register it with the epoll set
+    fn add_thread(&mut self, tid: u32) -> Result<()> {
+        let stack_mode = if self.unwinder.is_some() {
+            StackMode::UserStack
+        } else {
+            StackMode::Callchain
+        };
+        let event = PerfEvent::open(tid as i32, self.kind, stack_mode, self.ring_pages)?;
+
+        let mut ev = libc::epoll_event {
+            events: libc::EPOLLIN as u32,
+            u64: tid as u64,
+        };
+        let ret = unsafe {
+            libc::epoll_ctl(
+                self.epoll.as_raw_fd(),
+                libc::EPOLL_CTL_ADD,
+                event.as_raw_fd(),
+                &mut ev,
+            )
+        };
+        if ret < 0 {
+            return Err(Error::PerfEvent(format!(
+                "epoll_ctl failed for TID {}: {}",
+                tid,
+                std::io::Error::last_os_error()
+            )));
+        }
+
+        self.events.insert(tid, event);
+        Ok(())
+    }
+
+    /// Deregister and close a thread's event
+    fn remove_thread(&mut self, tid: u32) {
+        self.counts.blocked.remove(&tid);
+        self.counts.last_counters.remove(&tid);
+        if let Some(event) = self.events.remove(&tid) {
+            self.retired_lost += event.lost();
+            unsafe {
+                libc::epoll_ctl(
+                    self.epoll.as_raw_fd(),
+                    libc::EPOLL_CTL_DEL,
+                    event.as_raw_fd(),
+                    std::ptr::null_mut(),
+                );
+            }
+        }
+    }
+
+    /// Pick up new threads and drop any that exited without a HUP
+    fn rescan_threads(&mut self) {
+        self.last_rescan = Instant::now();
+
+        // The process may be exiting; keep what we have and let HUPs clean up
+        let Ok(tids) = process::thread_ids(self.pid) else {
+            return;
+        };
+        let tids: HashSet<u32> = tids.into_iter().collect();
+
+        for &tid in &tids {
+            if !self.events.contains_key(&tid) {
+                // Best effort: short-lived threads may be gone already
+                let _ = self.add_thread(tid);
+            }
+        }
+
+        let stale: Vec<u32> = self
+            .events
+            .keys()
+            .copied()
+            .filter(|tid| !tids.contains(tid))
+            .collect();
+        for tid in stale {
+            if let Some(event) = self.events.get_mut(&tid) {
+                self.counts.drain(event, self.unwinder.as_mut());
+            }
+            self.remove_thread(tid);
+        }
+    }
+}
+
+/// A stack's counts since they were last taken
+struct StackEntry {
+    count: u64,
+    /// Hardware mode only
+    counters: PmuCounters,
+    stack: Vec<u64>,
+}
+
+/// Per-stack totals decoded from the rings
+#[derive(Default)]
+struct StackCounts {
+    /// Per-thread, per-stack counts since the last `take_samples`, keyed by
+    /// (tid, stack hash)
+    ///
+    /// Entries are kept (with a zero count) after being taken so a stack seen
+    /// again does not allocate.
+    stacks: HashMap<(u32, u64), StackEntry>,
+    /// Off-CPU only: threads switched out, as tid -> (time, stack hash)
+    blocked: HashMap<u32, (u64, u64)>,
+    /// Hardware only: each thread's counter totals at its last sample
+    last_counters: HashMap<u32, PmuCounters>,
+    /// Reused for each unwound stack
+    frames: Vec<u64>,
+}
+
+impl StackCounts {
+    /// Drain an event's ring buffer into the per-stack counts, unwinding
+    /// copied stacks with `unwinder`
+    fn drain(&mut self, event: &mut PerfEvent, mut unwinder: Option<&mut Unwinder>) {
+        let off_cpu = event.kind() == EventKind::ContextSwitches;
+        event.read_records(|record| match record {
+            PerfRecord::Sample(sample) => {
+                let stack = match (&sample.user, unwinder.as_deref_mut()) {
+                    (Some(user), Some(unwinder)) => {
+                        unwinder.unwind(user.regs, user.bytes, &mut self.frames);
+                        &self.frames
+                    }
+                    _ => sample.stack,
+                };
+                let hash = stack_hash(stack);
+                let entry = self
+                    .stacks
+                    .entry((sample.tid, hash))
+                    .or_insert_with(|| StackEntry {
+                        count: 0,
+                        counters: PmuCounters::default(),
+                        stack: stack.to_vec(),
+                    });
+                if off_cpu {
+                    // Charged once the thread is switched back in
+                    self.blocked.insert(sample.tid, (sample.time, hash));
+                } else {
+                    entry.count += 1;
+                }
+                if let Some(totals) = sample.counters {
+                    let last = self.last_counters.insert(sample.tid, totals);
+                    entry.counters.add(&totals.since(&last.unwrap_or_default()));
+                }
+            }
+            PerfRecord::SwitchIn { tid, time } => {
+                if let Some((since, hash)) = self.blocked.remove(&tid)
+                    && let Some(entry) = self.stacks.get_mut(&(tid, hash))
+                {
+                    entry.count += time.saturating_sub(since);
+                }
+            }
+        });
+    }
+}
 
-        Ok(all_samples)
+/// FNV-1a over the stack addresses
+fn stack_hash(stack: &[u64]) -> u64 {
+    let mut hash: u64 = 0xcbf2_9ce4_8422_2325;
+    for &addr in stack {
+        hash ^= addr;
+        hash = hash.wrapping_mul(0x0000_0100_0000_01b3);
     }
+    hash
 }
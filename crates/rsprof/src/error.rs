@@ -34,6 +34,9 @@ pub enum Error {
 
     #[error("Unsupported platform: {0}")]
     UnsupportedPlatform(String),
+
+    #[error("Performance regression: {0}")]
+    Regression(String),
 }
 
 pub type Result<T> = std::result::Result<T, Error>;
@@ -47,6 +50,7 @@ pub mod exit_code {
     pub const PERMISSION_DENIED: i32 = 4;
     pub const MISSING_DEBUG_INFO: i32 = 5;
     pub const DATABASE_ERROR: i32 = 6;
+    pub const REGRESSION: i32 = 7;
 }
 
 impl Error {
@@ -59,6 +63,7 @@ impl Error {
             Error::MissingDebugInfo { .. } => exit_code::MISSING_DEBUG_INFO,
             Error::Database(_) => exit_code::DATABASE_ERROR,
             Error::InvalidArgument(_) => exit_code::INVALID_ARGUMENTS,
+            Error::Regression(_) => exit_code::REGRESSION,
             _ => exit_code::GENERAL_ERROR,
         }
     }
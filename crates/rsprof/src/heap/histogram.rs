@@ -0,0 +1,139 @@
+//! Allocation size and lifetime histograms per callsite, and the churn
+//! ranking built on them: sites allocating at a high rate, freeing soon and
+//! staying in one size band are the ones an arena or object pool pays off for.
+
+/// Buckets per histogram (must match rsprof-trace)
+pub const HISTOGRAM_BUCKETS: usize = 24;
+
+/// Lifetime ticks are nanoseconds >> this (must match rsprof-trace)
+const LIFETIME_SHIFT: u32 = 10;
+
+/// Lifetimes under this count as short (about 1ms, a lifetime bucket edge)
+pub const SHORT_LIVED_NS: u64 = 1 << 20;
+
+/// Log2-bucketed histograms of one callsite or location
+///
+/// The last bucket of each is open-ended. In sampled mode these count the
+/// sampled allocations only; the shares are what the churn ranking uses.
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct HeapHistogram {
+    /// Allocations by size: bucket `b` holds `[2^b, 2^(b+1))` bytes
+    pub size: [u64; HISTOGRAM_BUCKETS],
+    /// Frees by lifetime: see `lifetime_bounds_ns`
+    pub lifetime: [u64; HISTOGRAM_BUCKETS],
+}
+
+/// Byte range `[low, high)` of a size bucket
+pub fn size_bounds(bucket: usize) -> (u64, u64) {
+    let low = if bucket == 0 { 0 } else { 1 << bucket };
+    (low, 1 << (bucket + 1))
+}
+
+/// Nanosecond range `[low, high)` of a lifetime bucket
+pub fn lifetime_bounds_ns(bucket: usize) -> (u64, u64) {
+    let low = if bucket == 0 {
+        0
+    } else {
+        1 << (bucket - 1 + LIFETIME_SHIFT as usize)
+    };
+    (low, 1 << (bucket + LIFETIME_SHIFT as usize))
+}
+
+impl HeapHistogram {
+    /// Sum in another callsite's counts
+    pub fn add(&mut self, other: &HeapHistogram) {
+        for (total, count) in self.size.iter_mut().zip(other.size) {
+            *total += count;
+        }
+        for (total, count) in self.lifetime.iter_mut().zip(other.lifetime) {
+            *total += count;
+        }
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.size
+            .iter()
+            .chain(&self.lifetime)
+            .all(|&count| count == 0)
+    }
+
+    /// Lower bound of the lifetime bucket holding the median free, or None
+    /// without frees
+    pub fn median_lifetime_ns(&self) -> Option<u64> {
+        let total: u64 = self.lifetime.iter().sum();
+        let mut seen = 0;
+        for (bucket, &count) in self.lifetime.iter().enumerate() {
+            seen += count;
+            if count > 0 && seen * 2 >= total {
+                return Some(lifetime_bounds_ns(bucket).0);
+            }
+        }
+        None
+    }
+
+    /// Most common size bucket and its share of allocations (0..=1)
+    pub fn modal_size(&self) -> Option<(usize, f64)> {
+        let total: u64 = self.size.iter().sum();
+        let (bucket, &count) = self
+            .size
+            .iter()
+            .enumerate()
+            .max_by_key(|&(bucket, &count)| (count, std::cmp::Reverse(bucket)))?;
+        (total > 0).then(|| (bucket, count as f64 / total as f64))
+    }
+
+    /// Share of frees (0..=1) in buckets that end at or below `SHORT_LIVED_NS`
+    pub fn short_lived_share(&self) -> f64 {
+        let total: u64 = self.lifetime.iter().sum();
+        if total == 0 {
+            return 0.0;
+        }
+        let short: u64 = self
+            .lifetime
+            .iter()
+            .enumerate()
+            .filter(|&(bucket, _)| lifetime_bounds_ns(bucket).1 <= SHORT_LIVED_NS)
+            .map(|(_, &count)| count)
+            .sum();
+        short as f64 / total as f64
+    }
+
+    /// Churn summary for a site allocating `alloc_count` blocks in `secs`,
+    /// or None if it never freed anything
+    pub fn churn(&self, alloc_count: u64, secs: f64) -> Option<ChurnStats> {
+        let median_lifetime_ns = self.median_lifetime_ns()?;
+        let (size_bucket, size_band_share) = self.modal_size()?;
+        let alloc_rate = if secs > 0.0 {
+            alloc_count as f64 / secs
+        } else {
+            0.0
+        };
+        let short_lived_share = self.short_lived_share();
+        Some(ChurnStats {
+            alloc_rate,
+            median_lifetime_ns,
+            short_lived_share,
+            size_band: size_bounds(size_bucket),
+            size_band_share,
+            score: alloc_rate * short_lived_share * size_band_share,
+        })
+    }
+}
+
+/// How much a site churns, from its histograms
+#[derive(Debug, Clone, Copy, Default)]
+pub struct ChurnStats {
+    /// Allocations per second over the recording
+    pub alloc_rate: f64,
+    /// Lower bound of the median free's lifetime bucket
+    pub median_lifetime_ns: u64,
+    /// Share of frees under `SHORT_LIVED_NS` (0..=1)
+    pub short_lived_share: f64,
+    /// Byte range of the most common size bucket
+    pub size_band: (u64, u64),
+    /// Share of allocations in that band (0..=1)
+    pub size_band_share: f64,
+    /// Short-lived allocations per second in the band: the rate a pool of
+    /// band-sized buffers would absorb
+    pub score: f64,
+}
@@ -10,5 +10,13 @@
 // Shared memory sampler (always available) - reads from rsprof-trace
 mod shm_sampler;
 pub use shm_sampler::{
-    CpuSample, HeapStats as ShmHeapStats, ShmHeapSampler, TraceEvent, TraceEventType,
+    CpuSample, HeapStats as ShmHeapStats, ShmHeapSampler, ShmOverflow, TraceEvent, TraceEventType,
 };
+
+pub mod histogram;
+pub use histogram::{ChurnStats, HeapHistogram};
+
+mod shm_unwind;
+
+mod targets;
+pub use targets::{ShmTarget, ShmTargets, callsite_key};
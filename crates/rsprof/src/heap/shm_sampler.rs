@@ -3,6 +3,7 @@
 //! This reader reads pre-aggregated CPU and heap stats from shared memory
 //! populated by the rsprof-trace crate. No event processing needed.
 
+use super::histogram::{HISTOGRAM_BUCKETS, HeapHistogram};
 use crate::error::{Error, Result};
 use std::collections::HashMap;
 use std::path::Path;
@@ -11,14 +12,21 @@ use std::sync::atomic::{AtomicU32, AtomicU64, Ordering};
 /// Maximum stack depth (must match rsprof-trace)
 const MAX_STACK_DEPTH: usize = 64;
 
-/// Callsite table capacity (must match rsprof-trace)
-const CALLSITE_CAPACITY: usize = 8192;
+/// Shared memory name prefix; rsprof-trace appends the target's pid
+/// (must match rsprof-trace)
+const SHM_PREFIX: &str = "/rsprof-trace-";
 
-/// Shared memory path (must match rsprof-trace)
-const SHM_PATH: &str = "/rsprof-trace";
+/// Most counter shards a segment has (must match rsprof-trace)
+const MAX_COUNTER_SHARDS: u32 = 32;
 
-/// Magic number for validation (must match rsprof-trace v3)
-const MAGIC: u64 = 0x5253_5052_4F46_5333; // "RSPROFS3"
+/// Most histogram shards a segment has (must match rsprof-trace)
+const MAX_HISTOGRAM_SHARDS: u32 = 8;
+
+/// Magic number for validation (must match rsprof-trace)
+const MAGIC: u64 = 0x5253_5052_4F46_5341; // "RSPROFSA"
+
+/// Layout version (must match rsprof-trace v12)
+const VERSION: u32 = 12;
 
 /// Shared memory header (must match rsprof-trace)
 #[repr(C)]
@@ -28,20 +36,154 @@ struct StatsHeader {
     callsite_capacity: u32,
     alloc_table_capacity: u32,
     pid: u32,
+    counter_shards: u32,
+    table_segments: u32,
+    heap_sample_bytes: u64,
+    callsite_segments: AtomicU32,
+    alloc_segments: AtomicU32,
+    callsite_overflow: AtomicU64,
+    alloc_dropped: AtomicU64,
+    stack_node_capacity: u32,
+    stack_segments: AtomicU32,
+    stack_overflow: AtomicU64,
+    histogram_shards: u32,
+    histogram_buckets: u32,
+    pid_ns: u64,
+    start_time: u64,
 }
 
 /// Callsite stats (must match rsprof-trace)
 #[repr(C)]
 struct ShmCallsiteStats {
     hash: AtomicU64,
+    stack: AtomicU64,
+    tid: AtomicU32,
+    _reserved: u32,
+}
+
+/// Set in `ShmCallsiteStats::stack` once published (must match rsprof-trace)
+const STACK_PUBLISHED: u64 = 1 << 63;
+
+/// Stack store node (must match rsprof-trace)
+#[repr(C)]
+struct ShmStackNode {
+    addr: AtomicU64,
+    parent: AtomicU32,
+    _state: AtomicU32,
+}
+
+/// One shard of a callsite's counters (must match rsprof-trace)
+#[repr(C, align(64))]
+struct ShmCallsiteCounters {
     alloc_count: AtomicU64,
     alloc_bytes: AtomicU64,
     free_count: AtomicU64,
     free_bytes: AtomicU64,
     cpu_samples: AtomicU64,
-    stack_depth: AtomicU32,
-    _reserved: u32,
-    stack: [AtomicU64; MAX_STACK_DEPTH],
+}
+
+/// One shard of a callsite's allocation histograms (must match rsprof-trace)
+#[repr(C, align(64))]
+struct ShmCallsiteHistogram {
+    size: [AtomicU64; HISTOGRAM_BUCKETS],
+    lifetime: [AtomicU64; HISTOGRAM_BUCKETS],
+}
+
+/// Alloc table entry; only its size matters here (must match rsprof-trace)
+#[repr(C)]
+struct ShmAllocEntry {
+    _ptr: u64,
+    _size: u64,
+    _callsite: u64,
+    _born: u64,
+}
+
+/// Region offsets of the mapping, derived from the header (must match rsprof-trace)
+struct ShmLayout {
+    callsite_capacity: usize,
+    /// Callsite slots across all segments
+    callsite_slots: usize,
+    dirty_offset: usize,
+    callsites_offset: usize,
+    stack_nodes_offset: usize,
+    /// Stack nodes across all segments
+    stack_node_slots: usize,
+    counter_shards: usize,
+    histogram_shards: usize,
+    counters_offset: usize,
+    histograms_offset: usize,
+    total_size: usize,
+}
+
+impl ShmLayout {
+    fn new(
+        callsite_capacity: usize,
+        alloc_capacity: usize,
+        stack_node_capacity: usize,
+        segments: u32,
+        counter_shards: usize,
+        histogram_shards: usize,
+    ) -> Self {
+        let callsite_slots = segment_start(callsite_capacity, segments);
+        let alloc_slots = segment_start(alloc_capacity, segments);
+        let stack_node_slots = segment_start(stack_node_capacity, segments);
+        let dirty_offset = std::mem::size_of::<StatsHeader>();
+        let callsites_offset = dirty_offset + callsite_slots / 64 * 8;
+        let alloc_table_offset =
+            callsites_offset + callsite_slots * std::mem::size_of::<ShmCallsiteStats>();
+        let stack_nodes_offset =
+            alloc_table_offset + alloc_slots * std::mem::size_of::<ShmAllocEntry>();
+        let counters_offset = (stack_nodes_offset
+            + stack_node_slots * std::mem::size_of::<ShmStackNode>())
+        .next_multiple_of(64);
+        let histograms_offset = counters_offset
+            + counter_shards * callsite_slots * std::mem::size_of::<ShmCallsiteCounters>();
+        let total_size = histograms_offset
+            + histogram_shards * callsite_slots * std::mem::size_of::<ShmCallsiteHistogram>();
+        ShmLayout {
+            callsite_capacity,
+            callsite_slots,
+            dirty_offset,
+            callsites_offset,
+            stack_nodes_offset,
+            stack_node_slots,
+            counter_shards,
+            histogram_shards,
+            counters_offset,
+            histograms_offset,
+            total_size,
+        }
+    }
+}
+
+/// First slot of segment `seg` in a table whose first segment has `capacity` slots
+fn segment_start(capacity: usize, seg: u32) -> usize {
+    capacity * ((1 << seg) - 1)
+}
+
+/// Events rsprof-trace could not record because its tables were full
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct ShmOverflow {
+    /// Alloc/free/CPU events dropped because the callsite table was full
+    pub callsite_overflow: u64,
+    /// Allocations not tracked, so their frees are not attributed
+    pub alloc_dropped: u64,
+    /// Events dropped because the stack store was full
+    pub stack_overflow: u64,
+}
+
+impl ShmOverflow {
+    /// Total events affected
+    pub fn total(&self) -> u64 {
+        self.callsite_overflow + self.alloc_dropped + self.stack_overflow
+    }
+
+    /// Sum of two targets' counts
+    pub fn add(&mut self, other: &ShmOverflow) {
+        self.callsite_overflow += other.callsite_overflow;
+        self.alloc_dropped += other.alloc_dropped;
+        self.stack_overflow += other.stack_overflow;
+    }
 }
 
 /// Stats per callsite (public API)
@@ -52,6 +194,25 @@ pub struct HeapStats {
     pub total_frees: u64,
     pub total_alloc_bytes: u64,
     pub total_free_bytes: u64,
+    /// Size and lifetime histograms, unscaled in sampled mode
+    pub histogram: HeapHistogram,
+}
+
+/// Scale sampled (count, bytes) up to an unbiased estimate of the true totals
+///
+/// With exponential sampling intervals averaging `rate` bytes, an allocation
+/// of `s` bytes is sampled with probability `1 - exp(-s / rate)`. Sizes within
+/// a callsite are assumed to be close to their mean, as in Go's heap profiles.
+fn scale_heap_sample(count: u64, bytes: u64, rate: u64) -> (u64, u64) {
+    if count == 0 || bytes == 0 || rate <= 1 {
+        return (count, bytes);
+    }
+    let avg_size = bytes as f64 / count as f64;
+    let scale = 1.0 / (1.0 - (-avg_size / rate as f64).exp());
+    (
+        (count as f64 * scale).round() as u64,
+        (bytes as f64 * scale).round() as u64,
+    )
 }
 
 /// CPU sample data (for compatibility)
@@ -61,16 +222,20 @@ pub struct CpuSample {
     pub stack: Vec<u64>,
 }
 
-/// Snapshot of a callsite's stats
-#[derive(Debug, Clone)]
-pub struct CallsiteSnapshot {
-    pub hash: u64,
-    pub alloc_count: u64,
-    pub alloc_bytes: u64,
-    pub free_count: u64,
-    pub free_bytes: u64,
-    pub cpu_samples: u64,
-    pub stack: Vec<u64>,
+/// Reader-side copy of one callsite slot
+#[derive(Debug, Default)]
+struct CachedCallsite {
+    hash: u64,
+    heap: HeapStats,
+    cpu_samples: u64,
+    /// cpu_samples already returned by read_cpu_stats
+    cpu_reported: u64,
+    /// Queued in ShmHeapSampler::cpu_pending
+    cpu_pending: bool,
+    /// Copied once, when the writer has published it
+    stack: Vec<u64>,
+    /// Thread the CPU samples were taken on (0 for heap callsites)
+    tid: u32,
 }
 
 /// Event types for compatibility with existing code
@@ -96,11 +261,19 @@ pub struct ShmHeapSampler {
     /// Memory-mapped region
     mmap: *mut u8,
     mmap_size: usize,
+    layout: ShmLayout,
     /// Target PID
-    #[allow(dead_code)]
     target_pid: u32,
-    /// Previous CPU sample counts per callsite (for computing deltas)
-    prev_cpu_counts: HashMap<u64, u64>,
+    /// Callsites seen so far, keyed by slot index
+    callsites: HashMap<usize, CachedCallsite>,
+    /// Slots with CPU samples not yet returned by read_cpu_stats
+    cpu_pending: Vec<usize>,
+    /// Reused output buffer for read_cpu_stats: (delta, slot)
+    cpu_ready: Vec<(u64, usize)>,
+    /// Callsites with any heap activity
+    heap_sites: usize,
+    /// Mean bytes between sampled allocations (0 = unsampled)
+    heap_sample_bytes: u64,
 }
 
 // Safety: The mmap pointer is only accessed through &self or &mut self
@@ -110,16 +283,17 @@ unsafe impl Sync for ShmHeapSampler {}
 impl ShmHeapSampler {
     /// Create a new shared memory stats reader
     pub fn new(pid: u32, _exe_path: &Path) -> Result<Self> {
-        let shm_path = std::ffi::CString::new(SHM_PATH).unwrap();
+        let shm_name = format!("{}{}", SHM_PREFIX, pid);
+        let shm_path = std::ffi::CString::new(shm_name.as_str()).unwrap();
 
         unsafe {
-            // Open shared memory
-            let fd = libc::shm_open(shm_path.as_ptr(), libc::O_RDONLY, 0);
+            // Open shared memory (read-write: we clear the dirty bitmap)
+            let fd = libc::shm_open(shm_path.as_ptr(), libc::O_RDWR, 0);
 
             if fd < 0 {
                 return Err(Error::Sampler(format!(
                     "Failed to open shared memory '{}'. Is the target app using rsprof-trace with profiling feature?",
-                    SHM_PATH
+                    shm_name
                 )));
             }
 
@@ -135,7 +309,7 @@ impl ShmHeapSampler {
             let ptr = libc::mmap(
                 std::ptr::null_mut(),
                 buffer_size,
-                libc::PROT_READ,
+                libc::PROT_READ | libc::PROT_WRITE,
                 libc::MAP_SHARED,
                 fd,
                 0,
@@ -152,13 +326,51 @@ impl ShmHeapSampler {
             // Validate header
             let header = &*(mmap as *const StatsHeader);
 
-            if header.magic != MAGIC {
+            if buffer_size < std::mem::size_of::<StatsHeader>() || header.magic != MAGIC {
                 libc::munmap(ptr, buffer_size);
                 return Err(Error::Sampler(format!(
-                    "Invalid shared memory magic: expected 0x{:x}, got 0x{:x}. Make sure rsprof-trace is v3.",
+                    "Invalid shared memory magic: expected 0x{:x}, got 0x{:x}. Make sure rsprof-trace matches this rsprof version.",
                     MAGIC, header.magic
                 )));
             }
+            if header.version != VERSION {
+                let version = header.version;
+                libc::munmap(ptr, buffer_size);
+                return Err(Error::Sampler(format!(
+                    "Unsupported shared memory version {} (expected {}). Make sure rsprof-trace matches this rsprof version.",
+                    version, VERSION
+                )));
+            }
+
+            let valid_capacity = |c: u32| c >= 64 && c.is_power_of_two();
+            let layout = ShmLayout::new(
+                header.callsite_capacity as usize,
+                header.alloc_table_capacity as usize,
+                header.stack_node_capacity as usize,
+                header.table_segments,
+                header.counter_shards as usize,
+                header.histogram_shards as usize,
+            );
+            if !valid_capacity(header.callsite_capacity)
+                || !valid_capacity(header.alloc_table_capacity)
+                || !valid_capacity(header.stack_node_capacity)
+                || !(1..=16).contains(&header.table_segments)
+                || !(1..=MAX_COUNTER_SHARDS).contains(&header.counter_shards)
+                || !(1..=MAX_HISTOGRAM_SHARDS.min(header.counter_shards))
+                    .contains(&header.histogram_shards)
+                || header.histogram_buckets as usize != HISTOGRAM_BUCKETS
+                || buffer_size < layout.total_size
+            {
+                libc::munmap(ptr, buffer_size);
+                return Err(Error::Sampler(format!(
+                    "Unexpected shared memory layout (callsite capacity {}, alloc capacity {}, segments {}, shards {}, size {})",
+                    header.callsite_capacity,
+                    header.alloc_table_capacity,
+                    header.table_segments,
+                    header.counter_shards,
+                    buffer_size
+                )));
+            }
 
             if header.pid != pid {
                 eprintln!(
@@ -170,89 +382,186 @@ impl ShmHeapSampler {
             Ok(ShmHeapSampler {
                 mmap,
                 mmap_size: buffer_size,
+                layout,
                 target_pid: pid,
-                prev_cpu_counts: HashMap::new(),
+                callsites: HashMap::new(),
+                cpu_pending: Vec::new(),
+                cpu_ready: Vec::new(),
+                heap_sites: 0,
+                heap_sample_bytes: header.heap_sample_bytes,
             })
         }
     }
 
     /// Get pointer to callsites array
     unsafe fn get_callsites(&self) -> *const ShmCallsiteStats {
-        unsafe { self.mmap.add(std::mem::size_of::<StatsHeader>()) as *const ShmCallsiteStats }
+        unsafe { self.mmap.add(self.layout.callsites_offset) as *const ShmCallsiteStats }
     }
 
-    /// Read current snapshot of all callsites
-    pub fn read_snapshot(&self) -> Vec<CallsiteSnapshot> {
-        let mut result = Vec::new();
+    /// Get pointer to the counters of shard 0; shard `s` starts `s * callsite_slots` later
+    unsafe fn get_counters(&self) -> *const ShmCallsiteCounters {
+        unsafe { self.mmap.add(self.layout.counters_offset) as *const ShmCallsiteCounters }
+    }
 
-        unsafe {
-            let callsites = self.get_callsites();
+    /// Get pointer to the histograms of shard 0; shard `s` starts `s * callsite_slots` later
+    unsafe fn get_histograms(&self) -> *const ShmCallsiteHistogram {
+        unsafe { self.mmap.add(self.layout.histograms_offset) as *const ShmCallsiteHistogram }
+    }
 
-            for i in 0..CALLSITE_CAPACITY {
-                let entry = &*callsites.add(i);
-                let hash = entry.hash.load(Ordering::Acquire);
+    /// Dirty bitmap words covering the callsite segments currently in use
+    unsafe fn get_dirty(&self) -> *const [AtomicU64] {
+        unsafe {
+            let header = &*(self.mmap as *const StatsHeader);
+            let segments = header
+                .callsite_segments
+                .load(Ordering::Acquire)
+                .min(header.table_segments);
+            let slots = segment_start(self.layout.callsite_capacity, segments);
+            std::ptr::slice_from_raw_parts(
+                self.mmap.add(self.layout.dirty_offset) as *const AtomicU64,
+                slots / 64,
+            )
+        }
+    }
 
-                if hash == 0 {
-                    continue; // Empty slot
+    /// Rebuild a stack (innermost frame first) from the stack store
+    ///
+    /// Nodes are immutable once a callsite references them, so this follows
+    /// parent links without synchronization beyond the callsite's Acquire.
+    unsafe fn read_stack(mmap: *const u8, layout: &ShmLayout, mut id: u32, out: &mut Vec<u64>) {
+        unsafe {
+            let nodes = mmap.add(layout.stack_nodes_offset) as *const ShmStackNode;
+            while id != 0 && id as usize <= layout.stack_node_slots && out.len() < MAX_STACK_DEPTH {
+                let node = &*nodes.add(id as usize - 1);
+                let addr = node.addr.load(Ordering::Relaxed);
+                if addr != 0 {
+                    out.push(addr);
                 }
-
-                let stack_depth = entry.stack_depth.load(Ordering::Relaxed) as usize;
-                let stack: Vec<u64> = entry.stack[..stack_depth.min(MAX_STACK_DEPTH)]
-                    .iter()
-                    .map(|a| a.load(Ordering::Relaxed))
-                    .filter(|&addr| addr != 0)
-                    .collect();
-
-                result.push(CallsiteSnapshot {
-                    hash,
-                    alloc_count: entry.alloc_count.load(Ordering::Relaxed),
-                    alloc_bytes: entry.alloc_bytes.load(Ordering::Relaxed),
-                    free_count: entry.free_count.load(Ordering::Relaxed),
-                    free_bytes: entry.free_bytes.load(Ordering::Relaxed),
-                    cpu_samples: entry.cpu_samples.load(Ordering::Relaxed),
-                    stack,
-                });
+                id = node.parent.load(Ordering::Relaxed);
             }
         }
-
-        result
     }
 
-    /// Read current heap stats (compatible with old API)
-    pub fn read_stats(&self) -> HashMap<u64, HeapStats> {
-        let snapshot = self.read_snapshot();
-        let mut result = HashMap::new();
-
-        for cs in snapshot {
-            if cs.alloc_count > 0 || cs.free_count > 0 {
-                result.insert(
-                    cs.hash,
-                    HeapStats {
-                        live_bytes: cs.alloc_bytes as i64 - cs.free_bytes as i64,
-                        total_allocs: cs.alloc_count,
-                        total_frees: cs.free_count,
-                        total_alloc_bytes: cs.alloc_bytes,
-                        total_free_bytes: cs.free_bytes,
-                    },
-                );
+    /// Pull in callsites the target changed since the last call
+    ///
+    /// Only slots flagged in the header's dirty bitmap are visited, and a
+    /// slot's stack is copied once, the first time it is seen.
+    fn refresh(&mut self) {
+        unsafe {
+            let callsites = self.get_callsites();
+            let counters = self.get_counters();
+            let histograms = self.get_histograms();
+            let slots = self.layout.callsite_slots;
+
+            for (word_idx, word) in (*self.get_dirty()).iter().enumerate() {
+                // Cheap check first so idle words are never written
+                if word.load(Ordering::Relaxed) == 0 {
+                    continue;
+                }
+                let mut bits = word.swap(0, Ordering::SeqCst);
+
+                while bits != 0 {
+                    let slot = word_idx * 64 + bits.trailing_zeros() as usize;
+                    bits &= bits - 1;
+
+                    let entry = &*callsites.add(slot);
+                    let hash = entry.hash.load(Ordering::Acquire);
+                    if hash == 0 {
+                        continue;
+                    }
+
+                    let cached = self.callsites.entry(slot).or_default();
+                    cached.hash = hash;
+
+                    if cached.stack.is_empty() {
+                        let stack_ref = entry.stack.load(Ordering::Acquire);
+                        if stack_ref & STACK_PUBLISHED != 0 {
+                            cached.tid = entry.tid.load(Ordering::Relaxed);
+                            Self::read_stack(
+                                self.mmap,
+                                &self.layout,
+                                stack_ref as u32,
+                                &mut cached.stack,
+                            );
+                        }
+                    }
+
+                    // Merge the per-CPU shards
+                    let (mut alloc_count, mut alloc_bytes) = (0u64, 0u64);
+                    let (mut free_count, mut free_bytes) = (0u64, 0u64);
+                    let mut cpu_samples = 0u64;
+                    for shard in 0..self.layout.counter_shards {
+                        let c = &*counters.add(shard * slots + slot);
+                        alloc_count += c.alloc_count.load(Ordering::SeqCst);
+                        alloc_bytes += c.alloc_bytes.load(Ordering::SeqCst);
+                        free_count += c.free_count.load(Ordering::SeqCst);
+                        free_bytes += c.free_bytes.load(Ordering::SeqCst);
+                        cpu_samples += c.cpu_samples.load(Ordering::SeqCst);
+                    }
+
+                    let had_heap = cached.heap.total_allocs > 0 || cached.heap.total_frees > 0;
+                    let rate = self.heap_sample_bytes;
+                    let (alloc_count, alloc_bytes) =
+                        scale_heap_sample(alloc_count, alloc_bytes, rate);
+                    let (free_count, free_bytes) = scale_heap_sample(free_count, free_bytes, rate);
+
+                    // CPU-only callsites have nothing to merge
+                    let mut histogram = HeapHistogram::default();
+                    if alloc_count > 0 || free_count > 0 {
+                        for shard in 0..self.layout.histogram_shards {
+                            let h = &*histograms.add(shard * slots + slot);
+                            for bucket in 0..HISTOGRAM_BUCKETS {
+                                histogram.size[bucket] += h.size[bucket].load(Ordering::SeqCst);
+                                histogram.lifetime[bucket] +=
+                                    h.lifetime[bucket].load(Ordering::SeqCst);
+                            }
+                        }
+                    }
+
+                    cached.heap = HeapStats {
+                        live_bytes: alloc_bytes as i64 - free_bytes as i64,
+                        total_allocs: alloc_count,
+                        total_frees: free_count,
+                        total_alloc_bytes: alloc_bytes,
+                        total_free_bytes: free_bytes,
+                        histogram,
+                    };
+                    if !had_heap && (alloc_count > 0 || free_count > 0) {
+                        self.heap_sites += 1;
+                    }
+
+                    cached.cpu_samples = cpu_samples;
+                    if cpu_samples > cached.cpu_reported && !cached.cpu_pending {
+                        cached.cpu_pending = true;
+                        self.cpu_pending.push(slot);
+                    }
+                }
             }
         }
-
-        result
     }
 
-    /// Read inline stacks from callsites
-    pub fn read_inline_stacks(&self) -> HashMap<u64, Vec<u64>> {
-        let snapshot = self.read_snapshot();
-        let mut result = HashMap::new();
+    /// Read heap stats for every callsite with heap activity as
+    /// (slot, hash, stats, stack)
+    ///
+    /// Stats are cumulative since the target started. In sampled mode they are
+    /// scaled estimates rather than exact counts. A slot names one stack for
+    /// the life of the mapping, so callers can cache its attribution.
+    pub fn read_heap_stats(&mut self) -> impl Iterator<Item = (u64, u64, &HeapStats, &[u64])> {
+        self.refresh();
+        self.callsites
+            .iter()
+            .filter(|(_, cs)| cs.heap.total_allocs > 0 || cs.heap.total_frees > 0)
+            .map(|(&slot, cs)| (slot as u64, cs.hash, &cs.heap, cs.stack.as_slice()))
+    }
 
-        for cs in snapshot {
-            if !cs.stack.is_empty() {
-                result.insert(cs.hash, cs.stack);
-            }
-        }
+    /// Mean bytes between sampled allocations, or 0 if every allocation is recorded
+    pub fn heap_sample_bytes(&self) -> u64 {
+        self.heap_sample_bytes
+    }
 
-        result
+    /// Number of callsites with heap activity
+    pub fn heap_site_count(&self) -> usize {
+        self.heap_sites
     }
 
     /// Read CPU samples - returns snapshots with cpu_samples > 0
@@ -263,23 +572,27 @@ impl ShmHeapSampler {
         Vec::new()
     }
 
-    /// Read CPU stats per callsite (returns deltas since last read)
-    pub fn read_cpu_stats(&mut self) -> HashMap<u64, (u64, Vec<u64>)> {
-        let snapshot = self.read_snapshot();
-        let mut result = HashMap::new();
+    /// Read CPU stats per callsite as (sample delta since last read, tid, slot, stack)
+    pub fn read_cpu_stats(&mut self) -> impl Iterator<Item = (u64, u32, u64, &[u64])> {
+        self.refresh();
 
-        for cs in snapshot {
-            if cs.cpu_samples > 0 {
-                let prev = self.prev_cpu_counts.get(&cs.hash).copied().unwrap_or(0);
-                let delta = cs.cpu_samples.saturating_sub(prev);
+        self.cpu_ready.clear();
+        for slot in self.cpu_pending.drain(..) {
+            if let Some(cs) = self.callsites.get_mut(&slot) {
+                cs.cpu_pending = false;
+                let delta = cs.cpu_samples - cs.cpu_reported;
+                cs.cpu_reported = cs.cpu_samples;
                 if delta > 0 {
-                    result.insert(cs.hash, (delta, cs.stack));
+                    self.cpu_ready.push((delta, slot));
                 }
-                self.prev_cpu_counts.insert(cs.hash, cs.cpu_samples);
             }
         }
 
-        result
+        let callsites = &self.callsites;
+        self.cpu_ready.iter().map(move |&(delta, slot)| {
+            let cs = &callsites[&slot];
+            (delta, cs.tid, slot as u64, cs.stack.as_slice())
+        })
     }
 
     /// Poll events - for compatibility, computes deltas from snapshots
@@ -289,6 +602,80 @@ impl ShmHeapSampler {
         Vec::new()
     }
 
+    /// Events the target dropped because its tables were full
+    pub fn overflow(&self) -> ShmOverflow {
+        unsafe {
+            let header = &*(self.mmap as *const StatsHeader);
+            ShmOverflow {
+                callsite_overflow: header.callsite_overflow.load(Ordering::Relaxed),
+                alloc_dropped: header.alloc_dropped.load(Ordering::Relaxed),
+                stack_overflow: header.stack_overflow.load(Ordering::Relaxed),
+            }
+        }
+    }
+
+    /// The process this sampler reads
+    pub fn pid(&self) -> u32 {
+        self.target_pid
+    }
+
+    /// Unlink the shared memory of an exited target; existing mappings stay valid
+    pub fn remove_segment(pid: u32) {
+        if let Ok(name) = std::ffi::CString::new(format!("{}{}", SHM_PREFIX, pid)) {
+            unsafe { libc::shm_unlink(name.as_ptr()) };
+        }
+    }
+
+    /// Unlink the segments (and unwind tables) of processes that exited
+    /// without a recording reading them
+    ///
+    /// Only segments created in rsprof's own pid namespace are judged: in
+    /// another one, as with containers sharing /dev/shm, their pid names a
+    /// different process. Segments of older layouts are left alone.
+    pub fn remove_stale_segments() {
+        use std::io::Read;
+        use std::os::unix::fs::MetadataExt;
+
+        let Ok(own_ns) = std::fs::metadata("/proc/self/ns/pid").map(|m| m.ino()) else {
+            return;
+        };
+        let Ok(entries) = std::fs::read_dir("/dev/shm") else {
+            return;
+        };
+        for entry in entries.flatten() {
+            let Some(pid) = entry
+                .file_name()
+                .to_str()
+                .and_then(|name| name.strip_prefix(&SHM_PREFIX[1..]))
+                .and_then(|pid| pid.parse::<u32>().ok())
+            else {
+                continue;
+            };
+            let mut bytes = [0u8; std::mem::size_of::<StatsHeader>()];
+            if std::fs::File::open(entry.path())
+                .and_then(|mut file| file.read_exact(&mut bytes))
+                .is_err()
+            {
+                continue;
+            }
+            // Safety: plain integers and atomics, valid for any bit pattern
+            let header = unsafe { std::ptr::read_unaligned(bytes.as_ptr() as *const StatsHeader) };
+            if header.magic != MAGIC
+                || header.version != VERSION
+                || header.pid != pid
+                || header.pid_ns != own_ns
+            {
+                continue;
+            }
+            let alive = crate::process::start_time(pid)
+                .is_some_and(|start_time| start_time == header.start_time);
+            if !alive {
+                Self::remove_segment(pid);
+                super::shm_unwind::remove_unwind_table(pid);
+            }
+        }
+    }
+
     /// Get the target PID from shared memory
     pub fn shm_pid(&self) -> u32 {
         unsafe {
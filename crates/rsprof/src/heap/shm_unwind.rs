@@ -0,0 +1,117 @@
+//! Unwind tables shared with rsprof-trace targets.
+//!
+//! With `--unwind dwarf`, each attached process gets the CFI rows of every
+//! object it has mapped, at their runtime addresses, in a second shared
+//! memory object. rsprof-trace maps it once it appears and walks its stacks
+//! with it instead of frame pointers. The magic is written last, so a
+//! target never maps a half-written table.
+
+use crate::error::{Error, Result};
+use crate::symbols::UnwindRow;
+use std::sync::atomic::{AtomicU64, Ordering};
+
+/// Shared memory name prefix; the target's pid is appended
+/// (must match rsprof-trace)
+const SHM_PREFIX: &str = "/rsprof-unwind-";
+
+/// Magic number for validation (must match rsprof-trace v1)
+const MAGIC: u64 = 0x5253_5052_4F46_5557; // "RSPROFUW"
+
+const VERSION: u32 = 1;
+
+/// Unwind table header, followed by the rows (must match rsprof-trace)
+#[repr(C)]
+struct UnwindHeader {
+    magic: AtomicU64,
+    version: u32,
+    _reserved: u32,
+    rows: u64,
+}
+
+/// One row, as `UnwindRow` (must match rsprof-trace)
+#[repr(C)]
+struct ShmUnwindRow {
+    start: u64,
+    cfa_offset: i32,
+    cfa: u8,
+    rbp_slot: i8,
+    ra_slot: i8,
+    _reserved: u8,
+}
+
+/// Share `rows`, sorted by runtime address, with process `pid`, replacing
+/// any table it was sent before
+///
+/// A target that already mapped a table keeps using it.
+pub fn publish_unwind_table(pid: u32, rows: &[UnwindRow]) -> Result<()> {
+    let name = std::ffi::CString::new(format!("{}{}", SHM_PREFIX, pid)).unwrap();
+    let total =
+        std::mem::size_of::<UnwindHeader>() + rows.len() * std::mem::size_of::<ShmUnwindRow>();
+
+    unsafe {
+        libc::shm_unlink(name.as_ptr());
+        let fd = libc::shm_open(
+            name.as_ptr(),
+            libc::O_CREAT | libc::O_EXCL | libc::O_RDWR,
+            0o644,
+        );
+        if fd < 0 {
+            return Err(Error::Sampler(format!(
+                "Failed to create unwind table shared memory: {}",
+                std::io::Error::last_os_error()
+            )));
+        }
+        // Readable by a target running as another user, whatever the umask
+        if libc::fchmod(fd, 0o644) < 0 || libc::ftruncate(fd, total as libc::off_t) < 0 {
+            let err = std::io::Error::last_os_error();
+            libc::close(fd);
+            libc::shm_unlink(name.as_ptr());
+            return Err(Error::Sampler(format!(
+                "Failed to size unwind table shared memory: {}",
+                err
+            )));
+        }
+        let ptr = libc::mmap(
+            std::ptr::null_mut(),
+            total,
+            libc::PROT_READ | libc::PROT_WRITE,
+            libc::MAP_SHARED,
+            fd,
+            0,
+        );
+        libc::close(fd);
+        if ptr == libc::MAP_FAILED {
+            libc::shm_unlink(name.as_ptr());
+            return Err(Error::Sampler(format!(
+                "Failed to map unwind table shared memory: {}",
+                std::io::Error::last_os_error()
+            )));
+        }
+
+        let header = ptr as *mut UnwindHeader;
+        let out = header.add(1) as *mut ShmUnwindRow;
+        for (i, row) in rows.iter().enumerate() {
+            out.add(i).write(ShmUnwindRow {
+                start: row.start,
+                cfa_offset: row.cfa_offset,
+                cfa: row.cfa,
+                rbp_slot: row.rbp_slot,
+                ra_slot: row.ra_slot,
+                _reserved: 0,
+            });
+        }
+        (*header).version = VERSION;
+        (*header).rows = rows.len() as u64;
+        (*header).magic.store(MAGIC, Ordering::Release);
+
+        libc::munmap(ptr, total);
+    }
+    Ok(())
+}
+
+/// Unlink the unwind table of an exited process
+pub fn remove_unwind_table(pid: u32) {
+    if let Ok(name) = std::ffi::CString::new(format!("{}{}", SHM_PREFIX, pid)) {
+        unsafe { libc::shm_unlink(name.as_ptr()) };
+    }
+}
@@ -0,0 +1,198 @@
+//! The rsprof-trace processes of one recording.
+//!
+//! Each target has its own shared memory segment and symbol resolver; the
+//! resolvers of processes running the same executable share its debug info.
+//! With a name pattern (`--process`), processes that start matching during
+//! the recording are attached at the next rescan, as are children forked by
+//! an attached target. With unwind tables enabled, each target is sent the
+//! CFI rows of its mappings as it is attached.
+
+use super::shm_sampler::{ShmHeapSampler, ShmOverflow};
+use super::shm_unwind;
+use crate::error::Result;
+use crate::process::{self, ProcessInfo};
+use crate::symbols::{SymbolResolver, Unwinder};
+use std::collections::HashSet;
+use std::path::PathBuf;
+
+/// One attached process
+pub struct ShmTarget {
+    pub sampler: ShmHeapSampler,
+    pub resolver: SymbolResolver,
+    exe_path: PathBuf,
+    /// Rows of the unwind table it was sent (0 if none)
+    pub unwind_rows: usize,
+    /// Gone at the last rescan; dropped at the next, after a final read
+    exited: bool,
+}
+
+impl ShmTarget {
+    pub fn pid(&self) -> u32 {
+        self.sampler.pid()
+    }
+}
+
+/// Storage callsite key for a slot of process `pid`; slot indexes are only
+/// unique within a process
+pub fn callsite_key(pid: u32, slot: u64) -> u64 {
+    (pid as u64) << 32 | slot
+}
+
+/// All attached processes
+pub struct ShmTargets {
+    /// Name pattern new processes are matched against; None for a single pid
+    pattern: Option<String>,
+    targets: Vec<ShmTarget>,
+    /// Processes whose debug info could not be loaded; not retried
+    failed: HashSet<u32>,
+    /// Overflow counts of targets that have exited
+    retired: ShmOverflow,
+    /// Send each target an unwind table as it is attached
+    unwind_tables: bool,
+}
+
+impl ShmTargets {
+    /// Targets of a new recording; first clears away segments left by
+    /// processes that exited since the last one
+    pub fn new(pattern: Option<String>) -> Self {
+        ShmHeapSampler::remove_stale_segments();
+        ShmTargets {
+            pattern,
+            targets: Vec::new(),
+            failed: HashSet::new(),
+            retired: ShmOverflow::default(),
+            unwind_tables: false,
+        }
+    }
+
+    /// Send targets attached from now on the CFI unwind table of their
+    /// mappings, so rsprof-trace can walk stacks without frame pointers
+    pub fn set_unwind_tables(&mut self, enabled: bool) {
+        self.unwind_tables = enabled;
+    }
+
+    /// Open a process's shared memory; fails if it does not use rsprof-trace
+    ///
+    /// The resolver reuses the debug info of a target running the same
+    /// executable, or of `base`; other executables load their own.
+    pub fn attach(&mut self, proc_info: &ProcessInfo, base: Option<&SymbolResolver>) -> Result<()> {
+        let sampler = ShmHeapSampler::new(proc_info.pid(), proc_info.exe_path())?;
+        let base = self
+            .targets
+            .iter()
+            .find(|t| t.exe_path == *proc_info.exe_path())
+            .map(|t| &t.resolver)
+            .or(base);
+        let resolver = match base {
+            Some(base) => base.for_process(proc_info),
+            None => SymbolResolver::new(proc_info),
+        };
+        let resolver = resolver.inspect_err(|_| {
+            self.failed.insert(proc_info.pid());
+        })?;
+        // Best effort: without a table the target keeps walking frame pointers
+        let unwind_rows = if self.unwind_tables {
+            let rows = Unwinder::new(proc_info).runtime_rows();
+            let published = !rows.is_empty()
+                && shm_unwind::publish_unwind_table(proc_info.pid(), &rows).is_ok();
+            if published { rows.len() } else { 0 }
+        } else {
+            0
+        };
+        self.targets.push(ShmTarget {
+            sampler,
+            resolver,
+            exe_path: proc_info.exe_path().clone(),
+            unwind_rows,
+            exited: false,
+        });
+        Ok(())
+    }
+
+    /// Drop targets that exited before the last rescan, and attach new
+    /// processes: name matches, and children forked by a target. Returns
+    /// the processes attached.
+    pub fn rescan(&mut self) -> Vec<ProcessInfo> {
+        for target in self.targets.iter().filter(|t| t.exited) {
+            self.retired.add(&target.sampler.overflow());
+            ShmHeapSampler::remove_segment(target.pid());
+            shm_unwind::remove_unwind_table(target.pid());
+        }
+        self.targets.retain(|t| !t.exited);
+        for target in &mut self.targets {
+            target.exited = !process::is_running(target.pid());
+        }
+
+        let attached: HashSet<u32> = self.targets.iter().map(ShmTarget::pid).collect();
+        let Ok(entries) = std::fs::read_dir("/proc") else {
+            return Vec::new();
+        };
+        let own_pid = std::process::id();
+        let mut added = Vec::new();
+        for entry in entries.flatten() {
+            let Some(pid) = entry.file_name().to_str().and_then(|s| s.parse().ok()) else {
+                continue;
+            };
+            if pid == own_pid || attached.contains(&pid) || self.failed.contains(&pid) {
+                continue;
+            }
+            let name_matches = self.pattern.as_deref().is_some_and(|pattern| {
+                std::fs::read_to_string(format!("/proc/{}/comm", pid))
+                    .is_ok_and(|comm| comm.trim().contains(pattern))
+            });
+            let forked = process::parent_pid(pid).is_some_and(|ppid| attached.contains(&ppid));
+            if (name_matches || forked)
+                && let Some(proc_info) = self.try_attach(pid)
+            {
+                added.push(proc_info);
+            }
+        }
+        added
+    }
+
+    /// Attach `pid` if it has rsprof-trace shared memory yet
+    fn try_attach(&mut self, pid: u32) -> Option<ProcessInfo> {
+        let proc_info = ProcessInfo::new(pid).ok()?;
+        self.attach(&proc_info, None).ok()?;
+        Some(proc_info)
+    }
+
+    pub fn iter_mut(&mut self) -> impl Iterator<Item = &mut ShmTarget> {
+        self.targets.iter_mut()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.targets.is_empty()
+    }
+
+    pub fn len(&self) -> usize {
+        self.targets.len()
+    }
+
+    /// Callsites with heap activity, over all targets
+    pub fn heap_site_count(&self) -> usize {
+        self.targets
+            .iter()
+            .map(|t| t.sampler.heap_site_count())
+            .sum()
+    }
+
+    /// Mean bytes between sampled allocations, or 0 if every target records
+    /// every allocation
+    pub fn heap_sample_bytes(&self) -> u64 {
+        self.targets
+            .iter()
+            .map(|t| t.sampler.heap_sample_bytes())
+            .max()
+            .unwrap_or(0)
+    }
+
+    /// Events dropped on full tables, including by targets that have exited
+    pub fn overflow(&self) -> ShmOverflow {
+        let mut total = self.retired;
+        for target in &self.targets {
+            total.add(&target.sampler.overflow());
+        }
+        total
+    }
+}
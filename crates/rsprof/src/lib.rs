@@ -6,6 +6,7 @@ pub mod heap;
 pub mod process;
 pub mod storage;
 pub mod symbols;
+pub mod trigger;
 pub mod tui;
 
 pub use error::{Error, Result};
@@ -62,9 +62,25 @@ fn run() -> anyhow::Result<()> {
             filter,
         }) => {
             rsprof::commands::top::run(
-                &file, metric, top, threshold, since, until, json, csv, filter,
+                &file, metric, top, threshold, since, until, json, csv, filter, cli.pid,
             )?;
         }
+        Some(Command::Diff {
+            baseline,
+            candidate,
+            top,
+            threshold,
+            json,
+            csv,
+        }) => {
+            rsprof::commands::diff::run(&baseline, &candidate, top, threshold, json, csv)?;
+        }
+        Some(Command::Export { file, format }) => {
+            rsprof::commands::export::run(&file, format)?;
+        }
+        Some(Command::Compact { file }) => {
+            rsprof::commands::compact::run(&file, cli.output.as_deref())?;
+        }
         Some(Command::Query { file, sql }) => {
             rsprof::commands::query::run(&file, &sql)?;
         }
@@ -86,6 +102,9 @@ fn run() -> anyhow::Result<()> {
         Some(Command::List { dir }) => {
             rsprof::commands::list::run(dir.as_deref())?;
         }
+        Some(Command::Collect { listen, dir }) => {
+            rsprof::commands::collect::run(&listen, &dir)?;
+        }
         Some(Command::Completions { shell }) => {
             use clap::CommandFactory;
             let mut cmd = Cli::command();
@@ -101,15 +120,25 @@ fn run() -> anyhow::Result<()> {
 }
 
 fn run_profiler(cli: &Cli) -> anyhow::Result<()> {
-    // Resolve PID
-    let pid = match (cli.pid, &cli.process) {
-        (Some(pid), _) => pid,
-        (_, Some(name)) => rsprof::process::find_process_by_name(name)?,
+    // Resolve PIDs: --process records every matching process
+    let pids: Vec<u32> = match (cli.pid, &cli.process) {
+        (Some(pid), _) => vec![pid],
+        (_, Some(name)) => {
+            let matches = rsprof::process::find_processes_by_name(name)?;
+            if matches.is_empty() {
+                return Err(rsprof::Error::ProcessNotFound(format!(
+                    "No process matching '{}'",
+                    name
+                ))
+                .into());
+            }
+            matches.into_iter().map(|(pid, _)| pid).collect()
+        }
         _ => unreachable!("validated in cli"),
     };
 
-    // Verify process exists and get info
-    let proc_info = rsprof::process::ProcessInfo::new(pid)?;
+    // Verify process exists and get info; the first process names the profile
+    let proc_info = rsprof::process::ProcessInfo::new(pids[0])?;
     eprintln!(
         "Attaching to {} (PID {})",
         proc_info.name(),
@@ -117,6 +146,11 @@ fn run_profiler(cli: &Cli) -> anyhow::Result<()> {
     );
 
     // Determine output path
+    let stream_addr = cli
+        .stream
+        .as_deref()
+        .map(rsprof::storage::StreamAddr::parse)
+        .transpose()?;
     let output_path = if let Some(ref path) = cli.output {
         path.clone()
     } else if cli.append {
@@ -130,7 +164,9 @@ fn run_profiler(cli: &Cli) -> anyhow::Result<()> {
         std::path::PathBuf::from(format!("rsprof.{}.{}.db", proc_info.name(), timestamp))
     };
     let append_mode = cli.append && output_path.exists();
-    if append_mode {
+    if let Some(ref addr) = stream_addr {
+        eprintln!("Streaming to: {}", addr);
+    } else if append_mode {
         eprintln!("Appending to: {}", output_path.display());
     } else {
         eprintln!("Output: {}", output_path.display());
@@ -140,51 +176,157 @@ fn run_profiler(cli: &Cli) -> anyhow::Result<()> {
     eprintln!("Loading debug symbols...");
     let resolver = rsprof::symbols::SymbolResolver::new(&proc_info)?;
     eprintln!(
-        "Loaded {} address ranges from DWARF",
-        resolver.range_count()
+        "Indexed {} functions and {} compilation unit ranges from DWARF",
+        resolver.symbol_count(),
+        resolver.unit_count()
     );
     eprintln!("ASLR offset: 0x{:x}", resolver.aslr_offset());
 
     // Initialize storage
-    let storage = if append_mode {
-        rsprof::storage::Storage::open_append(&output_path)?
+    let mut storage = if let Some(ref addr) = stream_addr {
+        rsprof::storage::Storage::stream(addr, &proc_info, cli.cpu_freq)?
+    } else if append_mode {
+        rsprof::storage::Storage::open_append(&output_path, &proc_info)?
     } else {
         rsprof::storage::Storage::new(&output_path, &proc_info, cli.cpu_freq)?
     };
+    if let Some(retention) = cli.retention {
+        storage.set_retention(retention);
+    }
+    let triggers = if cli.trigger.is_empty() {
+        None
+    } else {
+        storage.set_capture(rsprof::storage::CaptureWindows {
+            pre: cli.pre_trigger,
+            post: cli.post_trigger,
+            baseline: cli.baseline_interval,
+        });
+        eprintln!(
+            "Recording on triggers: {:?} before and {:?} after each at full resolution, every {:?} otherwise",
+            cli.pre_trigger, cli.post_trigger, cli.baseline_interval
+        );
+        Some(rsprof::trigger::Triggers::new(
+            &cli.trigger,
+            proc_info.pid(),
+        )?)
+    };
 
-    // Try to initialize shared memory sampler (rsprof-trace) first
+    // Try to initialize shared memory samplers (rsprof-trace) first
     // This provides both CPU and heap profiling from self-instrumented targets
-    let shm_sampler = match rsprof::heap::ShmHeapSampler::new(pid, proc_info.exe_path()) {
-        Ok(shm) => {
-            eprintln!("Profiling enabled (rsprof-trace: CPU + heap via shared memory)");
-            Some(shm)
+    let pid = proc_info.pid();
+    let mut shm_targets = rsprof::heap::ShmTargets::new(cli.process.clone());
+    shm_targets.set_unwind_tables(cli.unwind == rsprof::cli::Unwind::Dwarf);
+    if shm_targets.attach(&proc_info, Some(&resolver)).is_ok() {
+        eprintln!("Profiling enabled (rsprof-trace: CPU + heap via shared memory)");
+        if let Some(target) = shm_targets.iter_mut().next()
+            && cli.unwind == rsprof::cli::Unwind::Dwarf
+        {
+            if target.unwind_rows > 0 {
+                eprintln!(
+                    "Sent rsprof-trace a {}-row CFI unwind table",
+                    target.unwind_rows
+                );
+            } else {
+                eprintln!("No CFI unwind table for rsprof-trace; it walks frame pointers");
+            }
+        }
+    }
+    for &other in &pids[1..] {
+        let Ok(info) = rsprof::process::ProcessInfo::new(other) else {
+            continue;
+        };
+        match shm_targets.attach(&info, Some(&resolver)) {
+            Ok(()) => {
+                eprintln!("Attaching to {} (PID {})", info.name(), info.pid());
+                storage.add_process(&info);
+            }
+            Err(e) => eprintln!("Skipping {} (PID {}): {}", info.name(), info.pid(), e),
         }
-        Err(_) => None,
+    }
+    if shm_targets.len() > 1 {
+        eprintln!("Recording {} processes", shm_targets.len());
+    }
+    let sample_bytes = shm_targets.heap_sample_bytes();
+    if sample_bytes > 0 {
+        eprintln!(
+            "Heap sampled every ~{} bytes; heap stats are estimates",
+            sample_bytes
+        );
+        storage.set_heap_sample_bytes(sample_bytes)?;
+    }
+
+    // perf samplers follow one process; more are recorded through rsprof-trace only
+    if pids.len() > 1 && (cli.pmu || cli.off_cpu || shm_targets.is_empty()) {
+        eprintln!(
+            "Note: {} processes match; perf-based sampling (--pmu, --off-cpu, and CPU without rsprof-trace) covers PID {} only",
+            pids.len(),
+            pid
+        );
+    }
+
+    // Hardware counters sample on cycles, so they also provide CPU samples
+    // unless rsprof-trace already does
+    let pmu_sampler = if cli.pmu {
+        match rsprof::cpu::CpuSampler::hardware(pid, cli.cpu_freq, cli.perf_pages, cli.unwind) {
+            Ok(s) => {
+                eprintln!(
+                    "Hardware counters enabled (cycles, instructions, LLC and branch misses)"
+                );
+                Some(s)
+            }
+            Err(e) => {
+                eprintln!("Hardware counters disabled: {}", e);
+                None
+            }
+        }
+    } else {
+        None
     };
 
     // Initialize perf-based CPU sampler as fallback
-    let perf_sampler = if shm_sampler.is_none() {
-        match rsprof::cpu::CpuSampler::new(pid, cli.cpu_freq) {
+    let perf_sampler = match pmu_sampler {
+        Some(s) => Some(s),
+        None if shm_targets.is_empty() => {
+            match rsprof::cpu::CpuSampler::new(pid, cli.cpu_freq, cli.perf_pages, cli.unwind) {
+                Ok(s) => {
+                    eprintln!("CPU profiling enabled (perf_event)");
+                    Some(s)
+                }
+                Err(e) => {
+                    eprintln!("CPU profiling disabled: {}", e);
+                    None
+                }
+            }
+        }
+        None => None, // Don't need perf when we have rsprof-trace
+    };
+
+    // Blocking-time sampler, independent of which source provides CPU
+    let offcpu_sampler = if cli.off_cpu {
+        match rsprof::cpu::CpuSampler::off_cpu(pid, cli.perf_pages, cli.unwind) {
             Ok(s) => {
-                eprintln!("CPU profiling enabled (perf_event)");
+                eprintln!("Off-CPU profiling enabled (context switches)");
                 Some(s)
             }
             Err(e) => {
-                eprintln!("CPU profiling disabled: {}", e);
+                eprintln!("Off-CPU profiling disabled: {}", e);
                 None
             }
         }
     } else {
-        None // Don't need perf when we have rsprof-trace
+        None
     };
 
-    // Run profiler
-    if cli.quiet {
+    // Run profiler; a streaming agent has no local profile for the TUI, and
+    // a triggered one shows nothing worth watching between triggers
+    if cli.quiet || stream_addr.is_some() || triggers.is_some() {
         run_headless(
             perf_sampler,
-            shm_sampler,
+            offcpu_sampler,
+            shm_targets,
             resolver,
             storage,
+            triggers,
             cli.interval,
             cli.duration,
             cli.include_internal,
@@ -192,7 +334,8 @@ fn run_profiler(cli: &Cli) -> anyhow::Result<()> {
     } else {
         rsprof::tui::run(
             perf_sampler,
-            shm_sampler,
+            offcpu_sampler,
+            shm_targets,
             resolver,
             storage,
             cli.interval,
@@ -409,9 +552,11 @@ fn find_user_frame(
 #[allow(clippy::too_many_arguments)]
 fn run_headless(
     mut perf_sampler: Option<rsprof::cpu::CpuSampler>,
-    mut shm_sampler: Option<rsprof::heap::ShmHeapSampler>,
+    mut offcpu_sampler: Option<rsprof::cpu::CpuSampler>,
+    mut shm_targets: rsprof::heap::ShmTargets,
     resolver: rsprof::symbols::SymbolResolver,
     mut storage: rsprof::storage::Storage,
+    mut triggers: Option<rsprof::trigger::Triggers>,
     checkpoint_interval: std::time::Duration,
     duration: Option<std::time::Duration>,
     include_internal: bool,
@@ -427,10 +572,14 @@ fn run_headless(
     })
     .context("Failed to set Ctrl-C handler")?;
 
+    // Targets may all exit; rsprof-trace still provides the CPU samples
+    let shm_mode = !shm_targets.is_empty();
     let start = std::time::Instant::now();
     let mut last_checkpoint = std::time::Instant::now();
     let mut total_cpu_samples = 0u64;
     let mut total_heap_events = 0u64;
+    let mut total_lost_samples = 0u64;
+    let mut trigger_count = 0u64;
 
     eprintln!("Recording (Ctrl-C to stop)...");
 
@@ -442,105 +591,374 @@ fn run_headless(
             break;
         }
 
-        // Read from shared memory sampler (rsprof-trace) - gets both CPU and heap events
-        if let Some(ref mut shm) = shm_sampler {
-            let _events = shm.poll_events(std::time::Duration::from_millis(1));
-
-            // Process CPU samples from rsprof-trace (aggregated stats)
-            let cpu_stats = shm.read_cpu_stats();
-            for (_hash, (count, stack)) in cpu_stats {
+        // Read from shared memory samplers (rsprof-trace) - gets both CPU and heap events
+        for target in shm_targets.iter_mut() {
+            let pid = target.pid();
+            let resolver = &target.resolver;
+
+            // Process CPU samples from rsprof-trace (aggregated stats); the
+            // shared memory is read before the first is returned
+            let scan_start = std::time::Instant::now();
+            let cpu_stats = target.sampler.read_cpu_stats();
+            storage.record_shm_scan(scan_start.elapsed());
+            for (count, tid, slot, stack) in cpu_stats {
                 total_cpu_samples += count;
-                let location = if include_internal {
-                    resolve_internal_stack(&stack, &resolver)
-                } else {
-                    // Walk the stack to find the first user frame (skip allocator/profiler internals)
-                    find_user_frame(&stack, &resolver)
-                };
-                if include_internal || !is_internal_location(&location) {
-                    storage.record_cpu_sample_count(
-                        stack.first().copied().unwrap_or(0),
-                        &location,
-                        count,
-                    );
+                let callsite = rsprof::heap::callsite_key(pid, slot);
+                let location_id = storage.callsite_location_id(callsite, stack, || {
+                    attribute_stack(stack, resolver, include_internal)
+                });
+                if let Some(location_id) = location_id {
+                    storage.record_cpu_samples_at(location_id, count, pid, tid);
+                }
+                let stack_id = storage.callsite_stack_id(callsite, stack, || {
+                    stack_frames(stack, resolver, include_internal)
+                });
+                if let Some(stack_id) = stack_id {
+                    storage.record_stack_samples_at(stack_id, count);
                 }
             }
-
-            // Just update the event count - heap stats are recorded at checkpoint time
-            total_heap_events = shm.read_stats().len() as u64;
+        }
+        // Just update the event count - heap stats are recorded at checkpoint time
+        if shm_mode {
+            total_heap_events = shm_targets.heap_site_count() as u64;
         }
 
-        // Fallback to perf-based CPU sampling if no SHM sampler
-        if shm_sampler.is_none()
-            && let Some(ref mut sampler) = perf_sampler
-        {
-            let samples = sampler.read_samples()?;
-            total_cpu_samples += samples.len() as u64;
+        // Perf-based CPU sampling if no SHM sampler; with --pmu it runs
+        // alongside rsprof-trace for the hardware counters only
+        if let Some(ref mut sampler) = perf_sampler {
+            let record_cpu = !shm_mode;
+            // Block until a ring crosses its watermark, waking in time for
+            // the next checkpoint and to notice Ctrl-C (the SHM path paces
+            // the loop itself)
+            let wait = if record_cpu {
+                checkpoint_interval
+                    .saturating_sub(last_checkpoint.elapsed())
+                    .min(std::time::Duration::from_millis(100))
+            } else {
+                std::time::Duration::ZERO
+            };
+            sampler.poll(wait)?;
+            if last_checkpoint.elapsed() >= checkpoint_interval {
+                sampler.drain_all();
+            }
 
-            for addr in samples {
-                let location = resolver.resolve(addr);
-                if include_internal || !is_internal_location(&location) {
-                    storage.record_cpu_sample(addr, &location);
-                }
+            total_cpu_samples += record_perf_samples(
+                sampler,
+                &resolver,
+                &mut storage,
+                include_internal,
+                record_cpu,
+            );
+
+            let lost = sampler.take_lost_samples();
+            total_lost_samples += lost;
+            storage.record_lost_samples(lost);
+        }
+
+        if let Some(ref mut sampler) = offcpu_sampler {
+            sampler.poll(std::time::Duration::ZERO)?;
+            if last_checkpoint.elapsed() >= checkpoint_interval {
+                sampler.drain_all();
             }
+            record_offcpu_samples(sampler, &resolver, &mut storage, include_internal);
+
+            let lost = sampler.take_lost_samples();
+            total_lost_samples += lost;
+            storage.record_lost_samples(lost);
+        }
+
+        if let Some(reason) = triggers.as_mut().and_then(|t| t.poll()) {
+            trigger_count += 1;
+            eprintln!("\nTriggered: {}", reason);
+            storage.trigger(&reason)?;
         }
 
         // Checkpoint - record heap stats and flush
         if last_checkpoint.elapsed() >= checkpoint_interval {
-            // Record heap stats from SHM sampler (rsprof-trace)
-            if let Some(ref shm) = shm_sampler {
-                let heap_stats = shm.read_stats();
-                let inline_stacks = shm.read_inline_stacks();
-                total_heap_events = heap_stats.len() as u64;
-
-                for (key_addr, stats) in heap_stats {
-                    let location = if let Some(stack) = inline_stacks.get(&key_addr) {
-                        if include_internal {
-                            resolve_internal_stack(stack, &resolver)
+            // Record heap stats from SHM samplers (rsprof-trace)
+            for target in shm_targets.iter_mut() {
+                let pid = target.pid();
+                let resolver = &target.resolver;
+                let scan_start = std::time::Instant::now();
+                let heap_stats = target.sampler.read_heap_stats();
+                storage.record_shm_scan(scan_start.elapsed());
+                for (slot, key_addr, stats, stack) in heap_stats {
+                    let callsite = rsprof::heap::callsite_key(pid, slot);
+                    let location_id = storage.callsite_location_id(callsite, stack, || {
+                        if !stack.is_empty() {
+                            attribute_stack(stack, resolver, include_internal)
+                        } else if include_internal {
+                            Some(rsprof::symbols::Location::unknown())
                         } else {
-                            find_user_frame(stack, &resolver)
+                            let location = resolver.resolve(key_addr);
+                            (!is_internal_location(&location)).then_some(location)
                         }
-                    } else if include_internal {
-                        rsprof::symbols::Location::unknown()
-                    } else {
-                        resolver.resolve(key_addr)
-                    };
-                    if include_internal || !is_internal_location(&location) {
-                        storage.record_heap_sample(
-                            &location,
+                    });
+                    if let Some(location_id) = location_id {
+                        storage.record_heap_sample_at(
+                            pid,
+                            location_id,
                             stats.total_alloc_bytes as i64,
                             stats.total_free_bytes as i64,
                             stats.live_bytes,
                             stats.total_allocs,
                             stats.total_frees,
                         );
+                        storage.record_heap_histogram_at(location_id, &stats.histogram);
                     }
                 }
             }
+            if shm_mode {
+                total_heap_events = shm_targets.heap_site_count() as u64;
+                storage.record_dropped_events(shm_targets.overflow().total());
+            }
 
+            storage.record_checkpoint_lag(
+                last_checkpoint
+                    .elapsed()
+                    .saturating_sub(checkpoint_interval),
+            );
             storage.flush_checkpoint()?;
             last_checkpoint = std::time::Instant::now();
+            for proc_info in shm_targets.rescan() {
+                storage.add_process(&proc_info);
+            }
+            let capture = if triggers.is_none() {
+                ""
+            } else if storage.capturing() {
+                " | Capturing"
+            } else {
+                " | Waiting for trigger"
+            };
             eprint!(
-                "\rCPU samples: {} | Heap sites: {} | Elapsed: {:?}",
+                "\rCPU samples: {} | Heap sites: {} | Lost: {} | Elapsed: {:?}{}",
                 total_cpu_samples,
                 total_heap_events,
-                start.elapsed()
+                total_lost_samples,
+                start.elapsed(),
+                capture
             );
         }
 
-        // Sleep briefly to avoid busy-waiting
-        std::thread::sleep(std::time::Duration::from_millis(10));
+        // Sleep briefly to avoid busy-waiting (the perf-only path blocks in poll)
+        if perf_sampler.is_none() || shm_mode {
+            std::thread::sleep(std::time::Duration::from_millis(10));
+        }
+    }
+
+    // Pick up samples still below the perf watermark
+    if let Some(ref mut sampler) = perf_sampler {
+        sampler.drain_all();
+        total_cpu_samples += record_perf_samples(
+            sampler,
+            &resolver,
+            &mut storage,
+            include_internal,
+            !shm_mode,
+        );
+        let lost = sampler.take_lost_samples();
+        total_lost_samples += lost;
+        storage.record_lost_samples(lost);
+    }
+    if let Some(ref mut sampler) = offcpu_sampler {
+        sampler.drain_all();
+        record_offcpu_samples(sampler, &resolver, &mut storage, include_internal);
+        let lost = sampler.take_lost_samples();
+        total_lost_samples += lost;
+        storage.record_lost_samples(lost);
+    }
+
+    if shm_mode {
+        storage.record_dropped_events(shm_targets.overflow().total());
     }
 
-    // Final flush
-    storage.flush_checkpoint()?;
+    // Final flush, waiting for the writer thread to finish
+    let deferred_checkpoints = storage.deferred_checkpoints();
+    let processes = storage.process_count();
+    let stats = storage.finish()?;
+    let elapsed = start.elapsed();
     eprintln!(
         "\nRecording complete. CPU samples: {}, Heap sites: {}",
         total_cpu_samples, total_heap_events
     );
+    if triggers.is_some() {
+        eprintln!(
+            "Triggers fired: {} (listed in the profile's meta under 'triggers')",
+            trigger_count
+        );
+    }
+    if processes > 1 {
+        eprintln!(
+            "Recorded {} processes; `rsprof top processes` splits the profile by process",
+            processes
+        );
+    }
+    eprintln!(
+        "Profiler overhead: {:.1}% of a core (SHM scan {}ms, symbolize {}ms, flush {}ms), worst checkpoint lag {}ms, profile {:.1} MB",
+        stats.overhead_percent(elapsed),
+        stats.shm_scan.as_millis(),
+        stats.symbolize.as_millis(),
+        stats.flush.as_millis(),
+        stats.lag.as_millis(),
+        stats.db_bytes as f64 / (1024.0 * 1024.0)
+    );
+    if stats.lag > checkpoint_interval / 2 {
+        eprintln!(
+            "Note: checkpoints ran up to {}ms late; rsprof cannot keep up at this rate (raise -i or lower --cpu-freq)",
+            stats.lag.as_millis()
+        );
+    }
+    if deferred_checkpoints > 0 {
+        eprintln!(
+            "Note: {} checkpoints were merged into later ones because the disk could not keep up",
+            deferred_checkpoints
+        );
+    }
+    if total_lost_samples > 0 {
+        eprintln!(
+            "Warning: {} samples lost to perf ring overflow; the profile is incomplete (try a larger --perf-pages)",
+            total_lost_samples
+        );
+    }
+    if shm_mode {
+        let overflow = shm_targets.overflow();
+        if overflow.callsite_overflow > 0 {
+            eprintln!(
+                "Warning: {} events dropped because the callsite table was full (raise RSPROF_CALLSITES in the target)",
+                overflow.callsite_overflow
+            );
+        }
+        if overflow.alloc_dropped > 0 {
+            eprintln!(
+                "Warning: {} allocations untracked because the alloc table was full; live bytes are overstated (raise RSPROF_ALLOCS in the target)",
+                overflow.alloc_dropped
+            );
+        }
+    }
 
     Ok(())
 }
 
+/// Attribute the perf sampler's pending stacks and record them; returns the sample count
+///
+/// CPU samples are only recorded when `record_cpu` (rsprof-trace provides
+/// them otherwise); hardware counters always are.
+fn record_perf_samples(
+    sampler: &mut rsprof::cpu::CpuSampler,
+    resolver: &rsprof::symbols::SymbolResolver,
+    storage: &mut rsprof::storage::Storage,
+    include_internal: bool,
+    record_cpu: bool,
+) -> u64 {
+    let mut total = 0;
+    let pid = sampler.pid();
+    for (count, tid, hash, stack) in sampler.take_samples() {
+        if !record_cpu {
+            continue;
+        }
+        total += count;
+        let location_id = storage.callsite_location_id(hash, stack, || {
+            attribute_stack(stack, resolver, include_internal)
+        });
+        if let Some(location_id) = location_id {
+            storage.record_cpu_samples_at(location_id, count, pid, tid);
+        }
+        let stack_id = storage.callsite_stack_id(hash, stack, || {
+            stack_frames(stack, resolver, include_internal)
+        });
+        if let Some(stack_id) = stack_id {
+            storage.record_stack_samples_at(stack_id, count);
+        }
+    }
+    for (counters, hash, stack) in sampler.take_counters() {
+        let location_id = storage.callsite_location_id(hash, stack, || {
+            attribute_stack(stack, resolver, include_internal)
+        });
+        if let Some(location_id) = location_id {
+            storage.record_pmu_at(location_id, &counters);
+        }
+    }
+    total
+}
+
+/// Attribute the off-CPU sampler's pending stacks and record their blocked time
+fn record_offcpu_samples(
+    sampler: &mut rsprof::cpu::CpuSampler,
+    resolver: &rsprof::symbols::SymbolResolver,
+    storage: &mut rsprof::storage::Storage,
+    include_internal: bool,
+) {
+    for (blocked_ns, _tid, hash, stack) in sampler.take_samples() {
+        let location_id = storage.offcpu_location_id(hash, stack, || {
+            attribute_blocked_stack(stack, resolver, include_internal)
+        });
+        if let Some(location_id) = location_id {
+            storage.record_offcpu_at(location_id, blocked_ns);
+        }
+    }
+}
+
+/// Location to charge a blocked stack to: the first frame past the
+/// shared-library code (syscall wrappers, futex waits) that went to sleep
+fn attribute_blocked_stack(
+    stack: &[u64],
+    resolver: &rsprof::symbols::SymbolResolver,
+    include_internal: bool,
+) -> Option<rsprof::symbols::Location> {
+    let skip = stack
+        .iter()
+        .take_while(|&&addr| is_shared_object_file(&resolver.resolve(addr).file))
+        .count();
+    let stack = if skip < stack.len() {
+        &stack[skip..]
+    } else {
+        stack
+    };
+    attribute_stack(stack, resolver, include_internal)
+}
+
+/// Whether a frame's file is a shared object (e.g. `libc.so.6`) rather than source
+fn is_shared_object_file(file: &str) -> bool {
+    !file.contains('/') && file.contains(".so")
+}
+
+/// Location to charge a stack's samples to, or None if it is profiler/allocator internal
+fn attribute_stack(
+    stack: &[u64],
+    resolver: &rsprof::symbols::SymbolResolver,
+    include_internal: bool,
+) -> Option<rsprof::symbols::Location> {
+    if include_internal {
+        return Some(resolve_internal_stack(stack, resolver));
+    }
+    // Walk the stack to find the first user frame (skip allocator/profiler internals)
+    let location = find_user_frame(stack, resolver);
+    (!is_internal_location(&location)).then_some(location)
+}
+
+/// A stack's frames for the stacks table, leaf first, without the
+/// profiler's own frames unless `include_internal`
+fn stack_frames(
+    stack: &[u64],
+    resolver: &rsprof::symbols::SymbolResolver,
+    include_internal: bool,
+) -> Vec<rsprof::symbols::Location> {
+    stack
+        .iter()
+        .filter(|&&addr| addr != 0)
+        .map(|&addr| resolver.resolve(addr))
+        .filter(|loc| include_internal || !is_profiler_frame(loc))
+        .collect()
+}
+
+/// Whether a frame belongs to rsprof-trace or its allocator hooks
+fn is_profiler_frame(loc: &rsprof::symbols::Location) -> bool {
+    loc.file.contains("rsprof-trace")
+        || loc.file.contains("rsprof-alloc")
+        || loc.function.contains("rsprof_trace::")
+        || loc.function.contains("rsprof_alloc::")
+}
+
 fn resolve_internal_stack(
     stack: &[u64],
     resolver: &rsprof::symbols::SymbolResolver,
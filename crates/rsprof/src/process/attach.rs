@@ -1,6 +1,7 @@
 use crate::error::{Error, Result};
 use std::fs;
 use std::path::PathBuf;
+use std::time::Duration;
 
 /// Information about a target process
 pub struct ProcessInfo {
@@ -72,26 +73,91 @@ impl ProcessInfo {
 
     /// Get all thread IDs for this process
     pub fn thread_ids(&self) -> Result<Vec<u32>> {
-        let task_path = format!("/proc/{}/task", self.pid);
-        let mut tids = Vec::new();
-
-        for entry in fs::read_dir(&task_path).map_err(|e| {
-            Error::ProcessNotFound(format!("Cannot read tasks for PID {}: {}", self.pid, e))
-        })? {
-            if let Ok(entry) = entry
-                && let Some(name) = entry.file_name().to_str()
-                && let Ok(tid) = name.parse::<u32>()
-            {
-                tids.push(tid);
-            }
+        thread_ids(self.pid)
+    }
+}
+
+/// List the thread IDs in /proc/[pid]/task
+pub fn thread_ids(pid: u32) -> Result<Vec<u32>> {
+    let task_path = format!("/proc/{}/task", pid);
+    let mut tids = Vec::new();
+
+    for entry in fs::read_dir(&task_path)
+        .map_err(|e| Error::ProcessNotFound(format!("Cannot read tasks for PID {}: {}", pid, e)))?
+    {
+        if let Ok(entry) = entry
+            && let Some(name) = entry.file_name().to_str()
+            && let Ok(tid) = name.parse::<u32>()
+        {
+            tids.push(tid);
         }
+    }
+
+    Ok(tids)
+}
 
-        Ok(tids)
+/// Read a thread's name from /proc/[pid]/task/[tid]/comm
+pub fn thread_name(pid: u32, tid: u32) -> Option<String> {
+    fs::read_to_string(format!("/proc/{}/task/{}/comm", pid, tid))
+        .ok()
+        .map(|name| name.trim_end().to_string())
+}
+
+/// State and parent pid from /proc/[pid]/stat
+fn read_stat(pid: u32) -> Option<(char, u32)> {
+    let stat = fs::read_to_string(format!("/proc/{}/stat", pid)).ok()?;
+    // The name in parentheses may contain spaces; the fields follow the last ')'
+    let mut fields = stat.get(stat.rfind(')')? + 1..)?.split_whitespace();
+    let state = fields.next()?.chars().next()?;
+    let ppid = fields.next()?.parse().ok()?;
+    Some((state, ppid))
+}
+
+/// CPU time `pid` has used so far, user and system, from /proc/[pid]/stat
+pub fn cpu_time(pid: u32) -> Option<Duration> {
+    let stat = fs::read_to_string(format!("/proc/{}/stat", pid)).ok()?;
+    // utime and stime are the 14th and 15th fields, the 12th and 13th after the name
+    let mut fields = stat
+        .get(stat.rfind(')')? + 1..)?
+        .split_whitespace()
+        .skip(11);
+    let utime: u64 = fields.next()?.parse().ok()?;
+    let stime: u64 = fields.next()?.parse().ok()?;
+    let ticks_per_sec = unsafe { libc::sysconf(libc::_SC_CLK_TCK) };
+    if ticks_per_sec <= 0 {
+        return None;
     }
+    Some(Duration::from_secs_f64(
+        (utime + stime) as f64 / ticks_per_sec as f64,
+    ))
 }
 
-/// Find a process by name (pgrep-style matching)
-pub fn find_process_by_name(pattern: &str) -> Result<u32> {
+/// When `pid` started, in clock ticks since boot, from /proc/[pid]/stat;
+/// None once it has exited (a zombie counts as gone)
+pub fn start_time(pid: u32) -> Option<u64> {
+    let stat = fs::read_to_string(format!("/proc/{}/stat", pid)).ok()?;
+    // state is the 3rd field and starttime the 22nd, the 1st and 20th after the name
+    let mut fields = stat.get(stat.rfind(')')? + 1..)?.split_whitespace();
+    if fields.next()? == "Z" {
+        return None;
+    }
+    fields.nth(18)?.parse().ok()
+}
+
+/// The process that forked `pid`
+pub fn parent_pid(pid: u32) -> Option<u32> {
+    read_stat(pid).map(|(_, ppid)| ppid)
+}
+
+/// Whether `pid` still runs (a zombie counts as gone)
+pub fn is_running(pid: u32) -> bool {
+    read_stat(pid).is_some_and(|(state, _)| state != 'Z')
+}
+
+/// Find all processes whose name contains `pattern` (pgrep-style
+/// matching), as (pid, name) in pid order; rsprof itself is left out
+pub fn find_processes_by_name(pattern: &str) -> Result<Vec<(u32, String)>> {
+    let own_pid = std::process::id();
     let mut matches: Vec<(u32, String)> = Vec::new();
 
     for entry in fs::read_dir("/proc")? {
@@ -101,6 +167,9 @@ pub fn find_process_by_name(pattern: &str) -> Result<u32> {
 
         // Check if it's a PID directory
         if let Ok(pid) = name_str.parse::<u32>() {
+            if pid == own_pid {
+                continue;
+            }
             let comm_path = format!("/proc/{}/comm", pid);
             if let Ok(comm) = fs::read_to_string(&comm_path) {
                 let comm = comm.trim();
@@ -112,6 +181,14 @@ pub fn find_process_by_name(pattern: &str) -> Result<u32> {
         }
     }
 
+    matches.sort_unstable_by_key(|&(pid, _)| pid);
+    Ok(matches)
+}
+
+/// Find a process by name (pgrep-style matching)
+pub fn find_process_by_name(pattern: &str) -> Result<u32> {
+    let matches = find_processes_by_name(pattern)?;
+
     match matches.len() {
         0 => Err(Error::ProcessNotFound(format!(
             "No process matching '{}'",
@@ -132,8 +209,16 @@ pub fn find_process_by_name(pattern: &str) -> Result<u32> {
     }
 }
 
+/// This machine's host name, or "localhost" if it cannot be read
+pub fn hostname() -> String {
+    fs::read_to_string("/proc/sys/kernel/hostname")
+        .map(|name| name.trim().to_string())
+        .ok()
+        .filter(|name| !name.is_empty())
+        .unwrap_or_else(|| "localhost".to_string())
+}
+
 /// Sanitize process name for use in filenames
-#[allow(dead_code)]
 pub fn sanitize_name(name: &str) -> String {
     name.chars()
         .map(|c| {
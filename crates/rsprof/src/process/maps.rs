@@ -1,4 +1,5 @@
 use crate::error::{Error, Result};
+use std::collections::HashMap;
 use std::fs;
 use std::path::Path;
 
@@ -79,8 +80,7 @@ impl MemoryMaps {
         // non-zero (typically 0x1000+), leading to a wrong ASLR base calculation.
         for mapping in &self.mappings {
             if let Some(ref pathname) = mapping.pathname
-                && (pathname == exe_str.as_ref()
-                    || pathname.ends_with(exe_path.file_name().unwrap().to_str().unwrap()))
+                && is_exe_pathname(pathname, &exe_str, exe_path)
             {
                 // For PIE binaries, ASLR offset = virtual_addr - file_offset
                 // The first segment usually has offset 0, giving us the true base
@@ -98,6 +98,31 @@ impl MemoryMaps {
         self.mappings.iter().filter(|m| m.is_executable())
     }
 
+    /// Every executable mapping, with the load bias of the shared object it
+    /// belongs to
+    ///
+    /// The bias is taken from the object's first mapping, the same way as
+    /// `aslr_offset`. It is None for the main executable and for mappings
+    /// with no file to read symbols from (`[vdso]`, JIT code).
+    pub fn executable_objects(&self, exe_path: &Path) -> Vec<(&MemoryMapping, Option<u64>)> {
+        let exe_str = exe_path.to_string_lossy();
+        let mut bases: HashMap<&str, u64> = HashMap::new();
+        let mut objects = Vec::new();
+
+        for mapping in &self.mappings {
+            let shared_object = mapping
+                .pathname
+                .as_deref()
+                .filter(|path| path.starts_with('/') && !is_exe_pathname(path, &exe_str, exe_path));
+            let bias = shared_object
+                .map(|path| *bases.entry(path).or_insert(mapping.start - mapping.offset));
+            if mapping.is_executable() {
+                objects.push((mapping, bias));
+            }
+        }
+        objects
+    }
+
     /// Check if an address is in an executable region
     pub fn is_executable_addr(&self, addr: u64) -> bool {
         self.mappings
@@ -105,3 +130,12 @@ impl MemoryMaps {
             .any(|m| m.is_executable() && addr >= m.start && addr < m.end)
     }
 }
+
+/// Whether a mapping's pathname is the main executable
+fn is_exe_pathname(pathname: &str, exe_str: &str, exe_path: &Path) -> bool {
+    pathname == exe_str
+        || exe_path
+            .file_name()
+            .and_then(|name| name.to_str())
+            .is_some_and(|name| pathname.ends_with(name))
+}
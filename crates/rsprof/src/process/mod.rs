@@ -1,5 +1,8 @@
 mod attach;
 mod maps;
 
-pub use attach::{ProcessInfo, find_process_by_name};
+pub use attach::{
+    ProcessInfo, cpu_time, find_process_by_name, find_processes_by_name, hostname, is_running,
+    parent_pid, sanitize_name, start_time, thread_ids, thread_name,
+};
 pub use maps::MemoryMaps;
@@ -0,0 +1,992 @@
+//! Compacted profiles: a read-only columnar form of a finished recording.
+//!
+//! `rsprof compact` writes one file that is memory-mapped on open. Samples
+//! are grouped by location, in checkpoint order, as varint columns with the
+//! checkpoints delta-encoded; a fixed-width index at the end holds each
+//! location's totals and where its columns are. Whole-recording views read
+//! just the index, so `top` and `view` cost per location rather than per
+//! sample. A chart, or a `--since`/`--until` range, decodes only the columns
+//! it reads.
+//!
+//! Layout, little-endian throughout:
+//!
+//! ```text
+//! MAGIC | meta | checkpoints | strings, histograms, columns | index | trailer
+//! ```
+//!
+//! Only raw checkpoints are kept, not the downsampled tiers, so a profile
+//! recorded with `--retention` charts the retained span while its totals
+//! still cover the whole recording. Threads, processes and stacks stay in
+//! the database.
+
+use super::varint::{Reader, put_i64, put_str, put_u64};
+use super::writer::{
+    ChurnEntry, CpuEntry, HeapEntry, OffCpuEntry, TimeSeriesPoint, bucket_cpu_timeseries,
+    bucket_heap_timeseries, query_heap_histograms, rank_churn, upgrade_schema,
+};
+use crate::cpu::PmuCounters;
+use crate::error::{Error, Result};
+use crate::heap::HeapHistogram;
+use crate::heap::histogram::HISTOGRAM_BUCKETS;
+use memmap2::Mmap;
+use rusqlite::Connection;
+use std::collections::HashMap;
+use std::fs::File;
+use std::io::{BufWriter, Read, Write};
+use std::path::{Path, PathBuf};
+
+/// First and last eight bytes of an archive
+const MAGIC: [u8; 8] = *b"RSPROFC\0";
+
+/// Bumped on any change to the layout
+const FORMAT_VERSION: u64 = 1;
+
+/// Index record: 64-bit words, see `Record`
+const RECORD_WORDS: usize = 28;
+const RECORD_BYTES: usize = RECORD_WORDS * 8;
+
+/// Trailer: section offsets and counts, then version and magic
+const TRAILER_WORDS: usize = 9;
+const TRAILER_BYTES: usize = TRAILER_WORDS * 8;
+
+/// Index record flags
+const HAS_HEAP: u64 = 1;
+const HAS_PMU: u64 = 2;
+
+/// Per-location sample columns. Each row is the checkpoint index (delta from
+/// the previous row) then `width` zigzag varints; heap values are
+/// cumulative, so they are stored as deltas from the previous row too.
+#[derive(Clone, Copy)]
+enum Column {
+    Cpu,
+    Heap,
+    OffCpu,
+    Pmu,
+}
+
+impl Column {
+    const ALL: [Column; 4] = [Column::Cpu, Column::Heap, Column::OffCpu, Column::Pmu];
+
+    fn width(self) -> usize {
+        match self {
+            Column::Cpu | Column::OffCpu => 1,
+            Column::Heap => 5,
+            Column::Pmu => 4,
+        }
+    }
+
+    fn cumulative(self) -> bool {
+        matches!(self, Column::Heap)
+    }
+
+    /// Word of the index record holding the column's offset (its length
+    /// follows)
+    fn word(self) -> usize {
+        20 + 2 * self as usize
+    }
+
+    /// (location_id, checkpoint_id, values...) sorted by location, then
+    /// checkpoint
+    fn sql(self) -> &'static str {
+        match self {
+            Column::Cpu => {
+                "SELECT location_id, checkpoint_id, count FROM cpu_samples
+                 ORDER BY location_id, checkpoint_id"
+            }
+            Column::Heap => {
+                "SELECT location_id, checkpoint_id,
+                        alloc_bytes, free_bytes, live_bytes, alloc_count, free_count
+                 FROM heap_samples ORDER BY location_id, checkpoint_id"
+            }
+            Column::OffCpu => {
+                "SELECT location_id, checkpoint_id, blocked_ns FROM offcpu_samples
+                 ORDER BY location_id, checkpoint_id"
+            }
+            Column::Pmu => {
+                "SELECT location_id, checkpoint_id,
+                        cycles, instructions, llc_misses, branch_misses
+                 FROM pmu_samples ORDER BY location_id, checkpoint_id"
+            }
+        }
+    }
+}
+
+fn corrupt(path: &Path, what: &str) -> Error {
+    Error::InvalidArgument(format!(
+        "{} is not a valid compacted profile: {}",
+        path.display(),
+        what
+    ))
+}
+
+/// Whether `path` is a compacted profile rather than a database
+pub fn is_archive(path: &Path) -> bool {
+    let mut magic = [0u8; 8];
+    File::open(path)
+        .and_then(|mut file| file.read_exact(&mut magic))
+        .is_ok_and(|()| magic == MAGIC)
+}
+
+/// Default name of the archive for `db`: the same path with `.rsc` for its
+/// extension
+pub fn archive_path(db: &Path) -> PathBuf {
+    db.with_extension("rsc")
+}
+
+/// Output file being written, tracking its length for section offsets
+struct ArchiveWriter {
+    out: BufWriter<File>,
+    len: u64,
+}
+
+impl ArchiveWriter {
+    /// Append `bytes`; returns where they start and how long they are
+    fn section(&mut self, bytes: &[u8]) -> std::io::Result<(u64, u64)> {
+        let offset = self.len;
+        self.out.write_all(bytes)?;
+        self.len += bytes.len() as u64;
+        Ok((offset, bytes.len() as u64))
+    }
+}
+
+/// An index record being built, as its words
+type RecordWords = [u64; RECORD_WORDS];
+
+/// What `compact` wrote
+pub struct CompactSummary {
+    pub locations: usize,
+    pub checkpoints: usize,
+    pub bytes: u64,
+}
+
+/// Write the compacted form of profile `db` to `out`
+///
+/// The archive is written next to `out` and renamed into place once
+/// complete, so a reader never maps a partial file.
+pub fn compact(db: &Path, out: &Path) -> Result<CompactSummary> {
+    // Connection::open would create an empty database instead
+    if !db.exists() {
+        return Err(Error::InvalidArgument(format!(
+            "profile not found: {}",
+            db.display()
+        )));
+    }
+    let conn = Connection::open(db)?;
+    upgrade_schema(&conn)?;
+
+    let mut tmp_name = out.as_os_str().to_owned();
+    tmp_name.push(".tmp");
+    let tmp = PathBuf::from(tmp_name);
+    let result = write_archive(&conn, &tmp);
+    match result {
+        Ok(summary) => {
+            std::fs::rename(&tmp, out)?;
+            Ok(summary)
+        }
+        Err(e) => {
+            let _ = std::fs::remove_file(&tmp);
+            Err(e)
+        }
+    }
+}
+
+fn write_archive(conn: &Connection, path: &Path) -> Result<CompactSummary> {
+    let mut writer = ArchiveWriter {
+        out: BufWriter::new(File::create(path)?),
+        len: 0,
+    };
+    writer.section(&MAGIC)?;
+
+    let mut buf = Vec::new();
+    let meta: Vec<(String, String)> = conn
+        .prepare("SELECT key, value FROM meta ORDER BY key")?
+        .query_map([], |row| Ok((row.get(0)?, row.get(1)?)))?
+        .collect::<rusqlite::Result<_>>()?;
+    put_u64(&mut buf, meta.len() as u64);
+    for (key, value) in &meta {
+        put_str(&mut buf, key);
+        put_str(&mut buf, value);
+    }
+    let meta_section = writer.section(&buf)?;
+
+    // Checkpoints by index, each with its CPU sample total (for percentages)
+    let checkpoints: Vec<(i64, i64)> = conn
+        .prepare("SELECT id, timestamp_ms FROM checkpoints ORDER BY id")?
+        .query_map([], |row| Ok((row.get(0)?, row.get(1)?)))?
+        .collect::<rusqlite::Result<_>>()?;
+    let checkpoint_index: HashMap<i64, u64> = checkpoints
+        .iter()
+        .enumerate()
+        .map(|(index, &(id, _))| (id, index as u64))
+        .collect();
+    let checkpoint_cpu: HashMap<i64, i64> = conn
+        .prepare("SELECT checkpoint_id, SUM(count) FROM cpu_samples GROUP BY checkpoint_id")?
+        .query_map([], |row| Ok((row.get(0)?, row.get(1)?)))?
+        .collect::<rusqlite::Result<_>>()?;
+    buf.clear();
+    let mut prev_ms = 0;
+    for &(id, timestamp_ms) in &checkpoints {
+        put_i64(&mut buf, timestamp_ms - prev_ms);
+        put_u64(
+            &mut buf,
+            checkpoint_cpu.get(&id).copied().unwrap_or(0) as u64,
+        );
+        prev_ms = timestamp_ms;
+    }
+    let checkpoint_section = writer.section(&buf)?;
+
+    // Locations, in id order, with their names
+    let mut records = Vec::new();
+    let mut record_index = HashMap::new();
+    let mut stmt = conn.prepare("SELECT id, file, line, function FROM locations ORDER BY id")?;
+    let rows = stmt.query_map([], |row| {
+        Ok((
+            row.get::<_, i64>(0)?,
+            row.get::<_, String>(1)?,
+            row.get::<_, i64>(2)?,
+            row.get::<_, String>(3)?,
+        ))
+    })?;
+    for row in rows {
+        let (id, file, line, function) = row?;
+        let mut words = [0u64; RECORD_WORDS];
+        words[0] = id as u64;
+        words[1] = line as u64;
+        (words[2], words[3]) = writer.section(file.as_bytes())?;
+        (words[4], words[5]) = writer.section(function.as_bytes())?;
+        record_index.insert(id, records.len());
+        records.push(words);
+    }
+
+    // Whole-recording totals, from the running-total tables
+    let mut stmt = conn.prepare("SELECT location_id, samples FROM cpu_totals")?;
+    for row in stmt.query_map([], |row| Ok((row.get::<_, i64>(0)?, row.get::<_, i64>(1)?)))? {
+        let (id, samples) = row?;
+        if let Some(&i) = record_index.get(&id) {
+            let words = &mut records[i];
+            words[6] = samples as u64;
+        }
+    }
+    let mut stmt = conn.prepare("SELECT location_id, blocked_ns FROM offcpu_totals")?;
+    for row in stmt.query_map([], |row| Ok((row.get::<_, i64>(0)?, row.get::<_, i64>(1)?)))? {
+        let (id, blocked_ns) = row?;
+        if let Some(&i) = record_index.get(&id) {
+            let words = &mut records[i];
+            words[7] = blocked_ns as u64;
+        }
+    }
+    let mut stmt = conn.prepare(
+        "SELECT location_id, alloc_bytes, free_bytes, live_bytes, alloc_count, free_count
+         FROM heap_latest",
+    )?;
+    for row in stmt.query_map([], |row| {
+        let mut values = [0i64; 6];
+        for (i, value) in values.iter_mut().enumerate() {
+            *value = row.get(i)?;
+        }
+        Ok(values)
+    })? {
+        let values = row?;
+        if let Some(&i) = record_index.get(&values[0]) {
+            let words = &mut records[i];
+            words[8] |= HAS_HEAP;
+            for (word, &value) in words[9..14].iter_mut().zip(&values[1..]) {
+                *word = value as u64;
+            }
+        }
+    }
+    let mut stmt = conn.prepare(
+        "SELECT location_id, cycles, instructions, llc_misses, branch_misses FROM pmu_totals",
+    )?;
+    for row in stmt.query_map([], |row| {
+        let mut values = [0i64; 5];
+        for (i, value) in values.iter_mut().enumerate() {
+            *value = row.get(i)?;
+        }
+        Ok(values)
+    })? {
+        let values = row?;
+        if let Some(&i) = record_index.get(&values[0]) {
+            let words = &mut records[i];
+            words[8] |= HAS_PMU;
+            for (word, &value) in words[14..18].iter_mut().zip(&values[1..]) {
+                *word = value as u64;
+            }
+        }
+    }
+
+    for (id, histogram) in query_heap_histograms(conn)? {
+        let Some(&i) = record_index.get(&id) else {
+            continue;
+        };
+        buf.clear();
+        for &count in histogram.size.iter().chain(&histogram.lifetime) {
+            put_u64(&mut buf, count);
+        }
+        (records[i][18], records[i][19]) = writer.section(&buf)?;
+    }
+
+    for column in Column::ALL {
+        write_columns(
+            conn,
+            &mut writer,
+            column,
+            &checkpoint_index,
+            &record_index,
+            &mut records,
+        )?;
+    }
+
+    let index_offset = writer.len;
+    for record in &records {
+        for word in record {
+            writer.out.write_all(&word.to_le_bytes())?;
+        }
+    }
+    writer.len += (records.len() * RECORD_BYTES) as u64;
+
+    let trailer = [
+        meta_section.0,
+        meta_section.1,
+        checkpoint_section.0,
+        checkpoint_section.1,
+        checkpoints.len() as u64,
+        index_offset,
+        records.len() as u64,
+        FORMAT_VERSION,
+        u64::from_le_bytes(MAGIC),
+    ];
+    for word in trailer {
+        writer.out.write_all(&word.to_le_bytes())?;
+    }
+    writer.len += TRAILER_BYTES as u64;
+    writer.out.flush()?;
+
+    Ok(CompactSummary {
+        locations: records.len(),
+        checkpoints: checkpoints.len(),
+        bytes: writer.len,
+    })
+}
+
+/// Write one column per location from `column`'s rows, which arrive grouped
+/// by location
+fn write_columns(
+    conn: &Connection,
+    writer: &mut ArchiveWriter,
+    column: Column,
+    checkpoint_index: &HashMap<i64, u64>,
+    record_index: &HashMap<i64, usize>,
+    records: &mut [RecordWords],
+) -> Result<()> {
+    let width = column.width();
+    let mut stmt = conn.prepare(column.sql())?;
+    let rows = stmt.query_map([], |row| {
+        let mut values = [0i64; 5];
+        for (i, value) in values.iter_mut().enumerate().take(width) {
+            *value = row.get(2 + i)?;
+        }
+        Ok((row.get::<_, i64>(0)?, row.get::<_, i64>(1)?, values))
+    })?;
+
+    let mut buf = Vec::new();
+    let mut current: Option<usize> = None;
+    let mut prev_index = 0;
+    let mut prev_values = [0i64; 5];
+    let word = column.word();
+    for row in rows {
+        let (location_id, checkpoint_id, values) = row?;
+        let (Some(&record), Some(&index)) = (
+            record_index.get(&location_id),
+            checkpoint_index.get(&checkpoint_id),
+        ) else {
+            continue;
+        };
+        if current != Some(record) {
+            if let Some(done) = current {
+                (records[done][word], records[done][word + 1]) = writer.section(&buf)?;
+            }
+            buf.clear();
+            current = Some(record);
+            prev_index = 0;
+            prev_values = [0; 5];
+        }
+        put_u64(&mut buf, index - prev_index);
+        for i in 0..width {
+            let base = if column.cumulative() {
+                prev_values[i]
+            } else {
+                0
+            };
+            put_i64(&mut buf, values[i] - base);
+        }
+        prev_index = index;
+        prev_values = values;
+    }
+    if let Some(done) = current {
+        (records[done][word], records[done][word + 1]) = writer.section(&buf)?;
+    }
+    Ok(())
+}
+
+/// One location's index entry:
+///
+/// | words | field |
+/// |---|---|
+/// | 0, 1 | location id, line |
+/// | 2..6 | file and function (offset, length) |
+/// | 6, 7 | CPU samples, off-CPU ns |
+/// | 8 | flags (`HAS_HEAP`, `HAS_PMU`) |
+/// | 9..14 | latest alloc, free and live bytes, alloc and free counts |
+/// | 14..18 | PMU cycles, instructions, LLC and branch misses |
+/// | 18, 19 | allocation histograms (offset, length; empty for none) |
+/// | 20..28 | `Column`s (offset, length each) |
+#[derive(Clone, Copy)]
+struct Record<'a> {
+    words: &'a [u8],
+}
+
+impl Record<'_> {
+    fn word(&self, i: usize) -> u64 {
+        let mut bytes = [0u8; 8];
+        bytes.copy_from_slice(&self.words[i * 8..i * 8 + 8]);
+        u64::from_le_bytes(bytes)
+    }
+
+    fn location_id(&self) -> i64 {
+        self.word(0) as i64
+    }
+
+    fn cpu_samples(&self) -> u64 {
+        self.word(6)
+    }
+
+    fn offcpu_ns(&self) -> u64 {
+        self.word(7)
+    }
+
+    fn has(&self, flag: u64) -> bool {
+        self.word(8) & flag != 0
+    }
+
+    fn heap(&self) -> [i64; 5] {
+        std::array::from_fn(|i| self.word(9 + i) as i64)
+    }
+
+    fn pmu(&self) -> PmuCounters {
+        PmuCounters {
+            cycles: self.word(14),
+            instructions: self.word(15),
+            llc_misses: self.word(16),
+            branch_misses: self.word(17),
+        }
+    }
+}
+
+/// A compacted profile, memory-mapped
+pub struct Archive {
+    map: Mmap,
+    meta: HashMap<String, String>,
+    /// Checkpoint timestamps, by index
+    timestamps: Vec<i64>,
+    /// CPU samples in each checkpoint, over all locations
+    checkpoint_cpu: Vec<u64>,
+    index_offset: usize,
+    location_count: usize,
+    total_samples: u64,
+}
+
+impl Archive {
+    pub fn open(path: &Path) -> Result<Self> {
+        let file = File::open(path)?;
+        // The file is never written in place: compact renames a finished
+        // archive over it
+        let map = unsafe { Mmap::map(&file) }?;
+
+        if map.len() < MAGIC.len() + TRAILER_BYTES || map[..MAGIC.len()] != MAGIC {
+            return Err(corrupt(path, "bad header"));
+        }
+        let trailer_at = map.len() - TRAILER_BYTES;
+        let trailer: Vec<u64> = map[trailer_at..]
+            .chunks_exact(8)
+            .map(|chunk| u64::from_le_bytes(chunk.try_into().unwrap_or_default()))
+            .collect();
+        if trailer[8] != u64::from_le_bytes(MAGIC) {
+            return Err(corrupt(path, "bad trailer"));
+        }
+        if trailer[7] != FORMAT_VERSION {
+            return Err(Error::InvalidArgument(format!(
+                "{} is a format {} archive; this rsprof reads format {} (compact the database again)",
+                path.display(),
+                trailer[7],
+                FORMAT_VERSION
+            )));
+        }
+
+        let section = |offset: u64, len: u64| {
+            let start = usize::try_from(offset).ok()?;
+            let end = start.checked_add(usize::try_from(len).ok()?)?;
+            (end <= trailer_at).then(|| &map[start..end])
+        };
+
+        let mut meta = HashMap::new();
+        let mut cursor =
+            Reader::new(section(trailer[0], trailer[1]).ok_or_else(|| corrupt(path, "meta"))?);
+        let count = cursor.u64().ok_or_else(|| corrupt(path, "meta"))?;
+        for _ in 0..count {
+            let (Some(key), Some(value)) = (cursor.str(), cursor.str()) else {
+                return Err(corrupt(path, "meta"));
+            };
+            meta.insert(key.to_string(), value.to_string());
+        }
+
+        let checkpoint_count = trailer[4] as usize;
+        let mut cursor = Reader::new(
+            section(trailer[2], trailer[3]).ok_or_else(|| corrupt(path, "checkpoints"))?,
+        );
+        let mut timestamps = Vec::with_capacity(checkpoint_count.min(trailer[3] as usize));
+        let mut checkpoint_cpu = Vec::with_capacity(timestamps.capacity());
+        let mut timestamp_ms = 0;
+        for _ in 0..checkpoint_count {
+            let (Some(delta), Some(samples)) = (cursor.i64(), cursor.u64()) else {
+                return Err(corrupt(path, "checkpoints"));
+            };
+            timestamp_ms += delta;
+            timestamps.push(timestamp_ms);
+            checkpoint_cpu.push(samples);
+        }
+
+        let location_count = trailer[6] as usize;
+        let index_len = (location_count as u64).saturating_mul(RECORD_BYTES as u64);
+        section(trailer[5], index_len).ok_or_else(|| corrupt(path, "index"))?;
+
+        let mut archive = Archive {
+            map,
+            meta,
+            timestamps,
+            checkpoint_cpu,
+            index_offset: trailer[5] as usize,
+            location_count,
+            total_samples: 0,
+        };
+        archive.total_samples = archive.records().map(|r| r.cpu_samples()).sum();
+        Ok(archive)
+    }
+
+    fn records(&self) -> impl Iterator<Item = Record<'_>> {
+        (0..self.location_count).map(|i| self.record(i))
+    }
+
+    fn record(&self, i: usize) -> Record<'_> {
+        let start = self.index_offset + i * RECORD_BYTES;
+        Record {
+            words: &self.map[start..start + RECORD_BYTES],
+        }
+    }
+
+    /// Index entry of a location; records are in id order
+    fn find(&self, location_id: i64) -> Option<Record<'_>> {
+        let mut low = 0;
+        let mut high = self.location_count;
+        while low < high {
+            let mid = (low + high) / 2;
+            let record = self.record(mid);
+            match record.location_id().cmp(&location_id) {
+                std::cmp::Ordering::Less => low = mid + 1,
+                std::cmp::Ordering::Greater => high = mid,
+                std::cmp::Ordering::Equal => return Some(record),
+            }
+        }
+        None
+    }
+
+    /// Bytes at (offset, length) words `word` and `word + 1` of a record;
+    /// empty when out of bounds
+    fn slice(&self, record: Record<'_>, word: usize) -> &[u8] {
+        let start = record.word(word) as usize;
+        let end = start.saturating_add(record.word(word + 1) as usize);
+        self.map.get(start..end).unwrap_or_default()
+    }
+
+    fn text(&self, record: Record<'_>, word: usize) -> String {
+        String::from_utf8_lossy(self.slice(record, word)).into_owned()
+    }
+
+    /// A column's rows as (checkpoint index, values)
+    fn column(&self, record: Record<'_>, column: Column) -> Vec<(usize, [i64; 5])> {
+        let width = column.width();
+        let mut cursor = Reader::new(self.slice(record, column.word()));
+        let mut rows = Vec::new();
+        let mut index = 0;
+        let mut values = [0i64; 5];
+        'rows: while !cursor.is_empty() {
+            let Some(delta) = cursor.u64() else {
+                break;
+            };
+            index += delta as usize;
+            for value in values.iter_mut().take(width) {
+                let Some(stored) = cursor.i64() else {
+                    break 'rows;
+                };
+                *value = if column.cumulative() {
+                    *value + stored
+                } else {
+                    stored
+                };
+            }
+            rows.push((index, values));
+        }
+        rows
+    }
+
+    fn histogram(&self, record: Record<'_>) -> Option<HeapHistogram> {
+        let bytes = self.slice(record, 18);
+        if bytes.is_empty() {
+            return None;
+        }
+        let mut cursor = Reader::new(bytes);
+        let mut histogram = HeapHistogram::default();
+        for bucket in 0..HISTOGRAM_BUCKETS {
+            histogram.size[bucket] = cursor.u64()?;
+        }
+        for bucket in 0..HISTOGRAM_BUCKETS {
+            histogram.lifetime[bucket] = cursor.u64()?;
+        }
+        Some(histogram)
+    }
+
+    fn cpu_entry(&self, record: Record<'_>, samples: u64, total: u64) -> CpuEntry {
+        CpuEntry {
+            location_id: record.location_id(),
+            file: self.text(record, 2),
+            line: record.word(1) as u32,
+            function: self.text(record, 4),
+            total_samples: samples,
+            total_percent: (samples as f64 / total as f64) * 100.0,
+            instant_percent: 0.0,
+        }
+    }
+
+    /// `values` are alloc, free and live bytes, then alloc and free counts
+    fn heap_entry(&self, record: Record<'_>, values: [i64; 5]) -> HeapEntry {
+        HeapEntry {
+            location_id: record.location_id(),
+            file: self.text(record, 2),
+            line: record.word(1) as u32,
+            function: self.text(record, 4),
+            total_alloc_bytes: values[0],
+            total_free_bytes: values[1],
+            live_bytes: values[2],
+            alloc_count: values[3] as u64,
+            free_count: values[4] as u64,
+        }
+    }
+
+    /// Sum of a column's first `width` values over checkpoints `first..=last`
+    fn column_sum(
+        &self,
+        record: Record<'_>,
+        column: Column,
+        first: usize,
+        last: usize,
+    ) -> [i64; 5] {
+        let mut sum = [0i64; 5];
+        for (index, values) in self.column(record, column) {
+            if (first..=last).contains(&index) {
+                for (total, value) in sum.iter_mut().zip(values) {
+                    *total += value;
+                }
+            }
+        }
+        sum
+    }
+
+    pub fn meta(&self, key: &str) -> Option<&str> {
+        self.meta.get(key).map(String::as_str)
+    }
+
+    fn meta_u64(&self, key: &str) -> u64 {
+        self.meta(key).and_then(|v| v.parse().ok()).unwrap_or(0)
+    }
+
+    /// Timestamp of the last checkpoint
+    pub fn duration_ms(&self) -> Option<i64> {
+        self.timestamps.last().copied()
+    }
+
+    pub fn total_samples(&self) -> u64 {
+        self.total_samples
+    }
+
+    pub fn lost_samples(&self) -> u64 {
+        self.meta_u64("lost_samples")
+    }
+
+    pub fn dropped_events(&self) -> u64 {
+        self.meta_u64("dropped_events")
+    }
+
+    /// First and last checkpoint indexes inside a time window, as
+    /// `query_checkpoint_range` picks them
+    pub fn checkpoint_range(
+        &self,
+        since_ms: Option<i64>,
+        until_ms: Option<i64>,
+    ) -> Option<(usize, usize)> {
+        let end_ms = self.duration_ms()?;
+        let from_ms = since_ms.map_or(i64::MIN, |since| end_ms - since);
+        let to_ms = until_ms.unwrap_or(i64::MAX);
+        let mut inside = self
+            .timestamps
+            .iter()
+            .enumerate()
+            .filter(|&(_, &ms)| ms >= from_ms && ms <= to_ms)
+            .map(|(index, _)| index);
+        let first = inside.next()?;
+        Some((first, inside.next_back().unwrap_or(first)))
+    }
+
+    /// Top CPU locations over the recording, or checkpoints `first..=last`
+    pub fn top_cpu(
+        &self,
+        range: Option<(usize, usize)>,
+        limit: usize,
+        threshold: f64,
+    ) -> Vec<CpuEntry> {
+        let samples: Vec<(Record<'_>, u64)> = match range {
+            None => self.records().map(|r| (r, r.cpu_samples())).collect(),
+            Some((first, last)) => self
+                .records()
+                .filter(|r| r.cpu_samples() > 0)
+                .map(|r| (r, self.column_sum(r, Column::Cpu, first, last)[0] as u64))
+                .collect(),
+        };
+        let total: u64 = samples.iter().map(|&(_, n)| n).sum();
+        let mut ranked: Vec<_> = samples.into_iter().filter(|&(_, n)| n > 0).collect();
+        ranked.sort_by_key(|&(_, n)| std::cmp::Reverse(n));
+        ranked
+            .into_iter()
+            .map(|(record, n)| self.cpu_entry(record, n, total))
+            .filter(|e| e.total_percent >= threshold)
+            .take(limit)
+            .collect()
+    }
+
+    /// Top heap locations by live bytes at the end of the recording, or of
+    /// checkpoints `first..=last` (with allocation totals for the range)
+    pub fn top_heap(&self, range: Option<(usize, usize)>, limit: usize) -> Vec<HeapEntry> {
+        let heap = self.records().filter(|r| r.has(HAS_HEAP));
+        let mut entries: Vec<HeapEntry> = match range {
+            None => heap.map(|r| self.heap_entry(r, r.heap())).collect(),
+            Some((first, last)) => heap
+                .filter_map(|r| {
+                    let rows = self.column(r, Column::Heap);
+                    let latest = |end: usize| rows.iter().rev().find(|(i, _)| *i < end);
+                    let (_, hi) = latest(last + 1)?;
+                    let lo = latest(first).map_or([0; 5], |&(_, values)| values);
+                    let mut values: [i64; 5] = std::array::from_fn(|i| hi[i] - lo[i]);
+                    values[2] = hi[2];
+                    Some(self.heap_entry(r, values))
+                })
+                .collect(),
+        };
+        entries.sort_by(|a, b| {
+            (b.live_bytes, b.total_alloc_bytes).cmp(&(a.live_bytes, a.total_alloc_bytes))
+        });
+        entries.truncate(limit);
+        entries
+    }
+
+    /// Top off-CPU locations over the recording, or checkpoints `first..=last`
+    pub fn top_offcpu(
+        &self,
+        range: Option<(usize, usize)>,
+        limit: usize,
+        threshold: f64,
+    ) -> Vec<OffCpuEntry> {
+        let mut entries: Vec<OffCpuEntry> = self
+            .records()
+            .filter(|r| r.offcpu_ns() > 0)
+            .map(|r| {
+                let blocked_ns = match range {
+                    None => r.offcpu_ns(),
+                    Some((first, last)) => {
+                        self.column_sum(r, Column::OffCpu, first, last)[0] as u64
+                    }
+                };
+                OffCpuEntry {
+                    location_id: r.location_id(),
+                    file: self.text(r, 2),
+                    line: r.word(1) as u32,
+                    function: self.text(r, 4),
+                    blocked_ns,
+                    percent: 0.0,
+                }
+            })
+            .filter(|e| e.blocked_ns > 0)
+            .collect();
+        entries.sort_by_key(|e| std::cmp::Reverse(e.blocked_ns));
+
+        let total: u64 = entries.iter().map(|e| e.blocked_ns).sum();
+        for entry in &mut entries {
+            entry.percent = (entry.blocked_ns as f64 / total as f64) * 100.0;
+        }
+        entries.retain(|e| e.percent >= threshold);
+        entries.truncate(limit);
+        entries
+    }
+
+    /// Hardware counters per location, over the recording or checkpoints
+    /// `first..=last`
+    pub fn pmu(&self, range: Option<(usize, usize)>) -> HashMap<i64, PmuCounters> {
+        self.records()
+            .filter(|r| r.has(HAS_PMU))
+            .map(|r| {
+                let counters = match range {
+                    None => r.pmu(),
+                    Some((first, last)) => {
+                        let sum = self.column_sum(r, Column::Pmu, first, last);
+                        PmuCounters {
+                            cycles: sum[0] as u64,
+                            instructions: sum[1] as u64,
+                            llc_misses: sum[2] as u64,
+                            branch_misses: sum[3] as u64,
+                        }
+                    }
+                };
+                (r.location_id(), counters)
+            })
+            .collect()
+    }
+
+    /// Heap locations most worth pooling, as `query_top_churn` ranks them
+    pub fn top_churn(&self, limit: usize) -> Vec<ChurnEntry> {
+        let mut histograms = HashMap::new();
+        let mut entries = Vec::new();
+        for record in self.records().filter(|r| r.has(HAS_HEAP)) {
+            if let Some(histogram) = self.histogram(record) {
+                histograms.insert(record.location_id(), histogram);
+                entries.push(self.heap_entry(record, record.heap()));
+            }
+        }
+        let secs = self.duration_ms().unwrap_or(0) as f64 / 1000.0;
+        rank_churn(&entries, &histograms, secs, limit)
+    }
+
+    /// A location's share of each checkpoint's CPU samples, where it had any
+    pub fn cpu_timeseries(&self, location_id: i64) -> Vec<TimeSeriesPoint> {
+        let Some(record) = self.find(location_id) else {
+            return Vec::new();
+        };
+        self.column(record, Column::Cpu)
+            .into_iter()
+            .filter_map(|(index, values)| {
+                let total = *self.checkpoint_cpu.get(index)?;
+                Some(TimeSeriesPoint {
+                    timestamp_ms: self.timestamps[index],
+                    percent: if total > 0 {
+                        values[0] as f64 * 100.0 / total as f64
+                    } else {
+                        0.0
+                    },
+                })
+            })
+            .collect()
+    }
+
+    /// CPU% in `num_buckets` buckets of `start_ms..end_ms`, the highest
+    /// checkpoint in each, as `query_cpu_timeseries_aggregated`
+    pub fn cpu_timeseries_aggregated(
+        &self,
+        location_id: i64,
+        start_ms: i64,
+        end_ms: i64,
+        num_buckets: usize,
+    ) -> Vec<(f64, f64)> {
+        bucket_cpu_timeseries(
+            self.cpu_timeseries(location_id),
+            start_ms,
+            end_ms,
+            num_buckets,
+        )
+    }
+
+    /// Live bytes in `num_buckets` buckets of `start_ms..end_ms`, carrying
+    /// values forward, as `query_heap_timeseries_aggregated`
+    pub fn heap_timeseries_aggregated(
+        &self,
+        location_id: i64,
+        start_ms: i64,
+        end_ms: i64,
+        num_buckets: usize,
+    ) -> Vec<(f64, f64)> {
+        let Some(record) = self.find(location_id) else {
+            return Vec::new();
+        };
+        let Some(&last_ms) = self
+            .timestamps
+            .iter()
+            .filter(|&&ms| ms >= start_ms && ms < end_ms)
+            .max()
+        else {
+            return Vec::new();
+        };
+
+        let mut carried = None;
+        let mut changes = Vec::new();
+        for (index, values) in self.column(record, Column::Heap) {
+            let Some(&ms) = self.timestamps.get(index) else {
+                break;
+            };
+            if ms < start_ms {
+                carried = Some(values[2]);
+            } else {
+                changes.push((ms, values[2]));
+            }
+        }
+        bucket_heap_timeseries(carried, changes, last_ms, start_ms, end_ms, num_buckets)
+    }
+
+    /// Live bytes at each of the last `num_points` checkpoints for the given
+    /// heap locations, as `query_heap_sparklines_for_locations`
+    pub fn heap_sparklines(
+        &self,
+        num_points: usize,
+        location_ids: &[i64],
+    ) -> HashMap<i64, Vec<i64>> {
+        let count = self.timestamps.len().min(num_points);
+        let window = self.timestamps.len() - count;
+        let records: Vec<Record<'_>> = if location_ids.is_empty() {
+            self.records().filter(|r| r.has(HAS_HEAP)).collect()
+        } else {
+            location_ids
+                .iter()
+                .filter_map(|&id| self.find(id))
+                .collect()
+        };
+
+        let mut sparklines = HashMap::new();
+        for record in records {
+            let rows = self.column(record, Column::Heap);
+            if rows.is_empty() {
+                continue;
+            }
+            let mut rows = rows.into_iter().peekable();
+            let mut live = 0;
+            let points = (window..window + count)
+                .map(|checkpoint| {
+                    while let Some(&(index, values)) = rows.peek() {
+                        if index > checkpoint {
+                            break;
+                        }
+                        live = values[2];
+                        rows.next();
+                    }
+                    live
+                })
+                .collect();
+            sparklines.insert(record.location_id(), points);
+        }
+        sparklines
+    }
+}
@@ -0,0 +1,130 @@
+//! Pre-trigger ring for `--trigger` capture.
+//!
+//! Checkpoints are held in memory for the pre-trigger window instead of
+//! going to the writer. Older ones are merged into a baseline checkpoint,
+//! written once per baseline interval. When a trigger fires, the baseline
+//! and then the ring are written, and the checkpoints of the post-trigger
+//! window go straight through. Merging keeps every count, so totals stay
+//! exact; only the time resolution outside the windows is lost.
+
+use super::flusher::CheckpointBatch;
+use std::collections::VecDeque;
+use std::time::Duration;
+
+/// Windows of a triggered capture
+#[derive(Debug, Clone, Copy)]
+pub struct CaptureWindows {
+    /// Recording kept at full resolution before a trigger
+    pub pre: Duration,
+    /// And after it
+    pub post: Duration,
+    /// Resolution of the recording outside the windows
+    pub baseline: Duration,
+}
+
+pub(super) struct CaptureRing {
+    windows: CaptureWindows,
+    /// Checkpoints of the pre-trigger window with the time each was
+    /// taken, oldest first
+    ring: VecDeque<(i64, Box<CheckpointBatch>)>,
+    /// Checkpoints that left the ring since the last baseline write, merged
+    baseline: Option<Box<CheckpointBatch>>,
+    /// When the baseline was last written
+    baseline_written_ms: i64,
+    /// After a trigger, checkpoints are written as taken until then
+    capture_until_ms: Option<i64>,
+}
+
+impl CaptureRing {
+    pub fn new(windows: CaptureWindows, now_ms: i64) -> Self {
+        CaptureRing {
+            windows,
+            ring: VecDeque::new(),
+            baseline: None,
+            baseline_written_ms: now_ms,
+            capture_until_ms: None,
+        }
+    }
+
+    /// Whether a trigger's post-trigger window is still open
+    pub fn capturing(&self, now_ms: i64) -> bool {
+        self.capture_until_ms.is_some_and(|until| now_ms <= until)
+    }
+
+    /// Take a checkpoint; returns one to write now, if any: the checkpoint
+    /// itself in a post-trigger window, or a baseline that is due
+    pub fn hold(
+        &mut self,
+        batch: Box<CheckpointBatch>,
+        now_ms: i64,
+    ) -> Option<Box<CheckpointBatch>> {
+        if self.capturing(now_ms) {
+            return Some(batch);
+        }
+        self.capture_until_ms = None;
+
+        self.ring.push_back((now_ms, batch));
+        let window_start_ms = now_ms - self.windows.pre.as_millis() as i64;
+        while self
+            .ring
+            .front()
+            .is_some_and(|&(taken_ms, _)| taken_ms < window_start_ms)
+        {
+            if let Some((_, batch)) = self.ring.pop_front() {
+                self.fold(batch);
+            }
+        }
+
+        if now_ms - self.baseline_written_ms < self.windows.baseline.as_millis() as i64 {
+            return None;
+        }
+        let baseline = self.baseline.take()?;
+        self.baseline_written_ms = now_ms;
+        Some(baseline)
+    }
+
+    /// Open a post-trigger window; returns the held baseline and ring to
+    /// write now, oldest first
+    ///
+    /// A trigger during an open window extends it.
+    pub fn trigger(&mut self, now_ms: i64) -> VecDeque<Box<CheckpointBatch>> {
+        self.capture_until_ms = Some(now_ms + self.windows.post.as_millis() as i64);
+        let mut due: VecDeque<Box<CheckpointBatch>> =
+            self.ring.drain(..).map(|(_, batch)| batch).collect();
+        if let Some(baseline) = self.baseline.take() {
+            due.push_front(baseline);
+        }
+        self.baseline_written_ms = now_ms;
+        due
+    }
+
+    /// The last checkpoint of the recording, `last`, with everything still
+    /// held merged into it unless a post-trigger window is open
+    pub fn finish(
+        mut self,
+        last: Option<Box<CheckpointBatch>>,
+        now_ms: i64,
+    ) -> Option<Box<CheckpointBatch>> {
+        if self.capturing(now_ms) {
+            return last;
+        }
+        let held = std::mem::take(&mut self.ring);
+        for (_, batch) in held {
+            self.fold(batch);
+        }
+        if let Some(batch) = last {
+            self.fold(batch);
+        }
+        self.baseline
+    }
+
+    /// Merge a checkpoint leaving the ring into the baseline
+    fn fold(&mut self, mut batch: Box<CheckpointBatch>) {
+        if let Some(older) = self.baseline.take() {
+            // A batch with only locations or meta has no timestamp of its own
+            batch.timestamp_ms = batch.timestamp_ms.max(older.timestamp_ms);
+            batch.absorb_older(*older);
+        }
+        self.baseline = Some(batch);
+    }
+}
@@ -0,0 +1,746 @@
+//! Background writer thread for checkpoint batches.
+//!
+//! The sampling loop hands each checkpoint to this thread through a bounded
+//! channel and never waits on SQLite, so a slow disk or a reader holding the
+//! database only delays the writes, not the sampling. A streaming agent runs
+//! its network sender (see `stream`) behind the same queue.
+
+use super::schema;
+use super::writer::ProfilerStats;
+use crate::cpu::PmuCounters;
+use crate::error::{Error, Result};
+use crate::heap::HeapHistogram;
+use crate::symbols::Location;
+use rusqlite::Connection;
+use std::collections::HashMap;
+use std::path::Path;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::mpsc::{self, Receiver, SyncSender, TrySendError};
+use std::sync::{Arc, Mutex};
+use std::thread::JoinHandle;
+use std::time::{Duration, Instant};
+
+/// Checkpoints that can be queued before the sampling loop starts
+/// coalescing them
+pub(super) const QUEUE_DEPTH: usize = 64;
+
+/// Most queued checkpoints written in one transaction
+const MAX_CHECKPOINTS_PER_TX: usize = 16;
+
+/// How long the writer waits on a database locked by a reader
+const BUSY_TIMEOUT: Duration = Duration::from_secs(5);
+
+/// Heap sample data: (alloc_bytes, free_bytes, live_bytes, alloc_count, free_count)
+pub(super) type HeapSampleData = (i64, i64, i64, u64, u64);
+
+/// Everything one checkpoint writes
+#[derive(Default)]
+pub(super) struct CheckpointBatch {
+    /// Checkpoint time; None for a batch with only locations, threads or meta
+    pub timestamp_ms: Option<i64>,
+    /// New locations, with ids assigned by `Storage`
+    pub locations: Vec<(i64, Location)>,
+    /// Newly attached processes: (pid, name, exe path)
+    pub processes: Vec<(u32, String, String)>,
+    /// Newly seen threads: (tid, pid, name)
+    pub threads: Vec<(u32, u32, String)>,
+    /// New stacks as location ids, leaf first, with ids assigned by `Storage`
+    pub stacks: Vec<(i64, Vec<i64>)>,
+    /// location_id -> count
+    pub cpu: HashMap<i64, u64>,
+    /// (tid, location_id) -> count
+    pub thread_cpu: HashMap<(u32, i64), u64>,
+    /// stack_id -> count
+    pub stack_cpu: HashMap<i64, u64>,
+    /// location_id -> cumulative heap stats
+    pub heap: HashMap<i64, HeapSampleData>,
+    /// (pid, location_id) -> cumulative heap stats of one process
+    pub process_heap: HashMap<(u32, i64), HeapSampleData>,
+    /// location_id -> cumulative size and lifetime histograms
+    pub heap_histograms: HashMap<i64, HeapHistogram>,
+    /// location_id -> nanoseconds blocked
+    pub offcpu: HashMap<i64, u64>,
+    /// location_id -> hardware counter deltas
+    pub pmu: HashMap<i64, PmuCounters>,
+    /// Metadata keys to set
+    pub meta: HashMap<&'static str, String>,
+    /// Drop raw samples from checkpoints before this time (retention)
+    pub prune_before_ms: Option<i64>,
+    /// Sampling loop costs; the writer fills in its own
+    pub stats: ProfilerStats,
+}
+
+impl CheckpointBatch {
+    /// Fold in an older batch that was never written
+    ///
+    /// Counts add up and the older locations, stacks, processes and threads
+    /// go first. Heap stats and histograms are cumulative, so the newer ones
+    /// win where both have a location; the timestamp is left alone.
+    pub fn absorb_older(&mut self, older: CheckpointBatch) {
+        let mut locations = older.locations;
+        locations.append(&mut self.locations);
+        self.locations = locations;
+
+        let mut stacks = older.stacks;
+        stacks.append(&mut self.stacks);
+        self.stacks = stacks;
+
+        let mut processes = older.processes;
+        processes.append(&mut self.processes);
+        self.processes = processes;
+
+        let mut threads = older.threads;
+        threads.append(&mut self.threads);
+        self.threads = threads;
+
+        for (location_id, count) in older.cpu {
+            *self.cpu.entry(location_id).or_insert(0) += count;
+        }
+        for (key, count) in older.thread_cpu {
+            *self.thread_cpu.entry(key).or_insert(0) += count;
+        }
+        for (stack_id, count) in older.stack_cpu {
+            *self.stack_cpu.entry(stack_id).or_insert(0) += count;
+        }
+        for (location_id, blocked_ns) in older.offcpu {
+            *self.offcpu.entry(location_id).or_insert(0) += blocked_ns;
+        }
+        for (location_id, counters) in older.pmu {
+            self.pmu.entry(location_id).or_default().add(&counters);
+        }
+        for (location_id, sample) in older.heap {
+            self.heap.entry(location_id).or_insert(sample);
+        }
+        for (key, sample) in older.process_heap {
+            self.process_heap.entry(key).or_insert(sample);
+        }
+        for (location_id, histogram) in older.heap_histograms {
+            self.heap_histograms.entry(location_id).or_insert(histogram);
+        }
+        let mut stats = older.stats;
+        stats.add(&self.stats);
+        self.stats = stats;
+        self.prune_before_ms = self.prune_before_ms.max(older.prune_before_ms);
+        // Newer meta values win
+        for (key, value) in older.meta {
+            self.meta.entry(key).or_insert(value);
+        }
+    }
+}
+
+/// Handle to the writer thread
+pub(super) struct Flusher {
+    tx: Option<SyncSender<Box<CheckpointBatch>>>,
+    handle: Option<JoinHandle<()>>,
+    /// First write error; the thread stops after it
+    error: Arc<Mutex<Option<Error>>>,
+    /// The writer's running costs, updated after each transaction
+    written: Arc<WriterStats>,
+}
+
+/// Writer thread costs, shared with the sampling loop
+#[derive(Default)]
+pub(super) struct WriterStats {
+    /// Time spent in transactions, in microseconds
+    busy_us: AtomicU64,
+    /// Database size after the last commit, or bytes sent when streaming
+    db_bytes: AtomicU64,
+    /// Batches committed so far
+    committed: AtomicU64,
+}
+
+impl WriterStats {
+    /// Add time spent writing, and note the output size so far
+    pub fn record(&self, busy: Duration, bytes: u64) {
+        self.busy_us
+            .fetch_add(busy.as_micros() as u64, Ordering::Relaxed);
+        self.db_bytes.store(bytes, Ordering::Relaxed);
+    }
+}
+
+impl Flusher {
+    /// Open a second connection to `path` and start the writer thread on it
+    pub fn spawn(path: &Path) -> Result<Self> {
+        let conn = Connection::open(path)?;
+        conn.execute_batch(
+            "PRAGMA journal_mode = WAL;
+             PRAGMA synchronous = NORMAL;",
+        )?;
+        conn.busy_timeout(BUSY_TIMEOUT)?;
+        let cpu_totals = schema::load_cpu_totals(&conn)?;
+
+        Self::start("rsprof-writer", move |rx, written| {
+            run(conn, rx, written, cpu_totals)
+        })
+    }
+
+    /// Run `body` on a new thread, fed from a fresh queue; its error is kept
+    /// for `take_error`
+    pub fn start<F>(name: &str, body: F) -> Result<Self>
+    where
+        F: FnOnce(Receiver<Box<CheckpointBatch>>, &WriterStats) -> Result<()> + Send + 'static,
+    {
+        let (tx, rx) = mpsc::sync_channel(QUEUE_DEPTH);
+        let error = Arc::new(Mutex::new(None));
+        let thread_error = Arc::clone(&error);
+        let written = Arc::new(WriterStats::default());
+        let thread_written = Arc::clone(&written);
+        let handle = std::thread::Builder::new()
+            .name(name.to_string())
+            .spawn(move || {
+                if let Err(e) = body(rx, &thread_written)
+                    && let Ok(mut slot) = thread_error.lock()
+                {
+                    *slot = Some(e);
+                }
+            })?;
+
+        Ok(Flusher {
+            tx: Some(tx),
+            handle: Some(handle),
+            error,
+            written,
+        })
+    }
+
+    /// Total time the writer has spent storing checkpoints
+    pub fn busy(&self) -> Duration {
+        Duration::from_micros(self.written.busy_us.load(Ordering::Relaxed))
+    }
+
+    /// Database size as of the writer's last commit
+    pub fn db_bytes(&self) -> u64 {
+        self.written.db_bytes.load(Ordering::Relaxed)
+    }
+
+    /// Batches the writer has committed, in the order they were queued
+    pub fn committed(&self) -> u64 {
+        self.written.committed.load(Ordering::Acquire)
+    }
+
+    /// Queue a batch without blocking; a full queue hands it back
+    pub fn try_send(
+        &self,
+        batch: Box<CheckpointBatch>,
+    ) -> std::result::Result<(), TrySendError<Box<CheckpointBatch>>> {
+        match &self.tx {
+            Some(tx) => tx.try_send(batch),
+            None => Err(TrySendError::Disconnected(batch)),
+        }
+    }
+
+    /// Queue a batch, waiting for room if the writer is behind
+    pub fn send(&self, batch: Box<CheckpointBatch>) -> bool {
+        self.tx.as_ref().is_some_and(|tx| tx.send(batch).is_ok())
+    }
+
+    /// The error that stopped the writer, if any
+    pub fn take_error(&self) -> Option<Error> {
+        self.error.lock().ok()?.take()
+    }
+
+    /// Write everything queued, stop the thread and return its error, if any
+    pub fn finish(&mut self) -> Option<Error> {
+        self.tx = None;
+        if let Some(handle) = self.handle.take() {
+            let _ = handle.join();
+        }
+        self.take_error()
+    }
+}
+
+impl Drop for Flusher {
+    fn drop(&mut self) {
+        self.finish();
+    }
+}
+
+/// Writer thread: drain the queue, several checkpoints per transaction
+fn run(
+    mut conn: Connection,
+    rx: Receiver<Box<CheckpointBatch>>,
+    written: &WriterStats,
+    cpu_totals: HashMap<i64, u64>,
+) -> Result<()> {
+    let mut state = WriterState {
+        written_heap: HashMap::new(),
+        written_process_heap: HashMap::new(),
+        written_histograms: HashMap::new(),
+        cpu_totals,
+        db_bytes: db_bytes(&conn).unwrap_or(0),
+    };
+
+    while let Ok(first) = rx.recv() {
+        let mut batches = vec![*first];
+        while batches.len() < MAX_CHECKPOINTS_PER_TX {
+            match rx.try_recv() {
+                Ok(batch) => batches.push(*batch),
+                Err(_) => break,
+            }
+        }
+
+        let start = Instant::now();
+        let count = batches.len() as u64;
+        write_batches(&mut conn, batches, &mut state)?;
+        state.db_bytes = db_bytes(&conn)?;
+        written.record(start.elapsed(), state.db_bytes);
+        written.committed.fetch_add(count, Ordering::Release);
+    }
+    Ok(())
+}
+
+/// Size of the database, counting pages still in the WAL
+fn db_bytes(conn: &Connection) -> rusqlite::Result<u64> {
+    let pages: i64 = conn.query_row("PRAGMA page_count", [], |row| row.get(0))?;
+    let page_size: i64 = conn.query_row("PRAGMA page_size", [], |row| row.get(0))?;
+    Ok((pages * page_size) as u64)
+}
+
+/// What the writer remembers between transactions
+struct WriterState {
+    /// Last heap values written per location; unchanged locations are skipped
+    written_heap: HashMap<i64, HeapSampleData>,
+    /// Same, per (pid, location)
+    written_process_heap: HashMap<(u32, i64), HeapSampleData>,
+    /// Same, for histograms
+    written_histograms: HashMap<i64, HeapHistogram>,
+    /// CPU running total per location, mirroring the cpu_totals table
+    cpu_totals: HashMap<i64, u64>,
+    /// Database size after the last commit
+    db_bytes: u64,
+}
+
+fn write_batches(
+    conn: &mut Connection,
+    batches: Vec<CheckpointBatch>,
+    state: &mut WriterState,
+) -> rusqlite::Result<()> {
+    let tx = conn.transaction()?;
+    let mut tiers = TierUpdates::default();
+    let mut prune_before_ms = None;
+
+    for batch in batches {
+        let start = Instant::now();
+        prune_before_ms = prune_before_ms.max(batch.prune_before_ms);
+
+        {
+            let mut stmt = tx.prepare_cached(
+                "INSERT INTO locations (id, file, line, function) VALUES (?, ?, ?, ?)",
+            )?;
+            for (id, location) in &batch.locations {
+                stmt.execute(rusqlite::params![
+                    id,
+                    &location.file,
+                    location.line as i64,
+                    &location.function
+                ])?;
+            }
+
+            let mut stmt = tx.prepare_cached("INSERT INTO stacks (id, frames) VALUES (?, ?)")?;
+            for (id, frames) in &batch.stacks {
+                stmt.execute(rusqlite::params![id, schema::encode_stack(frames)])?;
+            }
+
+            let mut stmt = tx.prepare_cached(
+                "INSERT OR REPLACE INTO processes (pid, name, exe_path) VALUES (?, ?, ?)",
+            )?;
+            for (pid, name, exe_path) in &batch.processes {
+                stmt.execute(rusqlite::params![*pid as i64, name, exe_path])?;
+            }
+
+            let mut stmt = tx.prepare_cached(
+                "INSERT OR REPLACE INTO threads (tid, name, pid) VALUES (?, ?, ?)",
+            )?;
+            for (tid, pid, name) in &batch.threads {
+                stmt.execute(rusqlite::params![*tid as i64, name, *pid as i64])?;
+            }
+
+            let mut stmt =
+                tx.prepare_cached("INSERT OR REPLACE INTO meta (key, value) VALUES (?, ?)")?;
+            for (key, value) in &batch.meta {
+                stmt.execute([key, value.as_str()])?;
+            }
+        }
+
+        let Some(timestamp_ms) = batch.timestamp_ms else {
+            continue;
+        };
+
+        tx.prepare_cached("INSERT INTO checkpoints (timestamp_ms) VALUES (?)")?
+            .execute([timestamp_ms])?;
+        let checkpoint_id = tx.last_insert_rowid();
+
+        // Insert CPU samples with their running totals, and update the rollup
+        {
+            let total: u64 = batch.cpu.values().sum();
+            for (&location_id, &count) in &batch.cpu {
+                tiers.add_cpu(
+                    timestamp_ms,
+                    location_id,
+                    count as f64 * 100.0 / total as f64,
+                );
+            }
+
+            let mut stmt = tx.prepare_cached(
+                "INSERT INTO cpu_samples (checkpoint_id, location_id, count, cumulative) VALUES (?, ?, ?, ?)",
+            )?;
+            let mut totals = tx.prepare_cached(
+                "INSERT OR REPLACE INTO cpu_totals (location_id, samples) VALUES (?, ?)",
+            )?;
+            for (location_id, count) in batch.cpu {
+                let cumulative = state.cpu_totals.entry(location_id).or_insert(0);
+                *cumulative += count;
+                stmt.execute(rusqlite::params![
+                    checkpoint_id,
+                    location_id,
+                    count as i64,
+                    *cumulative as i64
+                ])?;
+                totals.execute(rusqlite::params![location_id, *cumulative as i64])?;
+            }
+        }
+
+        // Insert per-thread CPU samples
+        {
+            let mut stmt = tx.prepare_cached(
+                "INSERT INTO thread_cpu_samples (checkpoint_id, tid, location_id, count) VALUES (?, ?, ?, ?)",
+            )?;
+            let mut totals = tx.prepare_cached(
+                "INSERT INTO thread_cpu_totals (tid, location_id, samples) VALUES (?1, ?2, ?3)
+                 ON CONFLICT (tid, location_id) DO UPDATE SET samples = samples + ?3",
+            )?;
+            for ((tid, location_id), count) in batch.thread_cpu {
+                stmt.execute(rusqlite::params![
+                    checkpoint_id,
+                    tid as i64,
+                    location_id,
+                    count as i64
+                ])?;
+                totals.execute(rusqlite::params![tid as i64, location_id, count as i64])?;
+            }
+        }
+
+        // Insert CPU samples by stack and add them to the totals
+        {
+            let mut stmt = tx.prepare_cached(
+                "INSERT INTO stack_samples (checkpoint_id, stack_id, count) VALUES (?, ?, ?)",
+            )?;
+            let mut totals = tx.prepare_cached(
+                "INSERT INTO stack_totals (stack_id, samples) VALUES (?1, ?2)
+                 ON CONFLICT (stack_id) DO UPDATE SET samples = samples + ?2",
+            )?;
+            for (stack_id, count) in batch.stack_cpu {
+                stmt.execute(rusqlite::params![checkpoint_id, stack_id, count as i64])?;
+                totals.execute(rusqlite::params![stack_id, count as i64])?;
+            }
+        }
+
+        // Insert off-CPU time and add it to the totals
+        {
+            let mut stmt = tx.prepare_cached(
+                "INSERT INTO offcpu_samples (checkpoint_id, location_id, blocked_ns) VALUES (?, ?, ?)",
+            )?;
+            let mut totals = tx.prepare_cached(
+                "INSERT INTO offcpu_totals (location_id, blocked_ns) VALUES (?1, ?2)
+                 ON CONFLICT (location_id) DO UPDATE SET blocked_ns = blocked_ns + ?2",
+            )?;
+            for (location_id, blocked_ns) in batch.offcpu {
+                stmt.execute(rusqlite::params![
+                    checkpoint_id,
+                    location_id,
+                    blocked_ns as i64
+                ])?;
+                totals.execute(rusqlite::params![location_id, blocked_ns as i64])?;
+            }
+        }
+
+        // Insert hardware counters and add them to the totals
+        {
+            let mut stmt = tx.prepare_cached(
+                "INSERT INTO pmu_samples (checkpoint_id, location_id, cycles, instructions, llc_misses, branch_misses) VALUES (?, ?, ?, ?, ?, ?)",
+            )?;
+            let mut totals = tx.prepare_cached(
+                "INSERT INTO pmu_totals (location_id, cycles, instructions, llc_misses, branch_misses)
+                 VALUES (?1, ?2, ?3, ?4, ?5)
+                 ON CONFLICT (location_id) DO UPDATE SET
+                     cycles = cycles + ?2,
+                     instructions = instructions + ?3,
+                     llc_misses = llc_misses + ?4,
+                     branch_misses = branch_misses + ?5",
+            )?;
+            for (location_id, counters) in batch.pmu {
+                let values = [
+                    counters.cycles as i64,
+                    counters.instructions as i64,
+                    counters.llc_misses as i64,
+                    counters.branch_misses as i64,
+                ];
+                stmt.execute(rusqlite::params![
+                    checkpoint_id,
+                    location_id,
+                    values[0],
+                    values[1],
+                    values[2],
+                    values[3]
+                ])?;
+                totals.execute(rusqlite::params![
+                    location_id,
+                    values[0],
+                    values[1],
+                    values[2],
+                    values[3]
+                ])?;
+            }
+        }
+
+        // Insert heap samples that changed since they were last written, and
+        // keep heap_latest pointing at them
+        {
+            let mut stmt = tx.prepare_cached(
+                "INSERT INTO heap_samples (checkpoint_id, location_id, alloc_bytes, free_bytes, live_bytes, alloc_count, free_count) VALUES (?, ?, ?, ?, ?, ?, ?)",
+            )?;
+            let mut latest = tx.prepare_cached(
+                "INSERT OR REPLACE INTO heap_latest (location_id, checkpoint_id, alloc_bytes, free_bytes, live_bytes, alloc_count, free_count) VALUES (?, ?, ?, ?, ?, ?, ?)",
+            )?;
+            for (location_id, data) in batch.heap {
+                if state.written_heap.get(&location_id) == Some(&data) {
+                    continue;
+                }
+                state.written_heap.insert(location_id, data);
+                let (alloc, free, live, alloc_cnt, free_cnt) = data;
+                tiers.add_heap(timestamp_ms, location_id, live);
+                stmt.execute(rusqlite::params![
+                    checkpoint_id,
+                    location_id,
+                    alloc,
+                    free,
+                    live,
+                    alloc_cnt as i64,
+                    free_cnt as i64
+                ])?;
+                latest.execute(rusqlite::params![
+                    location_id,
+                    checkpoint_id,
+                    alloc,
+                    free,
+                    live,
+                    alloc_cnt as i64,
+                    free_cnt as i64
+                ])?;
+            }
+        }
+
+        // Per-process heap stats; only the latest values are kept
+        {
+            let mut stmt = tx.prepare_cached(
+                "INSERT OR REPLACE INTO process_heap_latest (pid, location_id, alloc_bytes, free_bytes, live_bytes, alloc_count, free_count) VALUES (?, ?, ?, ?, ?, ?, ?)",
+            )?;
+            for (key, data) in batch.process_heap {
+                if state.written_process_heap.get(&key) == Some(&data) {
+                    continue;
+                }
+                state.written_process_heap.insert(key, data);
+                let (pid, location_id) = key;
+                let (alloc, free, live, alloc_cnt, free_cnt) = data;
+                stmt.execute(rusqlite::params![
+                    pid as i64,
+                    location_id,
+                    alloc,
+                    free,
+                    live,
+                    alloc_cnt as i64,
+                    free_cnt as i64
+                ])?;
+            }
+        }
+
+        // Histograms; only the latest values are kept, as one row per
+        // non-empty bucket
+        {
+            let mut clear =
+                tx.prepare_cached("DELETE FROM heap_histograms WHERE location_id = ?")?;
+            let mut stmt = tx.prepare_cached(
+                "INSERT INTO heap_histograms (location_id, bucket, size_count, lifetime_count) VALUES (?, ?, ?, ?)",
+            )?;
+            for (location_id, histogram) in batch.heap_histograms {
+                if state.written_histograms.get(&location_id) == Some(&histogram) {
+                    continue;
+                }
+                clear.execute([location_id])?;
+                for (bucket, (&size, &lifetime)) in
+                    histogram.size.iter().zip(&histogram.lifetime).enumerate()
+                {
+                    if size > 0 || lifetime > 0 {
+                        stmt.execute(rusqlite::params![
+                            location_id,
+                            bucket as i64,
+                            size as i64,
+                            lifetime as i64
+                        ])?;
+                    }
+                }
+                state.written_histograms.insert(location_id, histogram);
+            }
+        }
+
+        // Record what this checkpoint cost rsprof; the commit is not counted
+        let stats = &batch.stats;
+        tx.prepare_cached(
+            "INSERT INTO profiler_stats (checkpoint_id, shm_scan_us, symbolize_us, flush_us, lag_ms, lost_samples, dropped_events, db_bytes) VALUES (?, ?, ?, ?, ?, ?, ?, ?)",
+        )?
+        .execute(rusqlite::params![
+            checkpoint_id,
+            stats.shm_scan.as_micros() as i64,
+            stats.symbolize.as_micros() as i64,
+            start.elapsed().as_micros() as i64,
+            stats.lag.as_millis() as i64,
+            stats.lost_samples as i64,
+            stats.dropped_events as i64,
+            state.db_bytes as i64
+        ])?;
+    }
+
+    tiers.write(&tx)?;
+    if let Some(before_ms) = prune_before_ms {
+        prune_raw_samples(&tx, before_ms)?;
+    }
+
+    tx.commit()
+}
+
+/// Chart tier rows touched by one transaction, merged before writing
+#[derive(Default)]
+struct TierUpdates {
+    /// (tier, location_id, bucket) -> highest CPU%
+    cpu: HashMap<(i64, i64, i64), f64>,
+    /// (tier, location_id, bucket) -> (highest, final) live bytes
+    heap: HashMap<(i64, i64, i64), (i64, i64)>,
+}
+
+impl TierUpdates {
+    fn add_cpu(&mut self, timestamp_ms: i64, location_id: i64, pct: f64) {
+        for (tier, width) in (1..).zip(schema::TIER_WIDTHS_MS) {
+            let max_pct = self
+                .cpu
+                .entry((tier, location_id, timestamp_ms / width))
+                .or_insert(pct);
+            *max_pct = max_pct.max(pct);
+        }
+    }
+
+    /// Heap rows must be added in checkpoint order so the final value wins
+    fn add_heap(&mut self, timestamp_ms: i64, location_id: i64, live: i64) {
+        for (tier, width) in (1..).zip(schema::TIER_WIDTHS_MS) {
+            let (max_live, last_live) = self
+                .heap
+                .entry((tier, location_id, timestamp_ms / width))
+                .or_insert((live, live));
+            *max_live = (*max_live).max(live);
+            *last_live = live;
+        }
+    }
+
+    fn write(self, conn: &Connection) -> rusqlite::Result<()> {
+        let mut stmt = conn.prepare_cached(
+            "INSERT INTO cpu_rollup (tier, location_id, bucket, max_pct) VALUES (?, ?, ?, ?)
+             ON CONFLICT (tier, location_id, bucket)
+             DO UPDATE SET max_pct = MAX(max_pct, excluded.max_pct)",
+        )?;
+        for ((tier, location_id, bucket), max_pct) in self.cpu {
+            stmt.execute(rusqlite::params![tier, location_id, bucket, max_pct])?;
+        }
+
+        let mut stmt = conn.prepare_cached(
+            "INSERT INTO heap_rollup (tier, location_id, bucket, max_live, last_live)
+             VALUES (?, ?, ?, ?, ?)
+             ON CONFLICT (tier, location_id, bucket)
+             DO UPDATE SET max_live = MAX(max_live, excluded.max_live),
+                           last_live = excluded.last_live",
+        )?;
+        for ((tier, location_id, bucket), (max_live, last_live)) in self.heap {
+            stmt.execute(rusqlite::params![
+                tier,
+                location_id,
+                bucket,
+                max_live,
+                last_live
+            ])?;
+        }
+
+        Ok(())
+    }
+}
+
+/// Delete raw samples from checkpoints before `before_ms`
+///
+/// Each location keeps its latest CPU and heap row from before the cutoff:
+/// heap values carry forward from it, and CPU running totals are read from
+/// it. The tiers and totals tables are not touched. Only the checkpoints
+/// that passed the cutoff since the last prune are visited, so a prune
+/// costs the rows it deletes, not the history kept before it.
+fn prune_raw_samples(conn: &Connection, before_ms: i64) -> rusqlite::Result<()> {
+    let first_kept_at = |ms: i64| -> rusqlite::Result<Option<i64>> {
+        conn.query_row(
+            "SELECT MIN(id) FROM checkpoints WHERE timestamp_ms >= ?",
+            [ms],
+            |row| row.get(0),
+        )
+    };
+    let Some(first_kept) = first_kept_at(before_ms)? else {
+        return Ok(());
+    };
+    // Where the last prune stopped: rows before it are already pruned
+    let pruned_before =
+        match schema::get_meta(conn, "raw_retained_from_ms")?.and_then(|v| v.parse().ok()) {
+            Some(ms) => first_kept_at(ms)?.unwrap_or(first_kept),
+            None => 0,
+        };
+    if pruned_before >= first_kept {
+        return Ok(());
+    }
+
+    for table in [
+        "thread_cpu_samples",
+        "stack_samples",
+        "offcpu_samples",
+        "pmu_samples",
+    ] {
+        conn.execute(
+            &format!("DELETE FROM {table} WHERE checkpoint_id >= ?1 AND checkpoint_id < ?2"),
+            [pruned_before, first_kept],
+        )?;
+    }
+    for table in ["cpu_samples", "heap_samples"] {
+        // Rows kept by earlier prunes, superseded by one newly past the cutoff
+        conn.execute(
+            &format!(
+                "DELETE FROM {table}
+                 WHERE checkpoint_id < ?1
+                   AND location_id IN (
+                       SELECT location_id FROM {table}
+                       WHERE checkpoint_id >= ?1 AND checkpoint_id < ?2
+                   )"
+            ),
+            [pruned_before, first_kept],
+        )?;
+        // Rows newly past the cutoff, but each location's latest
+        conn.execute(
+            &format!(
+                "DELETE FROM {table}
+                 WHERE checkpoint_id >= ?1 AND checkpoint_id < ?2
+                   AND checkpoint_id < (
+                       SELECT MAX(newer.checkpoint_id) FROM {table} AS newer
+                       WHERE newer.location_id = {table}.location_id
+                         AND newer.checkpoint_id < ?2
+                   )"
+            ),
+            [pruned_before, first_kept],
+        )?;
+    }
+
+    conn.execute(
+        "INSERT OR REPLACE INTO meta (key, value) VALUES ('raw_retained_from_ms', ?)",
+        [before_ms.to_string()],
+    )?;
+    Ok(())
+}
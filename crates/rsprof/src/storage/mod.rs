@@ -1,9 +1,23 @@
+pub mod archive;
+mod capture;
+mod flusher;
 mod schema;
+pub mod stream;
+pub mod varint;
+mod wire;
 pub mod writer;
 
+pub use archive::{Archive, archive_path, compact, is_archive};
+pub use capture::CaptureWindows;
+pub use stream::{Hello, Listener, Sessions, Socket, StreamAddr, collect_stream};
 pub use writer::{
-    CombinedEntry, CpuEntry, HeapEntry, Storage, TimeSeriesPoint, query_combined_live,
-    query_cpu_timeseries, query_cpu_timeseries_aggregated, query_heap_sparklines,
-    query_heap_sparklines_for_locations, query_heap_timeseries_aggregated, query_top_cpu,
-    query_top_heap_live,
+    ChurnEntry, CombinedEntry, CpuEntry, HeapEntry, OffCpuEntry, ProcessEntry, ProfilerStats,
+    Storage, ThreadEntry, TimeSeriesPoint, bucket_cpu_timeseries, bucket_heap_timeseries,
+    for_each_stack, query_checkpoint_range, query_combined_live, query_cpu_timeseries,
+    query_cpu_timeseries_aggregated, query_dropped_events, query_heap_sparklines,
+    query_heap_sparklines_for_locations, query_heap_timeseries_aggregated, query_locations,
+    query_lost_samples, query_pmu_between, query_pmu_totals, query_pruned_before, query_top_churn,
+    query_top_cpu, query_top_cpu_between, query_top_cpu_for_pid, query_top_heap_between,
+    query_top_heap_for_pid, query_top_heap_live, query_top_offcpu, query_top_offcpu_between,
+    query_top_processes, query_top_threads, query_total_samples, rank_churn, upgrade_schema,
 };
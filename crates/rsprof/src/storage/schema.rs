@@ -1,12 +1,35 @@
+use super::varint;
 use rusqlite::Connection;
 
-pub const SCHEMA_VERSION: i32 = 3;
+pub const SCHEMA_VERSION: i32 = 13;
+
+/// Bucket widths of the downsampled chart tiers; tier `n` has width
+/// `TIER_WIDTHS_MS[n - 1]` and tier 0 is the raw checkpoints
+pub const TIER_WIDTHS_MS: [i64; 3] = [10_000, 60_000, 600_000];
 
 /// Create all tables (drops existing tables first to ensure clean state)
 pub fn create_tables(conn: &Connection) -> rusqlite::Result<()> {
     conn.execute_batch(
         r#"
         -- Drop existing tables to ensure clean state for new session
+        DROP TABLE IF EXISTS heap_histograms;
+        DROP TABLE IF EXISTS process_heap_latest;
+        DROP TABLE IF EXISTS processes;
+        DROP TABLE IF EXISTS profiler_stats;
+        DROP TABLE IF EXISTS stack_totals;
+        DROP TABLE IF EXISTS stack_samples;
+        DROP TABLE IF EXISTS stacks;
+        DROP TABLE IF EXISTS pmu_totals;
+        DROP TABLE IF EXISTS pmu_samples;
+        DROP TABLE IF EXISTS offcpu_totals;
+        DROP TABLE IF EXISTS offcpu_samples;
+        DROP TABLE IF EXISTS heap_rollup;
+        DROP TABLE IF EXISTS cpu_rollup;
+        DROP TABLE IF EXISTS heap_latest;
+        DROP TABLE IF EXISTS thread_cpu_totals;
+        DROP TABLE IF EXISTS cpu_totals;
+        DROP TABLE IF EXISTS thread_cpu_samples;
+        DROP TABLE IF EXISTS threads;
         DROP TABLE IF EXISTS heap_samples;
         DROP TABLE IF EXISTS cpu_samples;
         DROP TABLE IF EXISTS checkpoints;
@@ -34,20 +57,21 @@ pub fn create_tables(conn: &Connection) -> rusqlite::Result<()> {
             UNIQUE(file, line, function)
         );
 
-        -- CPU samples per checkpoint (references location_id)
+        -- CPU samples per checkpoint (references location_id); cumulative
+        -- is the location's running total through this checkpoint
         CREATE TABLE cpu_samples (
             checkpoint_id INTEGER NOT NULL,
             location_id INTEGER NOT NULL,
             count INTEGER NOT NULL,
+            cumulative INTEGER NOT NULL DEFAULT 0,
             PRIMARY KEY (checkpoint_id, location_id),
             FOREIGN KEY (checkpoint_id) REFERENCES checkpoints(id),
             FOREIGN KEY (location_id) REFERENCES locations(id)
         );
 
-        -- Index for timeseries queries by location
-        CREATE INDEX idx_cpu_location ON cpu_samples(location_id);
-
-        -- Heap samples per checkpoint (references location_id)
+        -- Heap samples (references location_id): cumulative stats, written
+        -- only at checkpoints where they changed. A location's value at a
+        -- checkpoint is its latest row at or before it (carry forward).
         CREATE TABLE heap_samples (
             checkpoint_id INTEGER NOT NULL,
             location_id INTEGER NOT NULL,
@@ -60,11 +84,364 @@ pub fn create_tables(conn: &Connection) -> rusqlite::Result<()> {
             FOREIGN KEY (checkpoint_id) REFERENCES checkpoints(id),
             FOREIGN KEY (location_id) REFERENCES locations(id)
         );
+        "#,
+    )?;
+    create_missing_tables(conn)
+}
+
+/// Create tables and indexes added since schema v3, if missing, and
+/// backfill them from the sample history (for older profiles)
+pub fn create_missing_tables(conn: &Connection) -> rusqlite::Result<()> {
+    if !has_column(conn, "cpu_samples", "cumulative")? {
+        conn.execute_batch(
+            r#"
+            ALTER TABLE cpu_samples ADD COLUMN cumulative INTEGER NOT NULL DEFAULT 0;
+            UPDATE cpu_samples SET cumulative = running.cumulative
+            FROM (
+                SELECT checkpoint_id, location_id,
+                       SUM(count) OVER (PARTITION BY location_id ORDER BY checkpoint_id)
+                           as cumulative
+                FROM cpu_samples
+            ) running
+            WHERE cpu_samples.checkpoint_id = running.checkpoint_id
+              AND cpu_samples.location_id = running.location_id;
+            "#,
+        )?;
+    }
 
-        -- Index for timeseries queries by location
-        CREATE INDEX idx_heap_location ON heap_samples(location_id);
+    conn.execute_batch(
+        r#"
+        -- Timeseries by location, and running totals at a checkpoint
+        CREATE INDEX IF NOT EXISTS idx_cpu_location_checkpoint
+            ON cpu_samples(location_id, checkpoint_id, cumulative);
+
+        -- Latest heap row per location at or before a checkpoint
+        CREATE INDEX IF NOT EXISTS idx_heap_location_checkpoint
+            ON heap_samples(location_id, checkpoint_id);
+
+        -- Threads seen in CPU samples, and the process they belong to
+        CREATE TABLE IF NOT EXISTS threads (
+            tid INTEGER PRIMARY KEY,
+            name TEXT NOT NULL,
+            pid INTEGER NOT NULL DEFAULT 0
+        );
+
+        -- CPU samples per checkpoint, split by thread
+        CREATE TABLE IF NOT EXISTS thread_cpu_samples (
+            checkpoint_id INTEGER NOT NULL,
+            tid INTEGER NOT NULL,
+            location_id INTEGER NOT NULL,
+            count INTEGER NOT NULL,
+            PRIMARY KEY (checkpoint_id, tid, location_id),
+            FOREIGN KEY (checkpoint_id) REFERENCES checkpoints(id),
+            FOREIGN KEY (location_id) REFERENCES locations(id)
+        );
+
+        -- Blocked (off-CPU) time per checkpoint, charged when threads wake
+        CREATE TABLE IF NOT EXISTS offcpu_samples (
+            checkpoint_id INTEGER NOT NULL,
+            location_id INTEGER NOT NULL,
+            blocked_ns INTEGER NOT NULL,
+            PRIMARY KEY (checkpoint_id, location_id),
+            FOREIGN KEY (checkpoint_id) REFERENCES checkpoints(id),
+            FOREIGN KEY (location_id) REFERENCES locations(id)
+        );
+
+        -- Total blocked time per location
+        CREATE TABLE IF NOT EXISTS offcpu_totals (
+            location_id INTEGER PRIMARY KEY,
+            blocked_ns INTEGER NOT NULL,
+            FOREIGN KEY (location_id) REFERENCES locations(id)
+        );
+
+        -- Hardware counter deltas per checkpoint (recorded with --pmu)
+        CREATE TABLE IF NOT EXISTS pmu_samples (
+            checkpoint_id INTEGER NOT NULL,
+            location_id INTEGER NOT NULL,
+            cycles INTEGER NOT NULL,
+            instructions INTEGER NOT NULL,
+            llc_misses INTEGER NOT NULL,
+            branch_misses INTEGER NOT NULL,
+            PRIMARY KEY (checkpoint_id, location_id),
+            FOREIGN KEY (checkpoint_id) REFERENCES checkpoints(id),
+            FOREIGN KEY (location_id) REFERENCES locations(id)
+        );
+
+        -- Hardware counter totals per location
+        CREATE TABLE IF NOT EXISTS pmu_totals (
+            location_id INTEGER PRIMARY KEY,
+            cycles INTEGER NOT NULL,
+            instructions INTEGER NOT NULL,
+            llc_misses INTEGER NOT NULL,
+            branch_misses INTEGER NOT NULL,
+            FOREIGN KEY (location_id) REFERENCES locations(id)
+        );
+
+        -- Distinct call stacks; frames are location ids, leaf first (see
+        -- `encode_stack`)
+        CREATE TABLE IF NOT EXISTS stacks (
+            id INTEGER PRIMARY KEY,
+            frames BLOB NOT NULL
+        );
+
+        -- CPU samples per checkpoint, by full stack
+        CREATE TABLE IF NOT EXISTS stack_samples (
+            checkpoint_id INTEGER NOT NULL,
+            stack_id INTEGER NOT NULL,
+            count INTEGER NOT NULL,
+            PRIMARY KEY (checkpoint_id, stack_id),
+            FOREIGN KEY (checkpoint_id) REFERENCES checkpoints(id),
+            FOREIGN KEY (stack_id) REFERENCES stacks(id)
+        );
+
+        -- Total CPU samples per stack
+        CREATE TABLE IF NOT EXISTS stack_totals (
+            stack_id INTEGER PRIMARY KEY,
+            samples INTEGER NOT NULL,
+            FOREIGN KEY (stack_id) REFERENCES stacks(id)
+        );
+
+        -- rsprof's own cost per checkpoint: phase times, drops and the
+        -- database size before the checkpoint was written
+        CREATE TABLE IF NOT EXISTS profiler_stats (
+            checkpoint_id INTEGER PRIMARY KEY,
+            shm_scan_us INTEGER NOT NULL,
+            symbolize_us INTEGER NOT NULL,
+            flush_us INTEGER NOT NULL,
+            lag_ms INTEGER NOT NULL,
+            lost_samples INTEGER NOT NULL,
+            dropped_events INTEGER NOT NULL,
+            db_bytes INTEGER NOT NULL,
+            FOREIGN KEY (checkpoint_id) REFERENCES checkpoints(id)
+        );
+
+        -- Processes recorded (several with --process matching many)
+        CREATE TABLE IF NOT EXISTS processes (
+            pid INTEGER PRIMARY KEY,
+            name TEXT NOT NULL,
+            exe_path TEXT NOT NULL
+        );
+
+        -- Latest cumulative heap stats per process and location; heap_samples
+        -- holds their sum over all processes
+        CREATE TABLE IF NOT EXISTS process_heap_latest (
+            pid INTEGER NOT NULL,
+            location_id INTEGER NOT NULL,
+            alloc_bytes INTEGER NOT NULL,
+            free_bytes INTEGER NOT NULL,
+            live_bytes INTEGER NOT NULL,
+            alloc_count INTEGER NOT NULL,
+            free_count INTEGER NOT NULL,
+            PRIMARY KEY (pid, location_id),
+            FOREIGN KEY (location_id) REFERENCES locations(id)
+        );
+
+        -- Latest cumulative allocation histograms per location, log2
+        -- buckets: size bucket b is [2^b, 2^(b+1)) bytes; lifetime bucket 0
+        -- is under 1024ns and bucket b is [2^(b-1), 2^b) * 1024ns. The last
+        -- bucket of each is open-ended.
+        CREATE TABLE IF NOT EXISTS heap_histograms (
+            location_id INTEGER NOT NULL,
+            bucket INTEGER NOT NULL,
+            size_count INTEGER NOT NULL,
+            lifetime_count INTEGER NOT NULL,
+            PRIMARY KEY (location_id, bucket),
+            FOREIGN KEY (location_id) REFERENCES locations(id)
+        );
         "#,
+    )?;
+
+    // Threads were recorded without their process before schema v12
+    if !has_column(conn, "threads", "pid")? {
+        conn.execute_batch(
+            r#"
+            ALTER TABLE threads ADD COLUMN pid INTEGER NOT NULL DEFAULT 0;
+            UPDATE threads SET pid = COALESCE((SELECT value FROM meta WHERE key = 'pid'), 0);
+            "#,
+        )?;
+    }
+
+    create_rollup_tables(conn)
+}
+
+/// Running totals kept up to date by the writer, so top queries read one
+/// row per location instead of the whole history
+fn create_rollup_tables(conn: &Connection) -> rusqlite::Result<()> {
+    if !has_table(conn, "cpu_totals")? {
+        conn.execute_batch(
+            r#"
+            CREATE TABLE cpu_totals (
+                location_id INTEGER PRIMARY KEY,
+                samples INTEGER NOT NULL,
+                FOREIGN KEY (location_id) REFERENCES locations(id)
+            );
+            INSERT INTO cpu_totals (location_id, samples)
+                SELECT location_id, SUM(count) FROM cpu_samples GROUP BY location_id;
+            "#,
+        )?;
+    }
+
+    if !has_table(conn, "thread_cpu_totals")? {
+        conn.execute_batch(
+            r#"
+            CREATE TABLE thread_cpu_totals (
+                tid INTEGER NOT NULL,
+                location_id INTEGER NOT NULL,
+                samples INTEGER NOT NULL,
+                PRIMARY KEY (tid, location_id),
+                FOREIGN KEY (location_id) REFERENCES locations(id)
+            );
+            INSERT INTO thread_cpu_totals (tid, location_id, samples)
+                SELECT tid, location_id, SUM(count) FROM thread_cpu_samples
+                GROUP BY tid, location_id;
+            "#,
+        )?;
+    }
+
+    if !has_table(conn, "heap_latest")? {
+        conn.execute_batch(
+            r#"
+            -- Each location's latest heap_samples row
+            CREATE TABLE heap_latest (
+                location_id INTEGER PRIMARY KEY,
+                checkpoint_id INTEGER NOT NULL,
+                alloc_bytes INTEGER NOT NULL,
+                free_bytes INTEGER NOT NULL,
+                live_bytes INTEGER NOT NULL,
+                alloc_count INTEGER NOT NULL,
+                free_count INTEGER NOT NULL,
+                FOREIGN KEY (location_id) REFERENCES locations(id)
+            );
+            INSERT INTO heap_latest
+                SELECT hs.location_id, hs.checkpoint_id, hs.alloc_bytes, hs.free_bytes,
+                       hs.live_bytes, hs.alloc_count, hs.free_count
+                FROM heap_samples hs
+                JOIN (
+                    SELECT location_id, MAX(checkpoint_id) as checkpoint_id
+                    FROM heap_samples
+                    GROUP BY location_id
+                ) latest
+                    ON hs.location_id = latest.location_id
+                    AND hs.checkpoint_id = latest.checkpoint_id;
+            "#,
+        )?;
+    }
+
+    create_tier_tables(conn)
+}
+
+/// Downsampled chart tiers, so zoomed-out charts read one row per bucket
+/// instead of every checkpoint in it
+fn create_tier_tables(conn: &Connection) -> rusqlite::Result<()> {
+    let tiers = TIER_WIDTHS_MS
+        .iter()
+        .enumerate()
+        .map(|(i, width)| format!("({}, {})", i + 1, width))
+        .collect::<Vec<_>>()
+        .join(", ");
+
+    if !has_table(conn, "cpu_rollup")? {
+        conn.execute_batch(&format!(
+            r#"
+            -- Highest per-checkpoint CPU% of a location within each bucket
+            CREATE TABLE cpu_rollup (
+                tier INTEGER NOT NULL,
+                location_id INTEGER NOT NULL,
+                bucket INTEGER NOT NULL,
+                max_pct REAL NOT NULL,
+                PRIMARY KEY (tier, location_id, bucket)
+            ) WITHOUT ROWID;
+            WITH tiers(tier, width) AS (VALUES {tiers}),
+            totals AS (
+                SELECT checkpoint_id, SUM(count) as total FROM cpu_samples GROUP BY checkpoint_id
+            )
+            INSERT INTO cpu_rollup (tier, location_id, bucket, max_pct)
+                SELECT t.tier, cs.location_id, c.timestamp_ms / t.width,
+                       MAX(CAST(cs.count AS REAL) * 100.0 / totals.total)
+                FROM cpu_samples cs
+                JOIN checkpoints c ON cs.checkpoint_id = c.id
+                JOIN totals ON totals.checkpoint_id = cs.checkpoint_id
+                CROSS JOIN tiers t
+                GROUP BY t.tier, cs.location_id, c.timestamp_ms / t.width;
+            "#
+        ))?;
+    }
+
+    if !has_table(conn, "heap_rollup")? {
+        conn.execute_batch(&format!(
+            r#"
+            -- Highest and final live bytes of a location's heap rows in each
+            -- bucket; buckets without a change carry the previous final value
+            CREATE TABLE heap_rollup (
+                tier INTEGER NOT NULL,
+                location_id INTEGER NOT NULL,
+                bucket INTEGER NOT NULL,
+                max_live INTEGER NOT NULL,
+                last_live INTEGER NOT NULL,
+                PRIMARY KEY (tier, location_id, bucket)
+            ) WITHOUT ROWID;
+            WITH tiers(tier, width) AS (VALUES {tiers})
+            INSERT INTO heap_rollup (tier, location_id, bucket, max_live, last_live)
+                SELECT tier, location_id, bucket, MAX(live_bytes), last_live
+                FROM (
+                    SELECT t.tier, hs.location_id, c.timestamp_ms / t.width as bucket,
+                           hs.live_bytes,
+                           LAST_VALUE(hs.live_bytes) OVER (
+                               PARTITION BY t.tier, hs.location_id, c.timestamp_ms / t.width
+                               ORDER BY hs.checkpoint_id
+                               ROWS BETWEEN UNBOUNDED PRECEDING AND UNBOUNDED FOLLOWING
+                           ) as last_live
+                    FROM heap_samples hs
+                    JOIN checkpoints c ON hs.checkpoint_id = c.id
+                    CROSS JOIN tiers t
+                )
+                GROUP BY tier, location_id, bucket;
+            "#
+        ))?;
+    }
+
+    Ok(())
+}
+
+fn has_table(conn: &Connection, name: &str) -> rusqlite::Result<bool> {
+    conn.query_row(
+        "SELECT COUNT(*) FROM sqlite_master WHERE type = 'table' AND name = ?",
+        [name],
+        |row| row.get::<_, i64>(0),
+    )
+    .map(|count| count > 0)
+}
+
+fn has_column(conn: &Connection, table: &str, column: &str) -> rusqlite::Result<bool> {
+    conn.query_row(
+        "SELECT COUNT(*) FROM pragma_table_info(?1) WHERE name = ?2",
+        [table, column],
+        |row| row.get::<_, i64>(0),
     )
+    .map(|count| count > 0)
+}
+
+/// Load each location's CPU running total (for the writer's cumulative column)
+pub fn load_cpu_totals(conn: &Connection) -> rusqlite::Result<std::collections::HashMap<i64, u64>> {
+    let mut stmt = conn.prepare("SELECT location_id, samples FROM cpu_totals")?;
+    let rows = stmt.query_map([], |row| {
+        Ok((row.get::<_, i64>(0)?, row.get::<_, i64>(1)? as u64))
+    })?;
+    rows.collect()
+}
+
+/// Load the pids already in the processes table (for append mode)
+pub fn load_process_ids(conn: &Connection) -> rusqlite::Result<std::collections::HashSet<u32>> {
+    let mut stmt = conn.prepare("SELECT pid FROM processes")?;
+    let rows = stmt.query_map([], |row| row.get::<_, i64>(0))?;
+    rows.map(|pid| pid.map(|pid| pid as u32)).collect()
+}
+
+/// Load the tids already named in the threads table (for append mode)
+pub fn load_thread_ids(conn: &Connection) -> rusqlite::Result<std::collections::HashSet<u32>> {
+    let mut stmt = conn.prepare("SELECT tid FROM threads")?;
+    let rows = stmt.query_map([], |row| row.get::<_, i64>(0))?;
+    rows.map(|tid| tid.map(|tid| tid as u32)).collect()
 }
 
 /// Get the last checkpoint timestamp (for append mode)
@@ -98,6 +475,46 @@ pub fn load_location_cache(
     Ok(cache)
 }
 
+/// Load all stacks as frames -> id (for append mode)
+pub fn load_stack_cache(
+    conn: &Connection,
+) -> rusqlite::Result<std::collections::HashMap<Vec<i64>, i64>> {
+    let mut stmt = conn.prepare("SELECT id, frames FROM stacks")?;
+    let rows = stmt.query_map([], |row| {
+        let id: i64 = row.get(0)?;
+        let blob: Vec<u8> = row.get(1)?;
+        Ok((id, blob))
+    })?;
+
+    let mut cache = std::collections::HashMap::new();
+    for row in rows {
+        let (id, blob) = row?;
+        let mut frames = Vec::new();
+        decode_stack(&blob, &mut frames);
+        cache.insert(frames, id);
+    }
+    Ok(cache)
+}
+
+/// Encode a stack's frames for `stacks.frames`: each location id as an
+/// unsigned LEB128 varint, leaf first
+pub fn encode_stack(frames: &[i64]) -> Vec<u8> {
+    let mut blob = Vec::with_capacity(frames.len() * 2);
+    for &frame in frames {
+        varint::put_u64(&mut blob, frame as u64);
+    }
+    blob
+}
+
+/// Decode `stacks.frames` into `frames`, replacing its contents
+pub fn decode_stack(blob: &[u8], frames: &mut Vec<i64>) {
+    frames.clear();
+    let mut reader = varint::Reader::new(blob);
+    while let Some(frame) = reader.u64() {
+        frames.push(frame as i64);
+    }
+}
+
 /// Set a metadata key
 pub fn set_meta(conn: &Connection, key: &str, value: &str) -> rusqlite::Result<()> {
     conn.execute(
@@ -108,7 +525,6 @@ pub fn set_meta(conn: &Connection, key: &str, value: &str) -> rusqlite::Result<(
 }
 
 /// Get a metadata key
-#[allow(dead_code)]
 pub fn get_meta(conn: &Connection, key: &str) -> rusqlite::Result<Option<String>> {
     conn.query_row("SELECT value FROM meta WHERE key = ?", [key], |row| {
         row.get(0)
@@ -116,7 +532,7 @@ pub fn get_meta(conn: &Connection, key: &str) -> rusqlite::Result<Option<String>
     .optional()
 }
 
-trait OptionalExt<T> {
+pub(super) trait OptionalExt<T> {
     fn optional(self) -> rusqlite::Result<Option<T>>;
 }
 
@@ -0,0 +1,727 @@
+//! Streaming checkpoints to a collector.
+//!
+//! An agent (`rsprof --stream`) keeps no database of its own: its
+//! checkpoints go through the usual writer queue to a sender thread, which
+//! ships them over TCP or a unix socket in the form of `wire`. While the
+//! network is slow or down the sender holds what it has, merging checkpoints
+//! past a limit, and reconnects with backoff; the sampling loop never waits
+//! on it. `rsprof collect` writes each stream through the normal writer and
+//! acks checkpoints as they are committed; the sender keeps each one until
+//! then and resends the unacked ones after a reconnect, so a dropped
+//! connection loses nothing and writes nothing twice.
+
+use super::flusher::{CheckpointBatch, Flusher, HeapSampleData, QUEUE_DEPTH, WriterStats};
+use super::schema::{self, SCHEMA_VERSION};
+use super::wire::{self, Message};
+use crate::error::{Error, Result};
+use crate::heap::HeapHistogram;
+use crate::process;
+use rusqlite::Connection;
+use std::collections::{HashMap, VecDeque};
+use std::fmt;
+use std::io::{Read, Write};
+use std::net::{TcpListener, TcpStream, ToSocketAddrs};
+use std::os::unix::fs::FileTypeExt;
+use std::os::unix::net::{UnixListener, UnixStream};
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::mpsc::{self, Receiver, RecvTimeoutError};
+use std::sync::{Condvar, Mutex, PoisonError};
+use std::time::{Duration, Instant};
+
+pub use super::wire::Hello;
+
+/// Connect attempts give up after this
+const CONNECT_TIMEOUT: Duration = Duration::from_secs(5);
+
+/// A write, or a wait for an ack, stalled this long counts as a lost
+/// connection
+const WRITE_TIMEOUT: Duration = Duration::from_secs(30);
+
+/// The collector drops an agent silent this long; one recording with a
+/// longer checkpoint interval just reconnects for each checkpoint
+const READ_TIMEOUT: Duration = Duration::from_secs(300);
+
+/// How often the collector looks for newly committed checkpoints to ack
+const ACK_INTERVAL: Duration = Duration::from_millis(100);
+
+/// Reconnect delay after the first failure; doubled on each one after
+const MIN_BACKOFF: Duration = Duration::from_millis(500);
+const MAX_BACKOFF: Duration = Duration::from_secs(30);
+
+/// Checkpoints held while the collector is unreachable; past this, each new
+/// one is merged with the newest held
+const MAX_UNSENT: usize = QUEUE_DEPTH;
+
+/// Checkpoints written but not yet acked; past this, the sender waits for
+/// the collector to catch up
+const MAX_UNACKED: usize = QUEUE_DEPTH;
+
+/// Meta key of the last checkpoint a collector stored for the session
+const STREAM_SEQ_KEY: &str = "stream_seq";
+
+/// Where an agent streams to and a collector listens
+#[derive(Debug, Clone)]
+pub enum StreamAddr {
+    /// `host:port`
+    Tcp(String),
+    /// `unix:/path/to/socket`
+    Unix(PathBuf),
+}
+
+impl StreamAddr {
+    pub fn parse(addr: &str) -> Result<Self> {
+        if let Some(path) = addr.strip_prefix("unix:") {
+            if path.is_empty() {
+                return Err(Error::InvalidArgument(
+                    "unix stream address needs a socket path".to_string(),
+                ));
+            }
+            return Ok(StreamAddr::Unix(path.into()));
+        }
+        let valid = addr
+            .rsplit_once(':')
+            .is_some_and(|(host, port)| !host.is_empty() && port.parse::<u16>().is_ok());
+        if !valid {
+            return Err(Error::InvalidArgument(format!(
+                "stream address '{}' is neither HOST:PORT nor unix:PATH",
+                addr
+            )));
+        }
+        Ok(StreamAddr::Tcp(addr.to_string()))
+    }
+
+    fn connect(&self) -> std::io::Result<Socket> {
+        match self {
+            StreamAddr::Tcp(addr) => {
+                let mut last_error = None;
+                for socket_addr in addr.to_socket_addrs()? {
+                    match TcpStream::connect_timeout(&socket_addr, CONNECT_TIMEOUT) {
+                        Ok(stream) => {
+                            stream.set_nodelay(true)?;
+                            let socket = Socket::Tcp(stream);
+                            socket.set_timeouts(WRITE_TIMEOUT, WRITE_TIMEOUT)?;
+                            return Ok(socket);
+                        }
+                        Err(e) => last_error = Some(e),
+                    }
+                }
+                Err(last_error.unwrap_or_else(|| {
+                    std::io::Error::new(
+                        std::io::ErrorKind::NotFound,
+                        format!("{} resolves to no address", addr),
+                    )
+                }))
+            }
+            StreamAddr::Unix(path) => {
+                let socket = Socket::Unix(UnixStream::connect(path)?);
+                socket.set_timeouts(WRITE_TIMEOUT, WRITE_TIMEOUT)?;
+                Ok(socket)
+            }
+        }
+    }
+
+    /// Listen for agents; a stale unix socket left by an earlier collector
+    /// is replaced
+    pub fn bind(&self) -> Result<Listener> {
+        match self {
+            StreamAddr::Tcp(addr) => Ok(Listener::Tcp(TcpListener::bind(addr)?)),
+            StreamAddr::Unix(path) => {
+                if std::fs::symlink_metadata(path).is_ok_and(|m| m.file_type().is_socket()) {
+                    std::fs::remove_file(path)?;
+                }
+                Ok(Listener::Unix(UnixListener::bind(path)?))
+            }
+        }
+    }
+}
+
+impl fmt::Display for StreamAddr {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        match self {
+            StreamAddr::Tcp(addr) => write!(f, "{}", addr),
+            StreamAddr::Unix(path) => write!(f, "unix:{}", path.display()),
+        }
+    }
+}
+
+/// A connected stream of either kind
+pub enum Socket {
+    Tcp(TcpStream),
+    Unix(UnixStream),
+}
+
+impl Socket {
+    fn set_timeouts(&self, read: Duration, write: Duration) -> std::io::Result<()> {
+        match self {
+            Socket::Tcp(stream) => {
+                stream.set_read_timeout(Some(read))?;
+                stream.set_write_timeout(Some(write))
+            }
+            Socket::Unix(stream) => {
+                stream.set_read_timeout(Some(read))?;
+                stream.set_write_timeout(Some(write))
+            }
+        }
+    }
+
+    fn set_nonblocking(&self, nonblocking: bool) -> std::io::Result<()> {
+        match self {
+            Socket::Tcp(stream) => stream.set_nonblocking(nonblocking),
+            Socket::Unix(stream) => stream.set_nonblocking(nonblocking),
+        }
+    }
+
+    fn try_clone(&self) -> std::io::Result<Socket> {
+        match self {
+            Socket::Tcp(stream) => stream.try_clone().map(Socket::Tcp),
+            Socket::Unix(stream) => stream.try_clone().map(Socket::Unix),
+        }
+    }
+
+    /// End the stream both ways, waking whoever is blocked reading it
+    fn shutdown(&self) -> std::io::Result<()> {
+        match self {
+            Socket::Tcp(stream) => stream.shutdown(std::net::Shutdown::Both),
+            Socket::Unix(stream) => stream.shutdown(std::net::Shutdown::Both),
+        }
+    }
+}
+
+impl Read for Socket {
+    fn read(&mut self, buf: &mut [u8]) -> std::io::Result<usize> {
+        match self {
+            Socket::Tcp(stream) => stream.read(buf),
+            Socket::Unix(stream) => stream.read(buf),
+        }
+    }
+}
+
+impl Write for Socket {
+    fn write(&mut self, buf: &[u8]) -> std::io::Result<usize> {
+        match self {
+            Socket::Tcp(stream) => stream.write(buf),
+            Socket::Unix(stream) => stream.write(buf),
+        }
+    }
+
+    fn flush(&mut self) -> std::io::Result<()> {
+        match self {
+            Socket::Tcp(stream) => stream.flush(),
+            Socket::Unix(stream) => stream.flush(),
+        }
+    }
+}
+
+/// A bound collector address
+pub enum Listener {
+    Tcp(TcpListener),
+    Unix(UnixListener),
+}
+
+impl Listener {
+    /// Wait for the next agent; returns its socket and a description of the
+    /// peer for logging
+    pub fn accept(&self) -> std::io::Result<(Socket, String)> {
+        let (socket, peer) = match self {
+            Listener::Tcp(listener) => {
+                let (stream, peer) = listener.accept()?;
+                (Socket::Tcp(stream), peer.to_string())
+            }
+            Listener::Unix(listener) => {
+                let (stream, _) = listener.accept()?;
+                (Socket::Unix(stream), "unix peer".to_string())
+            }
+        };
+        socket.set_timeouts(READ_TIMEOUT, WRITE_TIMEOUT)?;
+        Ok((socket, peer))
+    }
+}
+
+/// Agent side of a stream
+struct Sender {
+    addr: StreamAddr,
+    hello: Hello,
+    socket: Option<Socket>,
+    /// Checkpoints written but not yet acked, with their sequence numbers;
+    /// written again, in order, after a reconnect
+    unacked: VecDeque<(u64, CheckpointBatch)>,
+    /// Sequence number of the last checkpoint written
+    seq: u64,
+    /// Last sequence number the collector acked on this connection
+    acked: u64,
+    /// Bytes read from the collector and not yet decoded
+    incoming: Vec<u8>,
+    /// Heap values last written per location, process and histogram;
+    /// unchanged ones are left out of the next checkpoint, as the writer
+    /// would skip them anyway. Kept across reconnects, since everything
+    /// written after the last ack is written again first.
+    sent_heap: HashMap<i64, HeapSampleData>,
+    sent_process_heap: HashMap<(u32, i64), HeapSampleData>,
+    sent_histograms: HashMap<i64, HeapHistogram>,
+    bytes_sent: u64,
+    /// Next reconnect attempt, while disconnected
+    retry_at: Instant,
+    backoff: Duration,
+}
+
+fn unexpected(what: &str) -> std::io::Error {
+    std::io::Error::new(std::io::ErrorKind::InvalidData, what.to_string())
+}
+
+impl Sender {
+    /// Connect, send the hello and resend what the collector has not
+    /// stored; on failure, schedules the next attempt
+    fn connect(&mut self) -> std::io::Result<()> {
+        match self.open() {
+            Ok(()) => {
+                self.backoff = MIN_BACKOFF;
+                Ok(())
+            }
+            Err(e) => {
+                self.disconnect();
+                self.retry_at = Instant::now() + self.backoff;
+                self.backoff = (self.backoff * 2).min(MAX_BACKOFF);
+                Err(e)
+            }
+        }
+    }
+
+    fn open(&mut self) -> std::io::Result<()> {
+        let mut socket = self.addr.connect()?;
+        self.bytes_sent += wire::write_hello(&mut socket, &self.hello)? as u64;
+        self.socket = Some(socket);
+        self.acked = 0;
+        // The first ack says how much of the session the collector has
+        while !self.read_acks(true)? {}
+        if self.acked + (self.unacked.len() as u64) < self.seq {
+            return Err(unexpected(
+                "collector lost checkpoints it had acked; restart the recording",
+            ));
+        }
+
+        let Some(socket) = self.socket.as_mut() else {
+            return Err(std::io::ErrorKind::NotConnected.into());
+        };
+        for (seq, batch) in &self.unacked {
+            self.bytes_sent += wire::write_batch(socket, *seq, batch)? as u64;
+        }
+        Ok(())
+    }
+
+    fn disconnect(&mut self) {
+        self.socket = None;
+        self.incoming.clear();
+        self.retry_at = Instant::now();
+    }
+
+    /// Read what the collector has sent and drop the checkpoints it acks;
+    /// with `wait`, blocks until something arrives. Returns whether an ack
+    /// was read.
+    fn read_acks(&mut self, wait: bool) -> std::io::Result<bool> {
+        let Some(socket) = self.socket.as_mut() else {
+            return Err(std::io::ErrorKind::NotConnected.into());
+        };
+        socket.set_nonblocking(!wait)?;
+        let mut buf = [0u8; 512];
+        let read = loop {
+            match socket.read(&mut buf) {
+                Ok(0) => {
+                    break Err(std::io::Error::new(
+                        std::io::ErrorKind::UnexpectedEof,
+                        "collector closed the stream",
+                    ));
+                }
+                Ok(n) => {
+                    self.incoming.extend_from_slice(&buf[..n]);
+                    if wait {
+                        break Ok(());
+                    }
+                }
+                Err(e) if e.kind() == std::io::ErrorKind::WouldBlock && !wait => break Ok(()),
+                Err(e) if e.kind() == std::io::ErrorKind::WouldBlock => {
+                    break Err(std::io::Error::new(
+                        std::io::ErrorKind::TimedOut,
+                        "collector stopped acking",
+                    ));
+                }
+                Err(e) if e.kind() == std::io::ErrorKind::Interrupted => {}
+                Err(e) => break Err(e),
+            }
+        };
+        let restored = socket.set_nonblocking(false);
+        read?;
+        restored?;
+
+        let mut acked = false;
+        while let Some(message) =
+            wire::take_message(&mut self.incoming).map_err(|e| unexpected(&e.to_string()))?
+        {
+            let Message::Ack(seq) = message else {
+                return Err(unexpected("collector sent something other than an ack"));
+            };
+            while self.unacked.front().is_some_and(|&(sent, _)| sent <= seq) {
+                self.unacked.pop_front();
+            }
+            self.acked = self.acked.max(seq);
+            acked = true;
+        }
+        Ok(acked)
+    }
+
+    /// Drop heap entries equal to what was last written
+    fn strip_unchanged(&self, batch: &mut CheckpointBatch) {
+        batch
+            .heap
+            .retain(|id, data| self.sent_heap.get(id) != Some(&*data));
+        batch
+            .process_heap
+            .retain(|key, data| self.sent_process_heap.get(key) != Some(&*data));
+        batch
+            .heap_histograms
+            .retain(|id, hist| self.sent_histograms.get(id) != Some(&*hist));
+    }
+
+    /// Write one checkpoint after those already written; only then do its
+    /// heap values count as sent
+    fn write(&mut self, batch: &CheckpointBatch) -> std::io::Result<()> {
+        let Some(socket) = self.socket.as_mut() else {
+            return Err(std::io::ErrorKind::NotConnected.into());
+        };
+        self.bytes_sent += wire::write_batch(socket, self.seq + 1, batch)? as u64;
+        self.seq += 1;
+        self.sent_heap.extend(&batch.heap);
+        self.sent_process_heap.extend(&batch.process_heap);
+        self.sent_histograms.extend(&batch.heap_histograms);
+        Ok(())
+    }
+
+    /// Send held checkpoints in order, reconnecting first if it is time to
+    /// (or at once with `now`). A failed checkpoint stays at the front.
+    fn send_all(
+        &mut self,
+        unsent: &mut VecDeque<CheckpointBatch>,
+        now: bool,
+    ) -> std::io::Result<()> {
+        if unsent.is_empty() && self.unacked.is_empty() {
+            return Ok(());
+        }
+        if self.socket.is_none() {
+            if !now && Instant::now() < self.retry_at {
+                return Ok(());
+            }
+            self.connect()?;
+        }
+        let result = self.send_unsent(unsent);
+        if result.is_err() {
+            self.disconnect();
+        }
+        result
+    }
+
+    fn send_unsent(&mut self, unsent: &mut VecDeque<CheckpointBatch>) -> std::io::Result<()> {
+        self.read_acks(false)?;
+        while !unsent.is_empty() {
+            while self.unacked.len() >= MAX_UNACKED {
+                self.read_acks(true)?;
+            }
+            let Some(mut batch) = unsent.pop_front() else {
+                break;
+            };
+            self.strip_unchanged(&mut batch);
+            if let Err(e) = self.write(&batch) {
+                unsent.push_front(batch);
+                return Err(e);
+            }
+            // Kept until acked, to be written again after a reconnect
+            self.unacked.push_back((self.seq, batch));
+        }
+        Ok(())
+    }
+
+    /// Wait until the collector has acked every checkpoint written
+    fn wait_acked(&mut self) -> std::io::Result<()> {
+        while !self.unacked.is_empty() {
+            if let Err(e) = self.read_acks(true) {
+                self.disconnect();
+                return Err(e);
+            }
+        }
+        Ok(())
+    }
+}
+
+/// Hold a checkpoint for sending, merging it with the newest held one once
+/// `MAX_UNSENT` are waiting
+fn hold(unsent: &mut VecDeque<CheckpointBatch>, mut batch: CheckpointBatch) {
+    if unsent.len() >= MAX_UNSENT
+        && batch.timestamp_ms.is_some()
+        && let Some(older) = unsent.pop_back()
+    {
+        batch.absorb_older(older);
+    }
+    unsent.push_back(batch);
+}
+
+fn run_sender(
+    mut sender: Sender,
+    rx: Receiver<Box<CheckpointBatch>>,
+    written: &WriterStats,
+) -> Result<()> {
+    let mut unsent = VecDeque::new();
+    loop {
+        // Wait for the next checkpoint, or while holding some, for the next
+        // reconnect attempt
+        let idle = unsent.is_empty() && (sender.socket.is_some() || sender.unacked.is_empty());
+        let received = if idle {
+            rx.recv().map_err(|_| RecvTimeoutError::Disconnected)
+        } else {
+            rx.recv_timeout(sender.retry_at.saturating_duration_since(Instant::now()))
+        };
+        let open = match received {
+            Ok(batch) => {
+                hold(&mut unsent, *batch);
+                true
+            }
+            Err(RecvTimeoutError::Timeout) => true,
+            Err(RecvTimeoutError::Disconnected) => false,
+        };
+        while let Ok(batch) = rx.try_recv() {
+            hold(&mut unsent, *batch);
+        }
+
+        let start = Instant::now();
+        let mut sent = sender.send_all(&mut unsent, !open);
+        if !open && sent.is_ok() {
+            sent = sender.wait_acked();
+        }
+        written.record(start.elapsed(), sender.bytes_sent);
+
+        if !open {
+            return match sent {
+                Ok(()) => Ok(()),
+                Err(e) => Err(Error::Io(std::io::Error::new(
+                    e.kind(),
+                    format!(
+                        "{}: {} checkpoints not stored: {}",
+                        sender.addr,
+                        unsent.len() + sender.unacked.len(),
+                        e
+                    ),
+                ))),
+            };
+        }
+    }
+}
+
+/// Start the sender thread of an agent streaming to `addr`
+///
+/// Connects first, so a wrong address or a collector that is not running
+/// fails here rather than unnoticed during the recording.
+pub(super) fn spawn_sender(addr: &StreamAddr, hello: Hello) -> Result<Flusher> {
+    let mut sender = Sender {
+        addr: addr.clone(),
+        hello,
+        socket: None,
+        unacked: VecDeque::new(),
+        seq: 0,
+        acked: 0,
+        incoming: Vec::new(),
+        sent_heap: HashMap::new(),
+        sent_process_heap: HashMap::new(),
+        sent_histograms: HashMap::new(),
+        bytes_sent: 0,
+        retry_at: Instant::now(),
+        backoff: MIN_BACKOFF,
+    };
+    sender
+        .connect()
+        .map_err(|e| std::io::Error::new(e.kind(), format!("{}: {}", addr, e)))?;
+    Flusher::start("rsprof-stream", move |rx, written| {
+        run_sender(sender, rx, written)
+    })
+}
+
+/// Database of an agent's session under `dir`: one directory per host, named
+/// like a local recording
+fn session_path(dir: &Path, hello: &Hello) -> PathBuf {
+    let stamp = chrono::DateTime::from_timestamp_millis(hello.start_ms)
+        .unwrap_or_default()
+        .with_timezone(&chrono::Local)
+        .format("%y%m%d%H%M%S");
+    dir.join(process::sanitize_name(&hello.host)).join(format!(
+        "rsprof.{}.{}-{}.db",
+        process::sanitize_name(&hello.process_name),
+        stamp,
+        hello.pid
+    ))
+}
+
+/// Sessions being collected, so an agent's new stream takes over from its
+/// old one rather than writing the same database beside it
+#[derive(Default)]
+pub struct Sessions {
+    /// Session database -> id and socket of the stream writing it
+    active: Mutex<HashMap<PathBuf, (u64, Socket)>>,
+    /// Signalled whenever a stream lets go of its session
+    released: Condvar,
+    next_id: AtomicU64,
+}
+
+/// A session held by one stream; dropping it lets the next one in
+struct SessionClaim<'a> {
+    sessions: &'a Sessions,
+    path: PathBuf,
+    id: u64,
+}
+
+impl Sessions {
+    /// Take `path` for the stream on `socket`, first shutting down the
+    /// stream holding it and waiting until that one has written all it read
+    fn claim(&self, path: &Path, socket: &Socket) -> Result<SessionClaim<'_>> {
+        let socket = socket.try_clone()?;
+        let id = self.next_id.fetch_add(1, Ordering::Relaxed);
+        let mut active = self.active.lock().unwrap_or_else(PoisonError::into_inner);
+        while let Some((_, old)) = active.get(path) {
+            let _ = old.shutdown();
+            active = self
+                .released
+                .wait(active)
+                .unwrap_or_else(PoisonError::into_inner);
+        }
+        active.insert(path.to_path_buf(), (id, socket));
+        Ok(SessionClaim {
+            sessions: self,
+            path: path.to_path_buf(),
+            id,
+        })
+    }
+}
+
+impl Drop for SessionClaim<'_> {
+    fn drop(&mut self) {
+        let mut active = self
+            .sessions
+            .active
+            .lock()
+            .unwrap_or_else(PoisonError::into_inner);
+        if active.get(&self.path).is_some_and(|&(id, _)| id == self.id) {
+            active.remove(&self.path);
+        }
+        drop(active);
+        self.sessions.released.notify_all();
+    }
+}
+
+/// Create the session's database, or keep the existing one when the agent
+/// is reconnecting; returns the last checkpoint already stored
+fn open_session(path: &Path, hello: &Hello) -> Result<u64> {
+    if let Some(parent) = path.parent() {
+        std::fs::create_dir_all(parent)?;
+    }
+    let existed = path.exists();
+    let conn = Connection::open(path)?;
+    conn.execute_batch(
+        "PRAGMA journal_mode = WAL;
+         PRAGMA synchronous = NORMAL;",
+    )?;
+    if existed {
+        schema::create_missing_tables(&conn)?;
+        let stored = schema::get_meta(&conn, STREAM_SEQ_KEY)?;
+        return Ok(stored.and_then(|seq| seq.parse().ok()).unwrap_or(0));
+    }
+
+    schema::create_tables(&conn)?;
+    let start_time = chrono::DateTime::from_timestamp_millis(hello.start_ms).unwrap_or_default();
+    schema::set_meta(&conn, "version", &SCHEMA_VERSION.to_string())?;
+    schema::set_meta(&conn, "pid", &hello.pid.to_string())?;
+    schema::set_meta(&conn, "process_name", &hello.process_name)?;
+    schema::set_meta(&conn, "exe_path", &hello.exe_path)?;
+    schema::set_meta(&conn, "start_time", &start_time.to_rfc3339())?;
+    schema::set_meta(&conn, "cpu_freq_hz", &hello.cpu_freq.to_string())?;
+    schema::set_meta(&conn, "host", &hello.host)?;
+    Ok(0)
+}
+
+/// Write one agent's stream into its session database under `dir` until the
+/// agent disconnects; returns the checkpoints written
+///
+/// A stream already writing the session is shut down first. `on_open` sees
+/// the session and its database before the first write. Checkpoints are
+/// acked once committed, and those read before an error are still written.
+pub fn collect_stream(
+    socket: &mut Socket,
+    dir: &Path,
+    sessions: &Sessions,
+    on_open: impl FnOnce(&Hello, &Path),
+) -> Result<u64> {
+    let hello = match wire::read_message(socket)? {
+        Some(Message::Hello(hello)) => hello,
+        Some(_) => return Err(wire::corrupt("stream does not start with a hello")),
+        None => return Ok(0),
+    };
+    let path = session_path(dir, &hello);
+    let _claim = sessions.claim(&path, socket)?;
+    let stored = open_session(&path, &hello)?;
+    on_open(&hello, &path);
+
+    let mut flusher = Flusher::spawn(&path)?;
+    wire::write_ack(socket, stored)?;
+    let mut acks = socket.try_clone()?;
+    let (stop, stopped) = mpsc::channel::<()>();
+    let mut seq = stored;
+    let mut checkpoints = 0;
+    let result = std::thread::scope(|scope| {
+        let flusher = &flusher;
+        // Ack checkpoints as the writer commits them, until the stream ends
+        scope.spawn(move || {
+            let mut acked = 0;
+            while let Err(RecvTimeoutError::Timeout) = stopped.recv_timeout(ACK_INTERVAL) {
+                let committed = flusher.committed();
+                if committed > acked {
+                    if wire::write_ack(&mut acks, stored + committed).is_err() {
+                        break;
+                    }
+                    acked = committed;
+                }
+            }
+        });
+
+        let result = loop {
+            match wire::read_message(socket) {
+                Ok(Some(Message::Checkpoint {
+                    seq: number,
+                    mut batch,
+                })) => {
+                    // Resent after a reconnect but already stored
+                    if number <= seq {
+                        continue;
+                    }
+                    if number != seq + 1 {
+                        break Err(wire::corrupt("checkpoint out of sequence"));
+                    }
+                    seq = number;
+                    if batch.timestamp_ms.is_some() {
+                        checkpoints += 1;
+                    }
+                    batch.meta.insert(STREAM_SEQ_KEY, seq.to_string());
+                    // Blocks while the writer is behind, which slows the
+                    // agent down through the socket rather than losing
+                    // checkpoints
+                    if !flusher.send(batch) {
+                        break Ok(());
+                    }
+                }
+                Ok(Some(_)) => break Err(wire::corrupt("hello or ack after the hello")),
+                Ok(None) => break Ok(()),
+                Err(e) => break Err(e),
+            }
+        };
+        drop(stop);
+        result
+    });
+    if let Some(e) = flusher.finish() {
+        return Err(e);
+    }
+    result.map(|()| checkpoints)
+}
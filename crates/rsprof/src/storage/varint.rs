@@ -0,0 +1,89 @@
+//! LEB128 varints, as used by stack blobs, the stream, compacted profiles
+//! and pprof export.
+//!
+//! Unsigned values take 7 bits a byte, low bits first, with the top bit set
+//! on every byte but the last. Signed values are zigzagged first so small
+//! negative deltas stay short, and strings are a length then UTF-8.
+
+/// Append `value` as an unsigned varint
+#[inline]
+pub fn put_u64(buf: &mut Vec<u8>, mut value: u64) {
+    while value >= 0x80 {
+        buf.push(value as u8 | 0x80);
+        value >>= 7;
+    }
+    buf.push(value as u8);
+}
+
+/// Append `value` zigzagged, as an unsigned varint
+#[inline]
+pub fn put_i64(buf: &mut Vec<u8>, value: i64) {
+    put_u64(buf, ((value << 1) ^ (value >> 63)) as u64);
+}
+
+/// Append `value` as its byte length, then its bytes
+pub fn put_str(buf: &mut Vec<u8>, value: &str) {
+    put_u64(buf, value.len() as u64);
+    buf.extend_from_slice(value.as_bytes());
+}
+
+/// Reads values off the front of a buffer; None past its end or for a
+/// varint longer than 64 bits
+pub struct Reader<'a> {
+    buf: &'a [u8],
+}
+
+impl<'a> Reader<'a> {
+    pub fn new(buf: &'a [u8]) -> Self {
+        Reader { buf }
+    }
+
+    /// Bytes left
+    pub fn len(&self) -> usize {
+        self.buf.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.buf.is_empty()
+    }
+
+    pub fn u8(&mut self) -> Option<u8> {
+        let (&byte, rest) = self.buf.split_first()?;
+        self.buf = rest;
+        Some(byte)
+    }
+
+    #[inline]
+    pub fn u64(&mut self) -> Option<u64> {
+        let mut value = 0u64;
+        for shift in (0..64).step_by(7) {
+            let byte = self.u8()?;
+            value |= ((byte & 0x7f) as u64) << shift;
+            if byte & 0x80 == 0 {
+                return Some(value);
+            }
+        }
+        None
+    }
+
+    pub fn i64(&mut self) -> Option<i64> {
+        let value = self.u64()?;
+        Some((value >> 1) as i64 ^ -((value & 1) as i64))
+    }
+
+    /// Length-prefixed bytes, as written by `put_str`
+    pub fn bytes(&mut self) -> Option<&'a [u8]> {
+        let len = self.u64()? as usize;
+        if len > self.buf.len() {
+            return None;
+        }
+        let (bytes, rest) = self.buf.split_at(len);
+        self.buf = rest;
+        Some(bytes)
+    }
+
+    /// A string written by `put_str`; None also for invalid UTF-8
+    pub fn str(&mut self) -> Option<&'a str> {
+        std::str::from_utf8(self.bytes()?).ok()
+    }
+}
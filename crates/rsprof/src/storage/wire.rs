@@ -0,0 +1,795 @@
+//! Binary form of checkpoint batches, for streaming them to a collector.
+//!
+//! Each message is a frame: a little-endian `u32` payload length, then a
+//! kind byte and the fields. Integers are LEB128 varints (signed ones
+//! zigzagged first) and strings are length-prefixed UTF-8, so a checkpoint of
+//! small counts costs a few bytes per location. A stream opens with one
+//! `Hello` and carries one frame per checkpoint after it, each numbered in
+//! the session. The collector answers with `Ack` frames naming the last
+//! checkpoint it has committed, the first one right after the hello.
+
+use super::flusher::{CheckpointBatch, HeapSampleData};
+use super::varint::{self, Reader};
+use super::writer::ProfilerStats;
+use crate::cpu::PmuCounters;
+use crate::error::{Error, Result};
+use crate::heap::HeapHistogram;
+use crate::heap::histogram::HISTOGRAM_BUCKETS;
+use crate::symbols::Location;
+use std::io::{Read, Write};
+use std::time::Duration;
+
+/// Bumped on any change to the encoding
+pub const PROTOCOL_VERSION: u64 = 2;
+
+/// Largest frame accepted; anything bigger is a corrupt stream
+const MAX_FRAME_BYTES: usize = 256 << 20;
+
+const KIND_HELLO: u8 = 1;
+const KIND_CHECKPOINT: u8 = 2;
+const KIND_ACK: u8 = 3;
+
+/// Metadata keys a batch may set, sent by index
+const META_KEYS: [&str; 4] = [
+    "heap_sample_bytes",
+    "lost_samples",
+    "dropped_events",
+    "deferred_checkpoints",
+];
+
+/// The first message of a stream: who is recording
+#[derive(Debug, Clone)]
+pub struct Hello {
+    pub host: String,
+    pub pid: u32,
+    pub process_name: String,
+    pub exe_path: String,
+    pub cpu_freq: u64,
+    /// Recording start, in milliseconds since the Unix epoch; with `host`
+    /// and `pid` it names the session, so a reconnecting agent resumes it
+    pub start_ms: i64,
+}
+
+/// A decoded message
+pub(super) enum Message {
+    Hello(Hello),
+    /// A checkpoint and its sequence number, counted from 1 in the session
+    Checkpoint {
+        seq: u64,
+        batch: Box<CheckpointBatch>,
+    },
+    /// Every checkpoint up to this sequence number is stored
+    Ack(u64),
+}
+
+/// Frame being encoded, length prefix first
+struct Encoder {
+    buf: Vec<u8>,
+}
+
+impl Encoder {
+    fn new(kind: u8) -> Self {
+        let mut buf = vec![0; 4];
+        buf.push(kind);
+        Encoder { buf }
+    }
+
+    /// Fill in the length and write the frame in one call, so a failed
+    /// write never leaves half a frame counted as sent
+    fn write_to(mut self, out: &mut impl Write) -> std::io::Result<usize> {
+        let len = (self.buf.len() - 4) as u32;
+        self.buf[..4].copy_from_slice(&len.to_le_bytes());
+        out.write_all(&self.buf)?;
+        Ok(self.buf.len())
+    }
+
+    fn u64(&mut self, value: u64) {
+        varint::put_u64(&mut self.buf, value);
+    }
+
+    fn i64(&mut self, value: i64) {
+        varint::put_i64(&mut self.buf, value);
+    }
+
+    fn opt_i64(&mut self, value: Option<i64>) {
+        match value {
+            Some(value) => {
+                self.buf.push(1);
+                self.i64(value);
+            }
+            None => self.buf.push(0),
+        }
+    }
+
+    fn str(&mut self, value: &str) {
+        varint::put_str(&mut self.buf, value);
+    }
+
+    fn duration(&mut self, value: Duration) {
+        self.u64(value.as_micros() as u64);
+    }
+
+    fn heap(&mut self, data: &HeapSampleData) {
+        let &(alloc, free, live, alloc_count, free_count) = data;
+        self.i64(alloc);
+        self.i64(free);
+        self.i64(live);
+        self.u64(alloc_count);
+        self.u64(free_count);
+    }
+}
+
+/// Payload being decoded; running off the end is an error
+struct Decoder<'a> {
+    reader: Reader<'a>,
+}
+
+pub(super) fn corrupt(what: &str) -> Error {
+    Error::Io(std::io::Error::new(
+        std::io::ErrorKind::InvalidData,
+        format!("corrupt stream: {}", what),
+    ))
+}
+
+impl Decoder<'_> {
+    fn u8(&mut self) -> Result<u8> {
+        self.reader.u8().ok_or_else(|| corrupt("truncated"))
+    }
+
+    fn u64(&mut self) -> Result<u64> {
+        self.reader
+            .u64()
+            .ok_or_else(|| corrupt("truncated or overlong varint"))
+    }
+
+    fn u32(&mut self) -> Result<u32> {
+        u32::try_from(self.u64()?).map_err(|_| corrupt("value out of range"))
+    }
+
+    fn i64(&mut self) -> Result<i64> {
+        self.reader
+            .i64()
+            .ok_or_else(|| corrupt("truncated or overlong varint"))
+    }
+
+    fn opt_i64(&mut self) -> Result<Option<i64>> {
+        match self.u8()? {
+            0 => Ok(None),
+            _ => self.i64().map(Some),
+        }
+    }
+
+    fn str(&mut self) -> Result<String> {
+        let bytes = self.reader.bytes().ok_or_else(|| corrupt("truncated"))?;
+        String::from_utf8(bytes.to_vec()).map_err(|_| corrupt("invalid string"))
+    }
+
+    fn duration(&mut self) -> Result<Duration> {
+        self.u64().map(Duration::from_micros)
+    }
+
+    fn heap(&mut self) -> Result<HeapSampleData> {
+        Ok((
+            self.i64()?,
+            self.i64()?,
+            self.i64()?,
+            self.u64()?,
+            self.u64()?,
+        ))
+    }
+
+    /// Element count of a list, bounded by the bytes left (each element
+    /// takes at least one)
+    fn count(&mut self) -> Result<usize> {
+        let count = self.u64()? as usize;
+        if count > self.reader.len() {
+            return Err(corrupt("count past end of frame"));
+        }
+        Ok(count)
+    }
+}
+
+/// Write a stream's `Hello`; returns the bytes written
+pub(super) fn write_hello(out: &mut impl Write, hello: &Hello) -> std::io::Result<usize> {
+    let mut enc = Encoder::new(KIND_HELLO);
+    enc.u64(PROTOCOL_VERSION);
+    enc.str(&hello.host);
+    enc.u64(hello.pid as u64);
+    enc.str(&hello.process_name);
+    enc.str(&hello.exe_path);
+    enc.u64(hello.cpu_freq);
+    enc.i64(hello.start_ms);
+    enc.write_to(out)
+}
+
+/// Write one checkpoint batch as number `seq` of the session; returns the
+/// bytes written
+pub(super) fn write_batch(
+    out: &mut impl Write,
+    seq: u64,
+    batch: &CheckpointBatch,
+) -> std::io::Result<usize> {
+    let mut enc = Encoder::new(KIND_CHECKPOINT);
+    enc.u64(seq);
+    enc.opt_i64(batch.timestamp_ms);
+
+    enc.u64(batch.locations.len() as u64);
+    for (id, location) in &batch.locations {
+        enc.i64(*id);
+        enc.str(&location.file);
+        enc.u64(location.line as u64);
+        enc.str(&location.function);
+    }
+    enc.u64(batch.processes.len() as u64);
+    for (pid, name, exe_path) in &batch.processes {
+        enc.u64(*pid as u64);
+        enc.str(name);
+        enc.str(exe_path);
+    }
+    enc.u64(batch.threads.len() as u64);
+    for (tid, pid, name) in &batch.threads {
+        enc.u64(*tid as u64);
+        enc.u64(*pid as u64);
+        enc.str(name);
+    }
+    enc.u64(batch.stacks.len() as u64);
+    for (id, frames) in &batch.stacks {
+        enc.i64(*id);
+        enc.u64(frames.len() as u64);
+        for &frame in frames {
+            enc.i64(frame);
+        }
+    }
+
+    enc.u64(batch.cpu.len() as u64);
+    for (&location_id, &count) in &batch.cpu {
+        enc.i64(location_id);
+        enc.u64(count);
+    }
+    enc.u64(batch.thread_cpu.len() as u64);
+    for (&(tid, location_id), &count) in &batch.thread_cpu {
+        enc.u64(tid as u64);
+        enc.i64(location_id);
+        enc.u64(count);
+    }
+    enc.u64(batch.stack_cpu.len() as u64);
+    for (&stack_id, &count) in &batch.stack_cpu {
+        enc.i64(stack_id);
+        enc.u64(count);
+    }
+    enc.u64(batch.heap.len() as u64);
+    for (&location_id, data) in &batch.heap {
+        enc.i64(location_id);
+        enc.heap(data);
+    }
+    enc.u64(batch.process_heap.len() as u64);
+    for (&(pid, location_id), data) in &batch.process_heap {
+        enc.u64(pid as u64);
+        enc.i64(location_id);
+        enc.heap(data);
+    }
+    enc.u64(batch.heap_histograms.len() as u64);
+    for (&location_id, histogram) in &batch.heap_histograms {
+        enc.i64(location_id);
+        for &count in histogram.size.iter().chain(&histogram.lifetime) {
+            enc.u64(count);
+        }
+    }
+    enc.u64(batch.offcpu.len() as u64);
+    for (&location_id, &blocked_ns) in &batch.offcpu {
+        enc.i64(location_id);
+        enc.u64(blocked_ns);
+    }
+    enc.u64(batch.pmu.len() as u64);
+    for (&location_id, counters) in &batch.pmu {
+        enc.i64(location_id);
+        enc.u64(counters.cycles);
+        enc.u64(counters.instructions);
+        enc.u64(counters.llc_misses);
+        enc.u64(counters.branch_misses);
+    }
+
+    let meta: Vec<(usize, &String)> = batch
+        .meta
+        .iter()
+        .filter_map(|(key, value)| Some((META_KEYS.iter().position(|k| k == key)?, value)))
+        .collect();
+    enc.u64(meta.len() as u64);
+    for (key, value) in meta {
+        enc.u64(key as u64);
+        enc.str(value);
+    }
+    enc.opt_i64(batch.prune_before_ms);
+
+    let stats = &batch.stats;
+    enc.duration(stats.shm_scan);
+    enc.duration(stats.symbolize);
+    enc.duration(stats.lag);
+    enc.u64(stats.lost_samples);
+    enc.u64(stats.dropped_events);
+
+    enc.write_to(out)
+}
+
+/// Acknowledge every checkpoint up to `seq`
+pub(super) fn write_ack(out: &mut impl Write, seq: u64) -> std::io::Result<usize> {
+    let mut enc = Encoder::new(KIND_ACK);
+    enc.u64(seq);
+    enc.write_to(out)
+}
+
+/// Read the next message, or None at a clean end of stream
+pub(super) fn read_message(input: &mut impl Read) -> Result<Option<Message>> {
+    let mut len = [0u8; 4];
+    match input.read_exact(&mut len) {
+        Ok(()) => {}
+        Err(e) if e.kind() == std::io::ErrorKind::UnexpectedEof => return Ok(None),
+        Err(e) => return Err(e.into()),
+    }
+    let len = u32::from_le_bytes(len) as usize;
+    if len > MAX_FRAME_BYTES {
+        return Err(corrupt("frame too large"));
+    }
+    let mut payload = vec![0u8; len];
+    input.read_exact(&mut payload)?;
+    decode(&payload).map(Some)
+}
+
+/// Take the first message off `buf` once all of its frame has arrived, for
+/// reading a socket without blocking
+pub(super) fn take_message(buf: &mut Vec<u8>) -> Result<Option<Message>> {
+    let Some(len) = buf.first_chunk::<4>() else {
+        return Ok(None);
+    };
+    let len = u32::from_le_bytes(*len) as usize;
+    if len > MAX_FRAME_BYTES {
+        return Err(corrupt("frame too large"));
+    }
+    if buf.len() < 4 + len {
+        return Ok(None);
+    }
+    let message = decode(&buf[4..4 + len])?;
+    buf.drain(..4 + len);
+    Ok(Some(message))
+}
+
+fn decode(payload: &[u8]) -> Result<Message> {
+    let mut dec = Decoder {
+        reader: Reader::new(payload),
+    };
+    let message = match dec.u8()? {
+        KIND_HELLO => Message::Hello(read_hello(&mut dec)?),
+        KIND_CHECKPOINT => Message::Checkpoint {
+            seq: dec.u64()?,
+            batch: Box::new(read_batch(&mut dec)?),
+        },
+        KIND_ACK => Message::Ack(dec.u64()?),
+        _ => return Err(corrupt("unknown message kind")),
+    };
+    Ok(message)
+}
+
+fn read_hello(dec: &mut Decoder) -> Result<Hello> {
+    let version = dec.u64()?;
+    if version != PROTOCOL_VERSION {
+        return Err(Error::InvalidArgument(format!(
+            "agent speaks stream protocol {}, this collector {}",
+            version, PROTOCOL_VERSION
+        )));
+    }
+    Ok(Hello {
+        host: dec.str()?,
+        pid: dec.u32()?,
+        process_name: dec.str()?,
+        exe_path: dec.str()?,
+        cpu_freq: dec.u64()?,
+        start_ms: dec.i64()?,
+    })
+}
+
+fn read_batch(dec: &mut Decoder) -> Result<CheckpointBatch> {
+    let mut batch = CheckpointBatch {
+        timestamp_ms: dec.opt_i64()?,
+        ..Default::default()
+    };
+
+    for _ in 0..dec.count()? {
+        let id = dec.i64()?;
+        let file = dec.str()?;
+        let line = dec.u32()?;
+        let function = dec.str()?;
+        let location = Location {
+            file,
+            line,
+            column: 0,
+            function,
+        };
+        batch.locations.push((id, location));
+    }
+    for _ in 0..dec.count()? {
+        batch.processes.push((dec.u32()?, dec.str()?, dec.str()?));
+    }
+    for _ in 0..dec.count()? {
+        batch.threads.push((dec.u32()?, dec.u32()?, dec.str()?));
+    }
+    for _ in 0..dec.count()? {
+        let id = dec.i64()?;
+        let frames = (0..dec.count()?)
+            .map(|_| dec.i64())
+            .collect::<Result<Vec<i64>>>()?;
+        batch.stacks.push((id, frames));
+    }
+
+    for _ in 0..dec.count()? {
+        batch.cpu.insert(dec.i64()?, dec.u64()?);
+    }
+    for _ in 0..dec.count()? {
+        batch
+            .thread_cpu
+            .insert((dec.u32()?, dec.i64()?), dec.u64()?);
+    }
+    for _ in 0..dec.count()? {
+        batch.stack_cpu.insert(dec.i64()?, dec.u64()?);
+    }
+    for _ in 0..dec.count()? {
+        batch.heap.insert(dec.i64()?, dec.heap()?);
+    }
+    for _ in 0..dec.count()? {
+        batch
+            .process_heap
+            .insert((dec.u32()?, dec.i64()?), dec.heap()?);
+    }
+    for _ in 0..dec.count()? {
+        let location_id = dec.i64()?;
+        let mut histogram = HeapHistogram::default();
+        for bucket in 0..HISTOGRAM_BUCKETS {
+            histogram.size[bucket] = dec.u64()?;
+        }
+        for bucket in 0..HISTOGRAM_BUCKETS {
+            histogram.lifetime[bucket] = dec.u64()?;
+        }
+        batch.heap_histograms.insert(location_id, histogram);
+    }
+    for _ in 0..dec.count()? {
+        batch.offcpu.insert(dec.i64()?, dec.u64()?);
+    }
+    for _ in 0..dec.count()? {
+        let location_id = dec.i64()?;
+        let counters = PmuCounters {
+            cycles: dec.u64()?,
+            instructions: dec.u64()?,
+            llc_misses: dec.u64()?,
+            branch_misses: dec.u64()?,
+        };
+        batch.pmu.insert(location_id, counters);
+    }
+
+    for _ in 0..dec.count()? {
+        let key = *META_KEYS
+            .get(dec.u64()? as usize)
+            .ok_or_else(|| corrupt("unknown meta key"))?;
+        batch.meta.insert(key, dec.str()?);
+    }
+    batch.prune_before_ms = dec.opt_i64()?;
+
+    batch.stats = ProfilerStats {
+        shm_scan: dec.duration()?,
+        symbolize: dec.duration()?,
+        lag: dec.duration()?,
+        lost_samples: dec.u64()?,
+        dropped_events: dec.u64()?,
+        ..Default::default()
+    };
+    Ok(batch)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn hello() -> Hello {
+        Hello {
+            host: "build-01".to_string(),
+            pid: 4242,
+            process_name: "my_app".to_string(),
+            exe_path: "/usr/bin/my_app".to_string(),
+            cpu_freq: 99,
+            start_ms: 1_700_000_000_123,
+        }
+    }
+
+    fn batch() -> CheckpointBatch {
+        let mut batch = CheckpointBatch {
+            timestamp_ms: Some(1_700_000_001_000),
+            prune_before_ms: Some(-5),
+            ..Default::default()
+        };
+        batch.locations.push((
+            7,
+            Location {
+                file: "src/main.rs".to_string(),
+                line: 42,
+                column: 0,
+                function: "main::work".to_string(),
+            },
+        ));
+        batch
+            .processes
+            .push((4242, "my_app".to_string(), "/usr/bin/my_app".to_string()));
+        batch.threads.push((4243, 4242, "worker".to_string()));
+        batch.stacks.push((3, vec![7, 8, -1]));
+        batch.cpu.insert(7, 12);
+        batch.thread_cpu.insert((4243, 7), 12);
+        batch.stack_cpu.insert(3, 12);
+        batch.heap.insert(7, (4096, 1024, 3072, 4, 1));
+        batch
+            .process_heap
+            .insert((4242, 7), (4096, 1024, 3072, 4, 1));
+        let mut histogram = HeapHistogram::default();
+        histogram.size[3] = 4;
+        histogram.lifetime[HISTOGRAM_BUCKETS - 1] = u64::MAX;
+        batch.heap_histograms.insert(7, histogram);
+        batch.offcpu.insert(8, 1_500_000);
+        batch.pmu.insert(
+            7,
+            PmuCounters {
+                cycles: 1000,
+                instructions: 2000,
+                llc_misses: 3,
+                branch_misses: 4,
+            },
+        );
+        batch.meta.insert("lost_samples", "2".to_string());
+        batch.meta.insert("not_sent", "x".to_string());
+        batch.stats = ProfilerStats {
+            shm_scan: Duration::from_micros(150),
+            symbolize: Duration::from_micros(80),
+            lag: Duration::from_millis(3),
+            lost_samples: 2,
+            dropped_events: 1,
+            ..Default::default()
+        };
+        batch
+    }
+
+    /// A frame for `payload`, length prefix first
+    fn frame(payload: &[u8]) -> Vec<u8> {
+        let mut buf = (payload.len() as u32).to_le_bytes().to_vec();
+        buf.extend_from_slice(payload);
+        buf
+    }
+
+    fn read(buf: &[u8]) -> Result<Option<Message>> {
+        read_message(&mut &buf[..])
+    }
+
+    fn is_corrupt(result: Result<Option<Message>>, what: &str) -> bool {
+        matches!(result, Err(Error::Io(e))
+            if e.kind() == std::io::ErrorKind::InvalidData && e.to_string().contains(what))
+    }
+
+    #[test]
+    fn hello_round_trips() {
+        let mut buf = Vec::new();
+        let written = write_hello(&mut buf, &hello()).unwrap();
+        assert_eq!(written, buf.len());
+
+        let Some(Message::Hello(decoded)) = read(&buf).unwrap() else {
+            panic!("expected a hello");
+        };
+        let expected = hello();
+        assert_eq!(decoded.host, expected.host);
+        assert_eq!(decoded.pid, expected.pid);
+        assert_eq!(decoded.process_name, expected.process_name);
+        assert_eq!(decoded.exe_path, expected.exe_path);
+        assert_eq!(decoded.cpu_freq, expected.cpu_freq);
+        assert_eq!(decoded.start_ms, expected.start_ms);
+    }
+
+    #[test]
+    fn checkpoint_round_trips() {
+        let mut buf = Vec::new();
+        write_batch(&mut buf, 17, &batch()).unwrap();
+
+        let Some(Message::Checkpoint {
+            seq,
+            batch: decoded,
+        }) = read(&buf).unwrap()
+        else {
+            panic!("expected a checkpoint");
+        };
+        let expected = batch();
+        assert_eq!(seq, 17);
+        assert_eq!(decoded.timestamp_ms, expected.timestamp_ms);
+        assert_eq!(decoded.locations.len(), 1);
+        let (id, location) = &decoded.locations[0];
+        assert_eq!(*id, 7);
+        assert_eq!(location.file, "src/main.rs");
+        assert_eq!(location.line, 42);
+        assert_eq!(location.function, "main::work");
+        assert_eq!(decoded.processes, expected.processes);
+        assert_eq!(decoded.threads, expected.threads);
+        assert_eq!(decoded.stacks, expected.stacks);
+        assert_eq!(decoded.cpu, expected.cpu);
+        assert_eq!(decoded.thread_cpu, expected.thread_cpu);
+        assert_eq!(decoded.stack_cpu, expected.stack_cpu);
+        assert_eq!(decoded.heap, expected.heap);
+        assert_eq!(decoded.process_heap, expected.process_heap);
+        assert_eq!(decoded.heap_histograms, expected.heap_histograms);
+        assert_eq!(decoded.offcpu, expected.offcpu);
+        assert_eq!(decoded.pmu, expected.pmu);
+        // Only the known meta keys travel
+        assert_eq!(decoded.meta.len(), 1);
+        assert_eq!(decoded.meta["lost_samples"], "2");
+        assert_eq!(decoded.prune_before_ms, expected.prune_before_ms);
+        assert_eq!(decoded.stats.shm_scan, expected.stats.shm_scan);
+        assert_eq!(decoded.stats.symbolize, expected.stats.symbolize);
+        assert_eq!(decoded.stats.lag, expected.stats.lag);
+        assert_eq!(decoded.stats.lost_samples, expected.stats.lost_samples);
+        assert_eq!(decoded.stats.dropped_events, expected.stats.dropped_events);
+    }
+
+    #[test]
+    fn messages_follow_each_other() {
+        let mut buf = Vec::new();
+        write_hello(&mut buf, &hello()).unwrap();
+        write_batch(&mut buf, 1, &CheckpointBatch::default()).unwrap();
+        write_ack(&mut buf, u64::MAX).unwrap();
+
+        let mut input = &buf[..];
+        assert!(matches!(
+            read_message(&mut input),
+            Ok(Some(Message::Hello(_)))
+        ));
+        assert!(matches!(
+            read_message(&mut input),
+            Ok(Some(Message::Checkpoint { seq: 1, .. }))
+        ));
+        assert!(matches!(
+            read_message(&mut input),
+            Ok(Some(Message::Ack(u64::MAX)))
+        ));
+        assert!(matches!(read_message(&mut input), Ok(None)));
+    }
+
+    #[test]
+    fn take_message_waits_for_whole_frame() {
+        let mut frames = Vec::new();
+        write_ack(&mut frames, 300).unwrap();
+        write_ack(&mut frames, 301).unwrap();
+
+        let mut buf = Vec::new();
+        for &byte in &frames[..frames.len() / 2 - 1] {
+            buf.push(byte);
+            assert!(take_message(&mut buf).unwrap().is_none());
+        }
+        buf.extend_from_slice(&frames[frames.len() / 2 - 1..]);
+        assert!(matches!(
+            take_message(&mut buf),
+            Ok(Some(Message::Ack(300)))
+        ));
+        assert!(matches!(
+            take_message(&mut buf),
+            Ok(Some(Message::Ack(301)))
+        ));
+        assert!(buf.is_empty());
+        assert!(take_message(&mut buf).unwrap().is_none());
+    }
+
+    #[test]
+    fn truncated_frames_are_rejected() {
+        let mut buf = Vec::new();
+        write_batch(&mut buf, 1, &batch()).unwrap();
+
+        // Cut inside the length prefix: the stream just ended
+        for len in [0, 3] {
+            assert!(matches!(read(&buf[..len]), Ok(None)), "cut at {}", len);
+        }
+        // Cut inside the payload: the frame never arrived whole
+        for len in [4, 5, buf.len() / 2, buf.len() - 1] {
+            let result = read(&buf[..len]);
+            assert!(
+                matches!(&result, Err(Error::Io(e)) if e.kind() == std::io::ErrorKind::UnexpectedEof),
+                "cut at {}",
+                len
+            );
+        }
+        // A whole frame whose payload stops short of the fields; cut right
+        // after a list count, the count is what runs past the end
+        for len in [5, 6, 14, buf.len() / 2, buf.len() - 5] {
+            let short = frame(&buf[4..len]);
+            assert!(
+                is_corrupt(read(&short), "truncated")
+                    || is_corrupt(read(&short), "count past end of frame"),
+                "cut at {}",
+                len
+            );
+        }
+        assert!(is_corrupt(read(&frame(&[])), "truncated"));
+    }
+
+    #[test]
+    fn oversized_counts_are_rejected() {
+        // A location count far past what the frame could hold
+        let mut enc = Encoder::new(KIND_CHECKPOINT);
+        enc.u64(1);
+        enc.opt_i64(None);
+        enc.u64(u64::MAX);
+        let mut buf = Vec::new();
+        enc.write_to(&mut buf).unwrap();
+        assert!(is_corrupt(read(&buf), "count past end of frame"));
+
+        // A stack frame count one past the bytes left
+        let mut enc = Encoder::new(KIND_CHECKPOINT);
+        enc.u64(1);
+        enc.opt_i64(None);
+        enc.u64(0);
+        enc.u64(0);
+        enc.u64(0);
+        enc.u64(1);
+        enc.i64(3);
+        enc.u64(2);
+        enc.i64(7);
+        let mut buf = Vec::new();
+        enc.write_to(&mut buf).unwrap();
+        assert!(is_corrupt(read(&buf), "count past end of frame"));
+
+        // A string longer than the frame
+        let mut enc = Encoder::new(KIND_HELLO);
+        enc.u64(PROTOCOL_VERSION);
+        enc.u64(1 << 40);
+        let mut buf = Vec::new();
+        enc.write_to(&mut buf).unwrap();
+        assert!(is_corrupt(read(&buf), "truncated"));
+
+        // A frame length past the limit, refused before reading it
+        let len = (MAX_FRAME_BYTES as u32 + 1).to_le_bytes();
+        assert!(is_corrupt(read(&len), "frame too large"));
+        assert!(is_corrupt(
+            take_message(&mut len.to_vec()),
+            "frame too large"
+        ));
+
+        // A varint running past 64 bits
+        let mut payload = vec![KIND_ACK];
+        payload.extend_from_slice(&[0xff; 10]);
+        assert!(is_corrupt(read(&frame(&payload)), "overlong varint"));
+    }
+
+    #[test]
+    fn bad_version_is_rejected() {
+        let mut enc = Encoder::new(KIND_HELLO);
+        enc.u64(PROTOCOL_VERSION + 1);
+        enc.str("build-01");
+        enc.u64(4242);
+        enc.str("my_app");
+        enc.str("/usr/bin/my_app");
+        enc.u64(99);
+        enc.i64(0);
+        let mut buf = Vec::new();
+        enc.write_to(&mut buf).unwrap();
+
+        let Err(Error::InvalidArgument(message)) = read(&buf) else {
+            panic!("expected a version error");
+        };
+        assert!(message.contains(&format!("protocol {}", PROTOCOL_VERSION + 1)));
+    }
+
+    #[test]
+    fn unknown_kinds_and_meta_keys_are_rejected() {
+        assert!(is_corrupt(read(&frame(&[9])), "unknown message kind"));
+
+        let mut enc = Encoder::new(KIND_CHECKPOINT);
+        enc.u64(1);
+        enc.opt_i64(None);
+        for _ in 0..12 {
+            enc.u64(0);
+        }
+        enc.u64(1);
+        enc.u64(META_KEYS.len() as u64);
+        enc.str("1");
+        let mut buf = Vec::new();
+        enc.write_to(&mut buf).unwrap();
+        assert!(is_corrupt(read(&buf), "unknown meta key"));
+    }
+}
@@ -1,31 +1,130 @@
-use super::schema::{self, SCHEMA_VERSION};
-use crate::error::Result;
-use crate::process::ProcessInfo;
+use super::capture::{CaptureRing, CaptureWindows};
+use super::flusher::{CheckpointBatch, Flusher, HeapSampleData};
+use super::schema::{self, OptionalExt, SCHEMA_VERSION};
+use super::stream::{self, Hello, StreamAddr};
+use crate::cpu::PmuCounters;
+use crate::error::{Error, Result};
+use crate::heap::{ChurnStats, HeapHistogram};
+use crate::process::{self, ProcessInfo};
 use crate::symbols::Location;
 use rusqlite::Connection;
-use std::collections::HashMap;
+use std::collections::{HashMap, HashSet};
 use std::path::Path;
-use std::time::Instant;
+use std::sync::mpsc::TrySendError;
+use std::time::{Duration, Instant};
 
 /// Key for aggregating samples: (file, line, function)
 type LocationKey = (String, u32, String);
 
-/// Pending heap sample data: (alloc_bytes, free_bytes, live_bytes, alloc_count, free_count)
-type HeapSampleData = (i64, i64, i64, u64, u64);
-
 /// Storage writer for profiling data
+///
+/// Samples are collected into a pending checkpoint batch; writes happen on a
+/// background thread (see `flusher`), and `conn` is only used for queries.
 pub struct Storage {
     conn: Connection,
+    flusher: Flusher,
     start_time: Instant,
     /// Offset to add to timestamps when appending to existing profile
     time_offset_ms: i64,
-    checkpoint_id: i64,
-    /// Pending CPU samples: location_id -> count
-    pending_cpu: HashMap<i64, u64>,
-    /// Pending heap samples: location_id -> (alloc_bytes, free_bytes, live_bytes)
-    pending_heap: HashMap<i64, HeapSampleData>,
-    /// Cache: (file, line, function) -> location_id
+    /// Samples, locations, threads and meta for the next checkpoint
+    pending: CheckpointBatch,
+    /// Threads seen so far
+    known_threads: HashSet<u32>,
+    /// Processes written to the processes table so far
+    known_processes: HashSet<u32>,
+    /// First target process, for samplers that don't report one
+    pid: u32,
+    /// Cache: (file, line, function) -> location_id, including locations
+    /// not written yet
     location_cache: HashMap<LocationKey, i64>,
+    /// Location for each id in `location_cache`
+    locations: HashMap<i64, Location>,
+    /// Attributed location per sampler callsite; None if it was filtered out
+    callsite_locations: HashMap<u64, Option<i64>>,
+    /// Same, for off-CPU stacks, which are attributed differently
+    offcpu_callsite_locations: HashMap<u64, Option<i64>>,
+    /// Id for the next new location
+    next_location_id: i64,
+    /// Cache: frames (location ids, leaf first) -> stack_id, including
+    /// stacks not written yet
+    stack_cache: HashMap<Vec<i64>, i64>,
+    /// Stack id per sampler callsite; None if no frame was kept
+    callsite_stacks: HashMap<u64, Option<i64>>,
+    /// Id for the next new stack
+    next_stack_id: i64,
+    /// Samples the kernel dropped (perf ring overflow), across appends
+    lost_samples: u64,
+    /// Events rsprof-trace dropped on full tables, from earlier appended runs
+    dropped_events_base: u64,
+    /// Events dropped by the current target run
+    dropped_events_run: u64,
+    /// Checkpoints merged into the next one because the writer was behind
+    deferred_checkpoints: u64,
+    /// How long raw samples are kept; None keeps everything
+    retention: Option<Duration>,
+    /// Checkpoints taken since the last retention pass
+    checkpoints_since_prune: u32,
+    /// Loop-side profiler stats of the checkpoints handed to the writer
+    sent_stats: ProfilerStats,
+    /// Held checkpoints when recording on triggers only
+    capture: Option<CaptureRing>,
+    /// Triggers fired so far, one "timestamp_ms reason" per line
+    triggers: String,
+}
+
+/// Checkpoints between retention passes
+const PRUNE_EVERY: u32 = 60;
+
+/// Add one callsite's cumulative heap stats to a location's total
+fn add_heap_sample(total: &mut HeapSampleData, sample: HeapSampleData) {
+    total.0 += sample.0;
+    total.1 += sample.1;
+    total.2 += sample.2;
+    total.3 += sample.3;
+    total.4 += sample.4;
+}
+
+/// rsprof's own cost, for one checkpoint or summed over a recording
+#[derive(Debug, Clone, Copy, Default)]
+pub struct ProfilerStats {
+    /// Reading rsprof-trace's shared memory
+    pub shm_scan: Duration,
+    /// Symbolizing and attributing newly seen stacks
+    pub symbolize: Duration,
+    /// Writer thread time storing checkpoints
+    pub flush: Duration,
+    /// How late the checkpoint was taken past the interval; the worst
+    /// checkpoint when summed
+    pub lag: Duration,
+    /// Samples the kernel lost on perf ring overflow
+    pub lost_samples: u64,
+    /// Events rsprof-trace dropped on full tables
+    pub dropped_events: u64,
+    /// Database size on disk, or bytes sent when streaming
+    pub db_bytes: u64,
+}
+
+impl ProfilerStats {
+    /// Fold in a later checkpoint's stats
+    pub fn add(&mut self, other: &ProfilerStats) {
+        self.shm_scan += other.shm_scan;
+        self.symbolize += other.symbolize;
+        self.flush += other.flush;
+        self.lag = self.lag.max(other.lag);
+        self.lost_samples += other.lost_samples;
+        self.dropped_events += other.dropped_events;
+        self.db_bytes = self.db_bytes.max(other.db_bytes);
+    }
+
+    /// Time rsprof spent working, as a share of `elapsed` (100% is one core)
+    pub fn overhead_percent(&self, elapsed: Duration) -> f64 {
+        let busy = self.shm_scan + self.symbolize + self.flush;
+        if elapsed.is_zero() {
+            0.0
+        } else {
+            busy.as_secs_f64() * 100.0 / elapsed.as_secs_f64()
+        }
+    }
 }
 
 impl Storage {
@@ -57,20 +156,88 @@ impl Storage {
         schema::set_meta(&conn, "start_time", &chrono::Utc::now().to_rfc3339())?;
         schema::set_meta(&conn, "cpu_freq_hz", &cpu_freq.to_string())?;
 
-        Ok(Storage {
+        let mut storage = Storage {
             conn,
+            flusher: Flusher::spawn(path)?,
             start_time: Instant::now(),
             time_offset_ms: 0,
-            checkpoint_id: 0,
-            pending_cpu: HashMap::new(),
-            pending_heap: HashMap::new(),
+            pending: CheckpointBatch::default(),
+            known_threads: HashSet::new(),
+            known_processes: HashSet::new(),
+            pid: proc_info.pid(),
             location_cache: HashMap::new(),
-        })
+            locations: HashMap::new(),
+            callsite_locations: HashMap::new(),
+            offcpu_callsite_locations: HashMap::new(),
+            next_location_id: 1,
+            stack_cache: HashMap::new(),
+            callsite_stacks: HashMap::new(),
+            next_stack_id: 1,
+            lost_samples: 0,
+            dropped_events_base: 0,
+            dropped_events_run: 0,
+            deferred_checkpoints: 0,
+            retention: None,
+            checkpoints_since_prune: 0,
+            sent_stats: ProfilerStats::default(),
+            capture: None,
+            triggers: String::new(),
+        };
+        storage.add_process(proc_info);
+        Ok(storage)
+    }
+
+    /// Stream checkpoints to a collector instead of writing a local file
+    ///
+    /// Queries see an empty in-memory database: nothing is kept on this
+    /// side, so this suits headless recording only.
+    pub fn stream(addr: &StreamAddr, proc_info: &ProcessInfo, cpu_freq: u64) -> Result<Self> {
+        let conn = Connection::open_in_memory()?;
+        schema::create_tables(&conn)?;
+
+        let hello = Hello {
+            host: process::hostname(),
+            pid: proc_info.pid(),
+            process_name: proc_info.name().to_string(),
+            exe_path: proc_info.exe_path().display().to_string(),
+            cpu_freq,
+            start_ms: chrono::Utc::now().timestamp_millis(),
+        };
+
+        let mut storage = Storage {
+            conn,
+            flusher: stream::spawn_sender(addr, hello)?,
+            start_time: Instant::now(),
+            time_offset_ms: 0,
+            pending: CheckpointBatch::default(),
+            known_threads: HashSet::new(),
+            known_processes: HashSet::new(),
+            pid: proc_info.pid(),
+            location_cache: HashMap::new(),
+            locations: HashMap::new(),
+            callsite_locations: HashMap::new(),
+            offcpu_callsite_locations: HashMap::new(),
+            next_location_id: 1,
+            stack_cache: HashMap::new(),
+            callsite_stacks: HashMap::new(),
+            next_stack_id: 1,
+            lost_samples: 0,
+            dropped_events_base: 0,
+            dropped_events_run: 0,
+            deferred_checkpoints: 0,
+            retention: None,
+            checkpoints_since_prune: 0,
+            sent_stats: ProfilerStats::default(),
+            capture: None,
+            triggers: String::new(),
+        };
+        storage.add_process(proc_info);
+        Ok(storage)
     }
 
     /// Open an existing storage file in append mode
     /// Loads the existing location cache and continues from the last checkpoint timestamp
-    pub fn open_append(path: &Path) -> Result<Self> {
+    pub fn open_append(path: &Path, proc_info: &ProcessInfo) -> Result<Self> {
         let conn = Connection::open(path)?;
 
         // Enable WAL mode
@@ -79,26 +246,92 @@ impl Storage {
              PRAGMA synchronous = NORMAL;",
         )?;
 
+        schema::create_missing_tables(&conn)?;
+
         // Load existing location cache
         let location_cache = schema::load_location_cache(&conn)?;
         eprintln!("Loaded {} existing locations", location_cache.len());
+        let next_location_id = location_cache.values().max().map_or(1, |id| id + 1);
+        let locations = location_cache
+            .iter()
+            .map(|((file, line, function), &id)| {
+                let location = Location {
+                    file: file.clone(),
+                    line: *line,
+                    column: 0,
+                    function: function.clone(),
+                };
+                (id, location)
+            })
+            .collect();
+
+        let stack_cache = schema::load_stack_cache(&conn)?;
+        let next_stack_id = stack_cache.values().max().map_or(1, |id| id + 1);
 
         // Get last checkpoint timestamp to calculate offset
         let last_timestamp_ms = schema::get_last_checkpoint_timestamp(&conn)?.unwrap_or(0);
         eprintln!("Continuing from timestamp {}ms", last_timestamp_ms);
 
-        Ok(Storage {
+        let lost_samples = schema::get_meta(&conn, "lost_samples")?
+            .and_then(|v| v.parse().ok())
+            .unwrap_or(0);
+        let dropped_events_base = query_dropped_events(&conn);
+        let deferred_checkpoints = query_deferred_checkpoints(&conn);
+        let known_threads = schema::load_thread_ids(&conn)?;
+        let known_processes = schema::load_process_ids(&conn)?;
+        let triggers = schema::get_meta(&conn, "triggers")?.unwrap_or_default();
+
+        let mut storage = Storage {
             conn,
+            flusher: Flusher::spawn(path)?,
             start_time: Instant::now(),
             time_offset_ms: last_timestamp_ms,
-            checkpoint_id: 0,
-            pending_cpu: HashMap::new(),
-            pending_heap: HashMap::new(),
+            pending: CheckpointBatch::default(),
+            known_threads,
+            known_processes,
+            pid: proc_info.pid(),
             location_cache,
-        })
+            locations,
+            callsite_locations: HashMap::new(),
+            offcpu_callsite_locations: HashMap::new(),
+            next_location_id,
+            stack_cache,
+            callsite_stacks: HashMap::new(),
+            next_stack_id,
+            lost_samples,
+            dropped_events_base,
+            dropped_events_run: 0,
+            deferred_checkpoints,
+            retention: None,
+            checkpoints_since_prune: 0,
+            sent_stats: ProfilerStats::default(),
+            capture: None,
+            triggers,
+        };
+        storage.add_process(proc_info);
+        Ok(storage)
+    }
+
+    /// Note a process whose samples this profile records, once per pid
+    pub fn add_process(&mut self, proc_info: &ProcessInfo) {
+        if self.known_processes.insert(proc_info.pid()) {
+            self.pending.processes.push((
+                proc_info.pid(),
+                proc_info.name().to_string(),
+                proc_info.exe_path().display().to_string(),
+            ));
+        }
+    }
+
+    /// Processes recorded into this profile, across appends
+    pub fn process_count(&self) -> usize {
+        self.known_processes.len()
     }
 
     /// Get or create location_id for a (file, line, function)
+    ///
+    /// New ids are assigned here and the row is written with the next
+    /// checkpoint, so this never touches the database.
     fn get_location_id(&mut self, location: &Location) -> i64 {
         let key = (
             location.file.clone(),
@@ -110,41 +343,166 @@ impl Storage {
             return id;
         }
 
-        // Insert or get existing
-        self.conn
-            .execute(
-                "INSERT OR IGNORE INTO locations (file, line, function) VALUES (?, ?, ?)",
-                rusqlite::params![&location.file, location.line as i64, &location.function],
-            )
-            .ok();
+        let id = self.next_location_id;
+        self.next_location_id += 1;
+        self.location_cache.insert(key, id);
+        self.locations.insert(id, location.clone());
+        self.pending.locations.push((id, location.clone()));
+        id
+    }
 
-        let id: i64 = self
-            .conn
-            .query_row(
-                "SELECT id FROM locations WHERE file = ? AND line = ? AND function = ?",
-                rusqlite::params![&location.file, location.line as i64, &location.function],
-                |row| row.get(0),
-            )
-            .unwrap_or(0);
+    /// Location for an id handed out by this storage
+    pub fn location(&self, location_id: i64) -> Option<&Location> {
+        self.locations.get(&location_id)
+    }
 
-        self.location_cache.insert(key, id);
+    /// Location id for a sampler callsite, attributing it on first sight
+    ///
+    /// `callsite` is any id that names one stack for the life of the sampler
+    /// (an SHM slot, a perf stack hash), so steady-state ticks skip both
+    /// symbolization and hashing the location's strings. `attribute` returns
+    /// None for stacks that should not be recorded; that is cached too.
+    /// Empty stacks are never cached since their frames may not be published yet.
+    pub fn callsite_location_id(
+        &mut self,
+        callsite: u64,
+        stack: &[u64],
+        attribute: impl FnOnce() -> Option<Location>,
+    ) -> Option<i64> {
+        if let Some(&id) = self.callsite_locations.get(&callsite) {
+            return id;
+        }
+        let start = Instant::now();
+        let location = attribute();
+        self.pending.stats.symbolize += start.elapsed();
+        let id = location.map(|location| self.get_location_id(&location));
+        if !stack.is_empty() {
+            self.callsite_locations.insert(callsite, id);
+        }
+        id
+    }
+
+    /// `callsite_location_id` for the off-CPU sampler's stack hashes
+    pub fn offcpu_location_id(
+        &mut self,
+        callsite: u64,
+        stack: &[u64],
+        attribute: impl FnOnce() -> Option<Location>,
+    ) -> Option<i64> {
+        if let Some(&id) = self.offcpu_callsite_locations.get(&callsite) {
+            return id;
+        }
+        let start = Instant::now();
+        let location = attribute();
+        self.pending.stats.symbolize += start.elapsed();
+        let id = location.map(|location| self.get_location_id(&location));
+        if !stack.is_empty() {
+            self.offcpu_callsite_locations.insert(callsite, id);
+        }
+        id
+    }
+
+    /// Stack id for a sampler callsite, interning its frames on first sight
+    ///
+    /// Same caching as `callsite_location_id`; `frames` returns the stack's
+    /// locations, leaf first. Returns None if it keeps no frame.
+    pub fn callsite_stack_id(
+        &mut self,
+        callsite: u64,
+        stack: &[u64],
+        frames: impl FnOnce() -> Vec<Location>,
+    ) -> Option<i64> {
+        if let Some(&id) = self.callsite_stacks.get(&callsite) {
+            return id;
+        }
+        let start = Instant::now();
+        let frames = frames();
+        self.pending.stats.symbolize += start.elapsed();
+        let frames: Vec<i64> = frames
+            .iter()
+            .map(|location| self.get_location_id(location))
+            .collect();
+        let id = (!frames.is_empty()).then(|| self.get_stack_id(frames));
+        if !stack.is_empty() {
+            self.callsite_stacks.insert(callsite, id);
+        }
+        id
+    }
+
+    /// Get or create the stack_id for a list of location ids
+    fn get_stack_id(&mut self, frames: Vec<i64>) -> i64 {
+        if let Some(&id) = self.stack_cache.get(&frames) {
+            return id;
+        }
+
+        let id = self.next_stack_id;
+        self.next_stack_id += 1;
+        self.pending.stacks.push((id, frames.clone()));
+        self.stack_cache.insert(frames, id);
         id
     }
 
+    /// Record CPU samples for a stack id from `callsite_stack_id`
+    pub fn record_stack_samples_at(&mut self, stack_id: i64, count: u64) {
+        *self.pending.stack_cpu.entry(stack_id).or_insert(0) += count;
+    }
+
+    /// Record hardware counter deltas at a location
+    pub fn record_pmu_at(&mut self, location_id: i64, counters: &PmuCounters) {
+        self.pending
+            .pmu
+            .entry(location_id)
+            .or_default()
+            .add(counters);
+    }
+
+    /// Record time spent blocked (off-CPU) at a location
+    pub fn record_offcpu_at(&mut self, location_id: i64, blocked_ns: u64) {
+        *self.pending.offcpu.entry(location_id).or_insert(0) += blocked_ns;
+    }
+
     /// Record a CPU sample (aggregates by location_id)
     pub fn record_cpu_sample(&mut self, _addr: u64, location: &Location) -> i64 {
         let location_id = self.get_location_id(location);
-        *self.pending_cpu.entry(location_id).or_insert(0) += 1;
+        *self.pending.cpu.entry(location_id).or_insert(0) += 1;
         location_id
     }
 
     /// Record CPU samples with a count (for aggregated stats from rsprof-trace)
-    pub fn record_cpu_sample_count(&mut self, _addr: u64, location: &Location, count: u64) -> i64 {
+    ///
+    /// `tid` is the thread they were taken on (0 if unknown); the thread's name
+    /// is read the first time it is seen.
+    pub fn record_cpu_sample_count(
+        &mut self,
+        _addr: u64,
+        location: &Location,
+        count: u64,
+        tid: u32,
+    ) -> i64 {
         let location_id = self.get_location_id(location);
-        *self.pending_cpu.entry(location_id).or_insert(0) += count;
+        self.record_cpu_samples_at(location_id, count, self.pid, tid);
         location_id
     }
 
+    /// Record CPU samples for a location id from `callsite_location_id`
+    ///
+    /// `pid` is the process `tid` belongs to; the per-process split is kept
+    /// through the thread.
+    pub fn record_cpu_samples_at(&mut self, location_id: i64, count: u64, pid: u32, tid: u32) {
+        *self.pending.cpu.entry(location_id).or_insert(0) += count;
+        if tid != 0 {
+            if self.known_threads.insert(tid) {
+                let name = process::thread_name(pid, tid).unwrap_or_default();
+                self.pending.threads.push((tid, pid, name));
+            }
+            *self
+                .pending
+                .thread_cpu
+                .entry((tid, location_id))
+                .or_insert(0) += count;
+        }
+    }
+
     /// Record a heap sample (aggregates by location_id)
     /// Called once per checkpoint with cumulative stats from sampler.
     /// Multiple stack keys that resolve to the same location are summed.
@@ -158,82 +516,280 @@ impl Storage {
         free_count: u64,
     ) -> i64 {
         let location_id = self.get_location_id(location);
-        let entry = self
-            .pending_heap
-            .entry(location_id)
-            .or_insert((0, 0, 0, 0, 0));
-        // Sum values from different stack keys that resolve to same location
-        entry.0 += alloc_bytes;
-        entry.1 += free_bytes;
-        entry.2 += live_bytes;
-        entry.3 += alloc_count;
-        entry.4 += free_count;
+        self.record_heap_sample_at(
+            self.pid,
+            location_id,
+            alloc_bytes,
+            free_bytes,
+            live_bytes,
+            alloc_count,
+            free_count,
+        );
         location_id
     }
 
-    /// Flush pending data to a new checkpoint
-    pub fn flush_checkpoint(&mut self) -> Result<()> {
-        if self.pending_cpu.is_empty() && self.pending_heap.is_empty() {
+    /// Record a heap sample for a location id from `callsite_location_id`
+    ///
+    /// Locations are summed over all processes; `pid`'s own share is kept
+    /// alongside.
+    #[allow(clippy::too_many_arguments)]
+    pub fn record_heap_sample_at(
+        &mut self,
+        pid: u32,
+        location_id: i64,
+        alloc_bytes: i64,
+        free_bytes: i64,
+        live_bytes: i64,
+        alloc_count: u64,
+        free_count: u64,
+    ) {
+        let sample = (alloc_bytes, free_bytes, live_bytes, alloc_count, free_count);
+        // Sum values from different stack keys that resolve to same location
+        add_heap_sample(self.pending.heap.entry(location_id).or_default(), sample);
+        add_heap_sample(
+            self.pending
+                .process_heap
+                .entry((pid, location_id))
+                .or_default(),
+            sample,
+        );
+    }
+
+    /// Record a callsite's cumulative size and lifetime histograms
+    ///
+    /// Summed per checkpoint over callsites that resolve to one location,
+    /// like the heap stats.
+    pub fn record_heap_histogram_at(&mut self, location_id: i64, histogram: &HeapHistogram) {
+        if !histogram.is_empty() {
+            self.pending
+                .heap_histograms
+                .entry(location_id)
+                .or_default()
+                .add(histogram);
+        }
+    }
+
+    /// Note that heap stats are sampled estimates (mean bytes between samples)
+    pub fn set_heap_sample_bytes(&mut self, bytes: u64) -> Result<()> {
+        self.pending
+            .meta
+            .insert("heap_sample_bytes", bytes.to_string());
+        Ok(())
+    }
+
+    /// Record samples the kernel reported as lost
+    pub fn record_lost_samples(&mut self, count: u64) {
+        if count > 0 {
+            self.lost_samples += count;
+            self.pending.stats.lost_samples += count;
+            self.pending
+                .meta
+                .insert("lost_samples", self.lost_samples.to_string());
+        }
+    }
+
+    /// Total lost samples for this profile
+    pub fn lost_samples(&self) -> u64 {
+        self.lost_samples
+    }
+
+    /// Record the target's cumulative count of events dropped on full tables
+    pub fn record_dropped_events(&mut self, run_total: u64) {
+        if run_total != self.dropped_events_run {
+            self.pending.stats.dropped_events += run_total.saturating_sub(self.dropped_events_run);
+            self.dropped_events_run = run_total;
+            self.pending
+                .meta
+                .insert("dropped_events", self.dropped_events().to_string());
+        }
+    }
+
+    /// Total events dropped by rsprof-trace for this profile
+    pub fn dropped_events(&self) -> u64 {
+        self.dropped_events_base + self.dropped_events_run
+    }
+
+    /// Checkpoints merged into a later one because the writer thread was behind
+    pub fn deferred_checkpoints(&self) -> u64 {
+        self.deferred_checkpoints
+    }
+
+    /// Add time spent reading rsprof-trace's shared memory
+    pub fn record_shm_scan(&mut self, elapsed: Duration) {
+        self.pending.stats.shm_scan += elapsed;
+    }
+
+    /// Note how late this checkpoint is past its interval
+    pub fn record_checkpoint_lag(&mut self, lag: Duration) {
+        self.pending.stats.lag = self.pending.stats.lag.max(lag);
+    }
+
+    /// rsprof's own cost so far in this recording
+    pub fn profiler_stats(&self) -> ProfilerStats {
+        let mut stats = self.sent_stats;
+        stats.add(&self.pending.stats);
+        stats.flush = self.flusher.busy();
+        stats.db_bytes = self.flusher.db_bytes();
+        stats
+    }
+
+    /// Drop raw per-checkpoint samples once they are older than `retention`
+    ///
+    /// Totals and the downsampled chart tiers are kept for the whole
+    /// recording; zoomed-in charts of the dropped span come from the
+    /// finest tier instead.
+    pub fn set_retention(&mut self, retention: Duration) {
+        self.retention = Some(retention);
+    }
+
+    /// Record on triggers only: checkpoints are held for `windows.pre` and
+    /// written merged into one per `windows.baseline` unless a trigger fires
+    pub fn set_capture(&mut self, windows: CaptureWindows) {
+        self.capture = Some(CaptureRing::new(windows, self.timestamp_ms()));
+    }
+
+    /// Keep the held pre-trigger window and the coming post-trigger window
+    /// at full resolution; `reason` is noted in the profile's meta
+    ///
+    /// Does nothing unless `set_capture` was called.
+    pub fn trigger(&mut self, reason: &str) -> Result<()> {
+        let now_ms = self.timestamp_ms();
+        let Some(capture) = self.capture.as_mut() else {
             return Ok(());
+        };
+        let due = capture.trigger(now_ms);
+        self.triggers.push_str(&format!("{} {}\n", now_ms, reason));
+        self.pending.meta.insert("triggers", self.triggers.clone());
+        for batch in due {
+            self.send(batch)?;
         }
+        Ok(())
+    }
 
-        let tx = self.conn.transaction()?;
+    /// Whether a trigger's post-trigger window is open
+    pub fn capturing(&self) -> bool {
+        self.capture
+            .as_ref()
+            .is_some_and(|capture| capture.capturing(self.timestamp_ms()))
+    }
 
-        // Create checkpoint (add time offset for append mode)
-        let timestamp_ms = self.start_time.elapsed().as_millis() as i64 + self.time_offset_ms;
-        tx.execute(
-            "INSERT INTO checkpoints (timestamp_ms) VALUES (?)",
-            [timestamp_ms],
-        )?;
-        self.checkpoint_id = tx.last_insert_rowid();
+    /// Hand pending data to the writer thread as a new checkpoint, or to
+    /// the pre-trigger ring when recording on triggers
+    pub fn flush_checkpoint(&mut self) -> Result<()> {
+        let Some(batch) = self.take_batch() else {
+            return Ok(());
+        };
+        let now_ms = self.timestamp_ms();
+        let due = match self.capture.as_mut() {
+            Some(capture) => capture.hold(batch, now_ms),
+            None => Some(batch),
+        };
+        match due {
+            Some(batch) => self.send(batch),
+            None => Ok(()),
+        }
+    }
 
-        // Insert CPU samples (just checkpoint_id, location_id, count)
-        {
-            let mut stmt = tx.prepare_cached(
-                "INSERT INTO cpu_samples (checkpoint_id, location_id, count) VALUES (?, ?, ?)",
-            )?;
+    /// Hand a checkpoint to the writer thread
+    ///
+    /// Never blocks on the database. If the writer's queue is full the
+    /// checkpoint is merged into the next one instead: CPU counts carry
+    /// over, heap stats are cumulative so the next checkpoint supersedes them.
+    fn send(&mut self, batch: Box<CheckpointBatch>) -> Result<()> {
+        let stats = batch.stats;
+        match self.flusher.try_send(batch) {
+            Ok(()) => {
+                self.sent_stats.add(&stats);
+                Ok(())
+            }
+            Err(TrySendError::Full(batch)) => {
+                self.defer(batch);
+                Ok(())
+            }
+            Err(TrySendError::Disconnected(_)) => Err(self.writer_error()),
+        }
+    }
 
-            for (location_id, count) in self.pending_cpu.drain() {
-                stmt.execute(rusqlite::params![
-                    self.checkpoint_id,
-                    location_id,
-                    count as i64
-                ])?;
+    /// Flush the last checkpoint and wait until everything is on disk;
+    /// returns the recording's profiler stats
+    pub fn finish(mut self) -> Result<ProfilerStats> {
+        let mut last = self.take_batch();
+        if let Some(capture) = self.capture.take() {
+            last = capture.finish(last, self.timestamp_ms());
+        }
+        if let Some(batch) = last {
+            let stats = batch.stats;
+            if !self.flusher.send(batch) {
+                return Err(self.writer_error());
             }
+            self.sent_stats.add(&stats);
+        }
+        match self.flusher.finish() {
+            Some(e) => Err(e),
+            None => Ok(self.profiler_stats()),
         }
+    }
 
-        // Insert heap samples
+    /// Move pending data into a batch, or None if there is nothing to write
+    fn take_batch(&mut self) -> Option<Box<CheckpointBatch>> {
+        let pending = &self.pending;
+        let has_samples = !pending.cpu.is_empty()
+            || !pending.heap.is_empty()
+            || !pending.process_heap.is_empty()
+            || !pending.heap_histograms.is_empty()
+            || !pending.stack_cpu.is_empty()
+            || !pending.offcpu.is_empty()
+            || !pending.pmu.is_empty();
+        if !has_samples
+            && pending.meta.is_empty()
+            && pending.locations.is_empty()
+            && pending.stacks.is_empty()
+            && pending.threads.is_empty()
+            && pending.processes.is_empty()
         {
-            let mut stmt = tx.prepare_cached(
-                "INSERT INTO heap_samples (checkpoint_id, location_id, alloc_bytes, free_bytes, live_bytes, alloc_count, free_count) VALUES (?, ?, ?, ?, ?, ?, ?)",
-            )?;
+            return None;
+        }
 
-            for (location_id, (alloc, free, live, alloc_cnt, free_cnt)) in self.pending_heap.drain()
-            {
-                stmt.execute(rusqlite::params![
-                    self.checkpoint_id,
-                    location_id,
-                    alloc,
-                    free,
-                    live,
-                    alloc_cnt as i64,
-                    free_cnt as i64
-                ])?;
+        let mut batch = Box::new(std::mem::take(&mut self.pending));
+        if has_samples {
+            let timestamp_ms = self.timestamp_ms();
+            batch.timestamp_ms = Some(timestamp_ms);
+
+            if let Some(retention) = self.retention {
+                self.checkpoints_since_prune += 1;
+                if self.checkpoints_since_prune >= PRUNE_EVERY {
+                    self.checkpoints_since_prune = 0;
+                    batch.prune_before_ms = Some(timestamp_ms - retention.as_millis() as i64);
+                }
             }
+        } else {
+            // Profiler stats are stored per checkpoint; keep them for the next
+            self.pending.stats = std::mem::take(&mut batch.stats);
         }
+        Some(batch)
+    }
 
-        tx.commit()?;
-        Ok(())
+    /// Put an unsent batch back so the next checkpoint includes it
+    fn defer(&mut self, batch: Box<CheckpointBatch>) {
+        self.deferred_checkpoints += 1;
+        self.pending.absorb_older(*batch);
+        self.pending.meta.insert(
+            "deferred_checkpoints",
+            self.deferred_checkpoints.to_string(),
+        );
+    }
+
+    /// The error that stopped the writer thread
+    fn writer_error(&mut self) -> Error {
+        match self.flusher.finish() {
+            Some(e) => e,
+            None => Error::Io(std::io::Error::other("storage writer thread exited")),
+        }
     }
 
     /// Get total samples recorded
     pub fn total_samples(&self) -> Result<u64> {
-        let count: i64 = self.conn.query_row(
-            "SELECT COALESCE(SUM(count), 0) FROM cpu_samples",
-            [],
-            |row| row.get(0),
-        )?;
-        Ok(count as u64)
+        Ok(query_total_samples(&self.conn)? as u64)
     }
 
     /// Get number of checkpoints
@@ -244,6 +800,11 @@ impl Storage {
         Ok(count as u64)
     }
 
+    /// Timestamp a checkpoint taken now gets, including the append offset
+    pub fn timestamp_ms(&self) -> i64 {
+        self.start_time.elapsed().as_millis() as i64 + self.time_offset_ms
+    }
+
     /// Get the time offset in seconds (for append mode)
     /// Returns 0 for new profiles, or the last checkpoint timestamp for appended profiles
     pub fn time_offset_secs(&self) -> f64 {
@@ -260,6 +821,16 @@ impl Storage {
         query_top_cpu(&self.conn, limit, 0.0).unwrap_or_default()
     }
 
+    /// Hardware counter totals per location
+    pub fn query_pmu_totals(&self) -> HashMap<i64, PmuCounters> {
+        query_pmu_totals(&self.conn).unwrap_or_default()
+    }
+
+    /// Query where threads spent the most time blocked
+    pub fn query_top_offcpu(&self, limit: usize) -> Vec<OffCpuEntry> {
+        query_top_offcpu(&self.conn, limit, 0.0).unwrap_or_default()
+    }
+
     /// Query top heap consumers with live bytes and delta
     pub fn query_top_heap_live(&self, limit: usize) -> Vec<HeapEntry> {
         query_top_heap_live(&self.conn, limit).unwrap_or_default()
@@ -324,7 +895,7 @@ impl Storage {
     }
 
     /// Query time series aggregated into buckets at the database level
-    /// Returns exactly `num_buckets` points covering the time range
+    /// Returns at most `num_buckets` points covering the time range
     pub fn query_location_timeseries_aggregated(
         &self,
         location_id: i64,
@@ -332,51 +903,7 @@ impl Storage {
         end_ms: i64,
         num_buckets: usize,
     ) -> Vec<(f64, f64)> {
-        if num_buckets == 0 || start_ms >= end_ms {
-            return Vec::new();
-        }
-
-        let bucket_ms = (end_ms - start_ms) / num_buckets as i64;
-        if bucket_ms == 0 {
-            return Vec::new();
-        }
-
-        let query_result: rusqlite::Result<Vec<(f64, f64)>> = (|| {
-            // Aggregate by time bucket, taking MAX cpu% in each bucket
-            let mut stmt = self.conn.prepare(
-                r#"
-                WITH bucket_data AS (
-                    SELECT
-                        ((c.timestamp_ms - ?2) / ?4) as bucket_idx,
-                        CAST(cs.count AS REAL) * 100.0 / (
-                            SELECT SUM(count) FROM cpu_samples WHERE checkpoint_id = c.id
-                        ) as pct
-                    FROM checkpoints c
-                    JOIN cpu_samples cs ON cs.checkpoint_id = c.id AND cs.location_id = ?1
-                    WHERE c.timestamp_ms >= ?2 AND c.timestamp_ms < ?3
-                )
-                SELECT bucket_idx, MAX(pct) as max_pct
-                FROM bucket_data
-                GROUP BY bucket_idx
-                ORDER BY bucket_idx ASC
-                "#,
-            )?;
-
-            let rows = stmt.query_map(
-                rusqlite::params![location_id, start_ms, end_ms, bucket_ms],
-                |row| {
-                    let bucket_idx: i64 = row.get(0)?;
-                    let pct: f64 = row.get::<_, Option<f64>>(1)?.unwrap_or(0.0);
-                    // Convert bucket index back to time (center of bucket)
-                    let time_ms = start_ms + bucket_idx * bucket_ms + bucket_ms / 2;
-                    Ok((time_ms as f64 / 1000.0, pct))
-                },
-            )?;
-
-            Ok(rows.filter_map(|r| r.ok()).collect())
-        })();
-
-        query_result.unwrap_or_default()
+        query_cpu_timeseries_aggregated(&self.conn, location_id, start_ms, end_ms, num_buckets)
     }
 }
 
@@ -406,6 +933,48 @@ pub struct HeapEntry {
     pub free_count: u64,
 }
 
+/// A heap location ranked by how much it churns
+#[derive(Debug, Clone)]
+pub struct ChurnEntry {
+    pub location_id: i64,
+    pub file: String,
+    pub line: u32,
+    pub function: String,
+    pub alloc_count: u64,
+    pub churn: ChurnStats,
+    pub histogram: HeapHistogram,
+}
+
+/// Rank heap locations by churn score, dropping those that never churn
+///
+/// `secs` is the time the allocation counts were taken over.
+pub fn rank_churn<'a>(
+    entries: impl IntoIterator<Item = &'a HeapEntry>,
+    histograms: &HashMap<i64, HeapHistogram>,
+    secs: f64,
+    limit: usize,
+) -> Vec<ChurnEntry> {
+    let mut ranked: Vec<ChurnEntry> = entries
+        .into_iter()
+        .filter_map(|entry| {
+            let histogram = histograms.get(&entry.location_id)?;
+            let churn = histogram.churn(entry.alloc_count, secs)?;
+            (churn.score > 0.0).then(|| ChurnEntry {
+                location_id: entry.location_id,
+                file: entry.file.clone(),
+                line: entry.line,
+                function: entry.function.clone(),
+                alloc_count: entry.alloc_count,
+                churn,
+                histogram: *histogram,
+            })
+        })
+        .collect();
+    ranked.sort_by(|a, b| b.churn.score.total_cmp(&a.churn.score));
+    ranked.truncate(limit);
+    ranked
+}
+
 /// Combined CPU + Heap entry for "Both" view
 #[derive(Debug, Clone)]
 pub struct CombinedEntry {
@@ -415,9 +984,9 @@ pub struct CombinedEntry {
     pub function: String,
     pub cpu_total_pct: f64,
     pub cpu_instant_pct: f64,
-    /// Total heap allocations over all time (sum of alloc_bytes)
+    /// Total heap allocations so far (cumulative alloc_bytes)
     pub heap_total: i64,
-    /// Current slice heap usage (live_bytes at current checkpoint)
+    /// Current heap usage (live_bytes as of the latest checkpoint)
     pub heap_instant: i64,
 }
 
@@ -428,6 +997,31 @@ pub struct TimeSeriesPoint {
     pub percent: f64,
 }
 
+/// Pick the downsampled tier for a chart with `bucket_ms` buckets
+///
+/// Uses the coarsest tier no wider than a bucket, or the finest tier when
+/// the chart starts before the raw samples kept by retention. Returns
+/// (tier, width_ms), or None to read raw checkpoints.
+fn chart_tier(conn: &Connection, start_ms: i64, bucket_ms: i64) -> Option<(i64, i64)> {
+    let tiers = (1..).zip(schema::TIER_WIDTHS_MS);
+    if let Some(tier) = tiers
+        .clone()
+        .filter(|&(_, width)| width <= bucket_ms)
+        .last()
+    {
+        return Some(tier);
+    }
+
+    let raw_from_ms: Option<i64> = schema::get_meta(conn, "raw_retained_from_ms")
+        .ok()
+        .flatten()
+        .and_then(|v| v.parse().ok());
+    match raw_from_ms {
+        Some(raw_from_ms) if start_ms < raw_from_ms => Some((1, schema::TIER_WIDTHS_MS[0])),
+        _ => None,
+    }
+}
+
 /// Query CPU% over time for a specific location
 pub fn query_cpu_timeseries(
     conn: &Connection,
@@ -478,6 +1072,29 @@ pub fn query_cpu_timeseries_aggregated(
     }
 
     let query_result: rusqlite::Result<Vec<(f64, f64)>> = (|| {
+        if let Some((tier, width_ms)) = chart_tier(conn, start_ms, bucket_ms) {
+            let mut stmt = conn.prepare_cached(
+                r#"
+                SELECT (MAX(bucket * ?3, ?4) - ?4) / ?6 as bucket_idx, MAX(max_pct)
+                FROM cpu_rollup
+                WHERE tier = ?1 AND location_id = ?2
+                  AND bucket >= ?4 / ?3 AND bucket * ?3 < ?5
+                GROUP BY bucket_idx
+                ORDER BY bucket_idx ASC
+                "#,
+            )?;
+            let rows = stmt.query_map(
+                rusqlite::params![tier, location_id, width_ms, start_ms, end_ms, bucket_ms],
+                |row| {
+                    let bucket_idx: i64 = row.get(0)?;
+                    let pct: f64 = row.get(1)?;
+                    let time_ms = start_ms + bucket_idx * bucket_ms + bucket_ms / 2;
+                    Ok((time_ms as f64 / 1000.0, pct))
+                },
+            )?;
+            return Ok(rows.filter_map(|r| r.ok()).collect());
+        }
+
         let mut stmt = conn.prepare(
             r#"
             WITH bucket_data AS (
@@ -513,32 +1130,106 @@ pub fn query_cpu_timeseries_aggregated(
     query_result.unwrap_or_default()
 }
 
-/// Query top CPU consumers with both total and instant percentages (for live TUI)
-pub fn query_top_cpu_live(conn: &Connection, limit: usize) -> rusqlite::Result<Vec<CpuEntry>> {
-    // Get totals
-    let grand_total: f64 = conn.query_row(
-        "SELECT COALESCE(SUM(count), 0.0) FROM cpu_samples",
-        [],
-        |row| row.get(0),
-    )?;
-
-    if grand_total == 0.0 {
-        return Ok(vec![]);
+/// Bucket CPU% points the way `query_cpu_timeseries_aggregated` does: the
+/// highest point of each of `num_buckets` buckets of `start_ms..end_ms`
+///
+/// `points` must be in timestamp order.
+pub fn bucket_cpu_timeseries(
+    points: impl IntoIterator<Item = TimeSeriesPoint>,
+    start_ms: i64,
+    end_ms: i64,
+    num_buckets: usize,
+) -> Vec<(f64, f64)> {
+    if num_buckets == 0 || start_ms >= end_ms {
+        return Vec::new();
+    }
+    let bucket_ms = (end_ms - start_ms) / num_buckets as i64;
+    if bucket_ms == 0 {
+        return Vec::new();
     }
 
-    // Get last checkpoint for instant %
-    let last_checkpoint: Option<i64> = conn
-        .query_row(
-            "SELECT id FROM checkpoints ORDER BY timestamp_ms DESC LIMIT 1",
-            [],
-            |row| row.get(0),
-        )
-        .ok();
+    let mut buckets: Vec<(i64, f64)> = Vec::new();
+    for point in points {
+        if point.timestamp_ms < start_ms || point.timestamp_ms >= end_ms {
+            continue;
+        }
+        let bucket_idx = (point.timestamp_ms - start_ms) / bucket_ms;
+        match buckets.last_mut() {
+            Some((idx, pct)) if *idx == bucket_idx => *pct = pct.max(point.percent),
+            _ => buckets.push((bucket_idx, point.percent)),
+        }
+    }
+    buckets
+        .into_iter()
+        .map(|(bucket_idx, pct)| {
+            let time_ms = start_ms + bucket_idx * bucket_ms + bucket_ms / 2;
+            (time_ms as f64 / 1000.0, pct)
+        })
+        .collect()
+}
 
-    let instant_total: f64 = if let Some(cp_id) = last_checkpoint {
-        conn.query_row(
-            "SELECT COALESCE(SUM(count), 0.0) FROM cpu_samples WHERE checkpoint_id = ?",
-            [cp_id],
+/// Bucket live bytes the way `query_heap_timeseries_aggregated` does
+///
+/// `carried` is the value before `start_ms` and `changes` the (timestamp,
+/// bytes) changes after it, in order; each bucket up to the one holding
+/// `last_ms`, the last checkpoint in range, gets the highest value it saw.
+pub fn bucket_heap_timeseries(
+    carried: Option<i64>,
+    changes: impl IntoIterator<Item = (i64, i64)>,
+    last_ms: i64,
+    start_ms: i64,
+    end_ms: i64,
+    num_buckets: usize,
+) -> Vec<(f64, f64)> {
+    if num_buckets == 0 || start_ms >= end_ms {
+        return Vec::new();
+    }
+    let bucket_ms = (end_ms - start_ms) / num_buckets as i64;
+    if bucket_ms == 0 {
+        return Vec::new();
+    }
+    let last_bucket = (last_ms - start_ms) / bucket_ms;
+
+    let mut points = Vec::new();
+    let mut current = carried;
+    let mut changes = changes
+        .into_iter()
+        .filter(|&(ms, _)| ms >= start_ms && ms < end_ms)
+        .peekable();
+    for bucket_idx in 0..=last_bucket {
+        let mut max_bytes = current;
+        while let Some(&(ms, live)) = changes.peek() {
+            if (ms - start_ms) / bucket_ms > bucket_idx {
+                break;
+            }
+            max_bytes = Some(max_bytes.map_or(live, |m| m.max(live)));
+            current = Some(live);
+            changes.next();
+        }
+        if let Some(bytes) = max_bytes {
+            let time_ms = start_ms + bucket_idx * bucket_ms + bucket_ms / 2;
+            points.push((time_ms as f64 / 1000.0, bytes as f64));
+        }
+    }
+    points
+}
+
+/// Query top CPU consumers with both total and instant percentages (for live TUI)
+pub fn query_top_cpu_live(conn: &Connection, limit: usize) -> rusqlite::Result<Vec<CpuEntry>> {
+    // Get totals
+    let grand_total = query_total_samples(conn)? as f64;
+
+    if grand_total == 0.0 {
+        return Ok(vec![]);
+    }
+
+    // Get last checkpoint for instant %
+    let last_checkpoint = query_last_checkpoint(conn)?;
+
+    let instant_total: f64 = if let Some(cp_id) = last_checkpoint {
+        conn.query_row(
+            "SELECT COALESCE(SUM(count), 0.0) FROM cpu_samples WHERE checkpoint_id = ?",
+            [cp_id],
             |row| row.get(0),
         )?
     } else {
@@ -550,14 +1241,12 @@ pub fn query_top_cpu_live(conn: &Connection, limit: usize) -> rusqlite::Result<V
         r#"
         SELECT
             l.id, l.file, l.line, l.function,
-            SUM(cs.count) as total_samples,
-            COALESCE((
-                SELECT count FROM cpu_samples
-                WHERE location_id = l.id AND checkpoint_id = ?1
-            ), 0) as instant_samples
-        FROM cpu_samples cs
-        JOIN locations l ON cs.location_id = l.id
-        GROUP BY cs.location_id
+            ct.samples as total_samples,
+            COALESCE(cs.count, 0) as instant_samples
+        FROM cpu_totals ct
+        JOIN locations l ON ct.location_id = l.id
+        LEFT JOIN cpu_samples cs
+            ON cs.checkpoint_id = ?1 AND cs.location_id = ct.location_id
         ORDER BY total_samples DESC
         LIMIT ?2
         "#,
@@ -596,11 +1285,7 @@ pub fn query_top_cpu(
     limit: usize,
     threshold: f64,
 ) -> rusqlite::Result<Vec<CpuEntry>> {
-    let total: f64 = conn.query_row(
-        "SELECT COALESCE(SUM(count), 0.0) FROM cpu_samples",
-        [],
-        |row| row.get(0),
-    )?;
+    let total = query_total_samples(conn)? as f64;
 
     if total == 0.0 {
         return Ok(vec![]);
@@ -608,11 +1293,10 @@ pub fn query_top_cpu(
 
     let mut stmt = conn.prepare(
         r#"
-        SELECT l.id, l.file, l.line, l.function, SUM(cs.count) as samples
-        FROM cpu_samples cs
-        JOIN locations l ON cs.location_id = l.id
-        GROUP BY cs.location_id
-        ORDER BY samples DESC
+        SELECT l.id, l.file, l.line, l.function, ct.samples
+        FROM cpu_totals ct
+        JOIN locations l ON ct.location_id = l.id
+        ORDER BY ct.samples DESC
         LIMIT ?
         "#,
     )?;
@@ -642,39 +1326,654 @@ pub fn query_top_cpu(
     Ok(entries)
 }
 
+/// Query top CPU consumers within checkpoints `first..=last`
+///
+/// Each location's samples in the range are the difference of its running
+/// totals at the range ends, so this reads two index entries per location.
+pub fn query_top_cpu_between(
+    conn: &Connection,
+    first: i64,
+    last: i64,
+    limit: usize,
+    threshold: f64,
+) -> rusqlite::Result<Vec<CpuEntry>> {
+    let mut stmt = conn.prepare(
+        r#"
+        WITH in_range AS MATERIALIZED (
+            SELECT ct.location_id,
+                COALESCE((
+                    SELECT cumulative FROM cpu_samples
+                    WHERE location_id = ct.location_id AND checkpoint_id <= ?2
+                    ORDER BY checkpoint_id DESC LIMIT 1
+                ), 0) - COALESCE((
+                    SELECT cumulative FROM cpu_samples
+                    WHERE location_id = ct.location_id AND checkpoint_id < ?1
+                    ORDER BY checkpoint_id DESC LIMIT 1
+                ), 0) as samples
+            FROM cpu_totals ct
+        )
+        SELECT l.id, l.file, l.line, l.function, r.samples
+        FROM in_range r
+        JOIN locations l ON r.location_id = l.id
+        WHERE r.samples > 0
+        ORDER BY r.samples DESC
+        "#,
+    )?;
+
+    let rows = stmt.query_map([first, last], |row| {
+        Ok(CpuEntry {
+            location_id: row.get(0)?,
+            file: row.get(1)?,
+            line: row.get::<_, i64>(2)? as u32,
+            function: row.get(3)?,
+            total_samples: row.get::<_, i64>(4)? as u64,
+            total_percent: 0.0,
+            instant_percent: 0.0,
+        })
+    })?;
+
+    let mut entries = Vec::new();
+    for row in rows {
+        entries.push(row?);
+    }
+
+    let total: u64 = entries.iter().map(|e| e.total_samples).sum();
+    for entry in &mut entries {
+        entry.total_percent = (entry.total_samples as f64 / total as f64) * 100.0;
+    }
+    entries.retain(|e| e.total_percent >= threshold);
+    entries.truncate(limit);
+
+    Ok(entries)
+}
+
+/// Total CPU samples recorded, from the running totals
+pub fn query_total_samples(conn: &Connection) -> rusqlite::Result<i64> {
+    conn.query_row(
+        "SELECT COALESCE(SUM(samples), 0) FROM cpu_totals",
+        [],
+        |row| row.get(0),
+    )
+}
+
+/// Id of the newest checkpoint
+fn query_last_checkpoint(conn: &Connection) -> rusqlite::Result<Option<i64>> {
+    conn.query_row("SELECT MAX(id) FROM checkpoints", [], |row| row.get(0))
+}
+
+/// First and last checkpoint ids inside a time window
+///
+/// `since` keeps only the last part of the recording and `until` only the
+/// first part, both measured like checkpoint timestamps. Returns None when
+/// no checkpoint falls inside the window.
+pub fn query_checkpoint_range(
+    conn: &Connection,
+    since_ms: Option<i64>,
+    until_ms: Option<i64>,
+) -> rusqlite::Result<Option<(i64, i64)>> {
+    let end_ms: Option<i64> =
+        conn.query_row("SELECT MAX(timestamp_ms) FROM checkpoints", [], |row| {
+            row.get(0)
+        })?;
+    let Some(end_ms) = end_ms else {
+        return Ok(None);
+    };
+
+    let from_ms = since_ms.map_or(i64::MIN, |since| end_ms - since);
+    let to_ms = until_ms.unwrap_or(i64::MAX);
+
+    conn.query_row(
+        "SELECT MIN(id), MAX(id) FROM checkpoints WHERE timestamp_ms >= ? AND timestamp_ms <= ?",
+        [from_ms, to_ms],
+        |row| {
+            let first: Option<i64> = row.get(0)?;
+            let last: Option<i64> = row.get(1)?;
+            Ok(first.zip(last))
+        },
+    )
+}
+
+/// Where `--retention` pruned the raw samples up to, if checkpoint `first`
+/// lies before it
+///
+/// Per-checkpoint rows before that point are gone, so no range starting
+/// there can be summed from them.
+pub fn query_pruned_before(conn: &Connection, first: i64) -> rusqlite::Result<Option<i64>> {
+    let Some(retained_from_ms) =
+        schema::get_meta(conn, "raw_retained_from_ms")?.and_then(|v| v.parse::<i64>().ok())
+    else {
+        return Ok(None);
+    };
+    let first_ms: i64 = conn.query_row(
+        "SELECT timestamp_ms FROM checkpoints WHERE id = ?",
+        [first],
+        |row| row.get(0),
+    )?;
+    Ok((first_ms < retained_from_ms).then_some(retained_from_ms))
+}
+
+/// Bring a profile written by an older rsprof up to the current schema,
+/// building the running-total tables from its history
+pub fn upgrade_schema(conn: &Connection) -> rusqlite::Result<()> {
+    schema::create_missing_tables(conn)
+}
+
+/// Query results for per-thread CPU usage
+#[derive(Debug, Clone)]
+pub struct ThreadEntry {
+    pub tid: u32,
+    pub name: String,
+    pub total_samples: u64,
+    pub total_percent: f64,
+    /// Hottest location on this thread
+    pub file: String,
+    pub line: u32,
+    pub function: String,
+}
+
+/// Query CPU usage per thread, busiest first, with each thread's hottest location
+pub fn query_top_threads(
+    conn: &Connection,
+    limit: usize,
+    threshold: f64,
+) -> rusqlite::Result<Vec<ThreadEntry>> {
+    let total: f64 = conn.query_row(
+        "SELECT COALESCE(SUM(samples), 0.0) FROM thread_cpu_totals",
+        [],
+        |row| row.get(0),
+    )?;
+
+    if total == 0.0 {
+        return Ok(vec![]);
+    }
+
+    let mut stmt = conn.prepare(
+        r#"
+        WITH ranked AS (
+            SELECT tid, location_id,
+                   SUM(samples) OVER (PARTITION BY tid) as thread_samples,
+                   ROW_NUMBER() OVER (PARTITION BY tid ORDER BY samples DESC) as rank
+            FROM thread_cpu_totals
+        )
+        SELECT r.tid, COALESCE(t.name, ''), r.thread_samples, l.file, l.line, l.function
+        FROM ranked r
+        JOIN locations l ON r.location_id = l.id
+        LEFT JOIN threads t ON r.tid = t.tid
+        WHERE r.rank = 1
+        ORDER BY r.thread_samples DESC
+        LIMIT ?
+        "#,
+    )?;
+
+    let rows = stmt.query_map([limit as i64], |row| {
+        let samples: i64 = row.get(2)?;
+        Ok(ThreadEntry {
+            tid: row.get::<_, i64>(0)? as u32,
+            name: row.get(1)?,
+            total_samples: samples as u64,
+            total_percent: (samples as f64 / total) * 100.0,
+            file: row.get(3)?,
+            line: row.get::<_, i64>(4)? as u32,
+            function: row.get(5)?,
+        })
+    })?;
+
+    let mut entries = Vec::new();
+    for row in rows {
+        let entry = row?;
+        if entry.total_percent >= threshold {
+            entries.push(entry);
+        }
+    }
+
+    Ok(entries)
+}
+
+/// Query results for per-process usage
+#[derive(Debug, Clone)]
+pub struct ProcessEntry {
+    pub pid: u32,
+    pub name: String,
+    pub cpu_samples: u64,
+    /// Share of all processes' CPU samples
+    pub cpu_percent: f64,
+    /// Live heap bytes as of the latest checkpoint
+    pub live_bytes: i64,
+    pub total_alloc_bytes: i64,
+}
+
+/// Query CPU and heap per recorded process, busiest first
+pub fn query_top_processes(conn: &Connection, limit: usize) -> rusqlite::Result<Vec<ProcessEntry>> {
+    let total: f64 = conn.query_row(
+        "SELECT COALESCE(SUM(samples), 0.0) FROM thread_cpu_totals",
+        [],
+        |row| row.get(0),
+    )?;
+
+    let mut stmt = conn.prepare(
+        r#"
+        SELECT p.pid, p.name,
+            COALESCE((
+                SELECT SUM(tc.samples) FROM thread_cpu_totals tc
+                JOIN threads t ON tc.tid = t.tid
+                WHERE t.pid = p.pid
+            ), 0) as samples,
+            COALESCE((
+                SELECT SUM(live_bytes) FROM process_heap_latest WHERE pid = p.pid
+            ), 0) as live_bytes,
+            COALESCE((
+                SELECT SUM(alloc_bytes) FROM process_heap_latest WHERE pid = p.pid
+            ), 0) as alloc_bytes
+        FROM processes p
+        ORDER BY samples DESC, live_bytes DESC
+        LIMIT ?
+        "#,
+    )?;
+
+    let rows = stmt.query_map([limit as i64], |row| {
+        let samples: i64 = row.get(2)?;
+        Ok(ProcessEntry {
+            pid: row.get::<_, i64>(0)? as u32,
+            name: row.get(1)?,
+            cpu_samples: samples as u64,
+            cpu_percent: if total > 0.0 {
+                (samples as f64 / total) * 100.0
+            } else {
+                0.0
+            },
+            live_bytes: row.get(3)?,
+            total_alloc_bytes: row.get(4)?,
+        })
+    })?;
+    rows.collect()
+}
+
+/// Query one process's top CPU consumers, optionally within checkpoints
+/// `first..=last`; percentages are of that process's samples
+pub fn query_top_cpu_for_pid(
+    conn: &Connection,
+    pid: u32,
+    range: Option<(i64, i64)>,
+    limit: usize,
+    threshold: f64,
+) -> rusqlite::Result<Vec<CpuEntry>> {
+    // Whole-recording totals are kept per thread; ranges sum the raw samples
+    let sql = if range.is_some() {
+        r#"
+        SELECT l.id, l.file, l.line, l.function, SUM(s.count) as samples
+        FROM thread_cpu_samples s
+        JOIN threads t ON s.tid = t.tid
+        JOIN locations l ON s.location_id = l.id
+        WHERE t.pid = ?1 AND s.checkpoint_id BETWEEN ?2 AND ?3
+        GROUP BY l.id
+        ORDER BY samples DESC
+        "#
+    } else {
+        r#"
+        SELECT l.id, l.file, l.line, l.function, SUM(s.samples) as samples
+        FROM thread_cpu_totals s
+        JOIN threads t ON s.tid = t.tid
+        JOIN locations l ON s.location_id = l.id
+        WHERE t.pid = ?1
+        GROUP BY l.id
+        ORDER BY samples DESC
+        "#
+    };
+    let mut stmt = conn.prepare(sql)?;
+
+    let pid = pid as i64;
+    let (first, last) = range.unwrap_or_default();
+    let all: [&dyn rusqlite::ToSql; 3] = [&pid, &first, &last];
+    let params = if range.is_some() { &all[..] } else { &all[..1] };
+    let rows = stmt.query_map(params, |row| {
+        Ok(CpuEntry {
+            location_id: row.get(0)?,
+            file: row.get(1)?,
+            line: row.get::<_, i64>(2)? as u32,
+            function: row.get(3)?,
+            total_samples: row.get::<_, i64>(4)? as u64,
+            total_percent: 0.0,
+            instant_percent: 0.0,
+        })
+    })?;
+
+    let mut entries = Vec::new();
+    for row in rows {
+        entries.push(row?);
+    }
+
+    let total: u64 = entries.iter().map(|e| e.total_samples).sum();
+    for entry in &mut entries {
+        entry.total_percent = (entry.total_samples as f64 / total as f64) * 100.0;
+    }
+    entries.retain(|e| e.total_percent >= threshold);
+    entries.truncate(limit);
+    Ok(entries)
+}
+
+/// Query one process's top heap consumers as of the latest checkpoint
+pub fn query_top_heap_for_pid(
+    conn: &Connection,
+    pid: u32,
+    limit: usize,
+) -> rusqlite::Result<Vec<HeapEntry>> {
+    let mut stmt = conn.prepare(
+        r#"
+        SELECT
+            l.id, l.file, l.line, l.function,
+            ph.live_bytes, ph.alloc_bytes, ph.free_bytes, ph.alloc_count, ph.free_count
+        FROM process_heap_latest ph
+        JOIN locations l ON ph.location_id = l.id
+        WHERE ph.pid = ?1
+        ORDER BY ph.live_bytes DESC, ph.alloc_bytes DESC
+        LIMIT ?2
+        "#,
+    )?;
+
+    heap_entries(&mut stmt, [pid as i64, limit as i64])
+}
+
+/// Hardware counter totals per location
+pub fn query_pmu_totals(conn: &Connection) -> rusqlite::Result<HashMap<i64, PmuCounters>> {
+    let mut stmt = conn.prepare(
+        "SELECT location_id, cycles, instructions, llc_misses, branch_misses FROM pmu_totals",
+    )?;
+    pmu_counters(&mut stmt, [])
+}
+
+/// Hardware counters per location within checkpoints `first..=last`
+pub fn query_pmu_between(
+    conn: &Connection,
+    first: i64,
+    last: i64,
+) -> rusqlite::Result<HashMap<i64, PmuCounters>> {
+    let mut stmt = conn.prepare(
+        r#"
+        SELECT location_id, SUM(cycles), SUM(instructions), SUM(llc_misses), SUM(branch_misses)
+        FROM pmu_samples
+        WHERE checkpoint_id >= ?1 AND checkpoint_id <= ?2
+        GROUP BY location_id
+        "#,
+    )?;
+    pmu_counters(&mut stmt, [first, last])
+}
+
+/// Read (location_id, cycles, instructions, llc_misses, branch_misses) rows
+fn pmu_counters(
+    stmt: &mut rusqlite::Statement<'_>,
+    params: impl rusqlite::Params,
+) -> rusqlite::Result<HashMap<i64, PmuCounters>> {
+    let rows = stmt.query_map(params, |row| {
+        Ok((
+            row.get::<_, i64>(0)?,
+            PmuCounters {
+                cycles: row.get::<_, i64>(1)? as u64,
+                instructions: row.get::<_, i64>(2)? as u64,
+                llc_misses: row.get::<_, i64>(3)? as u64,
+                branch_misses: row.get::<_, i64>(4)? as u64,
+            },
+        ))
+    })?;
+
+    let mut counters = HashMap::new();
+    for row in rows {
+        let (location_id, values) = row?;
+        counters.insert(location_id, values);
+    }
+    Ok(counters)
+}
+
+/// Query results for time spent blocked (off-CPU)
+#[derive(Debug, Clone)]
+pub struct OffCpuEntry {
+    pub location_id: i64,
+    pub file: String,
+    pub line: u32,
+    pub function: String,
+    pub blocked_ns: u64,
+    /// Share of all blocked time
+    pub percent: f64,
+}
+
+/// Query the locations threads spent the most time blocked at
+pub fn query_top_offcpu(
+    conn: &Connection,
+    limit: usize,
+    threshold: f64,
+) -> rusqlite::Result<Vec<OffCpuEntry>> {
+    let mut stmt = conn.prepare(
+        r#"
+        SELECT l.id, l.file, l.line, l.function, ot.blocked_ns
+        FROM offcpu_totals ot
+        JOIN locations l ON ot.location_id = l.id
+        ORDER BY ot.blocked_ns DESC
+        "#,
+    )?;
+    offcpu_entries(&mut stmt, [], limit, threshold)
+}
+
+/// Query blocked time within checkpoints `first..=last`
+pub fn query_top_offcpu_between(
+    conn: &Connection,
+    first: i64,
+    last: i64,
+    limit: usize,
+    threshold: f64,
+) -> rusqlite::Result<Vec<OffCpuEntry>> {
+    let mut stmt = conn.prepare(
+        r#"
+        SELECT l.id, l.file, l.line, l.function, SUM(os.blocked_ns) as blocked_ns
+        FROM offcpu_samples os
+        JOIN locations l ON os.location_id = l.id
+        WHERE os.checkpoint_id >= ?1 AND os.checkpoint_id <= ?2
+        GROUP BY l.id
+        ORDER BY blocked_ns DESC
+        "#,
+    )?;
+    offcpu_entries(&mut stmt, [first, last], limit, threshold)
+}
+
+/// Read (id, file, line, function, blocked_ns) rows, largest first, and fill in percentages
+fn offcpu_entries(
+    stmt: &mut rusqlite::Statement<'_>,
+    params: impl rusqlite::Params,
+    limit: usize,
+    threshold: f64,
+) -> rusqlite::Result<Vec<OffCpuEntry>> {
+    let rows = stmt.query_map(params, |row| {
+        Ok(OffCpuEntry {
+            location_id: row.get(0)?,
+            file: row.get(1)?,
+            line: row.get::<_, i64>(2)? as u32,
+            function: row.get(3)?,
+            blocked_ns: row.get::<_, i64>(4)? as u64,
+            percent: 0.0,
+        })
+    })?;
+
+    let mut entries = Vec::new();
+    for row in rows {
+        entries.push(row?);
+    }
+
+    let total: u64 = entries.iter().map(|e| e.blocked_ns).sum();
+    for entry in &mut entries {
+        entry.percent = (entry.blocked_ns as f64 / total as f64) * 100.0;
+    }
+    entries.retain(|e| e.percent >= threshold);
+    entries.truncate(limit);
+
+    Ok(entries)
+}
+
+/// Every recorded location by id
+pub fn query_locations(conn: &Connection) -> rusqlite::Result<HashMap<i64, Location>> {
+    let mut stmt = conn.prepare("SELECT id, file, line, function FROM locations")?;
+    let rows = stmt.query_map([], |row| {
+        let location = Location {
+            file: row.get(1)?,
+            line: row.get::<_, i64>(2)? as u32,
+            column: 0,
+            function: row.get(3)?,
+        };
+        Ok((row.get::<_, i64>(0)?, location))
+    })?;
+    rows.collect()
+}
+
+/// Call `f(samples, frames)` for each stack with CPU samples, frames being
+/// location ids leaf first
+///
+/// Rows are read one at a time, so this runs in constant memory however
+/// large the profile. Profiles recorded before stacks were stored have none.
+pub fn for_each_stack(
+    conn: &Connection,
+    mut f: impl FnMut(u64, &[i64]) -> Result<()>,
+) -> Result<()> {
+    let mut stmt = conn.prepare(
+        r#"
+        SELECT st.samples, s.frames
+        FROM stack_totals st
+        JOIN stacks s ON st.stack_id = s.id
+        WHERE st.samples > 0
+        "#,
+    )?;
+
+    let mut rows = stmt.query([])?;
+    let mut frames = Vec::new();
+    while let Some(row) = rows.next()? {
+        let samples: i64 = row.get(0)?;
+        let blob: Vec<u8> = row.get(1)?;
+        schema::decode_stack(&blob, &mut frames);
+        f(samples as u64, &frames)?;
+    }
+    Ok(())
+}
+
 /// Query top heap consumers with totals
+///
+/// Heap rows are cumulative and only written when they change, so each
+/// location's current stats are its latest row, kept in heap_latest.
 pub fn query_top_heap_live(conn: &Connection, limit: usize) -> rusqlite::Result<Vec<HeapEntry>> {
-    // Get the most recent checkpoint for live_bytes
-    let last_checkpoint: Option<i64> = conn
-        .query_row(
-            "SELECT id FROM checkpoints ORDER BY timestamp_ms DESC LIMIT 1",
-            [],
-            |row| row.get(0),
+    let mut stmt = conn.prepare(
+        r#"
+        SELECT
+            l.id, l.file, l.line, l.function,
+            hl.live_bytes, hl.alloc_bytes, hl.free_bytes, hl.alloc_count, hl.free_count
+        FROM heap_latest hl
+        JOIN locations l ON hl.location_id = l.id
+        ORDER BY hl.live_bytes DESC, hl.alloc_bytes DESC
+        LIMIT ?1
+        "#,
+    )?;
+
+    heap_entries(&mut stmt, [limit as i64])
+}
+
+/// Query top heap consumers within checkpoints `first..=last`
+///
+/// Live bytes are as of `last`; allocation and free totals are the
+/// difference of the cumulative rows at the range ends.
+pub fn query_top_heap_between(
+    conn: &Connection,
+    first: i64,
+    last: i64,
+    limit: usize,
+) -> rusqlite::Result<Vec<HeapEntry>> {
+    let mut stmt = conn.prepare(
+        r#"
+        WITH bounds AS MATERIALIZED (
+            SELECT hl.location_id,
+                (SELECT checkpoint_id FROM heap_samples
+                 WHERE location_id = hl.location_id AND checkpoint_id <= ?2
+                 ORDER BY checkpoint_id DESC LIMIT 1) as end_cp,
+                (SELECT checkpoint_id FROM heap_samples
+                 WHERE location_id = hl.location_id AND checkpoint_id < ?1
+                 ORDER BY checkpoint_id DESC LIMIT 1) as start_cp
+            FROM heap_latest hl
         )
-        .ok();
+        SELECT
+            l.id, l.file, l.line, l.function,
+            hi.live_bytes,
+            hi.alloc_bytes - COALESCE(lo.alloc_bytes, 0) as alloc_bytes,
+            hi.free_bytes - COALESCE(lo.free_bytes, 0),
+            hi.alloc_count - COALESCE(lo.alloc_count, 0),
+            hi.free_count - COALESCE(lo.free_count, 0)
+        FROM bounds b
+        JOIN heap_samples hi ON hi.location_id = b.location_id AND hi.checkpoint_id = b.end_cp
+        LEFT JOIN heap_samples lo
+            ON lo.location_id = b.location_id AND lo.checkpoint_id = b.start_cp
+        JOIN locations l ON b.location_id = l.id
+        ORDER BY hi.live_bytes DESC, alloc_bytes DESC
+        LIMIT ?3
+        "#,
+    )?;
+
+    heap_entries(&mut stmt, rusqlite::params![first, last, limit as i64])
+}
+
+/// Load every location's allocation histograms
+pub(super) fn query_heap_histograms(
+    conn: &Connection,
+) -> rusqlite::Result<HashMap<i64, HeapHistogram>> {
+    let mut stmt = conn
+        .prepare("SELECT location_id, bucket, size_count, lifetime_count FROM heap_histograms")?;
+    let rows = stmt.query_map([], |row| {
+        Ok((
+            row.get::<_, i64>(0)?,
+            row.get::<_, i64>(1)? as usize,
+            row.get::<_, i64>(2)? as u64,
+            row.get::<_, i64>(3)? as u64,
+        ))
+    })?;
+
+    let mut histograms: HashMap<i64, HeapHistogram> = HashMap::new();
+    for row in rows {
+        let (location_id, bucket, size, lifetime) = row?;
+        let histogram = histograms.entry(location_id).or_default();
+        if let Some(count) = histogram.size.get_mut(bucket) {
+            *count = size;
+            histogram.lifetime[bucket] = lifetime;
+        }
+    }
+    Ok(histograms)
+}
+
+/// Query the heap locations most worth pooling, over the whole recording
+pub fn query_top_churn(conn: &Connection, limit: usize) -> rusqlite::Result<Vec<ChurnEntry>> {
+    let histograms = query_heap_histograms(conn)?;
+    let duration_ms: i64 = conn.query_row(
+        "SELECT COALESCE(MAX(timestamp_ms), 0) FROM checkpoints",
+        [],
+        |row| row.get(0),
+    )?;
 
     let mut stmt = conn.prepare(
         r#"
         SELECT
             l.id, l.file, l.line, l.function,
-            COALESCE((
-                SELECT live_bytes FROM heap_samples
-                WHERE location_id = l.id AND checkpoint_id = ?1
-            ), 0) as live,
-            SUM(hs.alloc_bytes) as total_alloc,
-            SUM(hs.free_bytes) as total_free,
-            SUM(hs.alloc_count) as total_alloc_count,
-            SUM(hs.free_count) as total_free_count
-        FROM heap_samples hs
-        JOIN locations l ON hs.location_id = l.id
-        GROUP BY hs.location_id
-        ORDER BY live DESC, total_alloc DESC
-        LIMIT ?2
+            hl.live_bytes, hl.alloc_bytes, hl.free_bytes, hl.alloc_count, hl.free_count
+        FROM heap_latest hl
+        JOIN locations l ON hl.location_id = l.id
+        WHERE hl.location_id IN (SELECT location_id FROM heap_histograms)
         "#,
     )?;
+    let entries = heap_entries(&mut stmt, [])?;
+
+    Ok(rank_churn(
+        &entries,
+        &histograms,
+        duration_ms as f64 / 1000.0,
+        limit,
+    ))
+}
 
-    let cp_id = last_checkpoint.unwrap_or(0);
-    let rows = stmt.query_map(rusqlite::params![cp_id, limit as i64], |row| {
+/// Collect rows of (id, file, line, function, live, alloc, free, alloc_count, free_count)
+fn heap_entries(
+    stmt: &mut rusqlite::Statement<'_>,
+    params: impl rusqlite::Params,
+) -> rusqlite::Result<Vec<HeapEntry>> {
+    let rows = stmt.query_map(params, |row| {
         Ok(HeapEntry {
             location_id: row.get(0)?,
             file: row.get(1)?,
@@ -702,20 +2001,10 @@ pub fn query_combined_live(
     limit: usize,
 ) -> rusqlite::Result<Vec<CombinedEntry>> {
     // Get CPU totals
-    let cpu_grand_total: f64 = conn.query_row(
-        "SELECT COALESCE(SUM(count), 0.0) FROM cpu_samples",
-        [],
-        |row| row.get(0),
-    )?;
+    let cpu_grand_total = query_total_samples(conn)? as f64;
 
     // Get last checkpoint for instant values
-    let last_checkpoint: Option<i64> = conn
-        .query_row(
-            "SELECT id FROM checkpoints ORDER BY timestamp_ms DESC LIMIT 1",
-            [],
-            |row| row.get(0),
-        )
-        .ok();
+    let last_checkpoint = query_last_checkpoint(conn)?;
 
     let cpu_instant_total: f64 = if let Some(cp_id) = last_checkpoint {
         conn.query_row(
@@ -728,22 +2017,21 @@ pub fn query_combined_live(
     };
 
     // Combined query joining CPU and Heap data
-    // heap_total = sum of all allocations over time (alloc_bytes)
-    // heap_instant = current slice's live bytes (live_bytes at current checkpoint)
+    // heap_total = all allocations so far (latest cumulative alloc_bytes)
+    // heap_instant = current live bytes (latest live_bytes, carried forward)
     let mut stmt = conn.prepare(
         r#"
         SELECT
             l.id, l.file, l.line, l.function,
-            COALESCE((SELECT SUM(count) FROM cpu_samples WHERE location_id = l.id), 0) as cpu_total,
-            COALESCE((SELECT count FROM cpu_samples WHERE location_id = l.id AND checkpoint_id = ?1), 0) as cpu_instant,
-            COALESCE((SELECT SUM(alloc_bytes) FROM heap_samples WHERE location_id = l.id), 0) as heap_total,
-            COALESCE((SELECT live_bytes FROM heap_samples WHERE location_id = l.id AND checkpoint_id = ?1), 0) as heap_instant
+            COALESCE(ct.samples, 0) as cpu_total,
+            COALESCE(cs.count, 0) as cpu_instant,
+            COALESCE(hl.alloc_bytes, 0) as heap_total,
+            COALESCE(hl.live_bytes, 0) as heap_instant
         FROM locations l
-        WHERE l.id IN (
-            SELECT DISTINCT location_id FROM cpu_samples
-            UNION
-            SELECT DISTINCT location_id FROM heap_samples
-        )
+        LEFT JOIN cpu_totals ct ON ct.location_id = l.id
+        LEFT JOIN cpu_samples cs ON cs.checkpoint_id = ?1 AND cs.location_id = l.id
+        LEFT JOIN heap_latest hl ON hl.location_id = l.id
+        WHERE ct.location_id IS NOT NULL OR hl.location_id IS NOT NULL
         ORDER BY cpu_total DESC
         LIMIT ?2
         "#,
@@ -786,6 +2074,9 @@ pub fn query_combined_live(
 }
 
 /// Query heap bytes over time aggregated into buckets (for chart rendering)
+///
+/// Heap rows are only written when a location changes, so each bucket takes
+/// the value carried in from before it as well as the rows inside it.
 pub fn query_heap_timeseries_aggregated(
     conn: &Connection,
     location_id: i64,
@@ -803,39 +2094,144 @@ pub fn query_heap_timeseries_aggregated(
     }
 
     let query_result: rusqlite::Result<Vec<(f64, f64)>> = (|| {
-        let mut stmt = conn.prepare(
-            r#"
-            WITH bucket_data AS (
-                SELECT
-                    ((c.timestamp_ms - ?2) / ?4) as bucket_idx,
-                    hs.live_bytes
-                FROM checkpoints c
-                JOIN heap_samples hs ON hs.checkpoint_id = c.id AND hs.location_id = ?1
-                WHERE c.timestamp_ms >= ?2 AND c.timestamp_ms < ?3
-            )
-            SELECT bucket_idx, MAX(live_bytes) as max_bytes
-            FROM bucket_data
-            GROUP BY bucket_idx
-            ORDER BY bucket_idx ASC
-            "#,
+        let tier = chart_tier(conn, start_ms, bucket_ms);
+
+        // Value carried into the range from the last change before it
+        let carried: Option<i64> = match tier {
+            Some((tier, width_ms)) => conn
+                .query_row(
+                    r#"
+                    SELECT last_live FROM heap_rollup
+                    WHERE tier = ?1 AND location_id = ?2 AND bucket < ?4 / ?3
+                    ORDER BY bucket DESC
+                    LIMIT 1
+                    "#,
+                    rusqlite::params![tier, location_id, width_ms, start_ms],
+                    |row| row.get(0),
+                )
+                .optional()?,
+            None => conn
+                .query_row(
+                    r#"
+                    SELECT hs.live_bytes
+                    FROM heap_samples hs
+                    JOIN checkpoints c ON hs.checkpoint_id = c.id
+                    WHERE hs.location_id = ?1 AND c.timestamp_ms < ?2
+                    ORDER BY hs.checkpoint_id DESC
+                    LIMIT 1
+                    "#,
+                    rusqlite::params![location_id, start_ms],
+                    |row| row.get(0),
+                )
+                .optional()?,
+        };
+
+        // Buckets run up to the last checkpoint in range
+        let last_ms: Option<i64> = conn.query_row(
+            "SELECT MAX(timestamp_ms) FROM checkpoints WHERE timestamp_ms >= ?1 AND timestamp_ms < ?2",
+            rusqlite::params![start_ms, end_ms],
+            |row| row.get(0),
         )?;
+        let Some(last_ms) = last_ms else {
+            return Ok(Vec::new());
+        };
+        let last_bucket = (last_ms - start_ms) / bucket_ms;
+
+        // Changes in range as (bucket_idx, highest, final) live bytes: one
+        // per raw row, or one per tier bucket
+        let changes: Vec<(i64, i64, i64)> = match tier {
+            Some((tier, width_ms)) => {
+                let mut stmt = conn.prepare_cached(
+                    r#"
+                    SELECT (MAX(bucket * ?3, ?4) - ?4) / ?6 as bucket_idx, max_live, last_live
+                    FROM heap_rollup
+                    WHERE tier = ?1 AND location_id = ?2
+                      AND bucket >= ?4 / ?3 AND bucket * ?3 < ?5
+                    ORDER BY bucket ASC
+                    "#,
+                )?;
+                stmt.query_map(
+                    rusqlite::params![tier, location_id, width_ms, start_ms, end_ms, bucket_ms],
+                    |row| Ok((row.get(0)?, row.get(1)?, row.get(2)?)),
+                )?
+                .filter_map(|r| r.ok())
+                .collect()
+            }
+            None => {
+                let mut stmt = conn.prepare(
+                    r#"
+                    SELECT ((c.timestamp_ms - ?2) / ?4) as bucket_idx, hs.live_bytes
+                    FROM heap_samples hs
+                    JOIN checkpoints c ON hs.checkpoint_id = c.id
+                    WHERE hs.location_id = ?1 AND c.timestamp_ms >= ?2 AND c.timestamp_ms < ?3
+                    ORDER BY hs.checkpoint_id ASC
+                    "#,
+                )?;
+                stmt.query_map(
+                    rusqlite::params![location_id, start_ms, end_ms, bucket_ms],
+                    |row| {
+                        let bytes: i64 = row.get(1)?;
+                        Ok((row.get(0)?, bytes, bytes))
+                    },
+                )?
+                .filter_map(|r| r.ok())
+                .collect()
+            }
+        };
 
-        let rows = stmt.query_map(
-            rusqlite::params![location_id, start_ms, end_ms, bucket_ms],
-            |row| {
-                let bucket_idx: i64 = row.get(0)?;
-                let bytes: i64 = row.get::<_, Option<i64>>(1)?.unwrap_or(0);
+        // Bucket max of the carried value and the changes in it
+        let mut points = Vec::new();
+        let mut current = carried;
+        let mut changes = changes.into_iter().peekable();
+        for bucket_idx in 0..=last_bucket {
+            let mut max_bytes = current;
+            while let Some(&(idx, max_live, last_live)) = changes.peek() {
+                if idx > bucket_idx {
+                    break;
+                }
+                max_bytes = Some(max_bytes.map_or(max_live, |m| m.max(max_live)));
+                current = Some(last_live);
+                changes.next();
+            }
+            if let Some(bytes) = max_bytes {
                 let time_ms = start_ms + bucket_idx * bucket_ms + bucket_ms / 2;
-                Ok((time_ms as f64 / 1000.0, bytes as f64))
-            },
-        )?;
+                points.push((time_ms as f64 / 1000.0, bytes as f64));
+            }
+        }
 
-        Ok(rows.filter_map(|r| r.ok()).collect())
+        Ok(points)
     })();
 
     query_result.unwrap_or_default()
 }
 
+/// Query the number of samples lost to perf ring overflow (0 if none recorded)
+pub fn query_lost_samples(conn: &Connection) -> u64 {
+    schema::get_meta(conn, "lost_samples")
+        .ok()
+        .flatten()
+        .and_then(|v| v.parse().ok())
+        .unwrap_or(0)
+}
+
+/// Query the number of events rsprof-trace dropped on full tables (0 if none recorded)
+pub fn query_dropped_events(conn: &Connection) -> u64 {
+    schema::get_meta(conn, "dropped_events")
+        .ok()
+        .flatten()
+        .and_then(|v| v.parse().ok())
+        .unwrap_or(0)
+}
+
+/// Query the number of checkpoints merged because the writer fell behind (0 if none)
+pub fn query_deferred_checkpoints(conn: &Connection) -> u64 {
+    schema::get_meta(conn, "deferred_checkpoints")
+        .ok()
+        .flatten()
+        .and_then(|v| v.parse().ok())
+        .unwrap_or(0)
+}
+
 /// Query sparkline data for all heap locations (recent N checkpoints)
 /// Returns HashMap<location_id, Vec<live_bytes>> for sparkline rendering
 pub fn query_heap_sparklines(conn: &Connection, num_points: usize) -> HashMap<i64, Vec<i64>> {
@@ -844,7 +2240,7 @@ pub fn query_heap_sparklines(conn: &Connection, num_points: usize) -> HashMap<i6
 
 /// Query sparkline data for specific locations (or all if location_ids is empty)
 /// Returns HashMap<location_id, Vec<live_bytes>> with exactly num_points values per location
-/// Missing checkpoints are filled with 0
+/// Checkpoints without a row carry the previous value forward (0 before the first)
 pub fn query_heap_sparklines_for_locations(
     conn: &Connection,
     num_points: usize,
@@ -881,31 +2277,36 @@ pub fn query_heap_sparklines_for_locations(
             .collect::<Vec<_>>()
             .join(",");
 
-        let query = if location_ids.is_empty() {
-            format!(
-                r#"
-                SELECT hs.location_id, hs.checkpoint_id, hs.live_bytes
-                FROM heap_samples hs
-                WHERE hs.checkpoint_id IN ({})
-                "#,
-                cp_placeholders
-            )
+        // Rows inside the window, plus each location's latest row before it
+        // (reported at index 0 so it seeds the carry-forward)
+        let loc_filter = if location_ids.is_empty() {
+            String::new()
         } else {
             let loc_placeholders = location_ids
                 .iter()
                 .map(|_| "?")
                 .collect::<Vec<_>>()
                 .join(",");
-            format!(
-                r#"
-                SELECT hs.location_id, hs.checkpoint_id, hs.live_bytes
-                FROM heap_samples hs
-                WHERE hs.checkpoint_id IN ({})
-                AND hs.location_id IN ({})
-                "#,
-                cp_placeholders, loc_placeholders
-            )
+            format!("AND location_id IN ({})", loc_placeholders)
         };
+        let query = format!(
+            r#"
+            SELECT location_id, checkpoint_id, live_bytes
+            FROM heap_samples
+            WHERE checkpoint_id IN ({cps}) {filter}
+            UNION ALL
+            SELECT hs.location_id, -1, hs.live_bytes
+            FROM heap_samples hs
+            JOIN (
+                SELECT location_id, MAX(checkpoint_id) as checkpoint_id
+                FROM heap_samples
+                WHERE checkpoint_id < ? {filter}
+                GROUP BY location_id
+            ) prev ON hs.location_id = prev.location_id AND hs.checkpoint_id = prev.checkpoint_id
+            "#,
+            cps = cp_placeholders,
+            filter = loc_filter
+        );
 
         let mut stmt = conn.prepare(&query)?;
 
@@ -918,11 +2319,15 @@ pub fn query_heap_sparklines_for_locations(
         for loc_id in location_ids {
             params.push(Box::new(*loc_id));
         }
+        params.push(Box::new(checkpoint_ids[0]));
+        for loc_id in location_ids {
+            params.push(Box::new(*loc_id));
+        }
 
         let params_ref: Vec<&dyn rusqlite::ToSql> = params.iter().map(|p| p.as_ref()).collect();
 
         // Collect all data points with their checkpoint index
-        let mut raw_data: HashMap<i64, Vec<(usize, i64)>> = HashMap::new();
+        let mut raw_data: HashMap<i64, Vec<(usize, i64, i64)>> = HashMap::new();
 
         let rows = stmt.query_map(params_ref.as_slice(), |row| {
             Ok((
@@ -932,15 +2337,21 @@ pub fn query_heap_sparklines_for_locations(
             ))
         })?;
 
-        for row in rows {
-            if let Ok((loc_id, cp_id, live_bytes)) = row
-                && let Some(&idx) = cp_index.get(&cp_id)
-            {
-                raw_data.entry(loc_id).or_default().push((idx, live_bytes));
+        for (loc_id, cp_id, live_bytes) in rows.flatten() {
+            let idx = if cp_id < 0 {
+                Some(0)
+            } else {
+                cp_index.get(&cp_id).copied()
+            };
+            if let Some(idx) = idx {
+                raw_data
+                    .entry(loc_id)
+                    .or_default()
+                    .push((idx, cp_id, live_bytes));
             }
         }
 
-        // Build result with zeros for missing checkpoints
+        // Build result, carrying values forward over checkpoints without a row
         let mut result: HashMap<i64, Vec<i64>> = HashMap::new();
 
         // For specified locations, ensure they all have entries (even if all zeros)
@@ -949,12 +2360,20 @@ pub fn query_heap_sparklines_for_locations(
         }
 
         // Fill in actual data
-        for (loc_id, data_points) in raw_data {
+        for (loc_id, mut data_points) in raw_data {
             let values = result
                 .entry(loc_id)
                 .or_insert_with(|| vec![0i64; num_checkpoints]);
-            for (idx, live_bytes) in data_points {
-                values[idx] = live_bytes;
+            // The pre-window row (cp_id -1) sorts before a row at index 0
+            data_points.sort_unstable_by_key(|&(idx, cp_id, _)| (idx, cp_id));
+            let mut points = data_points.into_iter().peekable();
+            let mut current = 0;
+            for (idx, value) in values.iter_mut().enumerate() {
+                while let Some(&(_, _, live_bytes)) = points.peek().filter(|p| p.0 == idx) {
+                    current = live_bytes;
+                    points.next();
+                }
+                *value = current;
             }
         }
 
@@ -1,44 +1,112 @@
+use super::index::{self, SymbolIndex};
 use crate::error::{Error, Result};
 use gimli::{EndianSlice, RunTimeEndian};
 use object::{Object, ObjectSection};
-use std::collections::HashMap;
+use std::cell::RefCell;
+use std::collections::{HashMap, HashSet};
 use std::fs::File;
+use std::ops::Range;
 use std::path::Path;
-use std::sync::Arc;
 
-/// Parsed DWARF debug information
+/// Sections read when decoding units
+const DEBUG_SECTIONS: [gimli::SectionId; 10] = [
+    gimli::SectionId::DebugAbbrev,
+    gimli::SectionId::DebugAddr,
+    gimli::SectionId::DebugAranges,
+    gimli::SectionId::DebugInfo,
+    gimli::SectionId::DebugLine,
+    gimli::SectionId::DebugLineStr,
+    gimli::SectionId::DebugRanges,
+    gimli::SectionId::DebugRngLists,
+    gimli::SectionId::DebugStr,
+    gimli::SectionId::DebugStrOffsets,
+];
+
+/// DWARF debug information, loaded one compilation unit at a time
+///
+/// Opening a binary only maps it and reads the symbol index (from the
+/// build-id cache when present). A unit's line table and function
+/// declarations are decoded the first time an address inside it is looked up.
 pub struct DwarfInfo {
-    /// Address ranges mapped to source locations
-    pub ranges: Vec<AddressRange>,
-    /// Function names by address
-    pub functions: HashMap<u64, String>,
-    /// Function declarations: function name -> (file, line)
-    pub function_decls: HashMap<String, (String, u32)>,
+    mmap: memmap2::Mmap,
+    endian: RunTimeEndian,
+    /// File range of each debug section, by name
+    sections: HashMap<&'static str, Range<usize>>,
+    /// Function symbols and unit address ranges
+    index: SymbolIndex,
+    /// Units decoded so far
+    loaded: RefCell<LoadedUnits>,
 }
 
 /// An address range mapped to a source location
-#[derive(Debug, Clone)]
+#[derive(Debug, Clone, Copy)]
 pub struct AddressRange {
     pub start: u64,
     pub end: u64,
-    pub file: String,
+    /// Index into the interned file names
+    pub file: u32,
     pub line: u32,
     pub column: u32,
 }
 
+/// Line tables and declarations of the units decoded so far
+#[derive(Default)]
+struct LoadedUnits {
+    /// .debug_info offset -> the unit's line ranges, sorted by start
+    ranges: HashMap<u64, Vec<AddressRange>>,
+    /// Interned file paths
+    files: FileNames,
+    /// Function declarations: function name -> (file, line)
+    function_decls: HashMap<String, (u32, u32)>,
+}
+
+/// File paths shared by every range that points at them
+#[derive(Default)]
+struct FileNames {
+    names: Vec<String>,
+    ids: HashMap<String, u32>,
+}
+
+impl FileNames {
+    fn intern(&mut self, name: String) -> u32 {
+        if let Some(&id) = self.ids.get(&name) {
+            return id;
+        }
+        let id = self.names.len() as u32;
+        self.names.push(name.clone());
+        self.ids.insert(name, id);
+        id
+    }
+
+    fn get(&self, id: u32) -> &str {
+        &self.names[id as usize]
+    }
+}
+
 impl DwarfInfo {
-    /// Parse DWARF info from an ELF file
+    /// Open an ELF file's debug info
     pub fn parse(path: &Path) -> Result<Self> {
+        Self::open(path, true)
+    }
+
+    /// Open a shared object, which may be stripped down to its dynamic symbols
+    ///
+    /// Without debug info only function names resolve; `location_at` and
+    /// `function_decl` return None.
+    pub fn parse_symbols(path: &Path) -> Result<Self> {
+        Self::open(path, false)
+    }
+
+    fn open(path: &Path, require_debug_info: bool) -> Result<Self> {
         let file = File::open(path).map_err(Error::Io)?;
 
         let mmap = unsafe { memmap2::Mmap::map(&file) }.map_err(Error::Io)?;
-        let mmap = Arc::new(mmap);
 
-        let object = object::File::parse(&**mmap)
+        let object = object::File::parse(&*mmap)
             .map_err(|e| Error::SymbolResolution(format!("Failed to parse ELF: {}", e)))?;
 
         // Check for debug info
-        if object.section_by_name(".debug_info").is_none() {
+        if require_debug_info && object.section_by_name(".debug_info").is_none() {
             return Err(Error::MissingDebugInfo {
                 path: path.display().to_string(),
             });
@@ -50,298 +118,396 @@ impl DwarfInfo {
             RunTimeEndian::Big
         };
 
-        // Parse function names from symbol table first (doesn't need DWARF)
-        let functions = Self::parse_functions(&object);
-
-        // Parse line info using a helper that owns the data
-        let ranges = Self::parse_line_info_from_object(&object, endian)?;
-
-        // Parse function declarations from DWARF DIEs
-        let function_decls = Self::parse_function_decls_from_object(&object, endian)?;
+        // Record where each debug section lives so units can be decoded later
+        let sections: HashMap<&'static str, Range<usize>> = object
+            .sections()
+            .filter_map(|section| {
+                let name = section.name().ok()?;
+                let id = DEBUG_SECTIONS.iter().find(|id| id.name() == name)?;
+                let (offset, size) = section.file_range()?;
+                Some((id.name(), offset as usize..(offset + size) as usize))
+            })
+            .collect();
+
+        let build_id = object.build_id().ok().flatten();
+        let cache_path = build_id.and_then(|id| index::cache_path(id, "idx"));
+        let cached = build_id
+            .zip(cache_path.as_deref())
+            .and_then(|(id, path)| SymbolIndex::load(path, id));
+
+        let index = match cached {
+            Some(index) => index,
+            None => {
+                let sections = Sections {
+                    mmap: &mmap,
+                    sections: &sections,
+                    endian,
+                };
+                let index = SymbolIndex::build(
+                    build_id.unwrap_or_default(),
+                    &Self::parse_functions(&object),
+                    &Self::unit_ranges(&sections.dwarf()),
+                );
+                // Best effort: a read-only cache dir only costs the next attach
+                if let Some(path) = &cache_path {
+                    let _ = index.save(path);
+                }
+                index
+            }
+        };
+        drop(object);
 
         Ok(DwarfInfo {
-            ranges,
-            functions,
-            function_decls,
+            mmap,
+            endian,
+            sections,
+            index,
+            loaded: RefCell::new(LoadedUnits::default()),
         })
     }
 
-    fn parse_line_info_from_object(
-        object: &object::File<'_>,
-        endian: RunTimeEndian,
-    ) -> Result<Vec<AddressRange>> {
-        // Helper to load a section's data
-        let load_section = |name: &str| -> &[u8] {
-            object
-                .section_by_name(name)
-                .and_then(|s| s.data().ok())
-                .unwrap_or(&[])
-        };
+    /// Number of function symbols indexed
+    pub fn symbol_count(&self) -> usize {
+        self.index.symbol_count()
+    }
+
+    /// Number of compilation-unit address ranges indexed
+    pub fn unit_count(&self) -> usize {
+        self.index.unit_count()
+    }
 
-        // Load all sections we need
-        let debug_abbrev = load_section(".debug_abbrev");
-        let debug_info = load_section(".debug_info");
-        let debug_line = load_section(".debug_line");
-        let debug_str = load_section(".debug_str");
-        let debug_line_str = load_section(".debug_line_str");
-
-        // Create DWARF context
-        let dwarf = gimli::Dwarf {
-            debug_abbrev: gimli::DebugAbbrev::new(debug_abbrev, endian),
-            debug_info: gimli::DebugInfo::new(debug_info, endian),
-            debug_line: gimli::DebugLine::new(debug_line, endian),
-            debug_str: gimli::DebugStr::new(debug_str, endian),
-            debug_line_str: gimli::DebugLineStr::new(debug_line_str, endian),
-            ..Default::default()
+    /// Name of the function containing `addr`
+    pub fn function_at(&self, addr: u64) -> Option<&str> {
+        self.index.function_at(addr)
+    }
+
+    /// Source location (file, line, column) of `addr`, from its unit's line table
+    pub fn location_at(&self, addr: u64) -> Option<(String, u32, u32)> {
+        let unit = self.index.unit_at(addr)?;
+        self.load_unit(unit);
+
+        let loaded = self.loaded.borrow();
+        let ranges = loaded.ranges.get(&unit)?;
+        let idx = ranges
+            .binary_search_by(|r| {
+                if addr < r.start {
+                    std::cmp::Ordering::Greater
+                } else if addr >= r.end {
+                    std::cmp::Ordering::Less
+                } else {
+                    std::cmp::Ordering::Equal
+                }
+            })
+            .ok()?;
+        let range = ranges[idx];
+        Some((
+            loaded.files.get(range.file).to_string(),
+            range.line,
+            range.column,
+        ))
+    }
+
+    /// Declaration (file, line) of `function`, which contains `addr`
+    pub fn function_decl(&self, addr: u64, function: &str) -> Option<(String, u32)> {
+        if let Some(unit) = self.index.unit_at(addr) {
+            self.load_unit(unit);
+        }
+        let loaded = self.loaded.borrow();
+        let &(file, line) = loaded.function_decls.get(function)?;
+        Some((loaded.files.get(file).to_string(), line))
+    }
+
+    /// Declaration file of the program's `main`
+    pub fn main_decl_file(&self) -> Option<String> {
+        self.index
+            .symbols()
+            .filter(|(_, name)| *name == "main" || name.ends_with("::main"))
+            .find_map(|(addr, name)| self.function_decl(addr, name))
+            .map(|(file, _)| file)
+    }
+
+    /// Decode a unit's line table and declarations, once
+    fn load_unit(&self, offset: u64) {
+        if self.loaded.borrow().ranges.contains_key(&offset) {
+            return;
+        }
+
+        let sections = Sections {
+            mmap: &self.mmap,
+            sections: &self.sections,
+            endian: self.endian,
+        };
+        let dwarf = sections.dwarf();
+        let mut loaded = self.loaded.borrow_mut();
+        let unit = dwarf
+            .debug_info
+            .header_from_offset(gimli::DebugInfoOffset(offset as usize))
+            .and_then(|header| dwarf.unit(header));
+        let ranges = match unit {
+            Ok(unit) => {
+                Self::parse_function_decls(&dwarf, &unit, &mut loaded);
+                Self::parse_line_info(&dwarf, &unit, &mut loaded.files)
+            }
+            // Remember the failure so it isn't retried on every lookup
+            Err(_) => Vec::new(),
         };
+        loaded.ranges.insert(offset, ranges);
+    }
 
-        Self::parse_line_info(&dwarf)
+    /// Address ranges of every unit as (start, end, .debug_info offset),
+    /// sorted by start
+    ///
+    /// Taken from .debug_aranges; units it doesn't cover fall back to the
+    /// ranges on their root DIE.
+    fn unit_ranges(dwarf: &gimli::Dwarf<EndianSlice<'_, RunTimeEndian>>) -> Vec<(u64, u64, u64)> {
+        let mut ranges = Vec::new();
+        let mut covered = HashSet::new();
+
+        let mut headers = dwarf.debug_aranges.headers();
+        while let Ok(Some(header)) = headers.next() {
+            let offset = header.debug_info_offset().0 as u64;
+            let mut entries = header.entries();
+            while let Ok(Some(entry)) = entries.next() {
+                if entry.length() > 0 {
+                    ranges.push((entry.address(), entry.address() + entry.length(), offset));
+                    covered.insert(offset);
+                }
+            }
+        }
+
+        let mut units = dwarf.units();
+        while let Ok(Some(header)) = units.next() {
+            let Some(offset) = header.offset().as_debug_info_offset() else {
+                continue;
+            };
+            let offset = offset.0 as u64;
+            if covered.contains(&offset) {
+                continue;
+            }
+            let Ok(unit) = dwarf.unit(header) else {
+                continue;
+            };
+            let Ok(mut unit_ranges) = dwarf.unit_ranges(&unit) else {
+                continue;
+            };
+            while let Ok(Some(range)) = unit_ranges.next() {
+                if range.end > range.begin {
+                    ranges.push((range.begin, range.end, offset));
+                }
+            }
+        }
+
+        ranges.sort_unstable_by_key(|r| r.0);
+        ranges
     }
 
     fn parse_line_info(
         dwarf: &gimli::Dwarf<EndianSlice<'_, RunTimeEndian>>,
-    ) -> Result<Vec<AddressRange>> {
+        unit: &gimli::Unit<EndianSlice<'_, RunTimeEndian>>,
+        files: &mut FileNames,
+    ) -> Vec<AddressRange> {
         let mut ranges = Vec::new();
-        let mut units = dwarf.units();
 
-        while let Ok(Some(header)) = units.next() {
-            let unit = dwarf
-                .unit(header)
-                .map_err(|e| Error::SymbolResolution(format!("Failed to parse unit: {}", e)))?;
-
-            if let Some(program) = unit.line_program.clone() {
-                let mut rows = program.rows();
-                let mut prev_row: Option<(u64, String, u32, u32)> = None;
-
-                while let Ok(Some((header, row))) = rows.next_row() {
-                    let addr = row.address();
-
-                    // Get file path
-                    let file = row.file(header).map(|f| {
-                        let mut path = String::new();
-
-                        if let Some(dir) = f.directory(header)
-                            && let Ok(dir_str) = dwarf.attr_string(&unit, dir)
-                            && let Ok(s) = dir_str.to_string()
-                        {
-                            path.push_str(s);
-                            if !path.ends_with('/') {
-                                path.push('/');
-                            }
-                        }
+        if let Some(program) = unit.line_program.clone() {
+            let mut rows = program.rows();
+            let mut prev_row: Option<(u64, Option<u32>, u32, u32)> = None;
+            // File index in the line program -> interned file
+            let mut file_ids: HashMap<u64, Option<u32>> = HashMap::new();
 
-                        if let Ok(name) = dwarf.attr_string(&unit, f.path_name())
-                            && let Ok(s) = name.to_string()
-                        {
-                            path.push_str(s);
-                        }
+            while let Ok(Some((header, row))) = rows.next_row() {
+                let addr = row.address();
 
-                        path
-                    });
+                // Get file path
+                let file = *file_ids.entry(row.file_index()).or_insert_with(|| {
+                    let f = row.file(header)?;
+                    let mut path = String::new();
 
-                    let file = file.unwrap_or_default();
-                    let line = row.line().map(|l| l.get() as u32).unwrap_or(0);
-                    let column = match row.column() {
-                        gimli::ColumnType::LeftEdge => 0,
-                        gimli::ColumnType::Column(c) => c.get() as u32,
-                    };
-
-                    // Create range from previous row to this one
-                    if let Some((prev_addr, prev_file, prev_line, prev_col)) = prev_row.take()
-                        && addr > prev_addr
-                        && !prev_file.is_empty()
+                    if let Some(dir) = f.directory(header)
+                        && let Ok(dir_str) = dwarf.attr_string(unit, dir)
+                        && let Ok(s) = dir_str.to_string()
                     {
-                        ranges.push(AddressRange {
-                            start: prev_addr,
-                            end: addr,
-                            file: prev_file,
-                            line: prev_line,
-                            column: prev_col,
-                        });
+                        path.push_str(s);
+                        if !path.ends_with('/') {
+                            path.push('/');
+                        }
                     }
 
-                    if !row.end_sequence() {
-                        prev_row = Some((addr, file, line, column));
+                    if let Ok(name) = dwarf.attr_string(unit, f.path_name())
+                        && let Ok(s) = name.to_string()
+                    {
+                        path.push_str(s);
                     }
+
+                    (!path.is_empty()).then(|| files.intern(path))
+                });
+
+                let line = row.line().map(|l| l.get() as u32).unwrap_or(0);
+                let column = match row.column() {
+                    gimli::ColumnType::LeftEdge => 0,
+                    gimli::ColumnType::Column(c) => c.get() as u32,
+                };
+
+                // Create range from previous row to this one
+                if let Some((prev_addr, Some(prev_file), prev_line, prev_col)) = prev_row.take()
+                    && addr > prev_addr
+                {
+                    ranges.push(AddressRange {
+                        start: prev_addr,
+                        end: addr,
+                        file: prev_file,
+                        line: prev_line,
+                        column: prev_col,
+                    });
+                }
+
+                if !row.end_sequence() {
+                    prev_row = Some((addr, file, line, column));
                 }
             }
         }
 
         // Sort by start address for binary search
         ranges.sort_by_key(|r| r.start);
-        Ok(ranges)
+        ranges
     }
 
-    fn parse_functions(object: &object::File<'_>) -> HashMap<u64, String> {
+    /// Demangled text symbols sorted by address
+    ///
+    /// Dynamic symbols are included so stripped shared objects still name
+    /// their exported functions.
+    fn parse_functions(object: &object::File<'_>) -> Vec<(u64, String)> {
         use object::ObjectSymbol;
 
-        let mut functions = HashMap::new();
+        let mut functions = Vec::new();
 
-        for symbol in object.symbols() {
+        for symbol in object.symbols().chain(object.dynamic_symbols()) {
             if symbol.kind() == object::SymbolKind::Text
+                && symbol.is_definition()
                 && let Ok(name) = symbol.name()
             {
                 let demangled = rustc_demangle::demangle(name).to_string();
-                functions.insert(symbol.address(), demangled);
+                functions.push((symbol.address(), demangled));
             }
         }
 
+        functions.sort_by_key(|&(addr, _)| addr);
+        functions.dedup_by_key(|&mut (addr, _)| addr);
         functions
     }
 
-    fn parse_function_decls_from_object(
-        object: &object::File<'_>,
-        endian: RunTimeEndian,
-    ) -> Result<HashMap<String, (String, u32)>> {
-        // Helper to load a section's data
-        let load_section = |name: &str| -> &[u8] {
-            object
-                .section_by_name(name)
-                .and_then(|s| s.data().ok())
-                .unwrap_or(&[])
-        };
-
-        // Load all sections we need (same as parse_line_info_from_object)
-        let debug_abbrev = load_section(".debug_abbrev");
-        let debug_info = load_section(".debug_info");
-        let debug_line = load_section(".debug_line");
-        let debug_str = load_section(".debug_str");
-        let debug_line_str = load_section(".debug_line_str");
-
-        // Create DWARF context
-        let dwarf = gimli::Dwarf {
-            debug_abbrev: gimli::DebugAbbrev::new(debug_abbrev, endian),
-            debug_info: gimli::DebugInfo::new(debug_info, endian),
-            debug_line: gimli::DebugLine::new(debug_line, endian),
-            debug_str: gimli::DebugStr::new(debug_str, endian),
-            debug_line_str: gimli::DebugLineStr::new(debug_line_str, endian),
-            ..Default::default()
-        };
-
-        Self::parse_function_decls(&dwarf)
-    }
-
     fn parse_function_decls(
         dwarf: &gimli::Dwarf<EndianSlice<'_, RunTimeEndian>>,
-    ) -> Result<HashMap<String, (String, u32)>> {
-        let mut function_decls: HashMap<String, (String, u32)> = HashMap::new();
-        let mut units = dwarf.units();
-
-        while let Ok(Some(header)) = units.next() {
-            let unit = match dwarf.unit(header) {
-                Ok(u) => u,
-                Err(_) => continue,
-            };
-
-            // Get the compilation unit's directory for resolving relative paths
-            let comp_dir = unit
-                .comp_dir
-                .as_ref()
-                .and_then(|d| d.to_string().ok())
-                .unwrap_or_default();
-
-            // Get line program for file table (optional - we can still get function names without it)
-            let line_program = unit.line_program.clone();
-
-            let mut entries = unit.entries();
-            while let Ok(Some((_, entry))) = entries.next_dfs() {
-                // Look for DW_TAG_subprogram (function definitions)
-                if entry.tag() != gimli::DW_TAG_subprogram {
-                    continue;
-                }
+        unit: &gimli::Unit<EndianSlice<'_, RunTimeEndian>>,
+        loaded: &mut LoadedUnits,
+    ) {
+        // Get the compilation unit's directory for resolving relative paths
+        let comp_dir = unit
+            .comp_dir
+            .as_ref()
+            .and_then(|d| d.to_string().ok())
+            .unwrap_or_default();
+
+        // Get line program for file table (optional - we can still get function names without it)
+        let line_program = unit.line_program.clone();
+
+        let mut entries = unit.entries();
+        while let Ok(Some((_, entry))) = entries.next_dfs() {
+            // Look for DW_TAG_subprogram (function definitions)
+            if entry.tag() != gimli::DW_TAG_subprogram {
+                continue;
+            }
 
-                // Get function name
-                let name = entry
-                    .attr_value(gimli::DW_AT_linkage_name)
+            // Get function name
+            let name = entry
+                .attr_value(gimli::DW_AT_linkage_name)
+                .ok()
+                .flatten()
+                .or_else(|| entry.attr_value(gimli::DW_AT_name).ok().flatten());
+
+            let func_name = match name {
+                Some(gimli::AttributeValue::DebugStrRef(offset)) => dwarf
+                    .debug_str
+                    .get_str(offset)
                     .ok()
-                    .flatten()
-                    .or_else(|| entry.attr_value(gimli::DW_AT_name).ok().flatten());
-
-                let func_name = match name {
-                    Some(gimli::AttributeValue::DebugStrRef(offset)) => dwarf
-                        .debug_str
-                        .get_str(offset)
-                        .ok()
-                        .and_then(|s| s.to_string().ok()),
-                    Some(gimli::AttributeValue::String(s)) => s.to_string().ok(),
-                    _ => None,
-                };
+                    .and_then(|s| s.to_string().ok()),
+                Some(gimli::AttributeValue::String(s)) => s.to_string().ok(),
+                _ => None,
+            };
 
-                let func_name = match func_name {
-                    Some(n) => rustc_demangle::demangle(n).to_string(),
-                    None => continue,
-                };
+            let func_name = match func_name {
+                Some(n) => rustc_demangle::demangle(n).to_string(),
+                None => continue,
+            };
 
-                // Get file index from DW_AT_decl_file
-                let file_idx = match entry.attr_value(gimli::DW_AT_decl_file).ok().flatten() {
-                    Some(gimli::AttributeValue::FileIndex(idx)) => idx,
-                    Some(gimli::AttributeValue::Udata(idx)) => idx,
-                    _ => continue,
-                };
+            // Get file index from DW_AT_decl_file
+            let file_idx = match entry.attr_value(gimli::DW_AT_decl_file).ok().flatten() {
+                Some(gimli::AttributeValue::FileIndex(idx)) => idx,
+                Some(gimli::AttributeValue::Udata(idx)) => idx,
+                _ => continue,
+            };
 
-                // Get line from DW_AT_decl_line
-                let line = match entry.attr_value(gimli::DW_AT_decl_line).ok().flatten() {
-                    Some(gimli::AttributeValue::Udata(l)) => l as u32,
-                    _ => 0,
-                };
+            // Get line from DW_AT_decl_line
+            let line = match entry.attr_value(gimli::DW_AT_decl_line).ok().flatten() {
+                Some(gimli::AttributeValue::Udata(l)) => l as u32,
+                _ => 0,
+            };
 
-                // Resolve file path from line program's file table
-                let file_path = if let Some(lp) = line_program.as_ref()
-                    && file_idx > 0
-                {
-                    let header = lp.header();
-                    header.file(file_idx).and_then(|file_entry| {
-                        let mut path = String::new();
-
-                        // Get directory
-                        if let Some(dir) = file_entry.directory(header)
-                            && let Ok(dir_str) = dwarf.attr_string(&unit, dir)
-                            && let Ok(s) = dir_str.to_string()
-                        {
-                            // Handle relative paths
-                            if !s.starts_with('/') && !comp_dir.is_empty() {
-                                path.push_str(comp_dir);
-                                if !path.ends_with('/') {
-                                    path.push('/');
-                                }
-                            }
-                            path.push_str(s);
+            // Resolve file path from line program's file table
+            let file_path = if let Some(lp) = line_program.as_ref()
+                && file_idx > 0
+            {
+                let header = lp.header();
+                header.file(file_idx).and_then(|file_entry| {
+                    let mut path = String::new();
+
+                    // Get directory
+                    if let Some(dir) = file_entry.directory(header)
+                        && let Ok(dir_str) = dwarf.attr_string(unit, dir)
+                        && let Ok(s) = dir_str.to_string()
+                    {
+                        // Handle relative paths
+                        if !s.starts_with('/') && !comp_dir.is_empty() {
+                            path.push_str(comp_dir);
                             if !path.ends_with('/') {
                                 path.push('/');
                             }
                         }
-
-                        // Get filename
-                        if let Ok(name) = dwarf.attr_string(&unit, file_entry.path_name())
-                            && let Ok(s) = name.to_string()
-                        {
-                            path.push_str(s);
+                        path.push_str(s);
+                        if !path.ends_with('/') {
+                            path.push('/');
                         }
+                    }
 
-                        if path.is_empty() { None } else { Some(path) }
-                    })
-                } else {
-                    None
-                };
+                    // Get filename
+                    if let Ok(name) = dwarf.attr_string(unit, file_entry.path_name())
+                        && let Ok(s) = name.to_string()
+                    {
+                        path.push_str(s);
+                    }
 
-                if let Some(file) = file_path {
-                    // Only store if we don't already have an entry, or if this one is "more user"
-                    // (prefer non-stdlib paths)
-                    let should_insert = match function_decls.get(&func_name) {
-                        Some((existing_file, _)) => {
-                            Self::is_stdlib_path(existing_file) && !Self::is_stdlib_path(&file)
-                        }
-                        None => true,
-                    };
+                    if path.is_empty() { None } else { Some(path) }
+                })
+            } else {
+                None
+            };
 
-                    if should_insert {
-                        function_decls.insert(func_name, (file, line));
+            if let Some(file) = file_path {
+                // Only store if we don't already have an entry, or if this one is "more user"
+                // (prefer non-stdlib paths)
+                let should_insert = match loaded.function_decls.get(&func_name) {
+                    Some(&(existing_file, _)) => {
+                        Self::is_stdlib_path(loaded.files.get(existing_file))
+                            && !Self::is_stdlib_path(&file)
                     }
+                    None => true,
+                };
+
+                if should_insert {
+                    let file = loaded.files.intern(file);
+                    loaded.function_decls.insert(func_name, (file, line));
                 }
             }
         }
-
-        Ok(function_decls)
     }
 
     /// Check if a path looks like stdlib/library code
@@ -352,3 +518,26 @@ impl DwarfInfo {
             || path.starts_with("<")
     }
 }
+
+/// Debug sections of the mapped binary, for building a `gimli::Dwarf` on demand
+struct Sections<'a> {
+    mmap: &'a [u8],
+    sections: &'a HashMap<&'static str, Range<usize>>,
+    endian: RunTimeEndian,
+}
+
+impl<'a> Sections<'a> {
+    /// Borrow the sections as a `gimli::Dwarf`; this only slices the mapping
+    fn dwarf(&self) -> gimli::Dwarf<EndianSlice<'a, RunTimeEndian>> {
+        let Ok(dwarf) =
+            gimli::Dwarf::load(|id| -> std::result::Result<_, std::convert::Infallible> {
+                let data = self
+                    .sections
+                    .get(id.name())
+                    .and_then(|range| self.mmap.get(range.clone()))
+                    .unwrap_or(&[]);
+                Ok(EndianSlice::new(data, self.endian))
+            });
+        dwarf
+    }
+}
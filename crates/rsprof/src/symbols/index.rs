@@ -0,0 +1,242 @@
+//! Address index for a binary: function symbols and compilation-unit ranges.
+//!
+//! Built once per binary and cached on disk keyed by its ELF build-id. The
+//! file is fixed-size little-endian records followed by a string table, and
+//! lookups binary-search the mapped file directly, so re-attaching to a
+//! binary does no parsing or demangling.
+//!
+//! Layout:
+//! - header: magic, version, build-id, symbol/unit counts, string table size
+//! - symbols: (address u64, name offset u32, name length u32), by address
+//! - units: (start u64, end u64, .debug_info offset u64), by start
+//! - strings: demangled function names
+
+use memmap2::Mmap;
+use std::fs::File;
+use std::io::Write;
+use std::ops::Deref;
+use std::path::{Path, PathBuf};
+
+const MAGIC: &[u8; 8] = b"RSPRFSYM";
+const VERSION: u32 = 2;
+const MAX_BUILD_ID: usize = 32;
+
+const HEADER_LEN: usize = 72;
+const SYMBOL_LEN: usize = 16;
+const UNIT_LEN: usize = 24;
+
+/// Cache file bytes: mapped from disk, or freshly built
+pub(super) enum Bytes {
+    Mapped(Mmap),
+    Owned(Vec<u8>),
+}
+
+impl Deref for Bytes {
+    type Target = [u8];
+
+    fn deref(&self) -> &[u8] {
+        match self {
+            Bytes::Mapped(mmap) => mmap,
+            Bytes::Owned(bytes) => bytes,
+        }
+    }
+}
+
+/// Function symbols and compilation-unit address ranges for one binary
+pub struct SymbolIndex {
+    bytes: Bytes,
+    symbols: usize,
+    units: usize,
+}
+
+impl SymbolIndex {
+    /// Build an index from symbols and unit ranges, both sorted by address
+    pub fn build(build_id: &[u8], symbols: &[(u64, String)], units: &[(u64, u64, u64)]) -> Self {
+        let strings_len: usize = symbols.iter().map(|(_, name)| name.len()).sum();
+        let mut bytes = Vec::with_capacity(
+            HEADER_LEN + symbols.len() * SYMBOL_LEN + units.len() * UNIT_LEN + strings_len,
+        );
+
+        let build_id = &build_id[..build_id.len().min(MAX_BUILD_ID)];
+        let mut id = [0u8; MAX_BUILD_ID];
+        id[..build_id.len()].copy_from_slice(build_id);
+
+        bytes.extend_from_slice(MAGIC);
+        bytes.extend_from_slice(&VERSION.to_le_bytes());
+        bytes.extend_from_slice(&(build_id.len() as u32).to_le_bytes());
+        bytes.extend_from_slice(&id);
+        bytes.extend_from_slice(&(symbols.len() as u64).to_le_bytes());
+        bytes.extend_from_slice(&(units.len() as u64).to_le_bytes());
+        bytes.extend_from_slice(&(strings_len as u64).to_le_bytes());
+
+        let mut offset = 0u32;
+        for (addr, name) in symbols {
+            bytes.extend_from_slice(&addr.to_le_bytes());
+            bytes.extend_from_slice(&offset.to_le_bytes());
+            bytes.extend_from_slice(&(name.len() as u32).to_le_bytes());
+            offset += name.len() as u32;
+        }
+        for (start, end, unit_offset) in units {
+            bytes.extend_from_slice(&start.to_le_bytes());
+            bytes.extend_from_slice(&end.to_le_bytes());
+            bytes.extend_from_slice(&unit_offset.to_le_bytes());
+        }
+        for (_, name) in symbols {
+            bytes.extend_from_slice(name.as_bytes());
+        }
+
+        SymbolIndex {
+            bytes: Bytes::Owned(bytes),
+            symbols: symbols.len(),
+            units: units.len(),
+        }
+    }
+
+    /// Map the cached index at `path` if it was built for `build_id`
+    pub fn load(path: &Path, build_id: &[u8]) -> Option<Self> {
+        let file = File::open(path).ok()?;
+        let mmap = unsafe { Mmap::map(&file) }.ok()?;
+        Self::validate(Bytes::Mapped(mmap), build_id)
+    }
+
+    /// Write the index to `path`, replacing any older cache file atomically
+    pub fn save(&self, path: &Path) -> std::io::Result<()> {
+        write_atomic(path, &self.bytes)
+    }
+
+    fn validate(bytes: Bytes, build_id: &[u8]) -> Option<Self> {
+        if bytes.len() < HEADER_LEN || &bytes[..8] != MAGIC {
+            return None;
+        }
+        let build_id = &build_id[..build_id.len().min(MAX_BUILD_ID)];
+        let id_len = read_u32(&bytes, 12) as usize;
+        if read_u32(&bytes, 8) != VERSION
+            || id_len != build_id.len()
+            || &bytes[16..16 + id_len] != build_id
+        {
+            return None;
+        }
+
+        let symbols = read_u64(&bytes, 48) as usize;
+        let units = read_u64(&bytes, 56) as usize;
+        let strings_len = read_u64(&bytes, 64) as usize;
+        let expected = symbols
+            .checked_mul(SYMBOL_LEN)?
+            .checked_add(units.checked_mul(UNIT_LEN)?)?
+            .checked_add(strings_len)?
+            .checked_add(HEADER_LEN)?;
+        if bytes.len() != expected {
+            return None;
+        }
+
+        Some(SymbolIndex {
+            bytes,
+            symbols,
+            units,
+        })
+    }
+
+    /// Number of function symbols
+    pub fn symbol_count(&self) -> usize {
+        self.symbols
+    }
+
+    /// Number of compilation-unit address ranges
+    pub fn unit_count(&self) -> usize {
+        self.units
+    }
+
+    /// Name of the function symbol with the highest address at or below `addr`
+    pub fn function_at(&self, addr: u64) -> Option<&str> {
+        let idx = self.symbol_partition(addr).checked_sub(1)?;
+        self.symbol(idx).map(|(_, name)| name)
+    }
+
+    /// .debug_info offset of the compilation unit covering `addr`
+    pub fn unit_at(&self, addr: u64) -> Option<u64> {
+        // Last range starting at or below addr
+        let (mut lo, mut hi) = (0, self.units);
+        while lo < hi {
+            let mid = (lo + hi) / 2;
+            if self.unit(mid).0 <= addr {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        let (_, end, offset) = self.unit(lo.checked_sub(1)?);
+        (addr < end).then_some(offset)
+    }
+
+    /// All function symbols, by address
+    pub fn symbols(&self) -> impl Iterator<Item = (u64, &str)> {
+        (0..self.symbols).filter_map(|idx| self.symbol(idx))
+    }
+
+    /// Number of symbols at or below `addr`
+    fn symbol_partition(&self, addr: u64) -> usize {
+        let (mut lo, mut hi) = (0, self.symbols);
+        while lo < hi {
+            let mid = (lo + hi) / 2;
+            if read_u64(&self.bytes, HEADER_LEN + mid * SYMBOL_LEN) <= addr {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        lo
+    }
+
+    fn symbol(&self, idx: usize) -> Option<(u64, &str)> {
+        let record = HEADER_LEN + idx * SYMBOL_LEN;
+        let addr = read_u64(&self.bytes, record);
+        let offset = read_u32(&self.bytes, record + 8) as usize;
+        let len = read_u32(&self.bytes, record + 12) as usize;
+        let strings = HEADER_LEN + self.symbols * SYMBOL_LEN + self.units * UNIT_LEN;
+        let name = self.bytes.get(strings + offset..strings + offset + len)?;
+        Some((addr, std::str::from_utf8(name).ok()?))
+    }
+
+    fn unit(&self, idx: usize) -> (u64, u64, u64) {
+        let record = HEADER_LEN + self.symbols * SYMBOL_LEN + idx * UNIT_LEN;
+        (
+            read_u64(&self.bytes, record),
+            read_u64(&self.bytes, record + 8),
+            read_u64(&self.bytes, record + 16),
+        )
+    }
+}
+
+/// Cache file for a binary with this build-id, under the user's cache dir;
+/// `extension` tells the index (`idx`) from other per-binary tables
+pub fn cache_path(build_id: &[u8], extension: &str) -> Option<PathBuf> {
+    let base = std::env::var_os("XDG_CACHE_HOME")
+        .map(PathBuf::from)
+        .or_else(|| std::env::var_os("HOME").map(|home| PathBuf::from(home).join(".cache")))?;
+    let hex: String = build_id.iter().map(|b| format!("{:02x}", b)).collect();
+    Some(
+        base.join("rsprof")
+            .join("symbols")
+            .join(format!("{}.{}", hex, extension)),
+    )
+}
+
+/// Write a cache file, replacing any older one atomically
+pub(super) fn write_atomic(path: &Path, bytes: &[u8]) -> std::io::Result<()> {
+    if let Some(dir) = path.parent() {
+        std::fs::create_dir_all(dir)?;
+    }
+    let tmp = path.with_extension(format!("tmp.{}", std::process::id()));
+    let mut file = File::create(&tmp)?;
+    file.write_all(bytes)?;
+    drop(file);
+    std::fs::rename(&tmp, path)
+}
+
+pub(super) fn read_u32(bytes: &[u8], at: usize) -> u32 {
+    u32::from_le_bytes(bytes[at..at + 4].try_into().unwrap())
+}
+
+pub(super) fn read_u64(bytes: &[u8], at: usize) -> u64 {
+    u64::from_le_bytes(bytes[at..at + 8].try_into().unwrap())
+}
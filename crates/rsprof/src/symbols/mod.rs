@@ -1,4 +1,8 @@
 mod dwarf;
+mod index;
+mod modules;
 mod resolver;
+mod unwind;
 
 pub use resolver::{Location, SymbolResolver, shorten_function_name};
+pub use unwind::{UnwindRow, Unwinder, UserRegs};
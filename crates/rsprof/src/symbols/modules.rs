@@ -0,0 +1,127 @@
+//! Shared objects mapped into the target, each with lazily loaded symbols.
+//!
+//! The table is built from /proc/[pid]/maps and refreshed when an address
+//! misses every known mapping, which is how a dlopen mid-recording shows up.
+//! A refresh keeps the objects already loaded, so only new ones are parsed,
+//! and an object's symbols are read on the first address that lands in it.
+
+use super::dwarf::DwarfInfo;
+use crate::process::MemoryMaps;
+use std::cell::OnceCell;
+use std::path::{Path, PathBuf};
+use std::time::{Duration, Instant};
+
+/// Minimum time between re-reads of the target's mappings
+const REFRESH_INTERVAL: Duration = Duration::from_millis(100);
+
+/// One shared object
+struct Module {
+    path: String,
+    /// Subtract from a runtime address to get the object's virtual address
+    bias: u64,
+    /// Loaded on first use; None if the object could not be read
+    symbols: OnceCell<Option<DwarfInfo>>,
+}
+
+/// A shared object and the object-relative address to look up in it
+pub struct ModuleHit<'a> {
+    /// File name of the object, e.g. `libcrypto.so.3`
+    pub name: &'a str,
+    pub addr: u64,
+    /// None if the object has no readable symbols
+    pub symbols: Option<&'a DwarfInfo>,
+}
+
+/// Executable mappings of shared objects in the target process
+pub struct ModuleTable {
+    pid: u32,
+    exe_path: PathBuf,
+    /// Executable ranges as (start, end, module index), sorted by start;
+    /// the index is None for the main executable and anonymous code
+    ranges: Vec<(u64, u64, Option<usize>)>,
+    modules: Vec<Module>,
+    last_refresh: Option<Instant>,
+}
+
+impl ModuleTable {
+    /// Table for `pid`; mappings are read on the first lookup
+    pub fn new(pid: u32, exe_path: &Path) -> Self {
+        ModuleTable {
+            pid,
+            exe_path: exe_path.to_path_buf(),
+            ranges: Vec::new(),
+            modules: Vec::new(),
+            last_refresh: None,
+        }
+    }
+
+    /// Whether `addr` falls outside every known mapping and the mappings are
+    /// due for a re-read
+    pub fn needs_refresh(&self, addr: u64) -> bool {
+        self.range_index(addr).is_none()
+            && self
+                .last_refresh
+                .is_none_or(|at| at.elapsed() >= REFRESH_INTERVAL)
+    }
+
+    /// Re-read the target's mappings, keeping objects already loaded
+    pub fn refresh(&mut self) {
+        self.last_refresh = Some(Instant::now());
+        let Ok(maps) = MemoryMaps::for_pid(self.pid) else {
+            return;
+        };
+
+        let mut ranges = Vec::new();
+        for (mapping, bias) in maps.executable_objects(&self.exe_path) {
+            let module = bias
+                .zip(mapping.pathname.as_deref())
+                .map(|(bias, path)| self.module_index(path, bias));
+            ranges.push((mapping.start, mapping.end, module));
+        }
+        ranges.sort_by_key(|&(start, _, _)| start);
+        self.ranges = ranges;
+    }
+
+    /// The shared object containing `addr`, loading its symbols on first use
+    ///
+    /// None for addresses in the main executable or outside every mapping.
+    pub fn lookup(&self, addr: u64) -> Option<ModuleHit<'_>> {
+        let (_, _, idx) = self.ranges[self.range_index(addr)?];
+        let module = &self.modules[idx?];
+        let symbols = module
+            .symbols
+            .get_or_init(|| DwarfInfo::parse_symbols(Path::new(&module.path)).ok())
+            .as_ref();
+        let name = module.path.rsplit('/').next().unwrap_or(&module.path);
+        Some(ModuleHit {
+            name,
+            addr: addr - module.bias,
+            symbols,
+        })
+    }
+
+    /// Index of the module for `path` loaded at `bias`, adding it if new
+    fn module_index(&mut self, path: &str, bias: u64) -> usize {
+        if let Some(idx) = self
+            .modules
+            .iter()
+            .position(|m| m.bias == bias && m.path == path)
+        {
+            return idx;
+        }
+        self.modules.push(Module {
+            path: path.to_string(),
+            bias,
+            symbols: OnceCell::new(),
+        });
+        self.modules.len() - 1
+    }
+
+    fn range_index(&self, addr: u64) -> Option<usize> {
+        let idx = self
+            .ranges
+            .partition_point(|&(start, _, _)| start <= addr)
+            .checked_sub(1)?;
+        (addr < self.ranges[idx].1).then_some(idx)
+    }
+}
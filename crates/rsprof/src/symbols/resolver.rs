@@ -1,8 +1,11 @@
-use super::dwarf::{AddressRange, DwarfInfo};
+use super::dwarf::DwarfInfo;
+use super::modules::ModuleTable;
 use crate::error::Result;
 use crate::process::{MemoryMaps, ProcessInfo};
+use std::cell::RefCell;
 use std::collections::HashMap;
 use std::path::{Path, PathBuf};
+use std::rc::Rc;
 
 /// A resolved source location
 #[derive(Debug, Clone, Default)]
@@ -51,14 +54,15 @@ impl Location {
 
 /// Symbol resolver using DWARF debug info
 pub struct SymbolResolver {
-    /// DWARF address ranges (sorted by start address)
-    ranges: Vec<AddressRange>,
-    /// Function names by address
-    functions: HashMap<u64, String>,
-    /// Function declarations: function name -> (file, line)
-    function_decls: HashMap<String, (String, u32)>,
+    /// Symbols, line tables and declarations (compilation units decoded on
+    /// demand); shared by resolvers for processes running the same binary
+    dwarf: Rc<DwarfInfo>,
+    /// (device, inode) of the executable the debug info was read from
+    exe_id: Option<(u64, u64)>,
     /// ASLR offset to subtract from runtime addresses
     aslr_offset: u64,
+    /// Shared objects, loaded as samples land in them
+    modules: RefCell<ModuleTable>,
     /// LRU cache for recent lookups
     cache: HashMap<u64, Location>,
     /// Root directory for the target app's source (used to filter dependencies)
@@ -78,18 +82,44 @@ impl SymbolResolver {
         let aslr_offset = maps.aslr_offset(proc_info.exe_path())?;
 
         Ok(SymbolResolver {
-            ranges: dwarf.ranges,
-            functions: dwarf.functions,
-            function_decls: dwarf.function_decls,
+            dwarf: Rc::new(dwarf),
+            exe_id: exe_id(proc_info),
             aslr_offset,
+            modules: RefCell::new(ModuleTable::new(proc_info.pid(), proc_info.exe_path())),
             cache: HashMap::new(),
             target_root,
         })
     }
 
-    /// Number of address ranges loaded
-    pub fn range_count(&self) -> usize {
-        self.ranges.len()
+    /// Resolver for another process, reusing this one's debug info when it
+    /// runs the same executable (forked or sibling workers)
+    pub fn for_process(&self, proc_info: &ProcessInfo) -> Result<Self> {
+        // Same file, not just the same path: the binary may have been rebuilt
+        if self.exe_id.is_none() || exe_id(proc_info) != self.exe_id {
+            return Self::new(proc_info);
+        }
+
+        let maps = MemoryMaps::for_pid(proc_info.pid())?;
+        let aslr_offset = maps.aslr_offset(proc_info.exe_path())?;
+
+        Ok(SymbolResolver {
+            dwarf: Rc::clone(&self.dwarf),
+            exe_id: self.exe_id,
+            aslr_offset,
+            modules: RefCell::new(ModuleTable::new(proc_info.pid(), proc_info.exe_path())),
+            cache: HashMap::new(),
+            target_root: self.target_root.clone(),
+        })
+    }
+
+    /// Number of function symbols indexed
+    pub fn symbol_count(&self) -> usize {
+        self.dwarf.symbol_count()
+    }
+
+    /// Number of compilation-unit address ranges indexed
+    pub fn unit_count(&self) -> usize {
+        self.dwarf.unit_count()
     }
 
     /// Get the ASLR offset being used
@@ -104,72 +134,68 @@ impl SymbolResolver {
             return loc.clone();
         }
 
+        if let Some(location) = self.resolve_shared_object(addr) {
+            return location;
+        }
+
         // Adjust for ASLR
         let debug_addr = addr.saturating_sub(self.aslr_offset);
 
         // Get function name first
         let function = self.find_function(debug_addr);
 
-        // Binary search for the address range
-
-        match self.ranges.binary_search_by(|r| {
-            if debug_addr < r.start {
-                std::cmp::Ordering::Greater
-            } else if debug_addr >= r.end {
-                std::cmp::Ordering::Less
-            } else {
-                std::cmp::Ordering::Equal
-            }
-        }) {
-            Ok(idx) => {
-                let range = &self.ranges[idx];
-                let file = simplify_path(&range.file);
-                let line = range.line;
+        // Look the address up in its compilation unit's line table
+        match self.dwarf.location_at(debug_addr) {
+            Some((range_file, line, column)) => {
+                let file = simplify_path(&range_file);
 
                 // Check if line info points to stdlib but function is user code
                 // If so, try to use the function's declaration location instead
                 if is_stdlib_path(&file)
                     && !is_stdlib_function(&function)
-                    && let Some((decl_file, decl_line)) = self.function_decls.get(&function)
+                    && let Some((decl_file, decl_line)) =
+                        self.dwarf.function_decl(debug_addr, &function)
                 {
-                    if !self.is_target_path(decl_file) {
+                    if !self.is_target_path(&decl_file) {
                         return Location::unknown();
                     }
-                    let simplified_decl = simplify_path(decl_file);
+                    let simplified_decl = simplify_path(&decl_file);
                     // Only use decl location if it's a user file
                     if !is_stdlib_path(&simplified_decl) {
                         return Location {
                             file: simplified_decl,
-                            line: *decl_line,
+                            line: decl_line,
                             column: 0,
                             function,
                         };
                     }
                 }
 
-                if !self.is_target_path(&range.file) {
+                if !self.is_target_path(&range_file) {
                     return Location::unknown();
                 }
 
                 Location {
                     file,
                     line,
-                    column: range.column,
+                    column,
                     function,
                 }
             }
-            Err(_) => {
+            None => {
                 // No line info, try to use function declaration if available
                 if function != "[unknown]" {
-                    if let Some((decl_file, decl_line)) = self.function_decls.get(&function) {
-                        if !self.is_target_path(decl_file) {
+                    if let Some((decl_file, decl_line)) =
+                        self.dwarf.function_decl(debug_addr, &function)
+                    {
+                        if !self.is_target_path(&decl_file) {
                             return Location::unknown();
                         }
-                        let simplified = simplify_path(decl_file);
+                        let simplified = simplify_path(&decl_file);
                         if !is_stdlib_path(&simplified) {
                             return Location {
                                 file: simplified,
-                                line: *decl_line,
+                                line: decl_line,
                                 column: 0,
                                 function,
                             };
@@ -188,6 +214,42 @@ impl SymbolResolver {
         }
     }
 
+    /// Resolve an address inside a shared object, or None if it is in the
+    /// main executable
+    ///
+    /// Mappings are re-read when an address misses all of them, so objects
+    /// dlopen'd after attach are picked up.
+    fn resolve_shared_object(&self, addr: u64) -> Option<Location> {
+        if self.modules.borrow().needs_refresh(addr) {
+            self.modules.borrow_mut().refresh();
+        }
+        let modules = self.modules.borrow();
+        let hit = modules.lookup(addr)?;
+        let Some(function) = hit
+            .symbols
+            .and_then(|symbols| symbols.function_at(hit.addr))
+        else {
+            return Some(Location::unknown());
+        };
+        let function = function.to_string();
+
+        let location = match hit.symbols.and_then(|s| s.location_at(hit.addr)) {
+            Some((file, line, column)) => Location {
+                file: simplify_path(&file),
+                line,
+                column,
+                function,
+            },
+            None => Location {
+                file: hit.name.to_string(),
+                line: 0,
+                column: 0,
+                function,
+            },
+        };
+        Some(location)
+    }
+
     /// Resolve and cache (mutable version)
     pub fn resolve_cached(&mut self, addr: u64) -> Location {
         if let Some(loc) = self.cache.get(&addr) {
@@ -200,25 +262,10 @@ impl SymbolResolver {
     }
 
     fn find_function(&self, addr: u64) -> String {
-        // Find the function containing this address
-        // Functions are stored by their start address, so we need to find
-        // the largest start address <= addr
-        let mut best: Option<(&u64, &String)> = None;
-
-        for (func_addr, name) in &self.functions {
-            if *func_addr <= addr {
-                match best {
-                    None => best = Some((func_addr, name)),
-                    Some((best_addr, _)) if func_addr > best_addr => {
-                        best = Some((func_addr, name));
-                    }
-                    _ => {}
-                }
-            }
-        }
-
-        best.map(|(_, name)| name.clone())
-            .unwrap_or_else(|| "[unknown]".to_string())
+        // The function with the largest start address <= addr
+        self.dwarf
+            .function_at(addr)
+            .map_or_else(|| "[unknown]".to_string(), str::to_string)
     }
 
     fn is_target_path(&self, path: &str) -> bool {
@@ -237,6 +284,13 @@ impl SymbolResolver {
     }
 }
 
+/// (device, inode) of a process's executable
+fn exe_id(proc_info: &ProcessInfo) -> Option<(u64, u64)> {
+    use std::os::unix::fs::MetadataExt;
+    let meta = std::fs::metadata(proc_info.proc_exe_path()).ok()?;
+    Some((meta.dev(), meta.ino()))
+}
+
 fn detect_target_root(dwarf: &DwarfInfo, exe_path: &Path) -> Option<PathBuf> {
     if let Some(root) = root_from_main_decl(dwarf) {
         return Some(root);
@@ -245,14 +299,7 @@ fn detect_target_root(dwarf: &DwarfInfo, exe_path: &Path) -> Option<PathBuf> {
 }
 
 fn root_from_main_decl(dwarf: &DwarfInfo) -> Option<PathBuf> {
-    let main_decl = dwarf.function_decls.iter().find_map(|(name, (file, _))| {
-        if name == "main" || name.ends_with("::main") {
-            Some(file.as_str())
-        } else {
-            None
-        }
-    })?;
-    root_from_source_path(main_decl)
+    root_from_source_path(&dwarf.main_decl_file()?)
 }
 
 fn root_from_source_path(path: &str) -> Option<PathBuf> {
@@ -0,0 +1,520 @@
+//! CFI unwind tables, for stacks of code built without frame pointers.
+//!
+//! A binary's `.eh_frame` is evaluated once into rows, each giving the rules
+//! that recover the caller's frame from some address on: where the canonical
+//! frame address (CFA) is, and where the return address and saved RBP sit
+//! relative to it. Only the rules x86-64 code actually uses are kept, so a
+//! row is 16 bytes and unwinding a frame is a binary search and two loads.
+//! Like the symbol index, tables are cached on disk keyed by build-id.
+//!
+//! Layout:
+//! - header: magic, version, build-id, row count
+//! - rows: (address u64, CFA offset i32, CFA register u8, RBP slot i8,
+//!   return address slot i8, reserved u8), by address
+
+use super::index::{self, Bytes, read_u32, read_u64};
+use crate::error::{Error, Result};
+use crate::process::{MemoryMaps, ProcessInfo};
+use gimli::{CfaRule, RegisterRule, RunTimeEndian, UnwindSection, X86_64};
+use memmap2::Mmap;
+use object::{Object, ObjectSection};
+use std::cell::OnceCell;
+use std::fs::File;
+use std::path::{Path, PathBuf};
+use std::time::{Duration, Instant};
+
+const MAGIC: &[u8; 8] = b"RSPRFUNW";
+const VERSION: u32 = 1;
+const MAX_BUILD_ID: usize = 32;
+
+const HEADER_LEN: usize = 56;
+const ROW_LEN: usize = 16;
+
+/// No unwind info covers the row's addresses
+pub const CFA_NONE: u8 = 0;
+/// The CFA is RSP plus the row's offset
+pub const CFA_RSP: u8 = 1;
+/// The CFA is RBP plus the row's offset
+pub const CFA_RBP: u8 = 2;
+/// Unwinding stops here: the outermost frame, or rules a row can't express
+pub const CFA_STOP: u8 = 3;
+
+/// Deepest stack unwound, as for the kernel's callchains
+const MAX_FRAMES: usize = 64;
+
+/// Minimum time between re-reads of the target's mappings
+const REFRESH_INTERVAL: Duration = Duration::from_millis(100);
+
+/// How to recover the caller's frame, from `start` up to the next row
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct UnwindRow {
+    pub start: u64,
+    pub cfa_offset: i32,
+    /// Register the CFA is based on (`CFA_*`)
+    pub cfa: u8,
+    /// Where the caller's RBP was saved, in words from the CFA; 0 if not
+    /// saved (it is unchanged)
+    pub rbp_slot: i8,
+    /// Where the return address is, in words from the CFA
+    pub ra_slot: i8,
+}
+
+impl UnwindRow {
+    fn rule(start: u64, cfa: u8) -> Self {
+        UnwindRow {
+            start,
+            cfa_offset: 0,
+            cfa,
+            rbp_slot: 0,
+            ra_slot: 0,
+        }
+    }
+
+    fn same_rules(&self, other: &UnwindRow) -> bool {
+        (self.cfa_offset, self.cfa, self.rbp_slot, self.ra_slot)
+            == (other.cfa_offset, other.cfa, other.rbp_slot, other.ra_slot)
+    }
+}
+
+/// The unwind rows of one binary, at its virtual addresses
+pub struct UnwindTable {
+    bytes: Bytes,
+    rows: usize,
+}
+
+impl UnwindTable {
+    /// The table for the ELF file at `path`, from the cache when present
+    ///
+    /// An object without `.eh_frame`, or not x86-64, gets an empty table.
+    pub fn open(path: &Path) -> Result<Self> {
+        let file = File::open(path).map_err(Error::Io)?;
+        let mmap = unsafe { Mmap::map(&file) }.map_err(Error::Io)?;
+        let object = object::File::parse(&*mmap)
+            .map_err(|e| Error::SymbolResolution(format!("Failed to parse ELF: {}", e)))?;
+
+        let build_id = object.build_id().ok().flatten();
+        let cache_path = build_id.and_then(|id| index::cache_path(id, "unw"));
+        if let Some(table) = build_id
+            .zip(cache_path.as_deref())
+            .and_then(|(id, path)| Self::load(path, id))
+        {
+            return Ok(table);
+        }
+
+        let table = Self::build(build_id.unwrap_or_default(), &parse_rows(&object));
+        // Best effort, as for the symbol index
+        if let Some(path) = &cache_path {
+            let _ = index::write_atomic(path, &table.bytes);
+        }
+        Ok(table)
+    }
+
+    /// Build a table from rows sorted by address
+    fn build(build_id: &[u8], rows: &[UnwindRow]) -> Self {
+        let mut bytes = Vec::with_capacity(HEADER_LEN + rows.len() * ROW_LEN);
+
+        let build_id = &build_id[..build_id.len().min(MAX_BUILD_ID)];
+        let mut id = [0u8; MAX_BUILD_ID];
+        id[..build_id.len()].copy_from_slice(build_id);
+
+        bytes.extend_from_slice(MAGIC);
+        bytes.extend_from_slice(&VERSION.to_le_bytes());
+        bytes.extend_from_slice(&(build_id.len() as u32).to_le_bytes());
+        bytes.extend_from_slice(&id);
+        bytes.extend_from_slice(&(rows.len() as u64).to_le_bytes());
+
+        for row in rows {
+            bytes.extend_from_slice(&row.start.to_le_bytes());
+            bytes.extend_from_slice(&row.cfa_offset.to_le_bytes());
+            bytes.push(row.cfa);
+            bytes.push(row.rbp_slot as u8);
+            bytes.push(row.ra_slot as u8);
+            bytes.push(0);
+        }
+
+        UnwindTable {
+            bytes: Bytes::Owned(bytes),
+            rows: rows.len(),
+        }
+    }
+
+    /// Map the cached table at `path` if it was built for `build_id`
+    fn load(path: &Path, build_id: &[u8]) -> Option<Self> {
+        let file = File::open(path).ok()?;
+        let bytes = Bytes::Mapped(unsafe { Mmap::map(&file) }.ok()?);
+        if bytes.len() < HEADER_LEN || &bytes[..8] != MAGIC {
+            return None;
+        }
+        let build_id = &build_id[..build_id.len().min(MAX_BUILD_ID)];
+        let id_len = read_u32(&bytes, 12) as usize;
+        if read_u32(&bytes, 8) != VERSION
+            || id_len != build_id.len()
+            || &bytes[16..16 + id_len] != build_id
+        {
+            return None;
+        }
+        let rows = read_u64(&bytes, 48) as usize;
+        if bytes.len() != rows.checked_mul(ROW_LEN)?.checked_add(HEADER_LEN)? {
+            return None;
+        }
+        Some(UnwindTable { bytes, rows })
+    }
+
+    /// All rows, by address
+    pub fn rows(&self) -> impl Iterator<Item = UnwindRow> + '_ {
+        (0..self.rows).map(|idx| self.row(idx))
+    }
+
+    /// The rules for `addr`, if any unwind info covers it
+    pub fn row_at(&self, addr: u64) -> Option<UnwindRow> {
+        let (mut lo, mut hi) = (0, self.rows);
+        while lo < hi {
+            let mid = (lo + hi) / 2;
+            if read_u64(&self.bytes, HEADER_LEN + mid * ROW_LEN) <= addr {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        let row = self.row(lo.checked_sub(1)?);
+        (row.cfa != CFA_NONE).then_some(row)
+    }
+
+    fn row(&self, idx: usize) -> UnwindRow {
+        let record = HEADER_LEN + idx * ROW_LEN;
+        UnwindRow {
+            start: read_u64(&self.bytes, record),
+            cfa_offset: read_u32(&self.bytes, record + 8) as i32,
+            cfa: self.bytes[record + 12],
+            rbp_slot: self.bytes[record + 13] as i8,
+            ra_slot: self.bytes[record + 14] as i8,
+        }
+    }
+}
+
+/// Evaluate every FDE in `.eh_frame` into rows sorted by address, with a
+/// `CFA_NONE` row wherever no FDE covers the addresses that follow
+///
+/// FDEs that fail to parse are skipped; their addresses get no rows.
+fn parse_rows(object: &object::File<'_>) -> Vec<UnwindRow> {
+    if object.architecture() != object::Architecture::X86_64 {
+        return Vec::new();
+    }
+    let Some(section) = object.section_by_name(".eh_frame") else {
+        return Vec::new();
+    };
+    let Ok(data) = section.data() else {
+        return Vec::new();
+    };
+    let endian = if object.is_little_endian() {
+        RunTimeEndian::Little
+    } else {
+        RunTimeEndian::Big
+    };
+    let eh_frame = gimli::EhFrame::new(data, endian);
+
+    let mut bases = gimli::BaseAddresses::default().set_eh_frame(section.address());
+    if let Some(text) = object.section_by_name(".text") {
+        bases = bases.set_text(text.address());
+    }
+    if let Some(got) = object.section_by_name(".got") {
+        bases = bases.set_got(got.address());
+    }
+
+    // (start, end, rules) of every row of every FDE
+    let mut spans = Vec::new();
+    let mut ctx = gimli::UnwindContext::new();
+    let mut entries = eh_frame.entries(&bases);
+    while let Ok(Some(entry)) = entries.next() {
+        let gimli::CieOrFde::Fde(partial) = entry else {
+            continue;
+        };
+        let Ok(fde) =
+            partial.parse(|section, bases, offset| section.cie_from_offset(bases, offset))
+        else {
+            continue;
+        };
+        let Ok(mut table) = fde.rows(&eh_frame, &bases, &mut ctx) else {
+            continue;
+        };
+        while let Ok(Some(row)) = table.next_row() {
+            if row.end_address() > row.start_address() {
+                spans.push((row.start_address(), row.end_address(), encode_row(row)));
+            }
+        }
+    }
+    spans.sort_by_key(|&(start, _, _)| start);
+
+    let mut rows: Vec<UnwindRow> = Vec::with_capacity(spans.len());
+    let mut covered_to = 0;
+    for (start, end, mut row) in spans {
+        // Overlapping FDEs are malformed; keep the first
+        if start < covered_to {
+            continue;
+        }
+        if start > covered_to && !rows.is_empty() {
+            rows.push(UnwindRow::rule(covered_to, CFA_NONE));
+        }
+        row.start = start;
+        if !rows.last().is_some_and(|last| last.same_rules(&row)) {
+            rows.push(row);
+        }
+        covered_to = end;
+    }
+    if !rows.is_empty() {
+        rows.push(UnwindRow::rule(covered_to, CFA_NONE));
+    }
+    rows
+}
+
+/// Reduce a CFI row to the rules an `UnwindRow` holds, or a stop
+fn encode_row(row: &gimli::UnwindTableRow<usize>) -> UnwindRow {
+    let stop = UnwindRow::rule(0, CFA_STOP);
+    let (cfa, offset) = match *row.cfa() {
+        CfaRule::RegisterAndOffset { register, offset } if register == X86_64::RSP => {
+            (CFA_RSP, offset)
+        }
+        CfaRule::RegisterAndOffset { register, offset } if register == X86_64::RBP => {
+            (CFA_RBP, offset)
+        }
+        // Expressions, as in PLT stubs
+        _ => return stop,
+    };
+    let Ok(cfa_offset) = i32::try_from(offset) else {
+        return stop;
+    };
+    // Undefined in the outermost frame (_start, thread entry)
+    let Some(ra_slot) = slot(row.register(X86_64::RA)) else {
+        return stop;
+    };
+    let rbp_slot = match row.register(X86_64::RBP) {
+        RegisterRule::Undefined | RegisterRule::SameValue => 0,
+        rule => match slot(rule) {
+            Some(slot) => slot,
+            None => return stop,
+        },
+    };
+    UnwindRow {
+        start: 0,
+        cfa_offset,
+        cfa,
+        rbp_slot,
+        ra_slot,
+    }
+}
+
+/// The word offset from the CFA of a register saved on the stack
+fn slot(rule: RegisterRule<usize>) -> Option<i8> {
+    let RegisterRule::Offset(offset) = rule else {
+        return None;
+    };
+    if offset % 8 != 0 {
+        return None;
+    }
+    i8::try_from(offset / 8).ok().filter(|&slot| slot != 0)
+}
+
+/// Registers of a sampled thread, from which its stack is unwound
+#[derive(Debug, Clone, Copy)]
+pub struct UserRegs {
+    pub ip: u64,
+    pub sp: u64,
+    pub bp: u64,
+}
+
+/// One mapped object and its unwind table, loaded on first use
+struct UnwindObject {
+    path: PathBuf,
+    /// Subtract from a runtime address to get the object's virtual address
+    bias: u64,
+    /// None if the object could not be read
+    table: OnceCell<Option<UnwindTable>>,
+}
+
+/// Unwinds copied stacks of one process with the CFI tables of the objects
+/// it has mapped
+///
+/// Mappings are re-read when an address misses all of them, as the symbol
+/// resolver does, so objects dlopen'd mid-recording are picked up.
+pub struct Unwinder {
+    pid: u32,
+    exe_path: PathBuf,
+    /// /proc/[pid]/exe, which can be read after the binary was replaced
+    proc_exe_path: PathBuf,
+    /// Executable ranges as (start, end, object index), sorted by start
+    ranges: Vec<(u64, u64, Option<usize>)>,
+    objects: Vec<UnwindObject>,
+    last_refresh: Option<Instant>,
+}
+
+impl Unwinder {
+    /// Unwinder for a process; mappings are read on the first unwind
+    pub fn new(proc_info: &ProcessInfo) -> Self {
+        Unwinder {
+            pid: proc_info.pid(),
+            exe_path: proc_info.exe_path().clone(),
+            proc_exe_path: proc_info.proc_exe_path().clone(),
+            ranges: Vec::new(),
+            objects: Vec::new(),
+            last_refresh: None,
+        }
+    }
+
+    /// Unwind into `frames`, leaf first, from the registers at a sample and
+    /// `stack`, a copy of the thread's stack from `regs.sp` up
+    ///
+    /// Every load comes from the copy, so a bad rule only ends the walk
+    /// early. Code without unwind info (JIT, vdso) is stepped over with its
+    /// frame pointer, if it keeps one.
+    pub fn unwind(&mut self, regs: UserRegs, stack: &[u8], frames: &mut Vec<u64>) {
+        let read = |addr: u64| -> Option<u64> {
+            let offset = usize::try_from(addr.checked_sub(regs.sp)?).ok()?;
+            let bytes = stack.get(offset..offset.checked_add(8)?)?;
+            Some(u64::from_le_bytes(bytes.try_into().ok()?))
+        };
+
+        frames.clear();
+        frames.push(regs.ip);
+        let UserRegs {
+            mut ip,
+            mut sp,
+            mut bp,
+        } = regs;
+        while frames.len() < MAX_FRAMES {
+            // Past the leaf, `ip` is a return address; the call before it
+            // holds the rules
+            let pc = if frames.len() == 1 { ip } else { ip - 1 };
+            let (cfa, ra) = match self.row_at(pc) {
+                Some(row) => {
+                    let base = match row.cfa {
+                        CFA_RSP => sp,
+                        CFA_RBP => bp,
+                        _ => break,
+                    };
+                    let cfa = base.wrapping_add_signed(row.cfa_offset as i64);
+                    let Some(ra) = read(cfa.wrapping_add_signed(row.ra_slot as i64 * 8)) else {
+                        break;
+                    };
+                    if row.rbp_slot != 0 {
+                        let Some(saved) = read(cfa.wrapping_add_signed(row.rbp_slot as i64 * 8))
+                        else {
+                            break;
+                        };
+                        bp = saved;
+                    }
+                    (cfa, ra)
+                }
+                None => {
+                    let (Some(saved), Some(ra)) = (read(bp), read(bp.wrapping_add(8))) else {
+                        break;
+                    };
+                    let cfa = bp.wrapping_add(16);
+                    bp = saved;
+                    (cfa, ra)
+                }
+            };
+            // Stacks grow down, so each caller's frame is above the last
+            if cfa <= sp || ra == 0 {
+                break;
+            }
+            frames.push(ra);
+            ip = ra;
+            sp = cfa;
+        }
+    }
+
+    /// Every row of every mapped object, at its runtime address, sorted
+    ///
+    /// Re-reads the mappings first; this is the table rsprof-trace walks
+    /// stacks with in the target.
+    pub fn runtime_rows(&mut self) -> Vec<UnwindRow> {
+        self.refresh();
+        let mut mapped: Vec<usize> = self.ranges.iter().filter_map(|r| r.2).collect();
+        mapped.sort_unstable();
+        mapped.dedup();
+
+        let mut rows = Vec::new();
+        for idx in mapped {
+            let object = &self.objects[idx];
+            if let Some(table) = Self::table(object) {
+                rows.extend(table.rows().map(|row| UnwindRow {
+                    start: row.start.wrapping_add(object.bias),
+                    ..row
+                }));
+            }
+        }
+        rows.sort_by_key(|row| row.start);
+        rows
+    }
+
+    /// The rules for runtime address `addr`
+    fn row_at(&mut self, addr: u64) -> Option<UnwindRow> {
+        if self.range_index(addr).is_none()
+            && self
+                .last_refresh
+                .is_none_or(|at| at.elapsed() >= REFRESH_INTERVAL)
+        {
+            self.refresh();
+        }
+        let (_, _, idx) = self.ranges[self.range_index(addr)?];
+        let object = &self.objects[idx?];
+        Self::table(object)?.row_at(addr - object.bias)
+    }
+
+    fn table(object: &UnwindObject) -> Option<&UnwindTable> {
+        object
+            .table
+            .get_or_init(|| UnwindTable::open(&object.path).ok())
+            .as_ref()
+    }
+
+    /// Re-read the target's mappings, keeping tables already loaded
+    fn refresh(&mut self) {
+        self.last_refresh = Some(Instant::now());
+        let Ok(maps) = MemoryMaps::for_pid(self.pid) else {
+            return;
+        };
+        let exe_bias = maps.aslr_offset(&self.exe_path).unwrap_or(0);
+
+        let mut ranges = Vec::new();
+        for (mapping, bias) in maps.executable_objects(&self.exe_path) {
+            let object = match (bias, mapping.pathname.as_deref()) {
+                (Some(bias), Some(path)) => Some(self.object_index(Path::new(path), bias)),
+                // The main executable; anonymous code and [vdso] have no path
+                (None, Some(path)) if path.starts_with('/') => {
+                    let proc_exe_path = self.proc_exe_path.clone();
+                    Some(self.object_index(&proc_exe_path, exe_bias))
+                }
+                _ => None,
+            };
+            ranges.push((mapping.start, mapping.end, object));
+        }
+        ranges.sort_by_key(|&(start, _, _)| start);
+        self.ranges = ranges;
+    }
+
+    /// Index of the object at `path` loaded at `bias`, adding it if new
+    fn object_index(&mut self, path: &Path, bias: u64) -> usize {
+        if let Some(idx) = self
+            .objects
+            .iter()
+            .position(|o| o.bias == bias && o.path == path)
+        {
+            return idx;
+        }
+        self.objects.push(UnwindObject {
+            path: path.to_path_buf(),
+            bias,
+            table: OnceCell::new(),
+        });
+        self.objects.len() - 1
+    }
+
+    fn range_index(&self, addr: u64) -> Option<usize> {
+        let idx = self
+            .ranges
+            .partition_point(|&(start, _, _)| start <= addr)
+            .checked_sub(1)?;
+        (addr < self.ranges[idx].1).then_some(idx)
+    }
+}
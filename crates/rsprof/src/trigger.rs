@@ -0,0 +1,227 @@
+//! Triggers for `--trigger` capture: what marks a moment worth keeping at
+//! full resolution
+//!
+//! The recording loop polls them between samples; see `Storage::trigger`
+//! for what happens when one fires.
+
+use crate::error::{Error, Result};
+use crate::process;
+use std::io::{BufRead, BufReader, Write};
+use std::os::unix::fs::FileTypeExt;
+use std::os::unix::net::UnixListener;
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::time::{Duration, Instant};
+
+/// How often the target's CPU use is read for a `cpu:` trigger
+const CPU_POLL_INTERVAL: Duration = Duration::from_millis(500);
+
+/// How long a socket client gets to send its command
+const SOCKET_READ_TIMEOUT: Duration = Duration::from_millis(200);
+
+/// Set by the SIGUSR2 handler, cleared by `Triggers::poll`
+static SIGUSR2_RECEIVED: AtomicBool = AtomicBool::new(false);
+
+extern "C" fn on_sigusr2(_signal: libc::c_int) {
+    SIGUSR2_RECEIVED.store(true, Ordering::Relaxed);
+}
+
+/// One `--trigger` source
+#[derive(Debug, Clone, PartialEq)]
+pub enum TriggerSpec {
+    /// SIGUSR2 sent to rsprof
+    Signal,
+    /// The target's CPU use rising to this many percent of one core
+    Cpu(f64),
+    /// A `trigger [reason]` line on a unix socket at this path
+    Socket(PathBuf),
+}
+
+impl TriggerSpec {
+    /// Parse `signal`, `cpu:PERCENT` or `socket:PATH`
+    pub fn parse(spec: &str) -> Result<Self> {
+        if spec == "signal" {
+            return Ok(TriggerSpec::Signal);
+        }
+        if let Some(percent) = spec.strip_prefix("cpu:") {
+            return match percent.trim_end_matches('%').parse::<f64>() {
+                Ok(percent) if percent > 0.0 => Ok(TriggerSpec::Cpu(percent)),
+                _ => Err(Error::InvalidArgument(format!(
+                    "invalid CPU trigger '{}': expected cpu:PERCENT, e.g. cpu:80",
+                    spec
+                ))),
+            };
+        }
+        if let Some(path) = spec.strip_prefix("socket:")
+            && !path.is_empty()
+        {
+            return Ok(TriggerSpec::Socket(PathBuf::from(path)));
+        }
+        Err(Error::InvalidArgument(format!(
+            "invalid trigger '{}': expected signal, cpu:PERCENT or socket:PATH",
+            spec
+        )))
+    }
+}
+
+/// `cpu:` trigger state: fires on crossing the threshold, re-arms below it
+struct CpuTrigger {
+    pid: u32,
+    threshold: f64,
+    /// CPU time used as of the last reading, and when it was taken
+    last: Option<(Instant, Duration)>,
+    /// Whether the last reading was at or over the threshold
+    above: bool,
+}
+
+impl CpuTrigger {
+    fn poll(&mut self) -> Option<String> {
+        if self
+            .last
+            .is_some_and(|(at, _)| at.elapsed() < CPU_POLL_INTERVAL)
+        {
+            return None;
+        }
+        let now = Instant::now();
+        let used = process::cpu_time(self.pid)?;
+        // The first reading only sets the baseline
+        let (then, used_then) = self.last.replace((now, used))?;
+        let wall = now.duration_since(then).as_secs_f64();
+        let percent = used.saturating_sub(used_then).as_secs_f64() * 100.0 / wall;
+
+        let was_above = std::mem::replace(&mut self.above, percent >= self.threshold);
+        (self.above && !was_above).then(|| format!("cpu {:.0}%", percent))
+    }
+}
+
+/// `socket:` trigger: a listening socket, removed again on drop
+struct SocketTrigger {
+    listener: UnixListener,
+    path: PathBuf,
+}
+
+impl SocketTrigger {
+    /// Listen at `path`, replacing a stale socket left by an earlier run
+    fn bind(path: &Path) -> Result<Self> {
+        if std::fs::symlink_metadata(path).is_ok_and(|m| m.file_type().is_socket()) {
+            std::fs::remove_file(path)?;
+        }
+        let listener = UnixListener::bind(path)?;
+        listener.set_nonblocking(true)?;
+        Ok(SocketTrigger {
+            listener,
+            path: path.to_path_buf(),
+        })
+    }
+
+    /// Serve pending connections; the reason of the first `trigger` command
+    fn poll(&mut self) -> Option<String> {
+        let mut fired = None;
+        loop {
+            let mut stream = match self.listener.accept() {
+                Ok((stream, _)) => stream,
+                // WouldBlock once no client is waiting
+                Err(_) => break,
+            };
+            // One command per connection; a slow client only costs the timeout
+            if stream.set_nonblocking(false).is_err()
+                || stream.set_read_timeout(Some(SOCKET_READ_TIMEOUT)).is_err()
+            {
+                continue;
+            }
+            let mut line = String::new();
+            if BufReader::new(&stream).read_line(&mut line).is_err() {
+                continue;
+            }
+            let mut words = line.split_whitespace();
+            let reply = if words.next() == Some("trigger") {
+                let reason: Vec<&str> = words.collect();
+                let reason = if reason.is_empty() {
+                    "socket".to_string()
+                } else {
+                    reason.join(" ")
+                };
+                fired.get_or_insert(reason);
+                "ok\n"
+            } else {
+                "error: expected 'trigger [reason]'\n"
+            };
+            let _ = stream.write_all(reply.as_bytes());
+        }
+        fired
+    }
+}
+
+impl Drop for SocketTrigger {
+    fn drop(&mut self) {
+        let _ = std::fs::remove_file(&self.path);
+    }
+}
+
+/// The triggers of one recording
+pub struct Triggers {
+    signal: bool,
+    cpu: Vec<CpuTrigger>,
+    sockets: Vec<SocketTrigger>,
+}
+
+impl Triggers {
+    /// Set up `specs`; `cpu:` triggers watch `pid`
+    pub fn new(specs: &[TriggerSpec], pid: u32) -> Result<Self> {
+        let mut triggers = Triggers {
+            signal: false,
+            cpu: Vec::new(),
+            sockets: Vec::new(),
+        };
+        for spec in specs {
+            match spec {
+                TriggerSpec::Signal => {
+                    if !triggers.signal {
+                        install_sigusr2_handler()?;
+                        triggers.signal = true;
+                    }
+                }
+                TriggerSpec::Cpu(threshold) => triggers.cpu.push(CpuTrigger {
+                    pid,
+                    threshold: *threshold,
+                    last: None,
+                    above: false,
+                }),
+                TriggerSpec::Socket(path) => triggers.sockets.push(SocketTrigger::bind(path)?),
+            }
+        }
+        Ok(triggers)
+    }
+
+    /// Why a trigger fired since the last poll, if one did
+    pub fn poll(&mut self) -> Option<String> {
+        let mut fired = None;
+        if self.signal && SIGUSR2_RECEIVED.swap(false, Ordering::Relaxed) {
+            fired = Some("SIGUSR2".to_string());
+        }
+        for cpu in &mut self.cpu {
+            if let Some(reason) = cpu.poll() {
+                fired.get_or_insert(reason);
+            }
+        }
+        for socket in &mut self.sockets {
+            if let Some(reason) = socket.poll() {
+                fired.get_or_insert(reason);
+            }
+        }
+        fired
+    }
+}
+
+fn install_sigusr2_handler() -> Result<()> {
+    unsafe {
+        let mut sa: libc::sigaction = std::mem::zeroed();
+        sa.sa_sigaction = on_sigusr2 as *const () as usize;
+        sa.sa_flags = libc::SA_RESTART;
+        libc::sigemptyset(&mut sa.sa_mask);
+        if libc::sigaction(libc::SIGUSR2, &sa, std::ptr::null_mut()) < 0 {
+            return Err(Error::Io(std::io::Error::last_os_error()));
+        }
+    }
+    Ok(())
+}
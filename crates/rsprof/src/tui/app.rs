@@ -1,7 +1,11 @@
-use crate::cpu::CpuSampler;
+use super::live::LiveHistory;
+use crate::cpu::{CpuSampler, PmuCounters};
 use crate::error::Result;
-use crate::heap::ShmHeapSampler;
-use crate::storage::{CpuEntry, HeapEntry, Storage, query_cpu_timeseries_aggregated};
+use crate::heap::{HeapHistogram, ShmTargets, callsite_key};
+use crate::storage::{
+    Archive, ChurnEntry, CpuEntry, HeapEntry, OffCpuEntry, ProfilerStats, Storage,
+    query_cpu_timeseries_aggregated, rank_churn,
+};
 use crate::symbols::SymbolResolver;
 use crossterm::{
     event::{
@@ -18,6 +22,20 @@ use std::io::{self, stdout};
 use std::path::Path;
 use std::time::{Duration, Instant};
 
+/// What the static viewer loads up front, from a database or an archive
+struct StaticProfile {
+    total_samples: u64,
+    duration_ms: i64,
+    lost_samples: u64,
+    dropped_events: u64,
+    entries: Vec<CpuEntry>,
+    heap_entries: Vec<HeapEntry>,
+    offcpu_entries: Vec<OffCpuEntry>,
+    pmu_totals: HashMap<i64, PmuCounters>,
+    churn_entries: Vec<ChurnEntry>,
+    heap_sparklines: HashMap<i64, Vec<i64>>,
+}
+
 /// Cache for chart data with prefetch window
 #[derive(Default)]
 struct ChartDataCache {
@@ -288,12 +306,16 @@ impl TableSort {
     }
 }
 
-/// View mode for switching between CPU and Memory views
+/// View mode for switching between CPU, Memory, Off-CPU and Churn views
 #[derive(Clone, Copy, PartialEq, Default)]
 pub enum ViewMode {
     #[default]
     Cpu,
     Memory,
+    /// Time blocked, recorded with --off-cpu
+    OffCpu,
+    /// Heap sites allocating fast and freeing soon, from the SHM histograms
+    Churn,
 }
 
 /// Fixed zoom levels with corresponding aggregation bucket sizes
@@ -472,17 +494,26 @@ impl ChartState {
 pub struct App {
     // Live mode components (None in static/view mode)
     sampler: Option<CpuSampler>,
-    shm_heap_sampler: Option<ShmHeapSampler>,
+    offcpu_sampler: Option<CpuSampler>,
+    /// rsprof-trace processes; None if no target used rsprof-trace at start
+    shm_targets: Option<ShmTargets>,
     resolver: Option<SymbolResolver>,
     storage: Option<Storage>,
-    // Static mode: read-only DB connection
+    // Static mode: read-only DB connection, or a compacted archive
     conn: Option<Connection>,
+    archive: Option<Archive>,
 
     checkpoint_interval: Duration,
     max_duration: Option<Duration>,
     start_time: Instant,
     last_checkpoint: Instant,
     total_samples: u64,
+    /// Samples dropped by the kernel (perf ring overflow)
+    lost_samples: u64,
+    /// Events rsprof-trace dropped on full tables
+    dropped_events: u64,
+    /// rsprof's own cost, as of the last checkpoint
+    profiler_stats: ProfilerStats,
     running: bool,
     paused: bool,
     paused_elapsed: Option<Duration>,
@@ -495,20 +526,35 @@ pub struct App {
     scroll_offset: usize,
     selected_location_id: Option<i64>,
     selected_heap_location_id: Option<i64>,
+    selected_offcpu_location_id: Option<i64>,
+    selected_churn_location_id: Option<i64>,
     selected_func_name: Option<String>,
     cpu_sort: TableSort,
     heap_sort: TableSort,
+    offcpu_sort: TableSort,
+    churn_sort: TableSort,
     func_history: Vec<(f64, f64)>,
     last_history_tick: Instant,
     live_cpu_totals: HashMap<i64, u64>,
     live_cpu_instant: HashMap<i64, u64>,
     location_info: HashMap<i64, LocationInfo>,
+    /// Checkpoint each CPU table row was last refreshed at, by location
     cpu_last_seen: HashMap<i64, u64>,
+    /// Recent checkpoints, for charts of a live recording
+    history: LiveHistory,
     heap_live_entries: HashMap<i64, HeapEntry>,
     heap_last_seen: HashMap<i64, u64>,
+    /// Size and lifetime histograms per location, for the churn view
+    heap_live_histograms: HashMap<i64, HeapHistogram>,
+    /// Nanoseconds blocked per location
+    live_offcpu_totals: HashMap<i64, u64>,
+    /// Hardware counter totals per location (with --pmu)
+    pmu_totals: HashMap<i64, PmuCounters>,
     chart_checkpoint_seq: u64,
     cached_entries: Vec<CpuEntry>,
     cached_heap_entries: Vec<HeapEntry>,
+    cached_offcpu_entries: Vec<OffCpuEntry>,
+    cached_churn_entries: Vec<ChurnEntry>,
     cached_cpu_sparklines: HashMap<i64, VecDeque<i64>>,
     cached_heap_sparklines: HashMap<i64, VecDeque<i64>>,
     table_area: Rect,
@@ -537,7 +583,8 @@ impl App {
     #[allow(clippy::too_many_arguments)]
     pub fn new(
         perf_sampler: Option<CpuSampler>,
-        shm_sampler: Option<ShmHeapSampler>,
+        offcpu_sampler: Option<CpuSampler>,
+        shm_targets: ShmTargets,
         resolver: SymbolResolver,
         storage: Storage,
         checkpoint_interval: Duration,
@@ -552,13 +599,23 @@ impl App {
         }
 
         // Pre-load existing data when appending
-        let (cached_entries, cached_heap_entries, total_samples) = if time_offset_secs > 0.0 {
-            let cpu_entries = storage.query_top_cpu_live(1000);
-            let heap_entries = storage.query_top_heap_live(100);
-            let samples = storage.total_samples().unwrap_or(0);
-            (cpu_entries, heap_entries, samples)
+        let (cached_entries, cached_heap_entries, cached_offcpu_entries, total_samples) =
+            if time_offset_secs > 0.0 {
+                let cpu_entries = storage.query_top_cpu_live(1000);
+                let heap_entries = storage.query_top_heap_live(100);
+                let offcpu_entries = storage.query_top_offcpu(1000);
+                let samples = storage.total_samples().unwrap_or(0);
+                (cpu_entries, heap_entries, offcpu_entries, samples)
+            } else {
+                (Vec::new(), Vec::new(), Vec::new(), 0)
+            };
+
+        let lost_samples = storage.lost_samples();
+        let dropped_events = storage.dropped_events();
+        let pmu_totals = if time_offset_secs > 0.0 {
+            storage.query_pmu_totals()
         } else {
-            (Vec::new(), Vec::new(), 0)
+            HashMap::new()
         };
 
         // Build location_info and live_cpu_totals from pre-loaded entries
@@ -575,6 +632,19 @@ impl App {
             );
             live_cpu_totals.insert(entry.location_id, entry.total_samples);
         }
+        let mut live_offcpu_totals = HashMap::new();
+        for entry in &cached_offcpu_entries {
+            location_info
+                .entry(entry.location_id)
+                .or_insert_with(|| LocationInfo {
+                    file: entry.file.clone(),
+                    line: entry.line,
+                    function: entry.function.clone(),
+                });
+            live_offcpu_totals.insert(entry.location_id, entry.blocked_ns);
+        }
+
+        let cpu_last_seen = cached_entries.iter().map(|e| (e.location_id, 0)).collect();
 
         // Build heap_live_entries from pre-loaded entries
         let mut heap_live_entries = HashMap::new();
@@ -584,15 +654,20 @@ impl App {
 
         App {
             sampler: perf_sampler,
-            shm_heap_sampler: shm_sampler,
+            offcpu_sampler,
+            shm_targets: (!shm_targets.is_empty()).then_some(shm_targets),
             resolver: Some(resolver),
             storage: Some(storage),
             conn: None,
+            archive: None,
             checkpoint_interval,
             max_duration,
             start_time: Instant::now(),
             last_checkpoint: Instant::now(),
             total_samples,
+            lost_samples,
+            dropped_events,
+            profiler_stats: ProfilerStats::default(),
             running: true,
             paused: false,
             paused_elapsed: None,
@@ -603,20 +678,30 @@ impl App {
             scroll_offset: 0,
             selected_location_id: None,
             selected_heap_location_id: None,
+            selected_offcpu_location_id: None,
+            selected_churn_location_id: None,
             selected_func_name: None,
             cpu_sort: TableSort::default_cpu(),
             heap_sort: TableSort::default_heap(),
+            offcpu_sort: TableSort::default_cpu(),
+            churn_sort: TableSort::default_cpu(),
             func_history: Vec::new(),
             last_history_tick: Instant::now(),
             live_cpu_totals,
             live_cpu_instant: HashMap::new(),
             location_info,
-            cpu_last_seen: HashMap::new(),
+            cpu_last_seen,
+            history: LiveHistory::new((time_offset_secs * 1000.0).round() as i64),
             heap_live_entries,
             heap_last_seen: HashMap::new(),
+            heap_live_histograms: HashMap::new(),
+            live_offcpu_totals,
+            pmu_totals,
             chart_checkpoint_seq: 0,
             cached_entries,
             cached_heap_entries,
+            cached_offcpu_entries,
+            cached_churn_entries: Vec::new(),
             cached_cpu_sparklines: HashMap::new(),
             cached_heap_sparklines: HashMap::new(),
             table_area: Rect::default(),
@@ -635,16 +720,33 @@ impl App {
 
     /// Create a static viewer app from a profile database
     pub fn from_file(path: &Path) -> Result<Self> {
+        // Compacted archives carry the same views, read from their index
+        if crate::storage::is_archive(path) {
+            let archive = Archive::open(path)?;
+            let heap_entries = archive.top_heap(None, 100);
+            let heap_location_ids: Vec<i64> = heap_entries.iter().map(|e| e.location_id).collect();
+            let profile = StaticProfile {
+                total_samples: archive.total_samples(),
+                duration_ms: archive.duration_ms().unwrap_or(0),
+                lost_samples: archive.lost_samples(),
+                dropped_events: archive.dropped_events(),
+                entries: archive.top_cpu(None, 1000, 0.0),
+                offcpu_entries: archive.top_offcpu(None, 1000, 0.0),
+                pmu_totals: archive.pmu(None),
+                churn_entries: archive.top_churn(1000),
+                heap_sparklines: archive.heap_sparklines(12, &heap_location_ids),
+                heap_entries,
+            };
+            return Ok(Self::from_static(path, None, Some(archive), profile));
+        }
+
         let conn = Connection::open(path)?;
 
+        // Older profiles get their running-total tables built once, here
+        crate::storage::upgrade_schema(&conn)?;
+
         // Load metadata
-        let total_samples: i64 = conn
-            .query_row(
-                "SELECT COALESCE(SUM(count), 0) FROM cpu_samples",
-                [],
-                |row| row.get(0),
-            )
-            .unwrap_or(0);
+        let total_samples = crate::storage::query_total_samples(&conn).unwrap_or(0);
 
         let duration_ms: i64 = conn
             .query_row(
@@ -654,16 +756,39 @@ impl App {
             )
             .unwrap_or(0);
 
-        let duration_secs = duration_ms as f64 / 1000.0;
-
         // Load all entries
-        let entries = crate::storage::query_top_cpu(&conn, 1000, 0.0)?;
         let heap_entries = crate::storage::query_top_heap_live(&conn, 100).unwrap_or_default();
-        // For static mode, initialize sparklines from DB and convert to VecDeque
         let heap_location_ids: Vec<i64> = heap_entries.iter().map(|e| e.location_id).collect();
-        let heap_sparklines_vec =
-            crate::storage::query_heap_sparklines_for_locations(&conn, 12, &heap_location_ids);
-        let heap_sparklines: HashMap<i64, VecDeque<i64>> = heap_sparklines_vec
+        let profile = StaticProfile {
+            total_samples: total_samples as u64,
+            duration_ms,
+            lost_samples: crate::storage::query_lost_samples(&conn),
+            dropped_events: crate::storage::query_dropped_events(&conn),
+            entries: crate::storage::query_top_cpu(&conn, 1000, 0.0)?,
+            offcpu_entries: crate::storage::query_top_offcpu(&conn, 1000, 0.0).unwrap_or_default(),
+            pmu_totals: crate::storage::query_pmu_totals(&conn).unwrap_or_default(),
+            churn_entries: crate::storage::query_top_churn(&conn, 1000).unwrap_or_default(),
+            // For static mode, initialize sparklines from DB
+            heap_sparklines: crate::storage::query_heap_sparklines_for_locations(
+                &conn,
+                12,
+                &heap_location_ids,
+            ),
+            heap_entries,
+        };
+        Ok(Self::from_static(path, Some(conn), None, profile))
+    }
+
+    /// Static viewer over a database or an archive, with its views loaded
+    fn from_static(
+        path: &Path,
+        conn: Option<Connection>,
+        archive: Option<Archive>,
+        profile: StaticProfile,
+    ) -> Self {
+        let duration_secs = profile.duration_ms as f64 / 1000.0;
+        let heap_sparklines: HashMap<i64, VecDeque<i64>> = profile
+            .heap_sparklines
             .into_iter()
             .map(|(k, v)| (k, VecDeque::from(v)))
             .collect();
@@ -672,15 +797,20 @@ impl App {
 
         let mut app = App {
             sampler: None,
-            shm_heap_sampler: None,
+            offcpu_sampler: None,
+            shm_targets: None,
             resolver: None,
             storage: None,
-            conn: Some(conn),
+            conn,
+            archive,
             checkpoint_interval: Duration::from_secs(1),
             max_duration: None,
             start_time: Instant::now(),
             last_checkpoint: Instant::now(),
-            total_samples: total_samples as u64,
+            total_samples: profile.total_samples,
+            lost_samples: profile.lost_samples,
+            dropped_events: profile.dropped_events,
+            profiler_stats: ProfilerStats::default(),
             running: true,
             paused: true, // Static mode is always "paused"
             paused_elapsed: None,
@@ -691,20 +821,30 @@ impl App {
             scroll_offset: 0,
             selected_location_id: None,
             selected_heap_location_id: None,
+            selected_offcpu_location_id: None,
+            selected_churn_location_id: None,
             selected_func_name: None,
             cpu_sort: TableSort::default_cpu(),
             heap_sort: TableSort::default_heap(),
+            offcpu_sort: TableSort::default_cpu(),
+            churn_sort: TableSort::default_cpu(),
             func_history: Vec::new(),
             last_history_tick: Instant::now(),
             live_cpu_totals: HashMap::new(),
             live_cpu_instant: HashMap::new(),
             location_info: HashMap::new(),
             cpu_last_seen: HashMap::new(),
+            history: LiveHistory::new(0),
             heap_live_entries: HashMap::new(),
             heap_last_seen: HashMap::new(),
+            heap_live_histograms: HashMap::new(),
+            live_offcpu_totals: HashMap::new(),
+            pmu_totals: profile.pmu_totals,
             chart_checkpoint_seq: 0,
-            cached_entries: entries,
-            cached_heap_entries: heap_entries,
+            cached_entries: profile.entries,
+            cached_heap_entries: profile.heap_entries,
+            cached_offcpu_entries: profile.offcpu_entries,
+            cached_churn_entries: profile.churn_entries,
             cached_cpu_sparklines: HashMap::new(),
             cached_heap_sparklines: heap_sparklines,
             table_area: Rect::default(),
@@ -729,12 +869,12 @@ impl App {
             app.load_timeseries_static(loc_id, &func_name);
         }
 
-        Ok(app)
+        app
     }
 
     /// Check if this is a static/view mode app
     pub fn is_static(&self) -> bool {
-        self.conn.is_some()
+        self.conn.is_some() || self.archive.is_some()
     }
 
     /// Get file name for static mode
@@ -744,7 +884,12 @@ impl App {
 
     /// Check if heap profiling is active
     pub fn has_heap_profiling(&self) -> bool {
-        self.shm_heap_sampler.is_some()
+        self.shm_targets.is_some()
+    }
+
+    /// rsprof-trace processes being recorded
+    pub fn process_count(&self) -> usize {
+        self.shm_targets.as_ref().map_or(0, ShmTargets::len)
     }
 
     pub fn run(&mut self) -> Result<()> {
@@ -844,73 +989,186 @@ impl App {
             if !self.is_static() && !self.paused {
                 let mut did_checkpoint = false;
                 let mut heap_entries_map: HashMap<i64, HeapEntry> = HashMap::new();
+                let mut heap_histograms_map: HashMap<i64, HeapHistogram> = HashMap::new();
 
-                // Prefer rsprof-trace SHM sampler (provides both CPU and heap)
-                if let Some(shm) = self.shm_heap_sampler.as_mut() {
-                    if let (Some(resolver), Some(storage)) =
-                        (self.resolver.as_ref(), self.storage.as_mut())
-                    {
-                        let _events = shm.poll_events(std::time::Duration::from_millis(1));
-
-                        // Process CPU samples from rsprof-trace (aggregated stats)
-                        let cpu_stats = shm.read_cpu_stats();
-                        let live_cpu_totals = &mut self.live_cpu_totals;
-                        let live_cpu_instant = &mut self.live_cpu_instant;
-                        let location_info = &mut self.location_info;
-                        for (_hash, (count, stack)) in cpu_stats {
+                // Off-CPU sampling runs alongside either CPU source
+                if let (Some(offcpu), Some(resolver), Some(storage)) = (
+                    self.offcpu_sampler.as_mut(),
+                    self.resolver.as_ref(),
+                    self.storage.as_mut(),
+                ) {
+                    offcpu.poll(Duration::ZERO)?;
+                    if self.last_checkpoint.elapsed() >= self.checkpoint_interval {
+                        offcpu.drain_all();
+                    }
+
+                    let include_internal = self.include_internal;
+                    for (blocked_ns, _tid, hash, stack) in offcpu.take_samples() {
+                        let location_id = storage.offcpu_location_id(hash, stack, || {
+                            attribute_blocked_stack(stack, resolver, include_internal)
+                        });
+                        if let Some(location_id) = location_id {
+                            storage.record_offcpu_at(location_id, blocked_ns);
+                            *self.live_offcpu_totals.entry(location_id).or_insert(0) += blocked_ns;
+                            note_location(&mut self.location_info, storage, location_id);
+                        }
+                    }
+
+                    let lost = offcpu.take_lost_samples();
+                    self.lost_samples += lost;
+                    storage.record_lost_samples(lost);
+                }
+
+                // Perf-based CPU sampling when there is no rsprof-trace; with
+                // --pmu it runs alongside it for the hardware counters only
+                if let (Some(sampler), Some(resolver), Some(storage)) = (
+                    self.sampler.as_mut(),
+                    self.resolver.as_ref(),
+                    self.storage.as_mut(),
+                ) {
+                    // Input polling paces this loop, so never block here
+                    sampler.poll(Duration::ZERO)?;
+                    let checkpoint_due = self.last_checkpoint.elapsed() >= self.checkpoint_interval;
+                    if checkpoint_due {
+                        sampler.drain_all();
+                    }
+
+                    let record_cpu = self.shm_targets.is_none();
+                    let live_cpu_totals = &mut self.live_cpu_totals;
+                    let live_cpu_instant = &mut self.live_cpu_instant;
+                    let location_info = &mut self.location_info;
+                    let include_internal = self.include_internal;
+                    let pid = sampler.pid();
+                    for (count, tid, hash, stack) in sampler.take_samples() {
+                        if !record_cpu {
+                            continue;
+                        }
+                        self.total_samples += count;
+                        let location_id = storage.callsite_location_id(hash, stack, || {
+                            attribute_stack(stack, resolver, include_internal)
+                        });
+                        if let Some(location_id) = location_id {
+                            storage.record_cpu_samples_at(location_id, count, pid, tid);
+                            *live_cpu_totals.entry(location_id).or_insert(0) += count;
+                            *live_cpu_instant.entry(location_id).or_insert(0) += count;
+                            note_location(location_info, storage, location_id);
+                        }
+                        let stack_id = storage.callsite_stack_id(hash, stack, || {
+                            stack_frames(stack, resolver, include_internal)
+                        });
+                        if let Some(stack_id) = stack_id {
+                            storage.record_stack_samples_at(stack_id, count);
+                        }
+                    }
+
+                    for (counters, hash, stack) in sampler.take_counters() {
+                        let location_id = storage.callsite_location_id(hash, stack, || {
+                            attribute_stack(stack, resolver, include_internal)
+                        });
+                        if let Some(location_id) = location_id {
+                            storage.record_pmu_at(location_id, &counters);
+                            self.pmu_totals
+                                .entry(location_id)
+                                .or_default()
+                                .add(&counters);
+                        }
+                    }
+
+                    let lost = sampler.take_lost_samples();
+                    self.lost_samples += lost;
+                    storage.record_lost_samples(lost);
+
+                    // Otherwise the SHM checkpoint below flushes
+                    if checkpoint_due && record_cpu {
+                        storage.record_checkpoint_lag(
+                            self.last_checkpoint
+                                .elapsed()
+                                .saturating_sub(self.checkpoint_interval),
+                        );
+                        storage.flush_checkpoint()?;
+                        did_checkpoint = true;
+                    }
+                }
+
+                // Prefer rsprof-trace SHM samplers (provide both CPU and heap)
+                if let Some(targets) = self.shm_targets.as_mut()
+                    && let Some(storage) = self.storage.as_mut()
+                {
+                    // Process CPU samples from rsprof-trace (aggregated stats)
+                    let live_cpu_totals = &mut self.live_cpu_totals;
+                    let live_cpu_instant = &mut self.live_cpu_instant;
+                    let location_info = &mut self.location_info;
+                    let include_internal = self.include_internal;
+                    for target in targets.iter_mut() {
+                        let pid = target.pid();
+                        let resolver = &target.resolver;
+                        let scan_start = Instant::now();
+                        let cpu_stats = target.sampler.read_cpu_stats();
+                        storage.record_shm_scan(scan_start.elapsed());
+                        for (count, tid, slot, stack) in cpu_stats {
                             self.total_samples += count;
-                            let location = if self.include_internal {
-                                resolve_internal_stack(&stack, resolver)
-                            } else {
-                                // Walk the stack to find the first user frame (skip allocator/profiler internals)
-                                find_user_frame(&stack, resolver)
-                            };
-                            if self.include_internal || !is_internal_location(&location) {
-                                let location_id = storage.record_cpu_sample_count(
-                                    stack.first().copied().unwrap_or(0),
-                                    &location,
-                                    count,
-                                );
+                            let callsite = callsite_key(pid, slot);
+                            let location_id = storage.callsite_location_id(callsite, stack, || {
+                                attribute_stack(stack, resolver, include_internal)
+                            });
+                            if let Some(location_id) = location_id {
+                                storage.record_cpu_samples_at(location_id, count, pid, tid);
                                 *live_cpu_totals.entry(location_id).or_insert(0) += count;
                                 *live_cpu_instant.entry(location_id).or_insert(0) += count;
-                                location_info
-                                    .entry(location_id)
-                                    .or_insert_with(|| LocationInfo {
-                                        file: location.file,
-                                        line: location.line,
-                                        function: location.function,
-                                    });
+                                note_location(location_info, storage, location_id);
+                            }
+                            let stack_id = storage.callsite_stack_id(callsite, stack, || {
+                                stack_frames(stack, resolver, include_internal)
+                            });
+                            if let Some(stack_id) = stack_id {
+                                storage.record_stack_samples_at(stack_id, count);
                             }
                         }
+                    }
 
-                        // Checkpoint - record heap stats and flush
-                        if self.last_checkpoint.elapsed() >= self.checkpoint_interval {
-                            // Record heap stats from rsprof-trace (once per checkpoint)
-                            let heap_stats = shm.read_stats();
-                            let inline_stacks = shm.read_inline_stacks();
-                            for (key_addr, stats) in heap_stats {
-                                let location = if let Some(stack) = inline_stacks.get(&key_addr) {
-                                    if self.include_internal {
-                                        resolve_internal_stack(stack, resolver)
-                                    } else {
-                                        find_user_frame(stack, resolver)
-                                    }
-                                } else if self.include_internal {
-                                    crate::symbols::Location::unknown()
-                                } else {
-                                    resolver.resolve(key_addr)
-                                };
-                                if self.include_internal || !is_internal_location(&location) {
-                                    let location_id = storage.record_heap_sample(
-                                        &location,
+                    // Checkpoint - record heap stats and flush
+                    if self.last_checkpoint.elapsed() >= self.checkpoint_interval {
+                        // Record heap stats from rsprof-trace (once per checkpoint)
+                        for target in targets.iter_mut() {
+                            let pid = target.pid();
+                            let resolver = &target.resolver;
+                            let scan_start = Instant::now();
+                            let heap_stats = target.sampler.read_heap_stats();
+                            storage.record_shm_scan(scan_start.elapsed());
+                            for (slot, key_addr, stats, stack) in heap_stats {
+                                let callsite = callsite_key(pid, slot);
+                                let location_id =
+                                    storage.callsite_location_id(callsite, stack, || {
+                                        if !stack.is_empty() {
+                                            attribute_stack(stack, resolver, include_internal)
+                                        } else if include_internal {
+                                            Some(crate::symbols::Location::unknown())
+                                        } else {
+                                            let location = resolver.resolve(key_addr);
+                                            (!is_internal_location(&location)).then_some(location)
+                                        }
+                                    });
+                                if let Some(location_id) = location_id {
+                                    storage.record_heap_sample_at(
+                                        pid,
+                                        location_id,
                                         stats.total_alloc_bytes as i64,
                                         stats.total_free_bytes as i64,
                                         stats.live_bytes,
                                         stats.total_allocs,
                                         stats.total_frees,
                                     );
+                                    storage.record_heap_histogram_at(location_id, &stats.histogram);
+                                    heap_histograms_map
+                                        .entry(location_id)
+                                        .or_default()
+                                        .add(&stats.histogram);
                                     let entry =
                                         heap_entries_map.entry(location_id).or_insert_with(|| {
+                                            let location = storage
+                                                .location(location_id)
+                                                .cloned()
+                                                .unwrap_or_else(crate::symbols::Location::unknown);
                                             HeapEntry {
                                                 location_id,
                                                 file: location.file,
@@ -930,57 +1188,49 @@ impl App {
                                     entry.free_count += stats.total_frees;
                                 }
                             }
-
-                            storage.flush_checkpoint()?;
-                            did_checkpoint = true;
                         }
-                    }
-                }
-                // Fallback: Use perf-based CPU sampling
-                else if let (Some(sampler), Some(resolver), Some(storage)) = (
-                    self.sampler.as_mut(),
-                    self.resolver.as_ref(),
-                    self.storage.as_mut(),
-                ) {
-                    let samples = sampler.read_samples()?;
-                    self.total_samples += samples.len() as u64;
 
-                    let live_cpu_totals = &mut self.live_cpu_totals;
-                    let live_cpu_instant = &mut self.live_cpu_instant;
-                    let location_info = &mut self.location_info;
-                    for addr in samples {
-                        let location = resolver.resolve(addr);
-                        if self.include_internal || !is_internal_location(&location) {
-                            let location_id = storage.record_cpu_sample(addr, &location);
-                            *live_cpu_totals.entry(location_id).or_insert(0) += 1;
-                            *live_cpu_instant.entry(location_id).or_insert(0) += 1;
-                            location_info
-                                .entry(location_id)
-                                .or_insert_with(|| LocationInfo {
-                                    file: location.file,
-                                    line: location.line,
-                                    function: location.function,
-                                });
-                        }
-                    }
+                        storage.record_dropped_events(targets.overflow().total());
+                        self.dropped_events = storage.dropped_events();
 
-                    if self.last_checkpoint.elapsed() >= self.checkpoint_interval {
+                        storage.record_checkpoint_lag(
+                            self.last_checkpoint
+                                .elapsed()
+                                .saturating_sub(self.checkpoint_interval),
+                        );
                         storage.flush_checkpoint()?;
                         did_checkpoint = true;
+                        for proc_info in targets.rescan() {
+                            storage.add_process(&proc_info);
+                        }
                     }
                 }
 
                 if did_checkpoint {
+                    if let Some(storage) = self.storage.as_ref() {
+                        self.profiler_stats = storage.profiler_stats();
+                    }
                     self.chart_checkpoint_seq = self.chart_checkpoint_seq.wrapping_add(1);
+                    let timestamp_ms = self.storage.as_ref().map_or(0, Storage::timestamp_ms);
+                    self.history.checkpoint(
+                        timestamp_ms,
+                        &self.live_cpu_instant,
+                        heap_entries_map
+                            .values()
+                            .map(|e| (e.location_id, e.live_bytes)),
+                    );
                     for (location_id, entry) in heap_entries_map {
                         self.heap_live_entries.insert(location_id, entry);
                     }
+                    self.heap_live_histograms.extend(heap_histograms_map);
                     self.last_checkpoint = Instant::now();
                     self.refresh_cpu_entries();
+                    self.refresh_offcpu_entries();
                     let heap_entries: Vec<HeapEntry> =
                         self.heap_live_entries.values().cloned().collect();
                     self.update_heap_entries(heap_entries);
                     self.update_sparklines();
+                    self.refresh_churn_entries();
                     // New data available; refresh chart data next time it's rendered.
                     self.chart_data_cache.location_id = None;
                     self.heap_chart_cache.location_id = None;
@@ -1062,6 +1312,50 @@ impl App {
                         }
                     }
                 }
+                ViewMode::OffCpu => {
+                    if !self.cached_offcpu_entries.is_empty() {
+                        if let Some(loc_id) = self.selected_offcpu_location_id
+                            && let Some(idx) = self
+                                .cached_offcpu_entries
+                                .iter()
+                                .position(|e| e.location_id == loc_id)
+                        {
+                            self.selected_row = idx;
+                        }
+
+                        self.selected_row =
+                            self.selected_row.min(self.cached_offcpu_entries.len() - 1);
+
+                        let visible_height = self.table_area.height.saturating_sub(3) as usize;
+                        let max_scroll = self
+                            .cached_offcpu_entries
+                            .len()
+                            .saturating_sub(visible_height.max(1));
+                        self.scroll_offset = self.scroll_offset.min(max_scroll);
+                    }
+                }
+                ViewMode::Churn => {
+                    if !self.cached_churn_entries.is_empty() {
+                        if let Some(loc_id) = self.selected_churn_location_id
+                            && let Some(idx) = self
+                                .cached_churn_entries
+                                .iter()
+                                .position(|e| e.location_id == loc_id)
+                        {
+                            self.selected_row = idx;
+                        }
+
+                        self.selected_row =
+                            self.selected_row.min(self.cached_churn_entries.len() - 1);
+
+                        let visible_height = self.table_area.height.saturating_sub(3) as usize;
+                        let max_scroll = self
+                            .cached_churn_entries
+                            .len()
+                            .saturating_sub(visible_height.max(1));
+                        self.scroll_offset = self.scroll_offset.min(max_scroll);
+                    }
+                }
             }
 
             // Render UI
@@ -1078,9 +1372,9 @@ impl App {
             }
         }
 
-        // Final flush (live mode only)
-        if let Some(storage) = self.storage.as_mut() {
-            storage.flush_checkpoint()?;
+        // Final flush (live mode only), waiting for the writer thread
+        if let Some(storage) = self.storage.take() {
+            storage.finish()?;
         }
 
         Ok(())
@@ -1103,8 +1397,9 @@ impl App {
                 self.paused = !self.paused;
                 if self.paused {
                     self.paused_elapsed = Some(self.start_time.elapsed());
-                } else {
-                    self.paused_elapsed = None;
+                } else if let Some(paused_at) = self.paused_elapsed.take() {
+                    // The pause is not checkpoint lag
+                    self.last_checkpoint += self.start_time.elapsed().saturating_sub(paused_at);
                 }
             }
             KeyCode::Tab => {
@@ -1115,18 +1410,26 @@ impl App {
             }
 
             // === VIEW MODE CONTROLS ===
-            // 1/2 - direct view selection
+            // 1/2/3/4 - direct view selection
             KeyCode::Char('1') => {
                 self.view_mode = ViewMode::Cpu;
             }
             KeyCode::Char('2') => {
                 self.view_mode = ViewMode::Memory;
             }
-            // m - toggle view mode
+            KeyCode::Char('3') => {
+                self.view_mode = ViewMode::OffCpu;
+            }
+            KeyCode::Char('4') => {
+                self.view_mode = ViewMode::Churn;
+            }
+            // m - cycle view mode
             KeyCode::Char('m') => {
                 self.view_mode = match self.view_mode {
                     ViewMode::Cpu => ViewMode::Memory,
-                    ViewMode::Memory => ViewMode::Cpu,
+                    ViewMode::Memory => ViewMode::OffCpu,
+                    ViewMode::OffCpu => ViewMode::Churn,
+                    ViewMode::Churn => ViewMode::Cpu,
                 };
             }
             // c or Enter - toggle chart visibility
@@ -1250,6 +1553,8 @@ impl App {
         match self.view_mode {
             ViewMode::Cpu => self.cached_entries.len(),
             ViewMode::Memory => self.cached_heap_entries.len(),
+            ViewMode::OffCpu => self.cached_offcpu_entries.len(),
+            ViewMode::Churn => self.cached_churn_entries.len(),
         }
     }
 
@@ -1344,6 +1649,25 @@ impl App {
         self.total_samples
     }
 
+    pub fn lost_samples(&self) -> u64 {
+        self.lost_samples
+    }
+
+    /// Events rsprof-trace dropped because its tables were full
+    pub fn dropped_events(&self) -> u64 {
+        self.dropped_events
+    }
+
+    /// rsprof's own cost so far (live mode)
+    pub fn profiler_stats(&self) -> &ProfilerStats {
+        &self.profiler_stats
+    }
+
+    /// Whether checkpoints have run well past their interval
+    pub fn checkpoints_lagging(&self) -> bool {
+        self.profiler_stats.lag > self.checkpoint_interval / 2
+    }
+
     pub fn is_paused(&self) -> bool {
         self.paused
     }
@@ -1364,6 +1688,19 @@ impl App {
         &self.cached_heap_entries
     }
 
+    pub fn offcpu_entries(&self) -> &[OffCpuEntry] {
+        &self.cached_offcpu_entries
+    }
+
+    pub fn churn_entries(&self) -> &[ChurnEntry] {
+        &self.cached_churn_entries
+    }
+
+    /// Hardware counter totals per location; empty unless recorded with --pmu
+    pub fn pmu_totals(&self) -> &HashMap<i64, PmuCounters> {
+        &self.pmu_totals
+    }
+
     pub fn cpu_sparklines(&self) -> &HashMap<i64, VecDeque<i64>> {
         &self.cached_cpu_sparklines
     }
@@ -1384,6 +1721,8 @@ impl App {
         match self.view_mode {
             ViewMode::Cpu => self.cpu_sort,
             ViewMode::Memory => self.heap_sort,
+            ViewMode::OffCpu => self.offcpu_sort,
+            ViewMode::Churn => self.churn_sort,
         }
     }
 
@@ -1397,7 +1736,8 @@ impl App {
         self.chart_area = area;
     }
 
-    /// Update function history from DB (live mode)
+    /// Update function history (live mode), from memory while it holds the
+    /// whole recording
     pub fn update_func_history(&mut self, location_id: i64, func_name: &str, _cpu_pct: f64) {
         let location_changed = self.selected_location_id != Some(location_id);
         if location_changed {
@@ -1411,7 +1751,15 @@ impl App {
         if location_changed || self.last_history_tick.elapsed() >= self.checkpoint_interval {
             self.chart_data_cache.location_id = None; // Invalidate for fresh data
             if let Some(storage) = &self.storage {
-                self.func_history = storage.query_location_timeseries(location_id);
+                self.func_history = if self.history.covers(0) {
+                    self.history
+                        .cpu_timeseries(location_id)
+                        .into_iter()
+                        .map(|p| (p.timestamp_ms as f64 / 1000.0, p.percent))
+                        .collect()
+                } else {
+                    storage.query_location_timeseries(location_id)
+                };
                 self.last_history_tick = Instant::now();
             }
         }
@@ -1437,6 +1785,12 @@ impl App {
                         .collect()
                 })
                 .unwrap_or_default();
+        } else if let Some(archive) = &self.archive {
+            self.func_history = archive
+                .cpu_timeseries(location_id)
+                .into_iter()
+                .map(|p| (p.timestamp_ms as f64 / 1000.0, p.percent))
+                .collect();
         }
     }
 
@@ -1477,6 +1831,18 @@ impl App {
                     self.update_selected_heap(location_id);
                 }
             }
+            ViewMode::OffCpu => {
+                self.selected_offcpu_location_id = self
+                    .cached_offcpu_entries
+                    .get(self.selected_row)
+                    .map(|e| e.location_id);
+            }
+            ViewMode::Churn => {
+                self.selected_churn_location_id = self
+                    .cached_churn_entries
+                    .get(self.selected_row)
+                    .map(|e| e.location_id);
+            }
         }
     }
 
@@ -1551,53 +1917,95 @@ impl App {
         self.heap_chart_cache.location_id = None;
     }
 
+    fn refresh_offcpu_entries(&mut self) {
+        let total: u64 = self.live_offcpu_totals.values().sum();
+        self.cached_offcpu_entries = self
+            .live_offcpu_totals
+            .iter()
+            .map(|(&location_id, &blocked_ns)| {
+                let info = self.location_info.get(&location_id);
+                let (file, line, function) = if let Some(info) = info {
+                    (info.file.clone(), info.line, info.function.clone())
+                } else {
+                    ("[unknown]".to_string(), 0, "[unknown]".to_string())
+                };
+                OffCpuEntry {
+                    location_id,
+                    file,
+                    line,
+                    function,
+                    blocked_ns,
+                    percent: (blocked_ns as f64 / total as f64) * 100.0,
+                }
+            })
+            .collect();
+        self.sort_offcpu_entries();
+    }
+
+    fn refresh_churn_entries(&mut self) {
+        self.cached_churn_entries = rank_churn(
+            self.heap_live_entries.values(),
+            &self.heap_live_histograms,
+            self.elapsed_secs(),
+            1000,
+        );
+        self.sort_churn_entries();
+    }
+
+    /// Fold the samples since the last checkpoint into the CPU table
+    ///
+    /// Rows are updated in place; only locations new since the last refresh
+    /// are built.
     fn refresh_cpu_entries(&mut self) {
         let total_samples = self.total_samples as f64;
         if total_samples <= 0.0 {
             self.cached_entries.clear();
+            self.cpu_last_seen.clear();
             self.live_cpu_instant.clear();
             return;
         }
 
-        let instant_total: u64 = self.live_cpu_instant.values().sum();
-        let mut entries = Vec::new();
-        for (&location_id, &total) in &self.live_cpu_totals {
+        for &location_id in self.live_cpu_instant.keys() {
+            if self.cpu_last_seen.contains_key(&location_id) {
+                continue;
+            }
             let info = self.location_info.get(&location_id);
             let (file, line, function) = if let Some(info) = info {
                 (info.file.clone(), info.line, info.function.clone())
             } else {
                 ("[unknown]".to_string(), 0, "[unknown]".to_string())
             };
-
-            let instant = self
-                .live_cpu_instant
-                .get(&location_id)
-                .copied()
-                .unwrap_or(0);
-            entries.push(CpuEntry {
+            self.cpu_last_seen
+                .insert(location_id, self.chart_checkpoint_seq);
+            self.cached_entries.push(CpuEntry {
                 location_id,
                 file,
                 line,
                 function,
-                total_samples: total,
-                total_percent: (total as f64 / total_samples) * 100.0,
-                instant_percent: if instant_total > 0 {
-                    (instant as f64 / instant_total as f64) * 100.0
-                } else {
-                    0.0
-                },
+                total_samples: 0,
+                total_percent: 0.0,
+                instant_percent: 0.0,
             });
         }
 
-        entries.sort_by(|a, b| {
-            b.total_samples
-                .cmp(&a.total_samples)
-                .then(a.location_id.cmp(&b.location_id))
-        });
-        self.cached_entries = entries;
-        for entry in &self.cached_entries {
+        let instant_total: u64 = self.live_cpu_instant.values().sum();
+        for entry in &mut self.cached_entries {
+            let location_id = entry.location_id;
+            let total = self.live_cpu_totals.get(&location_id).copied().unwrap_or(0);
+            let instant = self
+                .live_cpu_instant
+                .get(&location_id)
+                .copied()
+                .unwrap_or(0);
+            entry.total_samples = total;
+            entry.total_percent = (total as f64 / total_samples) * 100.0;
+            entry.instant_percent = if instant_total > 0 {
+                (instant as f64 / instant_total as f64) * 100.0
+            } else {
+                0.0
+            };
             self.cpu_last_seen
-                .insert(entry.location_id, self.chart_checkpoint_seq);
+                .insert(location_id, self.chart_checkpoint_seq);
         }
         self.live_cpu_instant.clear();
 
@@ -1645,11 +2053,14 @@ impl App {
             .collect();
         self.heap_live_entries.retain(|id, _| keep.contains(id));
         self.heap_last_seen.retain(|id, _| keep.contains(id));
+        self.heap_live_histograms.retain(|id, _| keep.contains(id));
     }
 
     fn sort_all_entries(&mut self) {
         self.sort_cpu_entries();
         self.sort_heap_entries();
+        self.sort_offcpu_entries();
+        self.sort_churn_entries();
     }
 
     fn sort_cpu_entries(&mut self) {
@@ -1690,12 +2101,51 @@ impl App {
         });
     }
 
+    fn sort_offcpu_entries(&mut self) {
+        let sort = self.offcpu_sort;
+        self.cached_offcpu_entries.sort_by(|a, b| {
+            let ordering = match sort.column {
+                SortColumn::Total | SortColumn::Live | SortColumn::Trend => {
+                    a.blocked_ns.cmp(&b.blocked_ns)
+                }
+                SortColumn::Function => a.function.cmp(&b.function),
+                SortColumn::Location => a.file.cmp(&b.file).then(a.line.cmp(&b.line)),
+            };
+            let ordering = if sort.descending {
+                ordering.reverse()
+            } else {
+                ordering
+            };
+            ordering.then(a.location_id.cmp(&b.location_id))
+        });
+    }
+
+    fn sort_churn_entries(&mut self) {
+        let sort = self.churn_sort;
+        self.cached_churn_entries.sort_by(|a, b| {
+            let ordering = match sort.column {
+                SortColumn::Total | SortColumn::Trend => cmp_f64(a.churn.score, b.churn.score),
+                SortColumn::Live => cmp_f64(a.churn.short_lived_share, b.churn.short_lived_share),
+                SortColumn::Function => a.function.cmp(&b.function),
+                SortColumn::Location => a.file.cmp(&b.file).then(a.line.cmp(&b.line)),
+            };
+            let ordering = if sort.descending {
+                ordering.reverse()
+            } else {
+                ordering
+            };
+            ordering.then(a.location_id.cmp(&b.location_id))
+        });
+    }
+
     fn toggle_sort(&mut self, column: SortColumn) {
         self.ensure_selection_anchor();
 
         let sort = match self.view_mode {
             ViewMode::Cpu => &mut self.cpu_sort,
             ViewMode::Memory => &mut self.heap_sort,
+            ViewMode::OffCpu => &mut self.offcpu_sort,
+            ViewMode::Churn => &mut self.churn_sort,
         };
 
         if sort.column == column {
@@ -1711,6 +2161,8 @@ impl App {
         match self.view_mode {
             ViewMode::Cpu => self.sort_cpu_entries(),
             ViewMode::Memory => self.sort_heap_entries(),
+            ViewMode::OffCpu => self.sort_offcpu_entries(),
+            ViewMode::Churn => self.sort_churn_entries(),
         }
 
         self.reselect_anchor();
@@ -1733,6 +2185,20 @@ impl App {
                     self.selected_heap_location_id = Some(entry.location_id);
                 }
             }
+            ViewMode::OffCpu => {
+                if self.selected_offcpu_location_id.is_none()
+                    && let Some(entry) = self.cached_offcpu_entries.get(self.selected_row)
+                {
+                    self.selected_offcpu_location_id = Some(entry.location_id);
+                }
+            }
+            ViewMode::Churn => {
+                if self.selected_churn_location_id.is_none()
+                    && let Some(entry) = self.cached_churn_entries.get(self.selected_row)
+                {
+                    self.selected_churn_location_id = Some(entry.location_id);
+                }
+            }
         }
     }
 
@@ -1758,6 +2224,26 @@ impl App {
                     self.selected_row = idx;
                 }
             }
+            ViewMode::OffCpu => {
+                if let Some(loc_id) = self.selected_offcpu_location_id
+                    && let Some(idx) = self
+                        .cached_offcpu_entries
+                        .iter()
+                        .position(|e| e.location_id == loc_id)
+                {
+                    self.selected_row = idx;
+                }
+            }
+            ViewMode::Churn => {
+                if let Some(loc_id) = self.selected_churn_location_id
+                    && let Some(idx) = self
+                        .cached_churn_entries
+                        .iter()
+                        .position(|e| e.location_id == loc_id)
+                {
+                    self.selected_row = idx;
+                }
+            }
         }
     }
 
@@ -1771,7 +2257,14 @@ impl App {
             return None;
         }
 
-        let fixed_width = 8 + 8 + 14;
+        // IPC and MPKI columns after Live, when there are counters to show;
+        // churn always shows lifetime and size there
+        let counter_width = match self.view_mode {
+            ViewMode::Cpu if !self.pmu_totals.is_empty() => 7 + 7,
+            ViewMode::Churn => 7 + 7,
+            _ => 0,
+        };
+        let fixed_width = 8 + 8 + counter_width + 14;
         let remaining = inner_width.saturating_sub(fixed_width);
         let func_width = remaining / 2;
         let loc_width = remaining - func_width;
@@ -1787,6 +2280,10 @@ impl App {
             return Some(SortColumn::Live);
         }
         offset += 8;
+        if pos < offset + counter_width {
+            return None;
+        }
+        offset += counter_width;
         if pos < offset + func_width {
             return Some(SortColumn::Function);
         }
@@ -1840,8 +2337,11 @@ impl App {
             let start_ms = (prefetch_start * 1000.0) as i64;
             let end_ms = (prefetch_end * 1000.0) as i64;
 
-            // Query from DB with aggregation
-            let data = if let Some(storage) = &self.storage {
+            // Recent live data is in memory; the rest comes from the database
+            let data = if !self.is_static() && self.history.covers(start_ms) {
+                self.history
+                    .cpu_timeseries_aggregated(location_id, start_ms, end_ms, num_buckets)
+            } else if let Some(storage) = &self.storage {
                 storage.query_location_timeseries_aggregated(
                     location_id,
                     start_ms,
@@ -1850,6 +2350,8 @@ impl App {
                 )
             } else if let Some(conn) = &self.conn {
                 query_cpu_timeseries_aggregated(conn, location_id, start_ms, end_ms, num_buckets)
+            } else if let Some(archive) = &self.archive {
+                archive.cpu_timeseries_aggregated(location_id, start_ms, end_ms, num_buckets)
             } else {
                 Vec::new()
             };
@@ -1962,8 +2464,11 @@ impl App {
             let start_ms = (prefetch_start * 1000.0) as i64;
             let end_ms = (prefetch_end * 1000.0) as i64;
 
-            // Query from DB with aggregation
-            let data = if let Some(storage) = &self.storage {
+            // Recent live data is in memory; the rest comes from the database
+            let data = if !self.is_static() && self.history.covers(start_ms) {
+                self.history
+                    .heap_timeseries_aggregated(location_id, start_ms, end_ms, num_buckets)
+            } else if let Some(storage) = &self.storage {
                 storage.query_heap_timeseries_aggregated(location_id, start_ms, end_ms, num_buckets)
             } else if let Some(conn) = &self.conn {
                 crate::storage::query_heap_timeseries_aggregated(
@@ -1973,6 +2478,8 @@ impl App {
                     end_ms,
                     num_buckets,
                 )
+            } else if let Some(archive) = &self.archive {
+                archive.heap_timeseries_aggregated(location_id, start_ms, end_ms, num_buckets)
             } else {
                 Vec::new()
             };
@@ -2070,3 +2577,83 @@ fn resolve_internal_stack(
     }
     crate::symbols::Location::unknown()
 }
+
+/// A stack's frames for the stacks table, leaf first, without the
+/// profiler's own frames unless `include_internal`
+fn stack_frames(
+    stack: &[u64],
+    resolver: &SymbolResolver,
+    include_internal: bool,
+) -> Vec<crate::symbols::Location> {
+    stack
+        .iter()
+        .filter(|&&addr| addr != 0)
+        .map(|&addr| resolver.resolve(addr))
+        .filter(|loc| include_internal || !is_profiler_frame(loc))
+        .collect()
+}
+
+/// Whether a frame belongs to rsprof-trace or its allocator hooks
+fn is_profiler_frame(loc: &crate::symbols::Location) -> bool {
+    loc.file.contains("rsprof-trace")
+        || loc.file.contains("rsprof-alloc")
+        || loc.function.contains("rsprof_trace::")
+        || loc.function.contains("rsprof_alloc::")
+}
+
+/// Location to charge a stack's samples to, or None if it is profiler/allocator internal
+fn attribute_stack(
+    stack: &[u64],
+    resolver: &crate::symbols::SymbolResolver,
+    include_internal: bool,
+) -> Option<crate::symbols::Location> {
+    if include_internal {
+        return Some(resolve_internal_stack(stack, resolver));
+    }
+    // Walk the stack to find the first user frame (skip allocator/profiler internals)
+    let location = find_user_frame(stack, resolver);
+    (!is_internal_location(&location)).then_some(location)
+}
+
+/// Location to charge a blocked stack to: the first frame past the
+/// shared-library code (syscall wrappers, futex waits) that went to sleep
+fn attribute_blocked_stack(
+    stack: &[u64],
+    resolver: &crate::symbols::SymbolResolver,
+    include_internal: bool,
+) -> Option<crate::symbols::Location> {
+    let skip = stack
+        .iter()
+        .take_while(|&&addr| is_shared_object_file(&resolver.resolve(addr).file))
+        .count();
+    let stack = if skip < stack.len() {
+        &stack[skip..]
+    } else {
+        stack
+    };
+    attribute_stack(stack, resolver, include_internal)
+}
+
+/// Whether a frame's file is a shared object (e.g. `libc.so.6`) rather than source
+fn is_shared_object_file(file: &str) -> bool {
+    !file.contains('/') && file.contains(".so")
+}
+
+/// Remember a location's display strings the first time its id is recorded
+fn note_location(
+    location_info: &mut HashMap<i64, LocationInfo>,
+    storage: &Storage,
+    location_id: i64,
+) {
+    location_info.entry(location_id).or_insert_with(|| {
+        let location = storage
+            .location(location_id)
+            .cloned()
+            .unwrap_or_else(crate::symbols::Location::unknown);
+        LocationInfo {
+            file: location.file,
+            line: location.line,
+            function: location.function,
+        }
+    });
+}
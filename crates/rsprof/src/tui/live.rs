@@ -0,0 +1,165 @@
+//! Per-checkpoint history of a live recording, kept in memory
+//!
+//! The live tables and sparklines are already built from the samples as
+//! they are taken; this holds the history behind the charts, so a live
+//! session only ever writes to SQLite. It covers the last
+//! `HISTORY_CHECKPOINTS` checkpoints; charts reaching further back, or into
+//! the earlier runs of an appended profile, still read the database.
+
+use crate::storage::{TimeSeriesPoint, bucket_cpu_timeseries, bucket_heap_timeseries};
+use std::collections::{HashMap, VecDeque};
+
+/// Checkpoints kept in memory (15 minutes at the default interval)
+const HISTORY_CHECKPOINTS: usize = 900;
+
+pub struct LiveHistory {
+    /// Timestamp and total CPU samples of each checkpoint kept
+    checkpoints: VecDeque<(i64, u64)>,
+    /// Sequence number of the oldest checkpoint kept
+    first_seq: u64,
+    /// Charts starting at or after this are answered from memory
+    covered_from_ms: i64,
+    /// CPU samples per location as (seq, count), for checkpoints with any
+    cpu: HashMap<i64, VecDeque<(u64, u64)>>,
+    /// Live bytes per location as (seq, bytes), at each change
+    heap: HashMap<i64, VecDeque<(u64, i64)>>,
+}
+
+impl LiveHistory {
+    /// History of a recording that continues a profile ending at
+    /// `offset_ms` (0 for a new profile)
+    pub fn new(offset_ms: i64) -> Self {
+        LiveHistory {
+            checkpoints: VecDeque::new(),
+            first_seq: 0,
+            covered_from_ms: if offset_ms > 0 { offset_ms + 1 } else { 0 },
+            cpu: HashMap::new(),
+            heap: HashMap::new(),
+        }
+    }
+
+    /// Add a checkpoint: `cpu` holds its samples per location, `heap` the
+    /// live bytes of each heap location it reported
+    ///
+    /// Only locations with samples and heap stats that changed are stored.
+    pub fn checkpoint(
+        &mut self,
+        timestamp_ms: i64,
+        cpu: &HashMap<i64, u64>,
+        heap: impl IntoIterator<Item = (i64, i64)>,
+    ) {
+        let seq = self.first_seq + self.checkpoints.len() as u64;
+        self.checkpoints
+            .push_back((timestamp_ms, cpu.values().sum()));
+        if self.checkpoints.len() > HISTORY_CHECKPOINTS
+            && let Some((dropped_ms, _)) = self.checkpoints.pop_front()
+        {
+            self.first_seq += 1;
+            self.covered_from_ms = dropped_ms + 1;
+        }
+        let first_seq = self.first_seq;
+
+        for (&location_id, &count) in cpu {
+            let series = self.cpu.entry(location_id).or_default();
+            series.push_back((seq, count));
+            while series.front().is_some_and(|&(s, _)| s < first_seq) {
+                series.pop_front();
+            }
+        }
+
+        for (location_id, bytes) in heap {
+            let series = self.heap.entry(location_id).or_default();
+            if series.back().is_some_and(|&(_, last)| last == bytes) {
+                continue;
+            }
+            series.push_back((seq, bytes));
+            // The last change before the window is the value carried into it
+            while series.get(1).is_some_and(|&(s, _)| s <= first_seq) {
+                series.pop_front();
+            }
+        }
+    }
+
+    /// Whether a chart starting at `start_ms` can be drawn from memory
+    pub fn covers(&self, start_ms: i64) -> bool {
+        start_ms >= self.covered_from_ms
+    }
+
+    /// Timestamp of the checkpoint with sequence number `seq`, if kept
+    fn timestamp(&self, seq: u64) -> Option<i64> {
+        let index = seq.checked_sub(self.first_seq)?;
+        self.checkpoints.get(index as usize).map(|&(ms, _)| ms)
+    }
+
+    /// A location's share of each checkpoint's CPU samples, where it had any
+    pub fn cpu_timeseries(&self, location_id: i64) -> Vec<TimeSeriesPoint> {
+        let Some(series) = self.cpu.get(&location_id) else {
+            return Vec::new();
+        };
+        series
+            .iter()
+            .filter_map(|&(seq, count)| {
+                let index = seq.checked_sub(self.first_seq)?;
+                let &(timestamp_ms, total) = self.checkpoints.get(index as usize)?;
+                Some(TimeSeriesPoint {
+                    timestamp_ms,
+                    percent: if total > 0 {
+                        count as f64 * 100.0 / total as f64
+                    } else {
+                        0.0
+                    },
+                })
+            })
+            .collect()
+    }
+
+    /// CPU% in `num_buckets` buckets of `start_ms..end_ms`, as
+    /// `query_cpu_timeseries_aggregated`
+    pub fn cpu_timeseries_aggregated(
+        &self,
+        location_id: i64,
+        start_ms: i64,
+        end_ms: i64,
+        num_buckets: usize,
+    ) -> Vec<(f64, f64)> {
+        bucket_cpu_timeseries(
+            self.cpu_timeseries(location_id),
+            start_ms,
+            end_ms,
+            num_buckets,
+        )
+    }
+
+    /// Live bytes in `num_buckets` buckets of `start_ms..end_ms`, as
+    /// `query_heap_timeseries_aggregated`
+    pub fn heap_timeseries_aggregated(
+        &self,
+        location_id: i64,
+        start_ms: i64,
+        end_ms: i64,
+        num_buckets: usize,
+    ) -> Vec<(f64, f64)> {
+        let Some(series) = self.heap.get(&location_id) else {
+            return Vec::new();
+        };
+        let Some(last_ms) = self
+            .checkpoints
+            .iter()
+            .rev()
+            .map(|&(ms, _)| ms)
+            .find(|&ms| ms >= start_ms && ms < end_ms)
+        else {
+            return Vec::new();
+        };
+
+        let mut carried = None;
+        let mut changes = Vec::new();
+        for &(seq, bytes) in series {
+            match self.timestamp(seq) {
+                Some(ms) if ms >= start_ms => changes.push((ms, bytes)),
+                _ => carried = Some(bytes),
+            }
+        }
+        bucket_heap_timeseries(carried, changes, last_ms, start_ms, end_ms, num_buckets)
+    }
+}
@@ -1,9 +1,10 @@
 mod app;
+mod live;
 mod ui;
 
 use crate::cpu::CpuSampler;
 use crate::error::Result;
-use crate::heap::ShmHeapSampler;
+use crate::heap::ShmTargets;
 use crate::storage::Storage;
 use crate::symbols::SymbolResolver;
 use std::time::Duration;
@@ -14,7 +15,8 @@ pub use app::App;
 #[allow(clippy::too_many_arguments)]
 pub fn run(
     perf_sampler: Option<CpuSampler>,
-    shm_sampler: Option<ShmHeapSampler>,
+    offcpu_sampler: Option<CpuSampler>,
+    shm_targets: ShmTargets,
     resolver: SymbolResolver,
     storage: Storage,
     checkpoint_interval: Duration,
@@ -24,7 +26,8 @@ pub fn run(
     let time_offset_secs = storage.time_offset_secs();
     let mut app = App::new(
         perf_sampler,
-        shm_sampler,
+        offcpu_sampler,
+        shm_targets,
         resolver,
         storage,
         checkpoint_interval,
@@ -1,5 +1,6 @@
 use super::app::{App, ChartType, Focus, SortColumn, TableSort, ViewMode};
-use crate::storage::{CpuEntry, HeapEntry};
+use crate::cpu::PmuCounters;
+use crate::storage::{ChurnEntry, CpuEntry, HeapEntry, OffCpuEntry};
 use ratatui::{
     Frame,
     layout::{Constraint, Direction, Layout, Rect},
@@ -25,6 +26,10 @@ struct TableRow {
     location: String,
     /// Sparkline data points (values for rendering)
     sparkline_data: Vec<i64>,
+    /// Two columns after Live, when the view has them: IPC and LLC misses
+    /// per kilo-instruction for hardware counter profiles, lifetime and size
+    /// for churn
+    extra: Option<[String; 2]>,
     /// Color for the total column
     total_color: Color,
     /// Color for the live column
@@ -35,6 +40,7 @@ struct TableRow {
 fn cpu_to_table_rows(
     entries: &[CpuEntry],
     sparklines: &HashMap<i64, VecDeque<i64>>,
+    pmu: &HashMap<i64, PmuCounters>,
 ) -> Vec<TableRow> {
     entries
         .iter()
@@ -57,6 +63,14 @@ fn cpu_to_table_rows(
                 function: format_function(&e.function),
                 location: format_location(&e.file, e.line),
                 sparkline_data,
+                extra: (!pmu.is_empty()).then(|| {
+                    let c = pmu.get(&e.location_id).copied().unwrap_or_default();
+                    [
+                        c.ipc().map_or("-".to_string(), |v| format!("{:.2}", v)),
+                        c.llc_mpki()
+                            .map_or("-".to_string(), |v| format!("{:.1}", v)),
+                    ]
+                }),
                 total_color: color_for_percent(e.total_percent),
                 live_color: color_for_percent(e.instant_percent),
             }
@@ -83,6 +97,7 @@ fn heap_to_table_rows(
                 function: format_function(&e.function),
                 location: format_location(&e.file, e.line),
                 sparkline_data,
+                extra: None,
                 total_color: color_for_bytes(e.total_alloc_bytes),
                 live_color: color_for_bytes(e.live_bytes),
             }
@@ -90,11 +105,68 @@ fn heap_to_table_rows(
         .collect()
 }
 
+/// Convert off-CPU entries to unified table rows
+///
+/// Total is time blocked and Live its share of all blocked time; there is no
+/// per-checkpoint history, so the trend column stays empty.
+fn offcpu_to_table_rows(entries: &[OffCpuEntry]) -> Vec<TableRow> {
+    entries
+        .iter()
+        .map(|e| TableRow {
+            total: format_nanos(e.blocked_ns),
+            live: format!("{:5.1}%", e.percent),
+            function: format_function(&e.function),
+            location: format_location(&e.file, e.line),
+            sparkline_data: Vec::new(),
+            extra: None,
+            total_color: color_for_percent(e.percent),
+            live_color: color_for_percent(e.percent),
+        })
+        .collect()
+}
+
+/// Convert churn entries to unified table rows
+///
+/// Total is short-lived allocations per second in the size band and Live the
+/// share of frees that were short-lived; the trend column is the lifetime
+/// histogram, short lifetimes on the left.
+fn churn_to_table_rows(entries: &[ChurnEntry]) -> Vec<TableRow> {
+    entries
+        .iter()
+        .map(|e| {
+            let frees: u64 = e.histogram.lifetime.iter().sum();
+            let sparkline_data = e
+                .histogram
+                .lifetime
+                .chunks(2)
+                .map(|pair| (pair.iter().sum::<u64>() * 1000 / frees.max(1)) as i64)
+                .collect();
+            let short_pct = e.churn.short_lived_share * 100.0;
+
+            TableRow {
+                total: format!("{}/s", format_rate(e.churn.score)),
+                live: format!("{:5.1}%", short_pct),
+                function: format_function(&e.function),
+                location: format_location(&e.file, e.line),
+                sparkline_data,
+                extra: Some([
+                    format_nanos(e.churn.median_lifetime_ns),
+                    format_bytes(e.churn.size_band.0 as i64),
+                ]),
+                total_color: color_for_percent(short_pct),
+                live_color: color_for_percent(short_pct),
+            }
+        })
+        .collect()
+}
+
 struct TableRenderState {
     selected: usize,
     scroll_offset: usize,
     focus: Focus,
     sort: TableSort,
+    /// Headers of the two extra columns
+    extra_labels: [&'static str; 2],
     area: Rect,
 }
 
@@ -129,13 +201,19 @@ fn render_unified_table(
         return;
     }
 
-    let header_labels = [
+    let show_extra = rows.iter().any(|r| r.extra.is_some());
+    let mut header_labels = vec![
         header_label("Total", SortColumn::Total, state.sort),
         header_label("Live", SortColumn::Live, state.sort),
+    ];
+    if show_extra {
+        header_labels.extend(state.extra_labels.map(str::to_string));
+    }
+    header_labels.extend([
         header_label("Function", SortColumn::Function, state.sort),
         header_label("Location", SortColumn::Location, state.sort),
         header_label("Trend", SortColumn::Trend, state.sort),
-    ];
+    ]);
     let header_cells = header_labels.iter().map(|h| {
         Cell::from(h.as_str()).style(
             Style::default()
@@ -174,24 +252,37 @@ fn render_unified_table(
                 Style::default()
             };
 
-            Row::new(vec![
+            let mut cells = vec![
                 Cell::from(row.total.clone()).style(Style::default().fg(row.total_color)),
                 Cell::from(row.live.clone()).style(Style::default().fg(row.live_color)),
+            ];
+            if show_extra {
+                let [first, second] = row.extra.clone().unwrap_or_default();
+                cells.push(Cell::from(first));
+                cells.push(Cell::from(second));
+            }
+            cells.extend([
                 Cell::from(row.function.clone()),
                 Cell::from(row.location.clone()),
                 Cell::from(sparkline_line),
-            ])
-            .style(style)
+            ]);
+            Row::new(cells).style(style)
         })
         .collect();
 
-    let widths = [
-        Constraint::Length(8),  // Total (fixed)
-        Constraint::Length(8),  // Live (fixed)
+    let mut widths = vec![
+        Constraint::Length(8), // Total (fixed)
+        Constraint::Length(8), // Live (fixed)
+    ];
+    if show_extra {
+        widths.push(Constraint::Length(7)); // IPC / Life (fixed)
+        widths.push(Constraint::Length(7)); // MPKI / Size (fixed)
+    }
+    widths.extend([
         Constraint::Fill(1),    // Function (expand)
         Constraint::Fill(1),    // Location (expand)
         Constraint::Length(14), // Trend (fixed, 12 chars + padding)
-    ];
+    ]);
 
     let table = Table::new(table_rows, widths).header(header).block(block);
 
@@ -331,7 +422,7 @@ fn render_header(frame: &mut Frame, app: &App, area: Rect) {
     // Split header: left (status) | right (tabs)
     let chunks = Layout::horizontal([
         Constraint::Min(40),
-        Constraint::Length(15), // "[CPU] [Memory]"
+        Constraint::Length(33), // "[CPU] [Memory] [Off-CPU] [Churn]"
     ])
     .split(area);
 
@@ -345,7 +436,7 @@ fn render_header_status(frame: &mut Frame, app: &App, area: Rect) {
     let minutes = (elapsed.as_secs() % 3600) / 60;
     let seconds = elapsed.as_secs() % 60;
 
-    let header = if app.is_static() {
+    let mut header = if app.is_static() {
         // Static/view mode header
         let file_name = app.file_name().unwrap_or("profile");
         Line::from(vec![
@@ -390,15 +481,45 @@ fn render_header_status(frame: &mut Frame, app: &App, area: Rect) {
             Span::raw(" "),
             status,
             Span::raw(format!(
-                " {:02}:{:02}:{:02} │ {} samples",
+                " {:02}:{:02}:{:02} │ {} samples │ rsprof {:.1}%",
                 hours,
                 minutes,
                 seconds,
-                app.total_samples()
+                app.total_samples(),
+                app.profiler_stats().overhead_percent(elapsed)
             )),
         ])
     };
 
+    if !app.is_static() && app.process_count() > 1 {
+        header
+            .spans
+            .push(Span::raw(format!(" │ {} processes", app.process_count())));
+    }
+
+    // rsprof itself is the bottleneck: checkpoints run late
+    if !app.is_static() && app.checkpoints_lagging() {
+        header.spans.push(Span::styled(
+            format!(" │ lag {}ms", app.profiler_stats().lag.as_millis()),
+            Style::default().fg(Color::Yellow),
+        ));
+    }
+
+    // Flag incomplete profiles: the kernel dropped samples on ring overflow
+    if app.lost_samples() > 0 {
+        header.spans.push(Span::styled(
+            format!(" │ {} lost", app.lost_samples()),
+            Style::default().fg(Color::Red),
+        ));
+    }
+    // rsprof-trace tables overflowed: heap and CPU numbers are degraded
+    if app.dropped_events() > 0 {
+        header.spans.push(Span::styled(
+            format!(" │ {} dropped", app.dropped_events()),
+            Style::default().fg(Color::Red),
+        ));
+    }
+
     let paragraph = Paragraph::new(header);
     frame.render_widget(paragraph, area);
 }
@@ -418,10 +539,25 @@ fn render_header_tabs(frame: &mut Frame, app: &App, area: Rect) {
         inactive_style
     };
 
+    let offcpu_style = if app.view_mode == ViewMode::OffCpu {
+        active_style
+    } else {
+        inactive_style
+    };
+    let churn_style = if app.view_mode == ViewMode::Churn {
+        active_style
+    } else {
+        inactive_style
+    };
+
     let tabs = Line::from(vec![
         Span::styled("[CPU]", cpu_style),
         Span::raw(" "),
         Span::styled("[Memory]", mem_style),
+        Span::raw(" "),
+        Span::styled("[Off-CPU]", offcpu_style),
+        Span::raw(" "),
+        Span::styled("[Churn]", churn_style),
     ]);
 
     let paragraph = Paragraph::new(tabs);
@@ -431,24 +567,36 @@ fn render_header_tabs(frame: &mut Frame, app: &App, area: Rect) {
 fn render_main_content(frame: &mut Frame, app: &mut App, area: Rect) {
     let elapsed_secs = app.elapsed_secs();
     let view_mode = app.view_mode;
-    let chart_visible = app.chart_visible;
+    // Off-CPU and churn have no timeseries to chart
+    let chart_visible =
+        app.chart_visible && !matches!(view_mode, ViewMode::OffCpu | ViewMode::Churn);
     let selected = app.selected_row();
     let scroll_offset = app.scroll_offset();
     let focus = app.focus;
     let sort = app.active_sort();
+    let extra_labels = if view_mode == ViewMode::Churn {
+        ["Life", "Size"]
+    } else {
+        ["IPC", "MPKI"]
+    };
 
     // Prepare table data based on view mode (use appropriate sparklines)
     let (title, rows) = match view_mode {
         ViewMode::Cpu => {
             let entries = app.entries();
-            let sparklines = app.cpu_sparklines().clone();
-            ("Top CPU", cpu_to_table_rows(entries, &sparklines))
+            let sparklines = app.cpu_sparklines();
+            (
+                "Top CPU",
+                cpu_to_table_rows(entries, sparklines, app.pmu_totals()),
+            )
         }
         ViewMode::Memory => {
             let entries = app.heap_entries();
-            let sparklines = app.heap_sparklines().clone();
-            ("Top Memory", heap_to_table_rows(entries, &sparklines))
+            let sparklines = app.heap_sparklines();
+            ("Top Memory", heap_to_table_rows(entries, sparklines))
         }
+        ViewMode::OffCpu => ("Top Off-CPU", offcpu_to_table_rows(app.offcpu_entries())),
+        ViewMode::Churn => ("Top Churn", churn_to_table_rows(app.churn_entries())),
     };
 
     if chart_visible {
@@ -472,6 +620,7 @@ fn render_main_content(frame: &mut Frame, app: &mut App, area: Rect) {
                 scroll_offset,
                 focus,
                 sort,
+                extra_labels,
                 area: chunks[0],
             },
         );
@@ -480,6 +629,7 @@ fn render_main_content(frame: &mut Frame, app: &mut App, area: Rect) {
         match view_mode {
             ViewMode::Cpu => render_line_chart(frame, app, elapsed_secs, chunks[1]),
             ViewMode::Memory => render_memory_chart(frame, app, elapsed_secs, chunks[1]),
+            ViewMode::OffCpu | ViewMode::Churn => {}
         }
     } else {
         // Full-width table with sparklines (no chart)
@@ -495,6 +645,7 @@ fn render_main_content(frame: &mut Frame, app: &mut App, area: Rect) {
                 scroll_offset,
                 focus,
                 sort,
+                extra_labels,
                 area,
             },
         );
@@ -835,6 +986,28 @@ fn format_bytes(bytes: i64) -> String {
     }
 }
 
+/// Format nanoseconds as seconds, milliseconds or microseconds
+fn format_nanos(ns: u64) -> String {
+    if ns >= 1_000_000_000 {
+        format!("{:.2}s", ns as f64 / 1e9)
+    } else if ns >= 1_000_000 {
+        format!("{:.1}ms", ns as f64 / 1e6)
+    } else {
+        format!("{:.1}us", ns as f64 / 1e3)
+    }
+}
+
+/// Format a per-second rate with a K or M suffix
+fn format_rate(per_sec: f64) -> String {
+    if per_sec >= 1e6 {
+        format!("{:.1}M", per_sec / 1e6)
+    } else if per_sec >= 1e3 {
+        format!("{:.1}K", per_sec / 1e3)
+    } else {
+        format!("{:.0}", per_sec)
+    }
+}
+
 /// Color for memory amount based on size
 fn color_for_bytes(bytes: i64) -> Color {
     if bytes >= 100_000_000 {